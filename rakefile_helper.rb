@@ -54,6 +54,23 @@ module RakefileHelpers
     return includes
   end
 
+  # Each line "TEST_DEFINES: A B=1" in a tester is one build of that tester
+  # with these defines added. Without such a line it is built once.
+  def extract_test_variants(filename)
+    variants = []
+    File.readlines(filename).each do |line|
+      m = line.match(/^\s*(?:\/\*|\/\/)\s*TEST_DEFINES:(.*?)(?:\*\/)?\s*$/)
+      variants << m[1].split unless m.nil?
+    end
+    variants << [] if variants.empty?
+    return variants
+  end
+
+  def variant_name(test_base, defines)
+    return test_base if defines.empty?
+    return test_base + '_' + defines.join('_').gsub(/[^A-Za-z0-9]+/, '_').downcase
+  end
+
   def find_source_file(header, paths)
     paths.each do |dir|
       src_file = dir + header.ext(C_EXTENSION)
@@ -98,6 +115,8 @@ module RakefileHelpers
 
   def compile(file, defines=[])
     compiler = build_compiler_fields
+    extra    = defines - ($cfg['compiler']['defines']['items'] || [])
+    compiler[:defines] += squash($cfg['compiler']['defines']['prefix'], extra)
     cmd_str  = "#{compiler[:command]}#{compiler[:defines]}#{compiler[:options]}#{compiler[:includes]} #{file} " +
                "#{$cfg['compiler']['object_files']['prefix']}#{$cfg['compiler']['object_files']['destination']}"
     obj_file = "#{File.basename(file, C_EXTENSION)}#{$cfg['compiler']['object_files']['extension']}"
@@ -181,108 +200,111 @@ module RakefileHelpers
     $cfg['compiler']['defines']['items'] = [] if $cfg['compiler']['defines']['items'].nil?
     $cfg['compiler']['defines']['items'] << 'TEST'
 
-    include_dirs = get_local_include_dirs
-
-    # Build and execute each unit test
+    # Build and execute each unit test, once per variant
     test_files.each do |test|
+      extract_test_variants(test).each do |variant|
+        run_test_variant(test, test_defines + variant, variant_name(File.basename(test, C_EXTENSION), variant))
+      end
+    end
+  end
 
-      obj_list = []
-
-      # Detect dependencies and build required required modules
-      header_list = extract_headers(test) + ['cmock.h']
-      header_list.each do |header|
-
-        #create mocks if needed
-        if (header =~ /Mock/)
-          require "./cmock/lib/cmock.rb"
-          @cmock ||= CMock.new($cfg_file)
-          #find source path from all the includes
-          $cfg['compiler']['includes']['items'].each do |dir|
-            potential_file = "#{dir}"+header.gsub('Mock','')
-            if File.exists?(potential_file)
-              original_directory = File.dirname(potential_file)
-              mock_filename = File.basename(header, '.h')
-              header_filename = File.basename(potential_file)
-
-              print "Found file: " + potential_file + "\n"
-              @cmock.setup_mocks(potential_file) #dir+header.gsub('Mock','')
-
-              # Mock created in mocks/, move to correct directory
-              paparazzi_home = ENV['PAPARAZZI_HOME']
-              mock_newdir    = original_directory.gsub(paparazzi_home + '/', '')
-
-              # If file is a _testable.h, put mock in the same directory
-              if header_filename.end_with?("testable.h")
-                mock_newdir = original_directory
-              end
-              mock_newfile   = mock_newdir + '/' + mock_filename
-              #print "MOVING TO : " + mock_newdir + "\n\n"
-              FileUtils.mkdir_p(mock_newdir)
-              FileUtils.mv('mocks/' + mock_filename + '.h', mock_newfile + '.h')
-              FileUtils.mv('mocks/' + mock_filename + '.c', mock_newfile + '.c')
-
-              # Includes within mock not using full path to include (only filename). Fix this
-              text = File.read(mock_newfile + '.h')
-              replace = text.gsub('#include "'+header_filename+'"', '#include "'+header.gsub('Mock','')+'"')
-              File.open(mock_newfile + '.h', "w") { |file| file.puts replace }
-
-              text = File.read(mock_newfile + '.c')
-              replace = text.gsub('#include "'+mock_filename+'.h"', '#include "'+header+'"')
-              File.open(mock_newfile + '.c', "w") { |file| file.puts replace }
-
-
-              break
+  def run_test_variant(test, test_defines, test_base)
+    include_dirs = get_local_include_dirs
+    obj_list = []
+
+    # Detect dependencies and build required required modules
+    header_list = extract_headers(test) + ['cmock.h']
+    header_list.each do |header|
+
+      #create mocks if needed
+      if (header =~ /Mock/)
+        require "./cmock/lib/cmock.rb"
+        @cmock ||= CMock.new($cfg_file)
+        #find source path from all the includes
+        $cfg['compiler']['includes']['items'].each do |dir|
+          potential_file = "#{dir}"+header.gsub('Mock','')
+          if File.exists?(potential_file)
+            original_directory = File.dirname(potential_file)
+            mock_filename = File.basename(header, '.h')
+            header_filename = File.basename(potential_file)
+
+            print "Found file: " + potential_file + "\n"
+            @cmock.setup_mocks(potential_file) #dir+header.gsub('Mock','')
+
+            # Mock created in mocks/, move to correct directory
+            paparazzi_home = ENV['PAPARAZZI_HOME']
+            mock_newdir    = original_directory.gsub(paparazzi_home + '/', '')
+
+            # If file is a _testable.h, put mock in the same directory
+            if header_filename.end_with?("testable.h")
+              mock_newdir = original_directory
             end
-          end
-          #@cmock.setup_mocks([$cfg['compiler']['source_path']+header.gsub('Mock','')])
-        end
+            mock_newfile   = mock_newdir + '/' + mock_filename
+            #print "MOVING TO : " + mock_newdir + "\n\n"
+            FileUtils.mkdir_p(mock_newdir)
+            FileUtils.mv('mocks/' + mock_filename + '.h', mock_newfile + '.h')
+            FileUtils.mv('mocks/' + mock_filename + '.c', mock_newfile + '.c')
 
-      end
-      #compile all mocks
-      header_list.each do |header|
-        #compile source file header if it exists
-        src_file = find_source_file(header, include_dirs)
-        if !src_file.nil?
-          obj_list << compile(src_file, test_defines)
+            # Includes within mock not using full path to include (only filename). Fix this
+            text = File.read(mock_newfile + '.h')
+            replace = text.gsub('#include "'+header_filename+'"', '#include "'+header.gsub('Mock','')+'"')
+            File.open(mock_newfile + '.h', "w") { |file| file.puts replace }
+
+            text = File.read(mock_newfile + '.c')
+            replace = text.gsub('#include "'+mock_filename+'.h"', '#include "'+header+'"')
+            File.open(mock_newfile + '.c', "w") { |file| file.puts replace }
+
+
+            break
+          end
         end
+        #@cmock.setup_mocks([$cfg['compiler']['source_path']+header.gsub('Mock','')])
       end
 
-      # Build the test runner (generate if configured to do so)
-      test_base = File.basename(test, C_EXTENSION)
-      runner_name = test_base + '_Runner.c'
-      if $cfg['compiler']['runner_path'].nil?
-        runner_path = $cfg['compiler']['build_path'] + runner_name
-        test_gen = UnityTestRunnerGenerator.new($cfg_file)
-        test_gen.run(test, runner_path)
-      else
-        runner_path = $cfg['compiler']['runner_path'] + runner_name
+    end
+    #compile all mocks
+    header_list.each do |header|
+      #compile source file header if it exists
+      src_file = find_source_file(header, include_dirs)
+      if !src_file.nil?
+        obj_list << compile(src_file, test_defines)
       end
+    end
+
+    # Build the test runner (generate if configured to do so)
+    runner_name = test_base + '_Runner.c'
+    if $cfg['compiler']['runner_path'].nil?
+      runner_path = $cfg['compiler']['build_path'] + runner_name
+      test_gen = UnityTestRunnerGenerator.new($cfg_file)
+      test_gen.run(test, runner_path)
+    else
+      runner_path = $cfg['compiler']['runner_path'] + runner_name
+    end
 
-      obj_list << compile(runner_path, test_defines)
+    obj_list << compile(runner_path, test_defines)
 
-      # Build the test module
-      obj_list << compile(test, test_defines)
+    # Build the test module
+    obj_list << compile(test, test_defines)
 
-      # Link the test executable
-      link_it(test_base, obj_list)
+    # Link the test executable
+    link_it(test_base, obj_list)
 
-      # Execute unit test and generate results file
-      simulator = build_simulator_fields
-      executable = $cfg['linker']['bin_files']['destination'] + test_base + $cfg['linker']['bin_files']['extension']
-      if simulator.nil?
-        cmd_str = executable
-      else
-        cmd_str = "#{simulator[:command]} #{simulator[:pre_support]} #{executable} #{simulator[:post_support]}"
-      end
-      output = execute(cmd_str)
-      test_results = $cfg['compiler']['build_path'] + test_base
-      if output.match(/OK$/m).nil?
-        test_results += '.testfail'
-      else
-        test_results += '.testpass'
-      end
-      File.open(test_results, 'w') { |f| f.print output }
+    # Execute unit test and generate results file
+    simulator = build_simulator_fields
+    executable = $cfg['linker']['bin_files']['destination'] + test_base + $cfg['linker']['bin_files']['extension']
+    if simulator.nil?
+      cmd_str = executable
+    else
+      cmd_str = "#{simulator[:command]} #{simulator[:pre_support]} #{executable} #{simulator[:post_support]}"
+    end
+    output = execute(cmd_str)
+    test_results = $cfg['compiler']['build_path'] + test_base
+    if output.match(/OK$/m).nil?
+      test_results += '.testfail'
+    else
+      test_results += '.testpass'
     end
+    File.open(test_results, 'w') { |f| f.print output }
   end
 
   def build_application(main)
@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/mcu_periph/spi_arbiter_tester.c
+ *  @brief Test code for the spi bus arbiter using unity and cmock.
+ *
+ * The arbiter sits between the devices on one spi_periph and spi_submit().
+ * It keeps a single transaction in flight on the bus, so the order in which
+ * waiting transactions go out is its own choice and not the FIFO of the spi
+ * driver:
+ * 1. Clients within their bus time budget before clients over budget. Over
+ *    budget, a client only gets bus time nobody else within budget wants.
+ * 2. Lower priority number first.
+ * 3. Earliest deadline first, then submission order.
+ * A transaction of a high priority client thus waits at most for the one
+ * transaction in flight.
+ *
+ * Usage:
+ * spi_arbiter_init(&spi2_arbiter, &spi2, 42000000);
+ * spi_arbiter_client_init(&imu_client, &spi2_arbiter, 0, 0, 0, 500);
+ * spi_arbiter_client_init(&logger_client, &spi2_arbiter, 2, 20000, 100000, 0);
+ * spi_arbiter_submit(&imu_client, &imu_trans);
+ */
+
+/* By prepending "Mock" to an include, a mock object is generated automatically by cmock. */
+#include "unity.h"
+#include "mcu_periph/Mockspi.h"
+#include "mcu_periph/spi_arbiter.h"
+
+/* Declared in spi.c during normal operation */
+struct spi_periph spi2;
+
+/* Defined in sys_time_arch.c during normal operation */
+uint32_t FakeSysTimeUsec;
+uint32_t get_sys_time_usec(void)
+{
+  return FakeSysTimeUsec;
+}
+
+struct spi_arbiter arbiter;
+struct spi_arbiter_client sensor_client;
+struct spi_arbiter_client telemetry_client;
+struct spi_arbiter_client logger_client;
+
+struct spi_transaction sensor_trans;
+struct spi_transaction telemetry_trans;
+struct spi_transaction logger_trans[2];
+
+uint8_t trans_buf[516];
+
+/* Transactions given to spi_submit */
+uint8_t SpiSubmitNrCalls;
+struct spi_transaction *SubmittedTransaction;
+
+/* Return value of SpiSubmitCall_Capture(), FALSE when the driver queue is full */
+bool_t SpiSubmitReturn;
+
+/* Completed transactions, the first 16 in order */
+struct spi_transaction *CompletedTransactions[16];
+uint32_t CompletedNr;
+
+/* 516 bytes at 42 MHz / 32 */
+#define BLOCK_DURATION_US (3145 + SPI_ARBITER_SETUP_US)
+
+/* 516 bytes at 42 MHz / 2, the SD card clock of a logger sharing the bus with a sensor */
+#define FAST_BLOCK_DURATION_US (196 + SPI_ARBITER_SETUP_US)
+
+/* 14 bytes at 42 MHz / 64 */
+#define SENSOR_DURATION_US (170 + SPI_ARBITER_SETUP_US)
+
+bool_t SpiSubmitCall_Capture(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) cmock_num_calls;
+  TEST_ASSERT_EQUAL_PTR(&spi2, p);
+  if (SpiSubmitReturn) {
+    SpiSubmitNrCalls++;
+    SubmittedTransaction = t;
+    t->status = SPITransPending;
+  }
+  return SpiSubmitReturn;
+}
+
+void helper_TransactionDone(struct spi_transaction *t)
+{
+  if (CompletedNr < 16) {
+    CompletedTransactions[CompletedNr] = t;
+  }
+  CompletedNr++;
+}
+
+void helper_InitTransaction(struct spi_transaction *t, uint16_t length, enum SPIClockDiv cdiv)
+{
+  t->input_buf = trans_buf;
+  t->output_buf = trans_buf;
+  t->input_length = length;
+  t->output_length = length;
+  t->cdiv = cdiv;
+  t->select = SPISelectUnselect;
+  t->after_cb = &helper_TransactionDone;
+  t->status = SPITransDone;
+}
+
+/**
+ * @brief Let the transaction on the bus finish after us microseconds
+ */
+void helper_CompleteAfter(uint32_t us)
+{
+  TEST_ASSERT_NOT_NULL(SubmittedTransaction);
+  struct spi_transaction *t = SubmittedTransaction;
+  SubmittedTransaction = NULL;
+  FakeSysTimeUsec += us;
+  t->status = SPITransSuccess;
+  t->after_cb(t);
+}
+
+/**
+ * @brief Called before each test by the unity framework
+ */
+void setUp(void)
+{
+  FakeSysTimeUsec = 1000;
+  SpiSubmitNrCalls = 0;
+  SubmittedTransaction = NULL;
+  SpiSubmitReturn = TRUE;
+  CompletedNr = 0;
+
+  spi_submit_StubWithCallback(SpiSubmitCall_Capture);
+
+  spi_arbiter_init(&arbiter, &spi2, 42000000);
+  /* Sensor read must be done within 0.5 ms */
+  spi_arbiter_client_init(&sensor_client, &arbiter, 0, 0, 0, 500);
+  spi_arbiter_client_init(&telemetry_client, &arbiter, 2, 0, 0, 0);
+  /* Logger gets 5 ms of bus time every 10 ms */
+  spi_arbiter_client_init(&logger_client, &arbiter, 1, 5000, 10000, 0);
+
+  helper_InitTransaction(&sensor_trans, 14, SPIDiv64);
+  helper_InitTransaction(&telemetry_trans, 32, SPIDiv64);
+  helper_InitTransaction(&logger_trans[0], 516, SPIDiv32);
+  helper_InitTransaction(&logger_trans[1], 516, SPIDiv32);
+}
+
+/**
+ * @brief Called after each test by the unity framework
+ */
+void tearDown(void)
+{
+}
+
+void test_InitializeArbiter(void)
+{
+  TEST_ASSERT_EQUAL_PTR(&spi2, arbiter.p);
+  TEST_ASSERT_EQUAL(42000000, arbiter.base_hz);
+  TEST_ASSERT_EQUAL(0, arbiter.queue_len);
+  TEST_ASSERT_FALSE(arbiter.busy);
+}
+
+void test_InitializeClient(void)
+{
+  TEST_ASSERT_EQUAL_PTR(&arbiter, logger_client.arb);
+  TEST_ASSERT_EQUAL(1, logger_client.priority);
+  TEST_ASSERT_EQUAL(5000, logger_client.budget_us);
+  TEST_ASSERT_EQUAL(10000, logger_client.period_us);
+  TEST_ASSERT_EQUAL(0, logger_client.deadline_us);
+  TEST_ASSERT_EQUAL(0, logger_client.used_us);
+  TEST_ASSERT_EQUAL(1000, logger_client.period_start);
+  TEST_ASSERT_EQUAL(0, logger_client.transactions);
+  TEST_ASSERT_EQUAL(0, logger_client.deadline_misses);
+  TEST_ASSERT_EQUAL(0, logger_client.max_wait_us);
+}
+
+/**
+ * Bus time of a transaction: the longer of input and output, eight clocks
+ * per byte at the base clock divided by 2..256, plus SPI_ARBITER_SETUP_US.
+ */
+void test_DurationFromLengthAndDivider(void)
+{
+  TEST_ASSERT_EQUAL(3145 + SPI_ARBITER_SETUP_US, spi_arbiter_duration_us(&arbiter, &logger_trans[0]));
+
+  sensor_trans.output_length = 2;
+  sensor_trans.input_length = 14;
+  TEST_ASSERT_EQUAL(170 + SPI_ARBITER_SETUP_US, spi_arbiter_duration_us(&arbiter, &sensor_trans));
+}
+
+void test_SubmitOnIdleBusGoesStraightToSpi(void)
+{
+  TEST_ASSERT_TRUE(spi_arbiter_submit(&sensor_client, &sensor_trans));
+
+  TEST_ASSERT_EQUAL(1, SpiSubmitNrCalls);
+  TEST_ASSERT_EQUAL_PTR(&sensor_trans, SubmittedTransaction);
+  TEST_ASSERT_TRUE(arbiter.busy);
+  TEST_ASSERT_EQUAL(0, arbiter.queue_len);
+  /* The arbiter needs to see the completion */
+  TEST_ASSERT_TRUE(sensor_trans.after_cb != &helper_TransactionDone);
+}
+
+void test_SecondSubmitWaitsForFirst(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+
+  TEST_ASSERT_TRUE(spi_arbiter_submit(&telemetry_client, &telemetry_trans));
+
+  TEST_ASSERT_EQUAL(1, SpiSubmitNrCalls);
+  TEST_ASSERT_EQUAL(1, arbiter.queue_len);
+  TEST_ASSERT_EQUAL(SPITransPending, telemetry_trans.status);
+}
+
+void test_CompletionCallsClientCallbackAndRestoresIt(void)
+{
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(200);
+
+  TEST_ASSERT_EQUAL(1, CompletedNr);
+  TEST_ASSERT_EQUAL_PTR(&sensor_trans, CompletedTransactions[0]);
+  TEST_ASSERT_EQUAL_PTR(&helper_TransactionDone, sensor_trans.after_cb);
+  TEST_ASSERT_EQUAL(SPITransSuccess, sensor_trans.status);
+  TEST_ASSERT_FALSE(arbiter.busy);
+  TEST_ASSERT_EQUAL(1, sensor_client.transactions);
+}
+
+void test_CompletionWithoutClientCallback(void)
+{
+  sensor_trans.after_cb = NULL;
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(200);
+
+  TEST_ASSERT_NULL(sensor_trans.after_cb);
+  TEST_ASSERT_FALSE(arbiter.busy);
+}
+
+void test_HigherPriorityGoesFirst(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&telemetry_client, &telemetry_trans);
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL_PTR(&sensor_trans, SubmittedTransaction);
+  helper_CompleteAfter(200);
+  TEST_ASSERT_EQUAL_PTR(&logger_trans[1], SubmittedTransaction);
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL_PTR(&telemetry_trans, SubmittedTransaction);
+  helper_CompleteAfter(100);
+
+  TEST_ASSERT_EQUAL(4, CompletedNr);
+  TEST_ASSERT_EQUAL(4, SpiSubmitNrCalls);
+}
+
+void test_SamePriorityInSubmissionOrder(void)
+{
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+
+  helper_CompleteAfter(200);
+  TEST_ASSERT_EQUAL_PTR(&logger_trans[0], SubmittedTransaction);
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL_PTR(&logger_trans[1], SubmittedTransaction);
+}
+
+void test_EarlierDeadlineFirstWithinSamePriority(void)
+{
+  struct spi_arbiter_client other_sensor_client;
+  struct spi_transaction other_sensor_trans;
+  spi_arbiter_client_init(&other_sensor_client, &arbiter, 0, 0, 0, 200);
+  helper_InitTransaction(&other_sensor_trans, 14, SPIDiv64);
+
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&sensor_client, &sensor_trans);             /* due at 1500 */
+  FakeSysTimeUsec += 100;
+  spi_arbiter_submit(&other_sensor_client, &other_sensor_trans); /* due at 1300 */
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL_PTR(&other_sensor_trans, SubmittedTransaction);
+}
+
+void test_ChargeBusTimeOnDispatch(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+
+  TEST_ASSERT_EQUAL(BLOCK_DURATION_US, logger_client.used_us);
+  TEST_ASSERT_EQUAL(0, telemetry_client.used_us);
+}
+
+/**
+ * The logger has higher priority than telemetry, but after its 5 ms in this
+ * period it has to wait until telemetry is done.
+ */
+void test_OverBudgetClientYieldsToClientWithinBudget(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  logger_client.used_us = 5000;
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+  spi_arbiter_submit(&telemetry_client, &telemetry_trans);
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+
+  TEST_ASSERT_EQUAL_PTR(&telemetry_trans, SubmittedTransaction);
+}
+
+void test_OverBudgetClientGetsLeftoverBandwidth(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL_PTR(&logger_trans[1], SubmittedTransaction);
+
+  /* Over budget, nobody else on the bus */
+  TEST_ASSERT_TRUE(logger_client.used_us > logger_client.budget_us);
+}
+
+void test_RefillBudgetEveryPeriod(void)
+{
+  logger_client.used_us = 7000;
+  FakeSysTimeUsec = 1000 + 10000 + 300;
+
+  spi_arbiter_periodic(&arbiter);
+
+  TEST_ASSERT_EQUAL(0, logger_client.used_us);
+  TEST_ASSERT_EQUAL(11000, logger_client.period_start);
+}
+
+void test_RefillBudgetWhenDispatchingInNextPeriod(void)
+{
+  logger_client.used_us = 7000;
+  FakeSysTimeUsec = 1000 + 10000;
+
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+
+  TEST_ASSERT_EQUAL(BLOCK_DURATION_US, logger_client.used_us);
+}
+
+/**
+ * A client without period has no budget to refill.
+ */
+void test_UnlimitedClientIsNeverOverBudget(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  telemetry_client.used_us = 1000000;
+  logger_client.used_us = 0;
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+  spi_arbiter_submit(&telemetry_client, &telemetry_trans);
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+
+  /* Both within budget, logger has priority */
+  TEST_ASSERT_EQUAL_PTR(&logger_trans[1], SubmittedTransaction);
+}
+
+void test_CountDeadlineMiss(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(BLOCK_DURATION_US);
+  helper_CompleteAfter(200);
+
+  TEST_ASSERT_EQUAL(1, sensor_client.deadline_misses);
+  TEST_ASSERT_EQUAL(0, logger_client.deadline_misses);
+}
+
+void test_NoDeadlineMissWithinDeadline(void)
+{
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(500);
+
+  TEST_ASSERT_EQUAL(0, sensor_client.deadline_misses);
+}
+
+void test_RecordLongestWait(void)
+{
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  FakeSysTimeUsec += 1000;
+  spi_arbiter_submit(&sensor_client, &sensor_trans);
+
+  helper_CompleteAfter(BLOCK_DURATION_US - 1000);
+
+  TEST_ASSERT_EQUAL(BLOCK_DURATION_US - 1000, sensor_client.max_wait_us);
+  TEST_ASSERT_EQUAL(0, logger_client.max_wait_us);
+}
+
+void test_KeepTransactionWhenSpiQueueFull(void)
+{
+  SpiSubmitReturn = FALSE;
+
+  TEST_ASSERT_TRUE(spi_arbiter_submit(&sensor_client, &sensor_trans));
+
+  TEST_ASSERT_FALSE(arbiter.busy);
+  TEST_ASSERT_EQUAL(1, arbiter.queue_len);
+
+  /* Retried from the periodic loop */
+  SpiSubmitReturn = TRUE;
+  spi_arbiter_periodic(&arbiter);
+
+  TEST_ASSERT_EQUAL_PTR(&sensor_trans, SubmittedTransaction);
+  TEST_ASSERT_TRUE(arbiter.busy);
+  TEST_ASSERT_EQUAL(0, arbiter.queue_len);
+}
+
+void test_RejectWhenArbiterQueueFull(void)
+{
+  struct spi_transaction extra[SPI_ARBITER_QUEUE_SIZE + 1];
+  for (uint8_t i = 0; i < SPI_ARBITER_QUEUE_SIZE + 1; i++) {
+    helper_InitTransaction(&extra[i], 32, SPIDiv64);
+    /* One in flight, the rest queued */
+    TEST_ASSERT_TRUE(spi_arbiter_submit(&telemetry_client, &extra[i]));
+  }
+
+  TEST_ASSERT_FALSE(spi_arbiter_submit(&sensor_client, &sensor_trans));
+  TEST_ASSERT_EQUAL(SPI_ARBITER_QUEUE_SIZE, arbiter.queue_len);
+}
+
+/**
+ * The arbiter does not preempt, so a sensor read can wait for a full block on
+ * the bus. To meet the 0.5 ms deadline, a block plus the sensor read must fit
+ * in it: at 42 MHz / 32 a block alone takes 3.2 ms.
+ */
+void test_BlockAtLowClockDoesNotFitSensorDeadline(void)
+{
+  TEST_ASSERT_TRUE(BLOCK_DURATION_US + SENSOR_DURATION_US > sensor_client.deadline_us);
+
+  logger_trans[0].cdiv = SPIDiv2;
+  TEST_ASSERT_EQUAL(FAST_BLOCK_DURATION_US, spi_arbiter_duration_us(&arbiter, &logger_trans[0]));
+  TEST_ASSERT_EQUAL(SENSOR_DURATION_US, spi_arbiter_duration_us(&arbiter, &sensor_trans));
+  TEST_ASSERT_TRUE(FAST_BLOCK_DURATION_US + SENSOR_DURATION_US <= sensor_client.deadline_us);
+}
+
+/**
+ * The logger keeps two blocks waiting all the time while the sensor is read
+ * every millisecond. The sensor never waits longer than the one block that
+ * can be on the bus, so with the logger at 42 MHz / 2 no read misses its
+ * deadline. The logger still gets the rest of the bus time.
+ */
+void test_SensorLatencyBoundedByOneBlock(void)
+{
+  uint32_t next_sensor = FakeSysTimeUsec;
+  uint32_t end = FakeSysTimeUsec + 1000000;
+  uint32_t logger_blocks = 0;
+  uint32_t sensor_reads = 0;
+
+  logger_trans[0].cdiv = SPIDiv2;
+  logger_trans[1].cdiv = SPIDiv2;
+  spi_arbiter_submit(&logger_client, &logger_trans[0]);
+  spi_arbiter_submit(&logger_client, &logger_trans[1]);
+  while (FakeSysTimeUsec < end) {
+    struct spi_transaction *t = SubmittedTransaction;
+    uint32_t duration = spi_arbiter_duration_us(&arbiter, t);
+    uint32_t elapsed = 0;
+    /* Sensor read becomes due while t is on the bus */
+    if (sensor_trans.status != SPITransPending && next_sensor < FakeSysTimeUsec + duration) {
+      if (next_sensor > FakeSysTimeUsec) {
+        elapsed = next_sensor - FakeSysTimeUsec;
+        FakeSysTimeUsec = next_sensor;
+      }
+      spi_arbiter_submit(&sensor_client, &sensor_trans);
+      next_sensor += 1000;
+    }
+    helper_CompleteAfter(duration - elapsed);
+    /* Keep the logger queue full */
+    if (t == &logger_trans[0] || t == &logger_trans[1]) {
+      logger_blocks++;
+      spi_arbiter_submit(&logger_client, t);
+    } else {
+      sensor_reads++;
+    }
+  }
+
+  TEST_ASSERT_TRUE(sensor_client.max_wait_us <= FAST_BLOCK_DURATION_US);
+  TEST_ASSERT_EQUAL(0, sensor_client.deadline_misses);
+  /* One read per millisecond */
+  TEST_ASSERT_TRUE(sensor_reads >= 999 && sensor_reads <= 1001);
+  /* Leftover bandwidth goes to the logger, far beyond its 50% budget */
+  TEST_ASSERT_TRUE(logger_blocks * FAST_BLOCK_DURATION_US > 700000);
+}
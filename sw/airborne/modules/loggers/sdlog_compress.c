@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlog_compress.c
+ *  @brief Streaming compressor for the pprzlog stream, one SD block at a time.
+ */
+
+#include "sdlog_compress.h"
+#include <string.h>
+
+/** Length of a frame once its length byte is known, frames shorter than the header are cut at it */
+static uint16_t frame_size(const uint8_t *frame)
+{
+  return frame[1] < 2 ? 2 : frame[1];
+}
+
+static uint16_t frame_key(const uint8_t *frame)
+{
+  return ((uint16_t) frame[7] << 8) | frame[8];
+}
+
+static struct SdlogCompressRef *find_ref(struct SdlogCompressRef *refs, uint16_t key)
+{
+  uint8_t i;
+  for (i = 0; i < SDLOG_COMPRESS_REFS; i++) {
+    if (refs[i].len != 0 && refs[i].key == key) {
+      return &refs[i];
+    }
+  }
+  return NULL;
+}
+
+/** Same update on both sides, so the decoder finds the references the encoder used */
+static void update_ref(struct SdlogCompressRef *refs, uint8_t *next_ref, const uint8_t *frame, uint16_t size)
+{
+  struct SdlogCompressRef *ref;
+  uint16_t key;
+  if (size < SDLOG_COMPRESS_FRAME_MIN) {
+    return;
+  }
+  key = frame_key(frame);
+  ref = find_ref(refs, key);
+  if (ref == NULL) {
+    ref = &refs[*next_ref];
+    *next_ref = (*next_ref + 1) % SDLOG_COMPRESS_REFS;
+  }
+  ref->key = key;
+  ref->len = size;
+  memcpy(ref->frame, frame, size);
+}
+
+/** Bytes needed to store a frame as XOR with ref */
+static uint16_t delta_cost(const uint8_t *frame, const uint8_t *ref, uint16_t size)
+{
+  uint16_t i, cost = 1 + (size + 7) / 8;
+  for (i = 0; i < size; i++) {
+    if (frame[i] != ref[i]) {
+      cost++;
+    }
+  }
+  return cost;
+}
+
+static bool_t emit_literal(struct SdlogCompress *c, uint8_t byte)
+{
+  if (c->lit_pos != 0 && c->out[c->lit_pos + 1] < 255) {
+    if (c->out_len + 1 > SDLOG_COMPRESS_BLOCK_SIZE) {
+      return FALSE;
+    }
+    c->out[c->lit_pos + 1]++;
+  } else {
+    if (c->out_len + 3 > SDLOG_COMPRESS_BLOCK_SIZE) {
+      return FALSE;
+    }
+    c->lit_pos = c->out_len;
+    c->out[c->out_len++] = SDLOG_COMPRESS_LITERALS;
+    c->out[c->out_len++] = 1;
+  }
+  c->out[c->out_len++] = byte;
+  return TRUE;
+}
+
+/** Store the complete frame in progress, as XOR with its reference if that is smaller */
+static bool_t emit_frame(struct SdlogCompress *c)
+{
+  uint16_t size = frame_size(c->frame);
+  uint16_t cost = 1 + size;
+  uint16_t i, j;
+  struct SdlogCompressRef *ref = NULL;
+
+  if (size >= SDLOG_COMPRESS_FRAME_MIN) {
+    ref = find_ref(c->refs, frame_key(c->frame));
+    if (ref != NULL && ref->len == size && delta_cost(c->frame, ref->frame, size) < cost) {
+      cost = delta_cost(c->frame, ref->frame, size);
+    } else {
+      ref = NULL;
+    }
+  }
+  if (c->out_len + cost > SDLOG_COMPRESS_BLOCK_SIZE) {
+    return FALSE;
+  }
+
+  if (ref == NULL) {
+    c->out[c->out_len++] = SDLOG_COMPRESS_RAW;
+    memcpy(&c->out[c->out_len], c->frame, size);
+    c->out_len += size;
+  } else {
+    c->out[c->out_len++] = SDLOG_COMPRESS_DELTA | (uint8_t)(ref - c->refs);
+    for (i = 0; i < size; i += 8) {
+      uint16_t mask_pos = c->out_len++;
+      c->out[mask_pos] = 0;
+      for (j = i; j < i + 8 && j < size; j++) {
+        uint8_t x = c->frame[j] ^ ref->frame[j];
+        if (x != 0) {
+          c->out[mask_pos] |= 1 << (j - i);
+          c->out[c->out_len++] = x;
+        }
+      }
+    }
+  }
+  update_ref(c->refs, &c->next_ref, c->frame, size);
+  c->frame_len = 0;
+  c->lit_pos = 0;
+  return TRUE;
+}
+
+static bool_t frame_complete(struct SdlogCompress *c)
+{
+  return c->frame_len >= 2 && c->frame_len == frame_size(c->frame);
+}
+
+void sdlog_compress_init(struct SdlogCompress *c)
+{
+  c->frame_len = 0;
+  sdlog_compress_start(c, NULL);
+}
+
+void sdlog_compress_start(struct SdlogCompress *c, uint8_t *out)
+{
+  uint8_t i;
+  c->out = out;
+  c->out_len = SDLOG_COMPRESS_HEADER_SIZE;
+  c->lit_pos = 0;
+  for (i = 0; i < SDLOG_COMPRESS_REFS; i++) {
+    c->refs[i].len = 0;
+  }
+  c->next_ref = 0;
+}
+
+uint16_t sdlog_compress(struct SdlogCompress *c, const uint8_t *data, uint16_t len)
+{
+  uint16_t taken = 0;
+  while (taken < len) {
+    if (frame_complete(c)) {
+      if (!emit_frame(c)) {
+        return taken;
+      }
+    }
+    if (c->frame_len > 0) {
+      c->frame[c->frame_len++] = data[taken++];
+    } else if (data[taken] == SDLOG_COMPRESS_STX) {
+      c->frame[0] = data[taken++];
+      c->frame_len = 1;
+      c->lit_pos = 0;
+    } else {
+      if (!emit_literal(c, data[taken])) {
+        return taken;
+      }
+      taken++;
+    }
+  }
+  /* A frame ending on the last byte is kept if it does not fit, the next call retries it */
+  if (frame_complete(c)) {
+    emit_frame(c);
+  }
+  return taken;
+}
+
+void sdlog_compress_finish(struct SdlogCompress *c)
+{
+  c->out[0] = c->out_len >> 8;
+  c->out[1] = c->out_len & 0xFF;
+  memset(&c->out[c->out_len], 0, SDLOG_COMPRESS_BLOCK_SIZE - c->out_len);
+}
+
+bool_t sdlog_compress_empty(struct SdlogCompress *c)
+{
+  return c->out_len == SDLOG_COMPRESS_HEADER_SIZE;
+}
+
+bool_t sdlog_compress_flush(struct SdlogCompress *c)
+{
+  if (frame_complete(c)) {
+    return emit_frame(c);
+  }
+  while (c->frame_len > 0) {
+    if (!emit_literal(c, c->frame[0])) {
+      return FALSE;
+    }
+    c->frame_len--;
+    memmove(c->frame, &c->frame[1], c->frame_len);
+  }
+  return TRUE;
+}
+
+int32_t sdlog_decompress(const uint8_t *block, uint8_t *out, uint32_t out_size)
+{
+  struct SdlogCompressRef refs[SDLOG_COMPRESS_REFS];
+  uint8_t next_ref = 0;
+  uint16_t used = ((uint16_t) block[0] << 8) | block[1];
+  uint16_t pos = SDLOG_COMPRESS_HEADER_SIZE;
+  uint32_t n = 0;
+  uint16_t i, j, size;
+  uint8_t tag;
+
+  if (used < SDLOG_COMPRESS_HEADER_SIZE || used > SDLOG_COMPRESS_BLOCK_SIZE) {
+    return -1;
+  }
+  for (i = 0; i < SDLOG_COMPRESS_REFS; i++) {
+    refs[i].len = 0;
+  }
+
+  while (pos < used) {
+    tag = block[pos++];
+    if (tag == SDLOG_COMPRESS_LITERALS) {
+      if (pos >= used || pos + 1 + block[pos] > used || n + block[pos] > out_size) {
+        return -1;
+      }
+      memcpy(&out[n], &block[pos + 1], block[pos]);
+      n += block[pos];
+      pos += 1 + block[pos];
+    } else if (tag == SDLOG_COMPRESS_RAW) {
+      if (pos + 2 > used) {
+        return -1;
+      }
+      size = frame_size(&block[pos]);
+      if (pos + size > used || n + size > out_size) {
+        return -1;
+      }
+      memcpy(&out[n], &block[pos], size);
+      pos += size;
+      update_ref(refs, &next_ref, &out[n], size);
+      n += size;
+    } else if (tag & SDLOG_COMPRESS_DELTA) {
+      struct SdlogCompressRef *ref;
+      if ((tag & ~SDLOG_COMPRESS_DELTA) >= SDLOG_COMPRESS_REFS) {
+        return -1;
+      }
+      ref = &refs[tag & ~SDLOG_COMPRESS_DELTA];
+      size = ref->len;
+      if (size == 0 || n + size > out_size) {
+        return -1;
+      }
+      for (i = 0; i < size; i += 8) {
+        uint8_t mask;
+        if (pos >= used) {
+          return -1;
+        }
+        mask = block[pos++];
+        for (j = i; j < i + 8 && j < size; j++) {
+          uint8_t x = 0;
+          if (mask & (1 << (j - i))) {
+            if (pos >= used) {
+              return -1;
+            }
+            x = block[pos++];
+          }
+          out[n + j] = ref->frame[j] ^ x;
+        }
+      }
+      update_ref(refs, &next_ref, &out[n], size);
+      n += size;
+    } else {
+      return -1;
+    }
+  }
+  return n;
+}
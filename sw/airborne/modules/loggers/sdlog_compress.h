@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlog_compress.h
+ *  @brief Streaming compressor for the pprzlog stream, one SD block at a time.
+ *
+ * High rate messages repeat with only a few changed bytes: the timestamp, the
+ * noisy low bytes of sensor values and the checksum. Each pprzlog frame
+ * (STX, length, ..., checksum) is therefore stored as the XOR with the
+ * previous frame of the same message, and the XOR is stored as a bitmask per
+ * eight bytes followed by only the bytes that are non-zero.
+ *
+ * Every output block starts with an empty reference table, so blocks decode
+ * independently of each other: a bad block on the card loses one block of
+ * log, not the rest of the file. RAM is bounded by the reference table.
+ *
+ * Block layout:
+ *  [0..1]  used bytes in the block including this header, big endian
+ *  records until the used length, then zero padding:
+ *  0x01 n <n bytes>                 n literal bytes (not part of a frame)
+ *  0x02 <frame>                     frame stored as is, length from frame[1]
+ *  0x80|slot <mask <bytes>>...      frame as XOR with reference slot, one mask
+ *                                   byte per 8 frame bytes, bit i set if byte
+ *                                   i of the group is non-zero and stored
+ *
+ * After each frame record both sides store the frame in the slot of its
+ * (ac_id, msg_id) key, or in the next slot round robin for a new key.
+ *
+ * Usage:
+ * sdlog_compress_init(&c);
+ * sdlog_compress_start(&c, block);
+ * while (sdlog_compress(&c, data, len) < len) {   // block is full
+ *   sdlog_compress_finish(&c);
+ *   ...write block, continue with the bytes not taken...
+ *   sdlog_compress_start(&c, block);
+ * }
+ *
+ * Bytes taken but not yet in the block (a frame in progress, or a complete
+ * frame that did not fit anymore) are kept and go into the next block. At the
+ * end of the log call sdlog_compress_flush() until it returns TRUE.
+ *
+ * The host side decompressor is sw/tools/sdlog_decompress.py.
+ */
+
+#ifndef SDLOG_COMPRESS_H
+#define SDLOG_COMPRESS_H
+
+#include "std.h"
+
+#define SDLOG_COMPRESS_BLOCK_SIZE 512
+#define SDLOG_COMPRESS_HEADER_SIZE 2
+#define SDLOG_COMPRESS_FRAME_MAX 256    /**< Length byte plus one */
+#define SDLOG_COMPRESS_FRAME_MIN 10     /**< Shorter frames have no message id and are not referenced */
+
+#ifndef SDLOG_COMPRESS_REFS
+#define SDLOG_COMPRESS_REFS 8           /**< Reference slots, at most 128 */
+#endif
+
+#define SDLOG_COMPRESS_STX 0x99
+#define SDLOG_COMPRESS_LITERALS 0x01
+#define SDLOG_COMPRESS_RAW 0x02
+#define SDLOG_COMPRESS_DELTA 0x80
+
+struct SdlogCompressRef {
+  uint16_t key;                 /**< ac_id << 8 | msg_id */
+  uint16_t len;                 /**< Frame length, 0 if the slot is empty */
+  uint8_t frame[SDLOG_COMPRESS_FRAME_MAX];
+};
+
+struct SdlogCompress {
+  uint8_t *out;                 /**< Block being filled */
+  uint16_t out_len;             /**< Used bytes of out, including the header */
+  uint16_t lit_pos;             /**< Offset of the open literal record in out, 0 if none */
+  uint8_t frame[SDLOG_COMPRESS_FRAME_MAX];
+  uint16_t frame_len;           /**< Bytes of the frame in progress */
+  struct SdlogCompressRef refs[SDLOG_COMPRESS_REFS];
+  uint8_t next_ref;
+};
+
+extern void sdlog_compress_init(struct SdlogCompress *c);
+/** Begin a new block in out (SDLOG_COMPRESS_BLOCK_SIZE bytes), with an empty reference table */
+extern void sdlog_compress_start(struct SdlogCompress *c, uint8_t *out);
+/**
+ * @brief Compress bytes into the current block
+ * @return Number of bytes taken, less than len once the block is full
+ */
+extern uint16_t sdlog_compress(struct SdlogCompress *c, const uint8_t *data, uint16_t len);
+/** Write the header and zero the rest of the block */
+extern void sdlog_compress_finish(struct SdlogCompress *c);
+/** @return TRUE if nothing was compressed into the current block */
+extern bool_t sdlog_compress_empty(struct SdlogCompress *c);
+/**
+ * @brief Put the bytes that are kept back into the current block
+ * A frame that is not complete is stored as literals.
+ * @return TRUE if nothing is kept anymore, FALSE if the block is full
+ */
+extern bool_t sdlog_compress_flush(struct SdlogCompress *c);
+
+/**
+ * @brief Decompress one block
+ * @return Number of bytes written to out, -1 if the block is corrupt or out is too small
+ */
+extern int32_t sdlog_decompress(const uint8_t *block, uint8_t *out, uint32_t out_size);
+
+#endif /* SDLOG_COMPRESS_H */
@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlog_compress_tester.c
+ *  @brief Test code and benchmark for the log block compression.
+ *
+ * The benchmark compresses a synthetic pprzlog stream with the high rate
+ * messages of a typical flight (IMU, actuators and a 12 channel data packet,
+ * all at 512 Hz) and prints the compression ratio, the CPU time per raw block
+ * on this host and the SPI time saved. Run the same stream on the target to
+ * get the CPU cost there.
+ *
+ * Longer runs: -DSDLOG_COMPRESS_BENCH_SECONDS=600
+ */
+
+/* clock_gettime() with -std=c99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "loggers/sdlog_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Simulated flight time of the benchmark */
+#ifndef SDLOG_COMPRESS_BENCH_SECONDS
+#define SDLOG_COMPRESS_BENCH_SECONDS 20
+#endif
+
+/* SPI clock of the card, to convert the bytes saved to time */
+#ifndef SDLOG_COMPRESS_BENCH_SPI_HZ
+#define SDLOG_COMPRESS_BENCH_SPI_HZ 10500000
+#endif
+
+/* Bytes on the bus per written block: token, data, CRC and data response */
+#define BENCH_SPI_BYTES_PER_BLOCK (SDLOG_COMPRESS_BLOCK_SIZE + 4)
+
+/* Raw bytes a single block can hold at most */
+#define RAW_SIZE 8192
+
+struct SdlogCompress comp;
+uint8_t Block[SDLOG_COMPRESS_BLOCK_SIZE];
+uint8_t Raw[RAW_SIZE];
+
+/* Stream used by the multi block tests */
+uint8_t *Stream;
+uint32_t StreamLen;
+uint8_t *Blocks;
+uint32_t NbBlocks;
+
+uint32_t LcgState;
+
+void setUp(void)
+{
+  memset(Block, 0xAA, sizeof(Block));
+  memset(Raw, 0xAA, sizeof(Raw));
+  Stream = malloc(RAW_SIZE);
+  StreamLen = 0;
+  Blocks = NULL;
+  LcgState = 12345;
+  sdlog_compress_init(&comp);
+  sdlog_compress_start(&comp, Block);
+}
+
+void tearDown(void)
+{
+  free(Stream);
+  free(Blocks);
+}
+
+uint32_t helper_Random(void)
+{
+  LcgState = LcgState * 1103515245 + 12345;
+  return LcgState >> 8;
+}
+
+void helper_Put32(uint8_t *p, uint32_t v)
+{
+  for (uint8_t i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+uint16_t helper_Used(const uint8_t *block)
+{
+  return (block[0] << 8) | block[1];
+}
+
+/**
+ * Append a pprzlog frame: STX, length, source, timestamp, ac_id, msg_id,
+ * payload, checksum.
+ */
+void helper_LogMessage(uint32_t timestamp, uint8_t msg_id, const uint8_t *payload, uint8_t len)
+{
+  uint8_t *p = &Stream[StreamLen];
+  uint8_t frame_len = 2 + 1 + 4 + 2 + len + 1;
+  uint8_t checksum = 0;
+
+  p[0] = 0x99;
+  p[1] = frame_len;
+  p[2] = 0;
+  helper_Put32(&p[3], timestamp);
+  p[7] = 1;
+  p[8] = msg_id;
+  memcpy(&p[9], payload, len);
+  for (uint8_t i = 1; i < frame_len - 1; i++) {
+    checksum += p[i];
+  }
+  p[frame_len - 1] = checksum;
+  StreamLen += frame_len;
+}
+
+/**
+ * Synthetic flight log: IMU (accelerometer and gyro, int32 with noise),
+ * 8 actuators (int16, slowly moving) and a 12 channel data packet (int16),
+ * every 1/512 s.
+ */
+void helper_GenerateFlightLog(uint32_t seconds)
+{
+  uint32_t samples = seconds * 512;
+  int16_t actuators[8] = {1500, 1500, 1500, 1500, 1200, 1200, 1200, 1200};
+
+  free(Stream);
+  Stream = malloc(samples * 128);
+  TEST_ASSERT_NOT_NULL(Stream);
+  StreamLen = 0;
+
+  for (uint32_t s = 0; s < samples; s++) {
+    uint8_t payload[48];
+    uint32_t timestamp = s * 10000 / 512;
+
+    for (uint8_t i = 0; i < 6; i++) {
+      int32_t base = (i == 2) ? 9810 : 0;
+      helper_Put32(&payload[4 * i], base + (int32_t)(helper_Random() % 64) - 32);
+    }
+    helper_LogMessage(timestamp, 200, payload, 24);
+
+    for (uint8_t i = 0; i < 8; i++) {
+      if (helper_Random() % 16 == 0) {
+        actuators[i] += (helper_Random() % 2) ? 1 : -1;
+      }
+      payload[2 * i] = actuators[i];
+      payload[2 * i + 1] = actuators[i] >> 8;
+    }
+    helper_LogMessage(timestamp, 105, payload, 16);
+
+    for (uint8_t i = 0; i < 12; i++) {
+      int16_t v = 100 * i + (helper_Random() % 8);
+      payload[2 * i] = v;
+      payload[2 * i + 1] = v >> 8;
+    }
+    helper_LogMessage(timestamp, 31, payload, 24);
+  }
+}
+
+/** Compress the whole stream into Blocks, in pieces of a ring block like the logger does */
+void helper_CompressStream(void)
+{
+  uint32_t max_blocks = StreamLen / 256 + 2;
+  uint32_t pos = 0;
+
+  Blocks = malloc(max_blocks * SDLOG_COMPRESS_BLOCK_SIZE);
+  TEST_ASSERT_NOT_NULL(Blocks);
+  NbBlocks = 0;
+
+  sdlog_compress_start(&comp, &Blocks[0]);
+  while (pos < StreamLen) {
+    uint16_t len = (StreamLen - pos > 512) ? 512 : StreamLen - pos;
+    uint16_t n = sdlog_compress(&comp, &Stream[pos], len);
+    pos += n;
+    if (n < len) {
+      sdlog_compress_finish(&comp);
+      NbBlocks++;
+      TEST_ASSERT_TRUE(NbBlocks < max_blocks);
+      sdlog_compress_start(&comp, &Blocks[NbBlocks * SDLOG_COMPRESS_BLOCK_SIZE]);
+    }
+  }
+  while (!sdlog_compress_flush(&comp)) {
+    sdlog_compress_finish(&comp);
+    NbBlocks++;
+    sdlog_compress_start(&comp, &Blocks[NbBlocks * SDLOG_COMPRESS_BLOCK_SIZE]);
+  }
+  sdlog_compress_finish(&comp);
+  NbBlocks++;
+}
+
+/** Decode all blocks in order and compare with the stream */
+void helper_CheckStream(void)
+{
+  uint32_t pos = 0;
+  for (uint32_t b = 0; b < NbBlocks; b++) {
+    int32_t n = sdlog_decompress(&Blocks[b * SDLOG_COMPRESS_BLOCK_SIZE], Raw, sizeof(Raw));
+    TEST_ASSERT_TRUE(n >= 0);
+    TEST_ASSERT_TRUE(pos + n <= StreamLen);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(&Stream[pos], Raw, n);
+    pos += n;
+  }
+  TEST_ASSERT_EQUAL(StreamLen, pos);
+}
+
+void test_EmptyBlock(void)
+{
+  TEST_ASSERT_TRUE(sdlog_compress_empty(&comp));
+
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL_HEX(0x00, Block[0]);
+  TEST_ASSERT_EQUAL_HEX(0x02, Block[1]);
+  for (uint16_t i = 2; i < SDLOG_COMPRESS_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX(0x00, Block[i]);
+  }
+  TEST_ASSERT_EQUAL(0, sdlog_decompress(Block, Raw, sizeof(Raw)));
+}
+
+/**
+ * @brief test_LiteralsOnly
+ * Bytes outside of frames are stored as one literal record.
+ */
+void test_LiteralsOnly(void)
+{
+  uint8_t data[100];
+  for (uint8_t i = 0; i < sizeof(data); i++) {
+    data[i] = i;
+  }
+
+  TEST_ASSERT_EQUAL(100, sdlog_compress(&comp, data, sizeof(data)));
+  TEST_ASSERT_FALSE(sdlog_compress_empty(&comp));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(2 + 2 + 100, helper_Used(Block));
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_LITERALS, Block[2]);
+  TEST_ASSERT_EQUAL(100, Block[3]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, &Block[4], sizeof(data));
+  TEST_ASSERT_EQUAL(100, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, Raw, sizeof(data));
+}
+
+/**
+ * @brief test_FirstFrameIsStoredAsIs
+ * There is no reference yet for the first frame of a message in a block.
+ */
+void test_FirstFrameIsStoredAsIs(void)
+{
+  const uint8_t payload[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  helper_LogMessage(1000, 42, payload, sizeof(payload));
+
+  TEST_ASSERT_EQUAL(20, sdlog_compress(&comp, Stream, StreamLen));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(2 + 1 + 20, helper_Used(Block));
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_RAW, Block[2]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, &Block[3], 20);
+  TEST_ASSERT_EQUAL(20, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, 20);
+}
+
+/**
+ * @brief test_RepeatedFrameIsStoredAsDelta
+ * The second frame of the same message only stores the bytes that changed:
+ * the timestamp, one payload byte and the checksum.
+ */
+void test_RepeatedFrameIsStoredAsDelta(void)
+{
+  uint8_t payload[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  helper_LogMessage(1000, 42, payload, sizeof(payload));
+  payload[4] = 50;
+  helper_LogMessage(1001, 42, payload, sizeof(payload));
+
+  TEST_ASSERT_EQUAL(40, sdlog_compress(&comp, Stream, StreamLen));
+  sdlog_compress_finish(&comp);
+
+  /* Tag, 3 masks, timestamp, payload byte, checksum */
+  TEST_ASSERT_EQUAL(2 + 21 + 1 + 3 + 3, helper_Used(Block));
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_DELTA | 0, Block[23]);
+  TEST_ASSERT_EQUAL_HEX(0x08, Block[24]);           /* timestamp byte 0 is frame byte 3 */
+  TEST_ASSERT_EQUAL_HEX(1000 ^ 1001, Block[25]);
+  TEST_ASSERT_EQUAL_HEX(0x20, Block[26]);           /* payload byte 4 is frame byte 13 */
+  TEST_ASSERT_EQUAL_HEX(5 ^ 50, Block[27]);
+  TEST_ASSERT_EQUAL_HEX(0x08, Block[28]);           /* checksum is frame byte 19 */
+  TEST_ASSERT_EQUAL(40, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, 40);
+}
+
+/**
+ * @brief test_OtherLengthIsNotADelta
+ * A message with the same id but another length has no usable reference.
+ */
+void test_OtherLengthIsNotADelta(void)
+{
+  const uint8_t payload[12] = {0};
+  helper_LogMessage(1000, 42, payload, 10);
+  helper_LogMessage(1001, 42, payload, 12);
+  helper_LogMessage(1002, 42, payload, 12);
+
+  TEST_ASSERT_EQUAL(64, sdlog_compress(&comp, Stream, StreamLen));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_RAW, Block[2]);
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_RAW, Block[23]);
+  /* The longer frame replaced the shorter one in the same slot */
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_DELTA | 0, Block[46]);
+  TEST_ASSERT_EQUAL(64, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, 64);
+}
+
+/**
+ * @brief test_ReferenceSlotsAreReused
+ * With more message ids than slots the oldest slot is replaced.
+ */
+void test_ReferenceSlotsAreReused(void)
+{
+  const uint8_t payload[4] = {0};
+  uint16_t pos = 2;
+  for (uint8_t i = 0; i <= SDLOG_COMPRESS_REFS; i++) {
+    helper_LogMessage(1000, i, payload, sizeof(payload));
+  }
+  helper_LogMessage(1000, SDLOG_COMPRESS_REFS, payload, sizeof(payload));
+  helper_LogMessage(1000, 0, payload, sizeof(payload));
+
+  TEST_ASSERT_EQUAL(StreamLen, sdlog_compress(&comp, Stream, StreamLen));
+  sdlog_compress_finish(&comp);
+
+  for (uint8_t i = 0; i <= SDLOG_COMPRESS_REFS; i++) {
+    TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_RAW, Block[pos]);
+    pos += 1 + 14;
+  }
+  /* The last new id took slot 0 */
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_DELTA | 0, Block[pos]);
+  pos += 1 + 2;
+  TEST_ASSERT_EQUAL_HEX(SDLOG_COMPRESS_RAW, Block[pos]);
+  TEST_ASSERT_EQUAL(StreamLen, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, StreamLen);
+}
+
+/**
+ * @brief test_FrameInSmallPieces
+ * Frames are collected across calls.
+ */
+void test_FrameInSmallPieces(void)
+{
+  uint8_t payload[24];
+  for (uint8_t s = 0; s < 5; s++) {
+    for (uint8_t i = 0; i < sizeof(payload); i++) {
+      payload[i] = (i % 4 == 0) ? helper_Random() : i;
+    }
+    helper_LogMessage(1000 + s, 7, payload, sizeof(payload));
+  }
+
+  for (uint16_t i = 0; i < StreamLen; i += 7) {
+    uint16_t len = (StreamLen - i < 7) ? StreamLen - i : 7;
+    TEST_ASSERT_EQUAL(len, sdlog_compress(&comp, &Stream[i], len));
+  }
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_TRUE(helper_Used(Block) < StreamLen * 2 / 3);
+  TEST_ASSERT_EQUAL(StreamLen, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, StreamLen);
+}
+
+/**
+ * @brief test_LiteralsFillBlockExactly
+ * Literal records hold 255 bytes, the block takes what still fits.
+ */
+void test_LiteralsFillBlockExactly(void)
+{
+  uint8_t data[1000];
+  for (uint16_t i = 0; i < sizeof(data); i++) {
+    data[i] = helper_Random() % SDLOG_COMPRESS_STX;
+  }
+
+  /* 255 literals, then 251 */
+  TEST_ASSERT_EQUAL(506, sdlog_compress(&comp, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(0, sdlog_compress(&comp, &data[506], sizeof(data) - 506));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(SDLOG_COMPRESS_BLOCK_SIZE, helper_Used(Block));
+  TEST_ASSERT_EQUAL(255, Block[3]);
+  TEST_ASSERT_EQUAL(251, Block[2 + 257 + 1]);
+  TEST_ASSERT_EQUAL(506, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, Raw, 506);
+}
+
+/**
+ * @brief test_FrameThatDoesNotFitGoesToNextBlock
+ * The frame is taken but kept, and stored first in the next block.
+ */
+void test_FrameThatDoesNotFitGoesToNextBlock(void)
+{
+  uint8_t data[490];
+  uint8_t next[SDLOG_COMPRESS_BLOCK_SIZE];
+  const uint8_t payload[20] = {0};
+  for (uint16_t i = 0; i < sizeof(data); i++) {
+    data[i] = 0x11;
+  }
+  helper_LogMessage(1000, 1, payload, sizeof(payload));
+
+  /* 2 + 2 + 255 + 2 + 235 = 496 used, the frame needs 31 */
+  TEST_ASSERT_EQUAL(sizeof(data), sdlog_compress(&comp, data, sizeof(data)));
+  TEST_ASSERT_EQUAL(StreamLen, sdlog_compress(&comp, Stream, StreamLen));
+  TEST_ASSERT_EQUAL(0, sdlog_compress(&comp, data, 1));
+  TEST_ASSERT_FALSE(sdlog_compress_flush(&comp));
+  sdlog_compress_finish(&comp);
+  TEST_ASSERT_EQUAL(496, helper_Used(Block));
+
+  sdlog_compress_start(&comp, next);
+  TEST_ASSERT_TRUE(sdlog_compress_flush(&comp));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(2 + 1 + 30, helper_Used(next));
+  TEST_ASSERT_EQUAL(30, sdlog_decompress(next, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(Stream, Raw, 30);
+}
+
+/**
+ * @brief test_FlushIncompleteFrame
+ * At the end of the log a frame that never completed is stored as literals.
+ */
+void test_FlushIncompleteFrame(void)
+{
+  const uint8_t data[5] = {0x99, 20, 0x01, 0x02, 0x03};
+
+  TEST_ASSERT_EQUAL(5, sdlog_compress(&comp, data, sizeof(data)));
+  TEST_ASSERT_TRUE(sdlog_compress_empty(&comp));
+  TEST_ASSERT_TRUE(sdlog_compress_flush(&comp));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(2 + 2 + 5, helper_Used(Block));
+  TEST_ASSERT_EQUAL(5, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, Raw, sizeof(data));
+}
+
+/**
+ * @brief test_ShortLengthByte
+ * A start byte followed by a length below 2 is a two byte frame.
+ */
+void test_ShortLengthByte(void)
+{
+  const uint8_t data[4] = {0x99, 0x00, 0x55, 0x99};
+
+  TEST_ASSERT_EQUAL(4, sdlog_compress(&comp, data, sizeof(data)));
+  TEST_ASSERT_TRUE(sdlog_compress_flush(&comp));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(4, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(data, Raw, sizeof(data));
+}
+
+/**
+ * @brief test_BlocksDecodeIndependently
+ * Every block decodes on its own, in any order, and together they give back
+ * the original stream.
+ */
+void test_BlocksDecodeIndependently(void)
+{
+  helper_GenerateFlightLog(2);
+  helper_CompressStream();
+  helper_CheckStream();
+
+  /* Decode from the last block to the first */
+  uint32_t end = StreamLen;
+  for (uint32_t b = NbBlocks; b-- > 0;) {
+    int32_t n = sdlog_decompress(&Blocks[b * SDLOG_COMPRESS_BLOCK_SIZE], Raw, sizeof(Raw));
+    TEST_ASSERT_TRUE(n > 0);
+    TEST_ASSERT_TRUE((uint32_t) n <= end);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(&Stream[end - n], Raw, n);
+    end -= n;
+  }
+  TEST_ASSERT_EQUAL(0, end);
+}
+
+void test_CorruptHeader(void)
+{
+  Block[0] = 0x02;
+  Block[1] = 0x01;
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+
+  /* Erased card */
+  memset(Block, 0xFF, sizeof(Block));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+}
+
+void test_CorruptRecord(void)
+{
+  const uint8_t unknown_tag[] = {0x00, 0x04, 0x03, 0x00};
+  const uint8_t empty_slot[] = {0x00, 0x04, SDLOG_COMPRESS_DELTA | 1, 0x00};
+  const uint8_t bad_slot[] = {0x00, 0x04, 0xFF, 0x00};
+  memset(Block, 0, sizeof(Block));
+
+  memcpy(Block, unknown_tag, sizeof(unknown_tag));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  memcpy(Block, empty_slot, sizeof(empty_slot));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  memcpy(Block, bad_slot, sizeof(bad_slot));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+}
+
+void test_TruncatedRecords(void)
+{
+  /* Literal record says four bytes, the block ends after three */
+  const uint8_t literals[] = {0x00, 0x07, 0x01, 0x04, 'a', 'b', 'c'};
+  /* Frame of 12 bytes, the block ends after 10 */
+  const uint8_t frame[] = {0x00, 0x0D, 0x02, 0x99, 0x0C, 0, 0, 0, 0, 0, 0, 0, 0};
+  memset(Block, 0, sizeof(Block));
+
+  memcpy(Block, literals, sizeof(literals));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  memcpy(Block, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, sizeof(Raw)));
+  Block[1] = 0x0F;
+  TEST_ASSERT_EQUAL(12, sdlog_decompress(Block, Raw, sizeof(Raw)));
+}
+
+void test_OutputTooSmall(void)
+{
+  uint8_t data[100];
+  memset(data, 0x11, sizeof(data));
+  sdlog_compress(&comp, data, sizeof(data));
+  sdlog_compress_finish(&comp);
+
+  TEST_ASSERT_EQUAL(-1, sdlog_decompress(Block, Raw, 99));
+  TEST_ASSERT_EQUAL(100, sdlog_decompress(Block, Raw, 100));
+}
+
+/**
+ * @brief test_BenchmarkFlightLog
+ * Compression ratio and CPU time against the SPI time saved.
+ */
+void test_BenchmarkFlightLog(void)
+{
+  struct timespec start, stop;
+
+  helper_GenerateFlightLog(SDLOG_COMPRESS_BENCH_SECONDS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  helper_CompressStream();
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  helper_CheckStream();
+
+  double ns = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+  uint32_t raw_blocks = (StreamLen + SDLOG_COMPRESS_BLOCK_SIZE - 1) / SDLOG_COMPRESS_BLOCK_SIZE;
+  double spi_saved_s = ((double) raw_blocks - NbBlocks) * BENCH_SPI_BYTES_PER_BLOCK * 8 /
+                       SDLOG_COMPRESS_BENCH_SPI_HZ;
+
+  printf("compress: %u raw bytes (%u blocks) in %u blocks, ratio %.2f\n", StreamLen, raw_blocks, NbBlocks,
+         (double) raw_blocks / NbBlocks);
+  printf("compress: %.0f ns per raw block on this host, %.3f s CPU for %u s of flight\n",
+         ns / raw_blocks, ns / 1e9, SDLOG_COMPRESS_BENCH_SECONDS);
+  printf("compress: %.3f s SPI saved at %u Hz, %.0f ns per raw block\n", spi_saved_s,
+         SDLOG_COMPRESS_BENCH_SPI_HZ, spi_saved_s * 1e9 / raw_blocks);
+
+  /* Most changed bytes are IMU noise, the deltas give about 1.7 on this log */
+  TEST_ASSERT_TRUE(NbBlocks * 3 < raw_blocks * 2);
+}
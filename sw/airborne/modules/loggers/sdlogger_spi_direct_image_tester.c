@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlogger_spi_direct_image_tester.c
+ *  @brief The logger from power up to a finished log, on image files.
+ *
+ * Nothing is mocked between the logger and the storage: the logger runs on
+ * the block device of an image file (peripherals/block_device_mmap.h), or on
+ * a stripe (sdlogger_stripe.h) over several of them. A log is recorded the
+ * way it is in flight, switch on, messages, switch off, and the image is
+ * checked afterwards: the index at 0x2000 and the data from 0x4000 on.
+ *
+ * The image device completes every operation before it returns, so each
+ * callback of the logger runs from inside the call that started the
+ * operation.
+ */
+
+/* mkstemp() with -std=c99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "subsystems/datalink/Mocktelemetry.h"
+#include "Mockmessages_testable.h"
+#include "peripherals/Mocksdcard_spi.h"
+#include "peripherals/block_device.h"
+#include "peripherals/block_device_mmap.h"
+#include "loggers/sdlogger_spi_direct.h"
+#include "loggers/sdlogger_stripe.h"
+#include "subsystems/datalink/Mockpprzlog_transport.h"
+#include "mcu_periph/Mockuart.h"
+#include "generated/Mockperiodic_telemetry.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Images are sparse, only the blocks that are written take disk space */
+#define IMAGE_BLOCKS 0x00100000
+#define NB_IMAGES 3
+
+#define INDEX_ADDRESS 0x00002000
+#define LOG_ADDRESS 0x00004000
+
+#define FRAME_LEN 23
+#define NB_FRAMES 100
+
+/* Actually defined in sdcard.c */
+struct SDCard sdcard1;
+
+/* Actually defined in spi.c */
+struct spi_periph spi2;
+
+/* Actually defined in radio_control.c */
+struct RadioControl radio_control;
+
+/* Actually defined in pprzlog_transport.c */
+struct pprzlog_transport pprzlog_tp;
+
+/* Actually defined in pprz_transport.c */
+struct pprz_transport pprz_tp;
+
+/* Actually defined in uart.c */
+struct uart_periph uart1;
+
+/* Actually defined in sys_time_arch.c */
+uint32_t get_sys_time_usec(void)
+{
+  return 0;
+}
+
+/* Actually defined in periodic_telemetry.c */
+uint8_t telemetry_mode_Main;
+uint8_t telemetry_mode_Logger;
+
+/* Actually defined in telemetry.c */
+telemetry_msg telemetry_msgs[TELEMETRY_NB_MSG] = TELEMETRY_MSG_NAMES;
+telemetry_cb telemetry_cbs[TELEMETRY_NB_MSG] = TELEMETRY_CBS_NULL;
+struct periodic_telemetry pprz_telemetry = { TELEMETRY_NB_MSG, telemetry_msgs, telemetry_cbs };
+
+#ifdef LOGGER_LED
+/* Actually defined in gpio_arch.c, the LED is tested in sdlogger_spi_direct_tester.c */
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+  (void) gpioport; (void) gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+  (void) gpioport; (void) gpios;
+}
+#endif
+
+/* Struct to save original state to revert to after each test */
+struct sdlogger_spi_periph sdlogger_spi_original;
+
+void sdlogger_spi_direct_send_latency(struct transport_tx *trans, struct link_device *dev);
+
+struct BlockDeviceMmap Images[NB_IMAGES];
+struct BlockDevice ImageDevices[NB_IMAGES];
+struct BlockDevice *ImageDevicePtrs[NB_IMAGES];
+char ImagePaths[NB_IMAGES][32];
+uint8_t NbImages;
+
+struct sdlogger_stripe stripe;
+struct BlockDevice StripeDevice;
+
+/* Everything that was logged, in order */
+uint8_t Logged[NB_FRAMES * FRAME_LEN];
+
+void setUp(void)
+{
+  sdlogger_spi_original = sdlogger_spi;
+  NbImages = 0;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+
+  Mocksdcard_spi_Init();
+  Mockpprzlog_transport_Init();
+  Mockuart_Init();
+}
+
+void tearDown(void)
+{
+  sdlogger_spi = sdlogger_spi_original;
+  for (uint8_t i = 0; i < NbImages; i++) {
+    block_device_mmap_close(&Images[i]);
+    unlink(ImagePaths[i]);
+  }
+
+  Mocksdcard_spi_Verify();
+  Mocksdcard_spi_Destroy();
+  Mockpprzlog_transport_Verify();
+  Mockpprzlog_transport_Destroy();
+  Mockuart_Verify();
+  Mockuart_Destroy();
+}
+
+/**
+ * Creates nb empty images of IMAGE_BLOCKS blocks each.
+ */
+void helper_OpenImages(uint8_t nb)
+{
+  for (uint8_t i = 0; i < nb; i++) {
+    strcpy(ImagePaths[i], "/tmp/sdloggerXXXXXX");
+    int fd = mkstemp(ImagePaths[i]);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_EQUAL(0, block_device_mmap_open(&Images[i], &ImageDevices[i],
+                                                ImagePaths[i], IMAGE_BLOCKS));
+    ImageDevicePtrs[i] = &ImageDevices[i];
+    NbImages++;
+  }
+}
+
+/**
+ * Runs the logger on bd, like sdlogger_spi_direct_init() does on sdcard1.
+ */
+void helper_InitializeLogger(struct BlockDevice *bd)
+{
+  pprzlog_transport_init_Expect();
+#if PERIODIC_TELEMETRY
+  register_periodic_telemetry_ExpectAndReturn(DefaultPeriodic, "SDCARD_LATENCY",
+                                              sdlogger_spi_direct_send_latency, TRUE);
+#endif
+  sdlogger_spi_direct_init_device(bd);
+#ifdef SDLOGGER_COMPRESS
+  sdlogger_spi.compress = FALSE;
+#endif
+}
+
+/**
+ * Periodic loop until the logger reaches status, fails after max loops.
+ */
+void helper_PeriodicUntil(enum SDLoggerStatus status, uint16_t max)
+{
+  for (uint16_t i = 0; i < max && sdlogger_spi.status != status; i++) {
+    sdlogger_spi_direct_periodic();
+  }
+  TEST_ASSERT_EQUAL(status, sdlogger_spi.status);
+}
+
+/**
+ * Logs NB_FRAMES frames of FRAME_LEN bytes through the calls of messages.h,
+ * with the periodic loop in between like in flight.
+ */
+void helper_LogFrames(void)
+{
+  for (uint16_t f = 0; f < NB_FRAMES; f++) {
+    uint8_t *frame = &Logged[f * FRAME_LEN];
+    frame[0] = 0x99;
+    frame[1] = FRAME_LEN;
+    for (uint8_t i = 2; i < FRAME_LEN; i++) {
+      frame[i] = (uint8_t)(f * 7 + i);
+    }
+
+    TEST_ASSERT_TRUE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, FRAME_LEN));
+    for (uint8_t i = 0; i < FRAME_LEN; i++) {
+      sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, frame[i]);
+    }
+    sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+    sdlogger_spi_direct_periodic();
+  }
+}
+
+/**
+ * Records one log on the device the logger runs on: power up, switch on,
+ * NB_FRAMES frames, switch off, back to Ready with the index written.
+ */
+void helper_RecordLog(void)
+{
+  helper_PeriodicUntil(SDLogger_Ready, 100);
+
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  helper_PeriodicUntil(SDLogger_Logging, 100);
+
+  helper_LogFrames();
+
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+  helper_PeriodicUntil(SDLogger_Ready, 100);
+}
+
+uint32_t helper_Uint(const uint8_t *location)
+{
+  return ((uint32_t)location[0] << 24) | ((uint32_t)location[1] << 16) |
+         ((uint32_t)location[2] << 8) | location[3];
+}
+
+/**
+ * Checks the index of the first log and its data, read back from blocks of
+ * the logical device with block(addr).
+ */
+void helper_CheckLog(const uint8_t *(*block)(uint32_t addr))
+{
+  const uint32_t log_blocks = (sizeof(Logged) + BLOCK_DEVICE_BLOCK_SIZE - 1) / BLOCK_DEVICE_BLOCK_SIZE;
+  const uint8_t *index = block(INDEX_ADDRESS);
+
+  /* Index: next address, last completed log, then start and length of log 1 */
+  TEST_ASSERT_EQUAL_HEX(LOG_ADDRESS + log_blocks, helper_Uint(&index[0]));
+  TEST_ASSERT_EQUAL(1, index[4]);
+  TEST_ASSERT_EQUAL_HEX(LOG_ADDRESS, helper_Uint(&index[5]));
+  TEST_ASSERT_EQUAL(log_blocks, helper_Uint(&index[9]));
+
+  /* Data, the last block padded with zeros */
+  for (uint32_t i = 0; i < log_blocks * BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    const uint8_t *data = block(LOG_ADDRESS + i / BLOCK_DEVICE_BLOCK_SIZE);
+    uint8_t expected = (i < sizeof(Logged)) ? Logged[i] : 0;
+    TEST_ASSERT_EQUAL_HEX8(expected, data[i % BLOCK_DEVICE_BLOCK_SIZE]);
+  }
+}
+
+const uint8_t *helper_ImageBlock(uint32_t addr)
+{
+  return &Images[0].map[addr * BLOCK_DEVICE_BLOCK_SIZE];
+}
+
+/* Logical block a of the stripe, where sdlogger_stripe_locate() puts it */
+const uint8_t *helper_StripeBlock(uint32_t addr)
+{
+  uint8_t image;
+  uint32_t image_addr;
+
+  sdlogger_stripe_locate(NB_IMAGES, 0, addr, &image, &image_addr);
+  return &Images[image].map[image_addr * BLOCK_DEVICE_BLOCK_SIZE];
+}
+
+/**
+ * @brief test_LogOnImage
+ * A log recorded on an empty image ends up at the start of the log space
+ * and is the first entry of the index.
+ */
+void test_LogOnImage(void)
+{
+  helper_OpenImages(1);
+  helper_InitializeLogger(&ImageDevices[0]);
+
+  helper_RecordLog();
+
+  helper_CheckLog(helper_ImageBlock);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+
+  /* A single image, no stripe in the entry */
+  const uint8_t *index = helper_ImageBlock(INDEX_ADDRESS);
+  TEST_ASSERT_EQUAL(0, index[5 + 8]);
+  TEST_ASSERT_EQUAL(0, index[5 + 9]);
+}
+
+/**
+ * @brief test_SecondLogFollowsFirst
+ * The index is read back from the image for the next log, which goes right
+ * behind the first one.
+ */
+void test_SecondLogFollowsFirst(void)
+{
+  const uint32_t log_blocks = (sizeof(Logged) + BLOCK_DEVICE_BLOCK_SIZE - 1) / BLOCK_DEVICE_BLOCK_SIZE;
+  helper_OpenImages(1);
+  helper_InitializeLogger(&ImageDevices[0]);
+  helper_RecordLog();
+
+  /* Power cycle */
+  helper_InitializeLogger(&ImageDevices[0]);
+  helper_RecordLog();
+
+  const uint8_t *index = helper_ImageBlock(INDEX_ADDRESS);
+  TEST_ASSERT_EQUAL_HEX(LOG_ADDRESS + 2 * log_blocks, helper_Uint(&index[0]));
+  TEST_ASSERT_EQUAL(2, index[4]);
+  TEST_ASSERT_EQUAL_HEX(LOG_ADDRESS + log_blocks, helper_Uint(&index[5 + 12]));
+  TEST_ASSERT_EQUAL(log_blocks, helper_Uint(&index[9 + 12]));
+  TEST_ASSERT_EQUAL_MEMORY(Logged, helper_ImageBlock(LOG_ADDRESS + log_blocks), sizeof(Logged));
+}
+
+/**
+ * @brief test_LogOnStripe
+ * The same log on a stripe over three images, the logger does not know the
+ * difference. The blocks of the log alternate between the images. The
+ * index entry records the stripe, the index block itself is on image
+ * 0x2000 % 3.
+ */
+void test_LogOnStripe(void)
+{
+  helper_OpenImages(NB_IMAGES);
+  sdlogger_stripe_init(&stripe, ImageDevicePtrs, NB_IMAGES);
+  sdlogger_stripe_block_device_init(&StripeDevice, &stripe);
+  helper_InitializeLogger(&StripeDevice);
+
+  helper_RecordLog();
+
+  helper_CheckLog(helper_StripeBlock);
+  for (uint8_t i = 0; i < NB_IMAGES; i++) {
+    TEST_ASSERT_TRUE(Images[i].blocks_written > 0);
+  }
+
+  const uint8_t *index = &Images[INDEX_ADDRESS % NB_IMAGES].map[(INDEX_ADDRESS / NB_IMAGES) * BLOCK_DEVICE_BLOCK_SIZE];
+  TEST_ASSERT_EQUAL_PTR(helper_StripeBlock(INDEX_ADDRESS), index);
+  TEST_ASSERT_EQUAL(NB_IMAGES, index[5 + 8]);
+  TEST_ASSERT_EQUAL(INDEX_ADDRESS % NB_IMAGES, index[5 + 9]);
+
+  uint32_t start, length;
+  uint8_t nb_cards, member;
+  sdlogger_stripe_index_parse(&index[5], &start, &length, &nb_cards, &member);
+  TEST_ASSERT_EQUAL_HEX(LOG_ADDRESS, start);
+  TEST_ASSERT_EQUAL(NB_IMAGES, nb_cards);
+  TEST_ASSERT_EQUAL(INDEX_ADDRESS % NB_IMAGES, member);
+}
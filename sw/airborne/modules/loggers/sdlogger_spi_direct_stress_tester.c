@@ -0,0 +1,502 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlogger_spi_direct_stress_tester.c
+ *  @brief Several threads logging at full rate through reserve/commit.
+ *
+ * Every producer thread writes numbered frames as fast as the ring allows.
+ * The logger runs on a block device of the tester with SDLOGGER_RING_BLOCKS
+ * block buffers, the ring takes all of them. The producers submit the blocks
+ * they complete, in any order. A card thread plays the SPI interrupt like the
+ * driver: it writes the submitted buffers in the order they were acquired,
+ * appends each one to a stream, frees it and calls
+ * sdlogger_spi_direct_multiwrite_written, which acquires it again.
+ *
+ * Afterwards the stream is parsed. Every frame must be intact and the frames
+ * of each producer must be complete and in order. Zeros between frames come
+ * from commits shorter than the reservation and are skipped. Every reserve
+ * that the full ring refused counts in dropped, and queue_max never exceeds
+ * the ring.
+ *
+ * test_StressSlowProducer() also runs the periodic loop from its own thread,
+ * with a simulated clock it advances on each call. One producer holds some of
+ * its reservations open for more than SDLOGGER_RESERVATION_TIMEOUT before it
+ * fills them. They are counted in stale, but the blocks wait for them, so
+ * the late frames are still intact and nothing else is overwritten.
+ *
+ * Frame: 0x99, length, producer, sequence number (4 bytes, little endian),
+ * payload, checksum (sum of the bytes from length up to the payload).
+ *
+ * Longer runs: -DSDLOGGER_STRESS_MESSAGES=1000000
+ */
+
+/* Built with the default number of block buffers and with 16 of them */
+/* TEST_DEFINES: */
+/* TEST_DEFINES: SDCARD_BLOCK_BUFFERS=16 */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "subsystems/datalink/Mocktelemetry.h"
+#include "Mockmessages_testable.h"
+#include "peripherals/Mocksdcard_spi.h"
+#include "peripherals/block_device.h"
+#include "loggers/sdlogger_spi_direct.h"
+#include "subsystems/datalink/Mockpprzlog_transport.h"
+#include "mcu_periph/Mockuart.h"
+#include "generated/Mockperiodic_telemetry.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Frames logged by every producer thread */
+#ifndef SDLOGGER_STRESS_MESSAGES
+#define SDLOGGER_STRESS_MESSAGES 20000
+#endif
+
+#define STRESS_MAX_THREADS 8
+#define STRESS_STX 0x99
+#define STRESS_HEADER_LEN 7
+#define STRESS_MIN_LEN (STRESS_HEADER_LEN + 1)
+#define STRESS_MAX_LEN 64
+
+/* Actually defined in sdcard.c */
+struct SDCard sdcard1;
+
+/* Actually defined in spi.c */
+struct spi_periph spi2;
+
+/* Actually defined in radio_control.c */
+struct RadioControl radio_control;
+
+/* Actually defined in pprzlog_transport.c */
+struct pprzlog_transport pprzlog_tp;
+
+/* Actually defined in pprz_transport.c */
+struct pprz_transport pprz_tp;
+
+/* Actually defined in uart.c */
+struct uart_periph uart1;
+
+/* Actually defined in sys_time_arch.c, advanced by helper_PeriodicThread() */
+uint32_t FakeSysTimeUsec;
+uint32_t get_sys_time_usec(void)
+{
+  return __atomic_load_n(&FakeSysTimeUsec, __ATOMIC_ACQUIRE);
+}
+
+/* Actually defined in periodic_telemetry.c */
+uint8_t telemetry_mode_Main;
+uint8_t telemetry_mode_Logger;
+
+/* Actually defined in telemetry.c */
+telemetry_msg telemetry_msgs[TELEMETRY_NB_MSG] = TELEMETRY_MSG_NAMES;
+telemetry_cb telemetry_cbs[TELEMETRY_NB_MSG] = TELEMETRY_CBS_NULL;
+struct periodic_telemetry pprz_telemetry = { TELEMETRY_NB_MSG, telemetry_msgs, telemetry_cbs };
+
+/* Struct to save original state to revert to after each test */
+struct sdlogger_spi_periph sdlogger_spi_original;
+
+void sdlogger_spi_direct_send_latency(struct transport_tx *trans, struct link_device *dev);
+
+/* Block buffers of the card, data at offset 0 */
+uint8_t CardBuf[SDLOGGER_RING_BLOCKS][SD_BLOCK_SIZE];
+/* Set by the producer that submits the buffer, cleared by the card thread */
+bool_t CardSubmitted[SDLOGGER_RING_BLOCKS];
+BlockDeviceCallback CardCallback[SDLOGGER_RING_BLOCKS];
+/* Buffers acquired and written so far, both in turn */
+uint32_t CardAcquired;
+uint32_t CardWritten;
+/* Set when the card thread can stop */
+bool_t CardStop;
+/* Everything the card received */
+uint8_t *Stream;
+uint32_t StreamLen;
+uint32_t StreamSize;
+/* Buffers submitted twice, or not acquired */
+uint32_t CardOverruns;
+/* Reserves refused to the producers */
+uint32_t Refused;
+/* Producer 0 holds every SlowEvery-th reservation open, 0 for never */
+uint32_t SlowEvery;
+/* Set when the periodic thread can stop */
+bool_t PeriodicStop;
+
+void setUp(void)
+{
+  sdlogger_spi_original = sdlogger_spi;
+
+  memset(CardSubmitted, 0, sizeof(CardSubmitted));
+  CardAcquired = 0;
+  CardWritten = 0;
+  CardStop = FALSE;
+  StreamLen = 0;
+  CardOverruns = 0;
+  Refused = 0;
+  SlowEvery = 0;
+  PeriodicStop = FALSE;
+  FakeSysTimeUsec = 0;
+
+  Mocksdcard_spi_Init();
+  Mockpprzlog_transport_Init();
+  Mockuart_Init();
+}
+
+void tearDown(void)
+{
+  sdlogger_spi = sdlogger_spi_original;
+  free(Stream);
+  Stream = NULL;
+
+  Mocksdcard_spi_Verify();
+  Mocksdcard_spi_Destroy();
+  Mockpprzlog_transport_Verify();
+  Mockpprzlog_transport_Destroy();
+  Mockuart_Verify();
+  Mockuart_Destroy();
+}
+
+/**
+ * Only called before the card thread runs and from the written callback, so
+ * never concurrently. Buffers are written in the order they were acquired,
+ * so they are acquired in turn as well.
+ */
+uint8_t *helper_BlockAcquire(void *dev)
+{
+  (void) dev;
+  if (CardAcquired - __atomic_load_n(&CardWritten, __ATOMIC_ACQUIRE) >= SDLOGGER_RING_BLOCKS) {
+    return NULL;
+  }
+  uint8_t idx = CardAcquired % SDLOGGER_RING_BLOCKS;
+  __atomic_store_n(&CardAcquired, CardAcquired + 1, __ATOMIC_RELEASE);
+  return CardBuf[idx];
+}
+
+/**
+ * Called from the producer that completes a block, the card thread picks it
+ * up when it is the oldest one acquired.
+ */
+void helper_BlockSubmit(void *dev, uint8_t *block, BlockDeviceCallback callback)
+{
+  (void) dev;
+  uint8_t idx = (block - CardBuf[0]) / SD_BLOCK_SIZE;
+  if (idx >= SDLOGGER_RING_BLOCKS || block != CardBuf[idx] ||
+      __atomic_load_n(&CardSubmitted[idx], __ATOMIC_ACQUIRE)) {
+    __atomic_fetch_add(&CardOverruns, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  CardCallback[idx] = callback;
+  __atomic_store_n(&CardSubmitted[idx], TRUE, __ATOMIC_RELEASE);
+}
+
+void helper_Periodic(void *dev)
+{
+  (void) dev;
+}
+
+enum BlockDeviceStatus helper_Status(void *dev)
+{
+  (void) dev;
+  return BlockDevice_MultiWriteIdle;
+}
+
+/* Only the operations of a running log, the logger is put in Logging directly */
+const struct BlockDeviceOps StressOps = {
+  .periodic = helper_Periodic,
+  .status = helper_Status,
+  .block_acquire = helper_BlockAcquire,
+  .block_submit = helper_BlockSubmit,
+};
+struct BlockDevice StressDevice = { .ops = &StressOps };
+
+/**
+ * Plays the SPI interrupt of the SD Card.
+ */
+void *helper_CardThread(void *arg)
+{
+  (void) arg;
+  while (TRUE) {
+    uint8_t idx = CardWritten % SDLOGGER_RING_BLOCKS;
+    if (CardWritten == __atomic_load_n(&CardAcquired, __ATOMIC_ACQUIRE) ||
+        !__atomic_load_n(&CardSubmitted[idx], __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&CardStop, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      sched_yield();
+      continue;
+    }
+    if (StreamLen + SD_BLOCK_SIZE <= StreamSize) {
+      memcpy(&Stream[StreamLen], CardBuf[idx], SD_BLOCK_SIZE);
+      StreamLen += SD_BLOCK_SIZE;
+    }
+    /* Free before the callback, like the driver */
+    __atomic_store_n(&CardSubmitted[idx], FALSE, __ATOMIC_RELAXED);
+    __atomic_store_n(&CardWritten, CardWritten + 1, __ATOMIC_RELEASE);
+    CardCallback[idx]();
+  }
+  return NULL;
+}
+
+/**
+ * Plays the main loop: a periodic call every millisecond of simulated time.
+ */
+void *helper_PeriodicThread(void *arg)
+{
+  (void) arg;
+  while (!__atomic_load_n(&PeriodicStop, __ATOMIC_ACQUIRE)) {
+    __atomic_fetch_add(&FakeSysTimeUsec, 1000, __ATOMIC_RELEASE);
+    sdlogger_spi_direct_periodic();
+    sched_yield();
+  }
+  return NULL;
+}
+
+/**
+ * Holds a reservation open until the periodic loop saw it waiting for more
+ * than SDLOGGER_RESERVATION_TIMEOUT.
+ */
+void helper_StallProducer(void)
+{
+  uint32_t start = get_sys_time_usec();
+  while (get_sys_time_usec() - start <= 2 * SDLOGGER_RESERVATION_TIMEOUT) {
+    sched_yield();
+  }
+}
+
+uint8_t helper_FrameLength(uint8_t producer, uint32_t seq)
+{
+  return STRESS_MIN_LEN + (seq * 7 + producer) % (STRESS_MAX_LEN - STRESS_MIN_LEN + 1);
+}
+
+/**
+ * Logs SDLOGGER_STRESS_MESSAGES frames. Every 16th frame reserves the
+ * maximum length and commits less.
+ */
+void *helper_ProducerThread(void *arg)
+{
+  uint8_t producer = (uint8_t)(uintptr_t) arg;
+  uint8_t frame[STRESS_MAX_LEN];
+  struct sdlogger_spi_span spans[2];
+
+  for (uint32_t seq = 0; seq < SDLOGGER_STRESS_MESSAGES; seq++) {
+    uint8_t len = helper_FrameLength(producer, seq);
+    uint8_t reserve = (seq % 16 == 0) ? STRESS_MAX_LEN : len;
+    uint8_t checksum = 0;
+
+    frame[0] = STRESS_STX;
+    frame[1] = len;
+    frame[2] = producer;
+    for (uint8_t i = 0; i < 4; i++) {
+      frame[3 + i] = seq >> (8 * i);
+    }
+    for (uint8_t i = STRESS_HEADER_LEN; i < len - 1; i++) {
+      frame[i] = seq + i + producer;
+    }
+    for (uint8_t i = 1; i < len - 1; i++) {
+      checksum += frame[i];
+    }
+    frame[len - 1] = checksum;
+
+    while (sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, reserve, spans) == 0) {
+      __atomic_fetch_add(&Refused, 1, __ATOMIC_RELAXED);
+      sched_yield();
+    }
+    if (producer == 0 && SlowEvery != 0 && seq % SlowEvery == 0) {
+      helper_StallProducer();
+    }
+    uint16_t first = (len < spans[0].len) ? len : spans[0].len;
+    memcpy(spans[0].buf, frame, first);
+    if (len > first) {
+      memcpy(spans[1].buf, &frame[first], len - first);
+    }
+    sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, len);
+  }
+  return NULL;
+}
+
+void helper_InitializeLogger(void)
+{
+  pprzlog_transport_init_Expect();
+#if PERIODIC_TELEMETRY
+  register_periodic_telemetry_ExpectAndReturn(DefaultPeriodic, "SDCARD_LATENCY",
+                                              sdlogger_spi_direct_send_latency, TRUE);
+#endif
+  sdlogger_spi_direct_init_device(&StressDevice);
+
+  /* The ring as at the start of a log */
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    sdlogger_spi.ring[i] = block_device_block_acquire(&StressDevice);
+    TEST_ASSERT_NOT_NULL(sdlogger_spi.ring[i]);
+  }
+  sdlogger_spi.space_end = SDLOGGER_RING_SIZE;
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+}
+
+/**
+ * Runs the producers and the card until everything is written, the last
+ * block padded with zeros.
+ */
+void helper_RunStress(uint8_t nb_producers)
+{
+  pthread_t card, periodic, producers[STRESS_MAX_THREADS];
+  struct sdlogger_spi_span spans[2];
+
+  StreamSize = (uint32_t) nb_producers * SDLOGGER_STRESS_MESSAGES * STRESS_MAX_LEN + SD_BLOCK_SIZE;
+  Stream = malloc(StreamSize);
+  TEST_ASSERT_NOT_NULL(Stream);
+
+  helper_InitializeLogger();
+
+  TEST_ASSERT_EQUAL(0, pthread_create(&card, NULL, helper_CardThread, NULL));
+  if (SlowEvery != 0) {
+    TEST_ASSERT_EQUAL(0, pthread_create(&periodic, NULL, helper_PeriodicThread, NULL));
+  }
+  for (uint8_t p = 0; p < nb_producers; p++) {
+    TEST_ASSERT_EQUAL(0, pthread_create(&producers[p], NULL, helper_ProducerThread,
+                                        (void *)(uintptr_t) p));
+  }
+  for (uint8_t p = 0; p < nb_producers; p++) {
+    pthread_join(producers[p], NULL);
+  }
+
+  /* Complete the last block */
+  uint16_t pad = (SD_BLOCK_SIZE - sdlogger_spi.head % SD_BLOCK_SIZE) % SD_BLOCK_SIZE;
+  if (pad > 0) {
+    while (sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, pad, spans) == 0) {
+      Refused++;
+      sched_yield();
+    }
+    sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, 0);
+  }
+  while (__atomic_load_n(&sdlogger_spi.tail, __ATOMIC_ACQUIRE) != sdlogger_spi.head) {
+    sched_yield();
+  }
+  __atomic_store_n(&CardStop, TRUE, __ATOMIC_RELEASE);
+  pthread_join(card, NULL);
+  if (SlowEvery != 0) {
+    __atomic_store_n(&PeriodicStop, TRUE, __ATOMIC_RELEASE);
+    pthread_join(periodic, NULL);
+  }
+}
+
+/**
+ * The ring statistics of the run, as sent in SDCARD_LATENCY.
+ */
+void helper_CheckQueueStatistics(void)
+{
+  TEST_ASSERT_EQUAL(Refused, sdlogger_spi.dropped);
+  TEST_ASSERT_TRUE(sdlogger_spi.queue_max > 0);
+  TEST_ASSERT_TRUE(sdlogger_spi.queue_max <= SDLOGGER_RING_BLOCKS);
+}
+
+/**
+ * Parses the stream, returns the number of frames of all producers together.
+ */
+uint32_t helper_CheckStream(uint8_t nb_producers)
+{
+  uint32_t next_seq[STRESS_MAX_THREADS] = {0};
+  uint32_t frames = 0;
+  uint32_t pos = 0;
+
+  while (pos < StreamLen) {
+    if (Stream[pos] == 0) {
+      pos++;
+      continue;
+    }
+    TEST_ASSERT_EQUAL_HEX_MESSAGE(STRESS_STX, Stream[pos], "Frame start");
+    TEST_ASSERT_TRUE_MESSAGE(pos + STRESS_HEADER_LEN < StreamLen, "Truncated frame");
+
+    uint8_t len = Stream[pos + 1];
+    uint8_t producer = Stream[pos + 2];
+    uint32_t seq = 0;
+    uint8_t checksum = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+      seq |= (uint32_t) Stream[pos + 3 + i] << (8 * i);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(producer < nb_producers, "Producer");
+    TEST_ASSERT_EQUAL_MESSAGE(next_seq[producer], seq, "Sequence number");
+    TEST_ASSERT_EQUAL_MESSAGE(helper_FrameLength(producer, seq), len, "Frame length");
+    TEST_ASSERT_TRUE_MESSAGE(pos + len <= StreamLen, "Truncated frame");
+    for (uint8_t i = STRESS_HEADER_LEN; i < len - 1; i++) {
+      TEST_ASSERT_EQUAL_HEX8_MESSAGE((uint8_t)(seq + i + producer), Stream[pos + i], "Payload");
+    }
+    for (uint8_t i = 1; i < len - 1; i++) {
+      checksum += Stream[pos + i];
+    }
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(checksum, Stream[pos + len - 1], "Checksum");
+
+    next_seq[producer]++;
+    frames++;
+    pos += len;
+  }
+
+  for (uint8_t p = 0; p < nb_producers; p++) {
+    TEST_ASSERT_EQUAL(SDLOGGER_STRESS_MESSAGES, next_seq[p]);
+  }
+  return frames;
+}
+
+void test_StressSingleProducer(void)
+{
+  helper_RunStress(1);
+
+  TEST_ASSERT_EQUAL(0, CardOverruns);
+  TEST_ASSERT_EQUAL(SDLOGGER_STRESS_MESSAGES, helper_CheckStream(1));
+  TEST_ASSERT_EQUAL(StreamLen / SD_BLOCK_SIZE, sdlogger_spi.log_len);
+  helper_CheckQueueStatistics();
+}
+
+void test_StressFourProducers(void)
+{
+  helper_RunStress(4);
+
+  TEST_ASSERT_EQUAL(0, CardOverruns);
+  TEST_ASSERT_EQUAL(4 * SDLOGGER_STRESS_MESSAGES, helper_CheckStream(4));
+  TEST_ASSERT_EQUAL(StreamLen / SD_BLOCK_SIZE, sdlogger_spi.log_len);
+  helper_CheckQueueStatistics();
+}
+
+void test_StressMaxProducers(void)
+{
+  helper_RunStress(STRESS_MAX_THREADS);
+
+  TEST_ASSERT_EQUAL(0, CardOverruns);
+  TEST_ASSERT_EQUAL(STRESS_MAX_THREADS * SDLOGGER_STRESS_MESSAGES,
+                    helper_CheckStream(STRESS_MAX_THREADS));
+  TEST_ASSERT_EQUAL(StreamLen / SD_BLOCK_SIZE, sdlogger_spi.log_len);
+  helper_CheckQueueStatistics();
+}
+
+void test_StressSlowProducer(void)
+{
+  SlowEvery = SDLOGGER_STRESS_MESSAGES / 8;
+  helper_RunStress(4);
+
+  TEST_ASSERT_EQUAL(0, CardOverruns);
+  TEST_ASSERT_EQUAL(4 * SDLOGGER_STRESS_MESSAGES, helper_CheckStream(4));
+  TEST_ASSERT_EQUAL(StreamLen / SD_BLOCK_SIZE, sdlogger_spi.log_len);
+  TEST_ASSERT_TRUE(sdlogger_spi.stale > 0);
+  helper_CheckQueueStatistics();
+}
@@ -1,16 +1,36 @@
+/* Built with the defaults, with the optional features switched on, with the
+ * shared sdcard buffer layout, with a ring of 16 blocks and with log
+ * compression */
+/* TEST_DEFINES: */
+/* TEST_DEFINES: SDCARD_TRACE */
+/* TEST_DEFINES: SDCARD_SHARED_BUFFER */
+/* TEST_DEFINES: SDCARD_BLOCK_BUFFERS=16 */
+/* TEST_DEFINES: SDLOGGER_COMPRESS */
+
 #include "unity.h"
 #include "subsystems/datalink/Mocktelemetry.h"
 #include "Mockmessages_testable.h"
 #include "peripherals/Mocksdcard_spi.h"
+#include "peripherals/block_device.h"
 #include "loggers/sdlogger_spi_direct.h"
+#include "loggers/sdlogger_stripe.h"
+#include "loggers/sdlog_compress.h"
+#include "peripherals/sd_trace.h"
 #include "subsystems/datalink/Mockpprzlog_transport.h"
 #include "mcu_periph/Mockuart.h"
 #include "generated/Mockperiodic_telemetry.h"
+#include <string.h>
 
 #define S(x) #x
 #define S_(x) S(x)
 #define S__LINE__ "Line: " S_(__LINE__)
 
+/* Commands 1 to 42 download a log, commands above that range do not touch
+ * the card */
+#ifndef SDLOGGER_COMMAND_RESET_LATENCY
+#define SDLOGGER_COMMAND_RESET_LATENCY 254
+#endif
+
 /**
  * Usage example of the SD Logger:
  * pprz_msg_send_ALIVE(&pprzlog_tp.trans_tx, &sdlogger_spi.device, AC_ID,
@@ -27,9 +47,94 @@
  *
  * In case of pprzlog_tp, a call to pprz_msg_send_*** results in the following
  * call sequence:
- * - check_free_space
+ * - check_free_space (reserves the space for the whole message)
  * - put_byte (numerous times depending on message)
- * - send_message
+ * - send_message (commits it)
+ * An interrupt may log a complete message in the middle of this sequence, it
+ * then fills its own reservation. put_byte always writes into the innermost
+ * one, so this only works for nested contexts. Threads that preempt each
+ * other in any order use reserve/commit instead.
+ *
+ * Serializers that know the size of a message up front can write it without
+ * the per-byte calls:
+ * - sdlogger_spi_direct_reserve (one or two spans in the ring)
+ * - memcpy into the spans
+ * - sdlogger_spi_direct_commit (with the spans)
+ *
+ * Every reservation has to be committed, also when the producer gives up on
+ * the message: a commit of length 0 fills it with zeros. The same goes for a
+ * check_free_space that returned TRUE, it needs its send_message. A block is
+ * not submitted before all of its bytes are committed, so the ring, and the
+ * card behind it, wait for an open reservation, however long it takes. A
+ * reservation is never abandoned: its spans point into the block buffer, and
+ * a producer that is only slow would still write into it once the device
+ * took it back for other data. Instead the contract is checked: if the
+ * oldest incomplete block is completely reserved and still waits after
+ * SDLOGGER_RESERVATION_TIMEOUT us, the periodic loop counts it once in
+ * stale. A stale count that is not 0 means a producer holds its reservation
+ * too long or forgets to commit it, the full ring then shows up in dropped
+ * as well.
+ *
+ * Logged bytes go into a ring of SDLOGGER_RING_BLOCKS block buffers of the
+ * block device, taken with block_device_block_acquire when the log starts.
+ * The logger has no buffers of its own, it fills the ones the device writes
+ * from. head and tail are free running byte counters. Producers reserve by
+ * moving head forward with a compare-and-swap, so each one gets its own
+ * bytes, and head never passes space_end: the end of the ring, or the end of
+ * the log space if that comes first. A commit adds the length of each span
+ * to the committed counter of its block. Whoever commits the last byte of a
+ * block submits it, whatever the state of the card. Blocks may complete out
+ * of order, the device writes them in the order they were acquired. Only the
+ * written callback of the device writes tail: it clears the committed counter
+ * of the block, acquires a new buffer for its slot, moves space_end and
+ * publishes tail with a release store. No interrupts are disabled anywhere.
+ *
+ * The buffers are the write-back queue that absorbs the time the card is
+ * busy. SDLOGGER_RING_BLOCKS defaults to SDCARD_BLOCK_BUFFERS, the device
+ * needs at least that many. It is a power of two, so the free running
+ * counters stay valid when they wrap. It has to hold the log rate for the
+ * longest stall plus the block being written:
+ *   SDCARD_BLOCK_BUFFERS >= rate [bytes/s] * stall [s] / 512 + 1
+ * e.g. 16 blocks (8 KiB) for 50 kB/s and stalls up to 150 ms. Take the
+ * stall from the max of the SDCARD_LATENCY message. That message also holds
+ * queue_max, the most ring blocks ever in use, and dropped, the number of
+ * messages refused because the ring was full, to check the margin in flight.
+ * sdlogger_spi_direct_stress_tester.c runs this with several threads.
+ *
+ * With SDLOGGER_COMPRESS the log can be compressed (see sdlog_compress.h),
+ * chosen with the compress setting when a log starts. The ring is then
+ * memory of the logger, comp_raw, and complete blocks are not submitted by
+ * the producers. The periodic loop compresses the oldest one into comp_buf
+ * and frees it, so it is the one writing tail. A full comp_buf is copied into
+ * a block buffer of the device and submitted, if there is no free buffer the
+ * periodic loop tries again. comp_head and comp_tail count the output blocks
+ * submitted and written. The index entry of a compressed log has bit 0 of
+ * byte 10 set.
+ *
+ * A log that reaches the end of the card wraps within the running log. The
+ * last block before the end is padded by the first message that does not fit
+ * anymore. Once it is written, the unused buffers go back to the device,
+ * newest first, and the multiwrite is stopped and started again at 0x4000.
+ * Messages are dropped until the ring has new buffers. The log gets two index
+ * entries, the second one has bit 1 of byte 10 set to tell the download tools
+ * that it continues the entry before it.
+ *
+ * Bytes 8 and 9 of an index entry describe the device the log is on, they
+ * are written with sdlogger_stripe_index_entry() (see sdlogger_stripe.h).
+ * Byte 8 is nb_members of the block device, the number of cards of a stripe
+ * and 0 on a single card. On a stripe byte 9 is the card that holds the
+ * index block, 0x2000 % nb_members, on a single card it is 0.
+ *
+ * The logger writes to a struct BlockDevice (peripherals/block_device.h), it
+ * does not call the SD card driver. sdlogger_spi_direct_init() initializes
+ * sdcard1 and runs the logger on its block device, sdlogger_spi.card.
+ * sdlogger_spi_direct_init_device() runs it on any other device: a stripe
+ * over several cards (sdlogger_stripe.h) or an image file on the host
+ * (sdlogger_spi_direct_image_tester.c). The latency fields of the
+ * SDCARD_LATENCY message come from sdcard1 only while the logger runs on its
+ * block device, on any other device they are zero and the histogram is left
+ * out. The queue fields are always sent. The callback of an operation can run before the
+ * operation returns, so the logger changes its state before it starts one.
  *
  * Put file index at address 0x2000
  * Start of logdata at address 0x4000
@@ -37,6 +142,7 @@
 
 /* Actually defined in sdcard.c */
 struct SDCard sdcard1;
+struct SDCard sdcard2;
 
 /* Actually defined in spi.c */
 struct spi_periph spi2;
@@ -53,6 +159,13 @@ struct pprz_transport pprz_tp;
 /* Actually defined in uart.c */
 struct uart_periph uart1;
 
+/* Actually defined in sys_time_arch.c */
+uint32_t FakeSysTimeUsec;
+uint32_t get_sys_time_usec(void)
+{
+  return FakeSysTimeUsec;
+}
+
 /* Actually defined in periodic_telemetry.c */
 uint8_t telemetry_mode_Main;
 uint8_t telemetry_mode_Logger;
@@ -102,6 +215,163 @@ void LED_SET(uint8_t led, bool_t status) {
 
 /* Private functions */
 void sdlogger_spi_direct_block_to_uart(void);
+void sdlogger_spi_direct_multiwrite_stopped(void);
+void sdlogger_spi_direct_index_written(void);
+void sdlogger_spi_direct_send_latency(struct transport_tx *trans, struct link_device *dev);
+
+/**
+ * Block device of the card in these tests. Like sdcard_spi_block_device_ops,
+ * every operation calls the driver function, which is mocked. So the
+ * expectations below are on the driver calls and the card state is set in
+ * sdcard1.status.
+ */
+void helperCardPeriodic(void *dev)
+{
+  sdcard_spi_periodic((struct SDCard *) dev);
+}
+
+void helperCardReadCapacity(void *dev, BlockDeviceCallback callback)
+{
+  sdcard_spi_read_csd((struct SDCard *) dev, callback);
+}
+
+uint32_t helperCardNbBlocks(void *dev)
+{
+  return ((struct SDCard *) dev)->nb_blocks;
+}
+
+void helperCardReadBlock(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  sdcard_spi_read_block((struct SDCard *) dev, addr, callback);
+}
+
+void helperCardWriteBlock(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  sdcard_spi_write_block((struct SDCard *) dev, addr, callback);
+}
+
+void helperCardMultiwriteStart(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  sdcard_spi_multiwrite_start((struct SDCard *) dev, addr, callback);
+}
+
+void helperCardMultiwriteNext(void *dev, BlockDeviceCallback callback)
+{
+  sdcard_spi_multiwrite_next((struct SDCard *) dev, callback);
+}
+
+void helperCardMultiwriteNextBuf(void *dev, uint8_t *buf, BlockDeviceCallback callback)
+{
+  sdcard_spi_multiwrite_next_buf((struct SDCard *) dev, buf, callback);
+}
+
+void helperCardMultiwriteStop(void *dev, BlockDeviceCallback callback)
+{
+  sdcard_spi_multiwrite_stop((struct SDCard *) dev, callback);
+}
+
+void helperCardErase(void *dev, uint32_t first, uint32_t last, BlockDeviceCallback callback)
+{
+  sdcard_spi_erase((struct SDCard *) dev, first, last, callback);
+}
+
+void helperCardEraseCancel(void *dev)
+{
+  sdcard_spi_erase_cancel((struct SDCard *) dev);
+}
+
+uint8_t *helperCardBlockAcquire(void *dev)
+{
+  return sdcard_spi_block_acquire((struct SDCard *) dev);
+}
+
+void helperCardBlockSubmit(void *dev, uint8_t *block, BlockDeviceCallback callback)
+{
+  sdcard_spi_block_submit((struct SDCard *) dev, block, callback);
+}
+
+void helperCardBlockRelease(void *dev, uint8_t *block)
+{
+  sdcard_spi_block_release((struct SDCard *) dev, block);
+}
+
+enum BlockDeviceStatus helperCardStatus(void *dev)
+{
+  switch (((struct SDCard *) dev)->status) {
+    case SDCard_UnInit:
+      return BlockDevice_UnInit;
+    case SDCard_Idle:
+      return BlockDevice_Idle;
+    case SDCard_Erasing:
+      return BlockDevice_Erasing;
+    case SDCard_MultiWriteIdle:
+      return BlockDevice_MultiWriteIdle;
+    case SDCard_Error:
+      return BlockDevice_Error;
+    default:
+      return BlockDevice_Busy;
+  }
+}
+
+const struct BlockDeviceOps TestCardOps = {
+  .periodic = helperCardPeriodic,
+  .read_capacity = helperCardReadCapacity,
+  .nb_blocks = helperCardNbBlocks,
+  .read_block = helperCardReadBlock,
+  .write_block = helperCardWriteBlock,
+  .multiwrite_start = helperCardMultiwriteStart,
+  .multiwrite_next = helperCardMultiwriteNext,
+  .multiwrite_next_buf = helperCardMultiwriteNextBuf,
+  .multiwrite_stop = helperCardMultiwriteStop,
+  .erase = helperCardErase,
+  .erase_cancel = helperCardEraseCancel,
+  .block_acquire = helperCardBlockAcquire,
+  .block_submit = helperCardBlockSubmit,
+  .block_release = helperCardBlockRelease,
+  .status = helperCardStatus,
+};
+
+/**
+ * @brief helperCardDevice
+ * Stub of sdcard_spi_block_device_init(), with the buffers where the driver
+ * has them.
+ */
+void helperCardDevice(struct BlockDevice *bd, struct SDCard *sd, int cmock_num_calls)
+{
+  (void) cmock_num_calls;
+  bd->ops = &TestCardOps;
+  bd->dev = sd;
+  bd->read_buf = &sd->input_buf[0];
+  bd->write_buf = &sd->output_buf[6];
+  bd->multiwrite_buf = &sd->output_buf[1];
+  bd->nb_members = 0;
+}
+
+/**
+ * Block buffers of the card, handed out in turn by helperBlockAcquire().
+ * Like the ones of the driver, the data starts at offset 1.
+ */
+#define TEST_BLOCKS (2 * SDLOGGER_RING_BLOCKS)
+uint8_t TestBlocks[TEST_BLOCKS][SD_BLOCK_PADDED_SIZE];
+uint8_t NextTestBlock;
+/* Number of acquires that still succeed */
+uint8_t AcquireLeft;
+
+/**
+ * @brief helperBlockAcquire
+ * Stub of sdcard_spi_block_acquire(), the next test block or NULL when the
+ * test ran out of them.
+ */
+uint8_t *helperBlockAcquire(struct SDCard *sd, int cmock_num_calls)
+{
+  (void) cmock_num_calls;
+  TEST_ASSERT_EQUAL_PTR(&sdcard1, sd);
+  if (AcquireLeft == 0) {
+    return NULL;
+  }
+  AcquireLeft--;
+  return &TestBlocks[NextTestBlock++ % TEST_BLOCKS][1];
+}
 
 void setUp(void)
 {
@@ -120,29 +390,59 @@ void setUp(void)
   sdlogger_spi.next_available_address = 123;
   sdlogger_spi.last_completed = 123;
   sdlogger_spi.sdcard_buf_idx = 123;
-  sdlogger_spi.idx = 123;
+  sdlogger_spi.head = 123;
+  sdlogger_spi.tail = 123;
+  sdlogger_spi.nesting = 123;
+  sdlogger_spi.space_end = 123;
+  sdlogger_spi.stalled = TRUE;
+  sdlogger_spi.stale = 123;
+  sdlogger_spi.queue_max = 123;
+  sdlogger_spi.dropped = 123;
   sdlogger_spi.log_len = 123;
   sdlogger_spi.command = 123;
   sdlogger_spi.download_id = 123;
   sdlogger_spi.download_address = 123;
   sdlogger_spi.download_length = 123;
+  sdlogger_spi.erase_blocks = 123;
+  sdlogger_spi.erased_address = 123;
+  sdlogger_spi.erase_end = 123;
+  sdlogger_spi.log_space_end = 123;
+  sdlogger_spi.wrap_len = 123;
 
   /* Set incorrect values to sdcard buffers */
   for (uint16_t i = 0; i < SD_BLOCK_SIZE + 10; i++) {
     sdcard1.input_buf[i] = 123;
     sdcard1.output_buf[i] = 123;
   }
-  /* Set incorrect values to logger buffer */
-  for (uint8_t i = 0; i < sizeof(sdlogger_spi.buffer); i++) {
-    sdlogger_spi.buffer[i] = 123;
+  /* Set incorrect values to logger ring */
+  memset(TestBlocks, 123, sizeof(TestBlocks));
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    sdlogger_spi.ring[i] = TestBlocks[i];
+    sdlogger_spi.committed[i] = 123;
   }
+  NextTestBlock = 0;
+  AcquireLeft = 255;
+#ifdef SDLOGGER_COMPRESS
+  sdlogger_spi.compressing = TRUE;
+  sdlogger_spi.comp_head = 123;
+  sdlogger_spi.comp_tail = 123;
+  sdlogger_spi.comp_raw_pos = 123;
+  /* Only tests of the compressed log turn it on */
+  sdlogger_spi.compress = FALSE;
+#endif
   sdcard1.status = SDCard_Error;
 
+  /* Tests that do not initialize the logger run on sdcard1 as well */
+  helperCardDevice(&sdlogger_spi.card, &sdcard1, 0);
+  sdlogger_spi.bd = &sdlogger_spi.card;
+
   radio_control.values[SDLOGGER_CONTROL_SWITCH] = 0;
 
   Mocksdcard_spi_Init();
   Mockpprzlog_transport_Init();
   Mockuart_Init();
+
+  sdcard_spi_block_acquire_StubWithCallback(helperBlockAcquire);
 }
 
 void tearDown(void)
@@ -158,20 +458,45 @@ void tearDown(void)
   Mockuart_Destroy();
 }
 
-void helperInitializeLogger(void)
+void helperInitializeCall(void)
 {
   /* Expectations */
   /* Expect the SD Card to be initialized in the call as well */
   sdcard_spi_init_Expect(&sdcard1,
                          &(SDLOGGER_SPI_LINK_DEVICE),
                          SDLOGGER_SPI_LINK_SLAVE_NUMBER);
+  /* The logger runs on the block device of the card */
+  sdcard_spi_block_device_init_Expect(&sdlogger_spi.card, &sdcard1);
+  sdcard_spi_block_device_init_StubWithCallback(helperCardDevice);
   /* Expect initialization of pprzlog_tp! */
   pprzlog_transport_init_Expect();
+#if PERIODIC_TELEMETRY
+  /* Block write latency of the SD Card is reported periodically */
+  register_periodic_telemetry_ExpectAndReturn(DefaultPeriodic, "SDCARD_LATENCY",
+                                              sdlogger_spi_direct_send_latency, TRUE);
+#endif
 
   /* Call the function */
   sdlogger_spi_direct_init();
 }
 
+/**
+ * @brief helperInitializeLogger
+ * Initialized logger with the ring as at the start of a log: a block buffer
+ * of the card in every slot, acquired in slot order, and room for the whole
+ * ring.
+ */
+void helperInitializeLogger(void)
+{
+  helperInitializeCall();
+
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    sdlogger_spi.ring[i] = &TestBlocks[i][1];
+  }
+  NextTestBlock = SDLOGGER_RING_BLOCKS;
+  sdlogger_spi.space_end = SDLOGGER_RING_SIZE;
+}
+
 void helperAssignUint(uint8_t location[], uint32_t value) {
   location[0] = value >> 24;
   location[1] = value >> 16;
@@ -200,7 +525,14 @@ void testHelperAssignUint(void) {
  */
 void testInitializeLoggerStruct(void)
 {
-  helperInitializeLogger();
+  memset(&sdlogger_spi.card, 0, sizeof(sdlogger_spi.card));
+  sdlogger_spi.bd = NULL;
+
+  helperInitializeCall();
+
+  /* Block device of sdcard1 */
+  TEST_ASSERT_EQUAL_PTR(&sdlogger_spi.card, sdlogger_spi.bd);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1, sdlogger_spi.card.dev);
 
   /* Values in the struct should be set to their defaults */
   TEST_ASSERT_EQUAL(SDLogger_Initializing, sdlogger_spi.status);
@@ -208,15 +540,41 @@ void testInitializeLoggerStruct(void)
   TEST_ASSERT_EQUAL(0, sdlogger_spi.last_completed);
   /* Initialize SD Card buffer at 1 because byte 0 is reserved for start flag */
   TEST_ASSERT_EQUAL(1, sdlogger_spi.sdcard_buf_idx);
-  for (uint8_t i = 0; i < sizeof(sdlogger_spi.buffer); i++) {
-    TEST_ASSERT_EQUAL(0, sdlogger_spi.buffer[i]);
+  /* Ring is empty */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[i]);
+    /* Block buffers are only held while logging */
+    TEST_ASSERT_NULL(sdlogger_spi.ring[i]);
   }
-  TEST_ASSERT_EQUAL(0, sdlogger_spi.idx);
+  /* Nothing can be reserved */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.space_end);
+  TEST_ASSERT_FALSE(sdlogger_spi.stalled);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.stale);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.nesting);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.queue_max);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+#ifdef SDLOGGER_COMPRESS
+  /* Off unless selected in the settings */
+  TEST_ASSERT_FALSE(sdlogger_spi.compress);
+  TEST_ASSERT_FALSE(sdlogger_spi.compressing);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_tail);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_raw_pos);
+#endif
   TEST_ASSERT_EQUAL(0, sdlogger_spi.log_len);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.wrap_len);
   TEST_ASSERT_EQUAL(0, sdlogger_spi.command);
   TEST_ASSERT_EQUAL(0, sdlogger_spi.download_id);
   TEST_ASSERT_EQUAL(0, sdlogger_spi.download_address);
   TEST_ASSERT_EQUAL(0, sdlogger_spi.download_length);
+  TEST_ASSERT_EQUAL(SDLOGGER_ERASE_AHEAD_BLOCKS, sdlogger_spi.erase_blocks);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.erased_address);
+  /* Nothing may be erased before the index was read */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.erase_end);
+  /* No limit until the card capacity is known */
+  TEST_ASSERT_EQUAL_HEX(SDLOGGER_LOG_SPACE_UNKNOWN, sdlogger_spi.log_space_end);
   /*  Link device function references: */
   TEST_ASSERT_EQUAL_PTR(sdlogger_spi.device.check_free_space,
                         &sdlogger_spi_direct_check_free_space);
@@ -232,6 +590,40 @@ void testInitializeLoggerStruct(void)
                         &sdlogger_spi);
 }
 
+/**
+ * @brief testInitializeOnOtherBlockDevice
+ * sdlogger_spi_direct_init_device() leaves sdcard1 alone, everything goes
+ * to the device it was given. Here that is the block device of sdcard2.
+ */
+void testInitializeOnOtherBlockDevice(void)
+{
+  struct BlockDevice other;
+  helperCardDevice(&other, &sdcard2, 0);
+  sdlogger_spi.bd = NULL;
+
+  /* Expectations, no sdcard_spi_init */
+  pprzlog_transport_init_Expect();
+#if PERIODIC_TELEMETRY
+  register_periodic_telemetry_ExpectAndReturn(DefaultPeriodic, "SDCARD_LATENCY",
+                                              sdlogger_spi_direct_send_latency, TRUE);
+#endif
+
+  sdlogger_spi_direct_init_device(&other);
+
+  TEST_ASSERT_EQUAL_PTR(&other, sdlogger_spi.bd);
+  TEST_ASSERT_EQUAL(SDLogger_Initializing, sdlogger_spi.status);
+
+  /* The periodic loop and the index request go to sdcard2 */
+  sdcard2.status = SDCard_Idle;
+  sdcard_spi_periodic_Expect(&sdcard2);
+  sdcard_spi_read_csd_Expect(&sdcard2, NULL);
+  sdcard_spi_read_block_Expect(&sdcard2, 0x00002000, &sdlogger_spi_direct_index_received);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_RetreivingIndex, sdlogger_spi.status);
+}
+
 /**
  * @brief testDoNothingWhileInitializing
  * Wait for the SD Card to become idle.
@@ -257,7 +649,8 @@ void testDoNothingWhileInitializing(void)
  * As soon as the periodic functions get called, the SD Card runs the
  * initialization sequence. When it is done with this, the logger should request
  * the index, which is located at the beginning of the second 4MiB block, at
- * address 0x2000.
+ * address 0x2000. The card capacity is requested first, the end of the log
+ * space is known by the time the index arrives.
  */
 void testReadIndexWhenSDCardGetsIdle(void)
 {
@@ -268,6 +661,7 @@ void testReadIndexWhenSDCardGetsIdle(void)
 
   /* Expectations */
   sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_read_csd_Expect(&sdcard1, NULL);
   sdcard_spi_read_block_Expect(&sdcard1,
                                0x00002000,
                                &sdlogger_spi_direct_index_received);
@@ -301,16 +695,18 @@ void testWaitWhileRetreivingIndex(void)
  * after initialization. The next available address and last completed log
  * information are stored for later use.
  *
- * For now, this information is not used but overwritten. Multiple logs are
- * possible while logging with power on.
+ * The log space is circular: it runs from 0x4000 up to the end of the card.
+ * The next log continues where the previous one ended, also after a power
+ * cycle, so the oldest logs are the ones that get overwritten.
  */
 void testSaveIndexInformationForLaterUse(void)
 {
   /* Preconditions */
   sdlogger_spi.status = SDLogger_RetreivingIndex;
+  sdcard1.nb_blocks = 0x00100000; /* 512 MiB card */
   /* SD Card buffer contains relevant values */
   /* Next available address: */
-  helperAssignUint(&sdcard1.input_buf[0], 0x12345678);
+  helperAssignUint(&sdcard1.input_buf[0], 0x00012345);
   /* Last completed log: */
   sdcard1.input_buf[4] = 12;
 
@@ -318,12 +714,66 @@ void testSaveIndexInformationForLaterUse(void)
   sdlogger_spi_direct_index_received();
 
   /* Verify correct values set by function */
-  TEST_ASSERT_EQUAL(0x00004000, sdlogger_spi.next_available_address);
-  TEST_ASSERT_EQUAL(0, sdlogger_spi.last_completed);
+  TEST_ASSERT_EQUAL_HEX(0x00012345, sdlogger_spi.next_available_address);
+  TEST_ASSERT_EQUAL(12, sdlogger_spi.last_completed);
+  TEST_ASSERT_EQUAL_HEX(0x00100000, sdlogger_spi.log_space_end);
   /* State change */
   TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
 }
 
+/**
+ * @brief testIndexOutsideLogSpaceStartsAtBeginning
+ * A new card has no valid index. Addresses outside the log space, or too close
+ * to its end to hold a log, start at the beginning of the log space.
+ */
+void testIndexOutsideLogSpaceStartsAtBeginning(void)
+{
+  /* Preconditions */
+  sdlogger_spi.status = SDLogger_RetreivingIndex;
+  sdcard1.nb_blocks = 0x00100000;
+  helperAssignUint(&sdcard1.input_buf[0], 0x12345678);
+  sdcard1.input_buf[4] = 0xFF;
+
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00004000, sdlogger_spi.next_available_address);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.last_completed);
+
+  /* Inside, but no room for a log */
+  sdlogger_spi.status = SDLogger_RetreivingIndex;
+  helperAssignUint(&sdcard1.input_buf[0], 0x00100000 - SDLOGGER_MIN_LOG_BLOCKS + 1);
+
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00004000, sdlogger_spi.next_available_address);
+
+  /* Below the log space, on top of the index */
+  sdlogger_spi.status = SDLogger_RetreivingIndex;
+  helperAssignUint(&sdcard1.input_buf[0], 0x00002000);
+
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00004000, sdlogger_spi.next_available_address);
+}
+
+/**
+ * @brief testUnknownCapacityHasNoLimit
+ * If the capacity could not be read, the log space does not wrap.
+ */
+void testUnknownCapacityHasNoLimit(void)
+{
+  /* Preconditions */
+  sdlogger_spi.status = SDLogger_RetreivingIndex;
+  sdcard1.nb_blocks = 0;
+  helperAssignUint(&sdcard1.input_buf[0], 0x12345678);
+  sdcard1.input_buf[4] = 3;
+
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(SDLOGGER_LOG_SPACE_UNKNOWN, sdlogger_spi.log_space_end);
+  TEST_ASSERT_EQUAL_HEX(0x12345678, sdlogger_spi.next_available_address);
+}
+
 /**
  * @brief testStartLoggingWhenSwitchIsFlipped
  * The log procedure is started if the switch is flipped.
@@ -352,19 +802,53 @@ void testStartLoggingWhenSwitchIsFlipped(void)
 
   /* Expections second run */
   sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
 
   /* Second periodic loop */
   sdlogger_spi_direct_periodic();
 
   /* Logger is accepting messages */
   TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  /* into new block buffers of the card, in slot order, zeroed */
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    TEST_ASSERT_EQUAL_PTR(&TestBlocks[SDLOGGER_RING_BLOCKS + i][1], sdlogger_spi.ring[i]);
+    TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[i][0]);
+    TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[i][SD_BLOCK_SIZE - 1]);
+  }
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE, sdlogger_spi.space_end);
   /* LED is on */
 #ifdef LOGGER_LED
   TEST_ASSERT_TRUE(LED_STATUS(LOGGER_LED));
 #endif
 }
 
+/**
+ * @brief testStartLoggingWithoutBlockBuffers
+ * A card with fewer block buffers than the ring cannot log. The buffers taken
+ * go back and the multiwrite is stopped again.
+ */
+void testStartLoggingWithoutBlockBuffers(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdcard1.status = SDCard_Idle;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.next_available_address = 0x00004000;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  AcquireLeft = 1;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
+  sdcard_spi_block_release_Expect(&sdcard1, &TestBlocks[SDLOGGER_RING_BLOCKS][1]);
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Error, sdlogger_spi.status);
+}
+
 void testOnlyStartMultiwriteOnceWhenSwitchIsFlipped(void) {
   /* Preconditions */
   helperInitializeLogger();
@@ -377,7 +861,7 @@ void testOnlyStartMultiwriteOnceWhenSwitchIsFlipped(void) {
 
   /* Expectations */
   sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
 
   /* First Periodic loop */
   sdlogger_spi_direct_periodic();
@@ -422,7 +906,7 @@ void testDoNotStartMultiWriteIfSdCardIsNotIdle(void)
 
   /* Expectation: */
   sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
 
   /* Second periodic loop */
   sdlogger_spi_direct_periodic();
@@ -454,505 +938,2518 @@ void testDoNotLogIfSwitchIsDisabled(void)
 }
 
 /**
- * @brief testCheckFreeSpaceNotLogging
- * If not logging, return FALSE to prevent further calls to write.
+ * @brief testEraseAheadWhenReadyAndCardIdle
+ * While waiting for the switch, the region of the next log is erased so the
+ * card does not have to erase while logging. The erase never goes beyond
+ * erase_end, where the first log still listed in the index begins. Each read
+ * of the index sets it, an index update first clears the entries of the logs
+ * in the next erase_blocks blocks (testEraseAheadAfterIndexWrap()).
  */
-void testCheckFreeSpaceNotLogging(void)
+void testEraseAheadWhenReadyAndCardIdle(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  /* Not accepting messages */
+  sdlogger_spi.erase_blocks = 2048;
   sdlogger_spi.status = SDLogger_Ready;
-  /* Function call (from messages.h) */
-  bool_t available = sdlogger_spi_direct_check_free_space(
-                       sdlogger_spi.device.periph,
-                       20);
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.erase_end = 0x00100000;
+  sdcard1.status = SDCard_Idle;
+  /* Switch in state OFF: */
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
 
-  /* No space available for writing */
-  TEST_ASSERT_FALSE(available);
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_erase_Expect(&sdcard1, 0x00004000, 0x00004000 + 2047, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(0x00004000, sdlogger_spi.erased_address);
 }
 
 /**
- * @brief testCheckFreeSpaceLoggingAndAvailable
- * State of the logger is accepting messages. Return TRUE.
+ * @brief testEraseAheadOnlyOnce
+ * The region is not erased again when the card returns to idle.
  */
-void testCheckFreeSpaceLoggingAndAvailable(void)
+void testEraseAheadOnlyOnce(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  /* Accepting messages */
-  sdlogger_spi.status = SDLogger_Logging;
-  sdlogger_spi.sdcard_buf_idx = 1;
-  sdlogger_spi.idx = 0;
+  sdlogger_spi.erase_blocks = 2048;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.erased_address = 0x00004000;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
 
-  /* Function call (from messages.h) */
-  bool_t available = sdlogger_spi_direct_check_free_space(
-                       sdlogger_spi.device.periph,
-                       20);
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  /* Do not expect erase */
 
-  /* There is space available for writing */
-  TEST_ASSERT_TRUE(available);
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
 }
 
-void testCheckFreeSpaceRequestJustTheAvailableBytes(void)
+/**
+ * @brief testNoEraseAheadWhenDisabled
+ * Erase ahead is disabled with zero blocks.
+ */
+void testNoEraseAheadWhenDisabled(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_Logging;
-  /* SDCard buffer full, logger buffer almost full */
-  sdlogger_spi.sdcard_buf_idx = 513;
-  sdlogger_spi.idx = SDLOGGER_BUFFER_SIZE - 4;
+  sdlogger_spi.erase_blocks = 0;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
 
-  /* Requesting free space */
-  bool_t available = sdlogger_spi_direct_check_free_space(
-                       sdlogger_spi.device.periph,
-                       4);
-  /* There is (just) enough space */
-  TEST_ASSERT_TRUE(available);
-}
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  /* Do not expect erase */
 
-void testCheckFreeSpaceRequestOneTooManyBytes(void)
-{
-  /* Preconditions */
-  helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_Logging;
-  /* SDCard buffer full, logger buffer almost full */
-  sdlogger_spi.sdcard_buf_idx = 513;
-  sdlogger_spi.idx = SDLOGGER_BUFFER_SIZE - 4;
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
 
-  /* Requesting free space */
-  bool_t available = sdlogger_spi_direct_check_free_space(
-                       sdlogger_spi.device.periph,
-                       5);
-  /* There is (just) not enough space */
-  TEST_ASSERT_FALSE(available);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.erased_address);
 }
 
-void testCheckFreeSpaceBothBuffersPossible(void)
+/**
+ * @brief testEraseAheadStopsAtEndOfLogSpace
+ * Blocks beyond the end of the card are not erased.
+ */
+void testEraseAheadStopsAtEndOfLogSpace(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_Logging;
-  sdlogger_spi.sdcard_buf_idx = 510;
-  sdlogger_spi.idx = 0;
+  sdlogger_spi.erase_blocks = 2048;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 1000;
+  sdlogger_spi.erase_end = 0x00100000;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
 
-  /* Requesting free space */
-  bool_t available = sdlogger_spi_direct_check_free_space(
-                       sdlogger_spi.device.periph,
-                       67);
-  /* There is (just) enough space */
-  TEST_ASSERT_TRUE(available);
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_erase_Expect(&sdcard1, 0x00100000 - 1000, 0x00100000 - 1, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(0x00100000 - 1000, sdlogger_spi.erased_address);
 }
 
-void testCheckFreeSpaceBothBuffersJustNotPossible(void)
+/**
+ * @brief testEraseAheadStopsAtListedLog
+ * A log the index still lists is not erased.
+ */
+void testEraseAheadStopsAtListedLog(void)
 {
   /* Preconditions */
   helperInitializeLogger();
+  sdlogger_spi.erase_blocks = 2048;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.erase_end = 0x00004400;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_erase_Expect(&sdcard1, 0x00004000, 0x000043FF, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(0x00004000, sdlogger_spi.erased_address);
+}
+
+/**
+ * @brief testNoEraseAheadIntoListedLog
+ * If a listed log reaches over the next available address, there is nothing
+ * to erase ahead.
+ */
+void testNoEraseAheadIntoListedLog(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.erase_blocks = 2048;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.erase_end = 0x00004000;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  /* Do not expect erase */
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
+}
+
+/**
+ * @brief testCancelEraseWhenSwitchIsFlipped
+ * Logging has priority over the erase. The erase is cancelled and the
+ * multiwrite is queued, it starts when the current erase chunk is done.
+ */
+void testCancelEraseWhenSwitchIsFlipped(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.erase_blocks = 2048;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.erased_address = 0x00004000;
+  sdcard1.status = SDCard_Erasing;
+  /* Switch turned ON: */
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_erase_cancel_Expect(&sdcard1);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+}
+
+/**
+ * @brief testCheckFreeSpaceNotLogging
+ * If not logging, return FALSE to prevent further calls to write.
+ */
+void testCheckFreeSpaceNotLogging(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  /* Not accepting messages */
+  sdlogger_spi.status = SDLogger_Ready;
+  /* Function call (from messages.h) */
+  bool_t available = sdlogger_spi_direct_check_free_space(
+                       sdlogger_spi.device.periph,
+                       20);
+
+  /* No space available for writing */
+  TEST_ASSERT_FALSE(available);
+  /* Not logging is not dropping */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+}
+
+/**
+ * @brief testCheckFreeSpaceLoggingAndAvailable
+ * State of the logger is accepting messages. Return TRUE. The space is
+ * reserved for the message right away, so an interrupt logging in between
+ * cannot take it.
+ */
+void testCheckFreeSpaceLoggingAndAvailable(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  /* Accepting messages */
   sdlogger_spi.status = SDLogger_Logging;
-  sdlogger_spi.sdcard_buf_idx = 510;
-  sdlogger_spi.idx = 0;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+
+  /* Function call (from messages.h) */
+  bool_t available = sdlogger_spi_direct_check_free_space(
+                       sdlogger_spi.device.periph,
+                       20);
+
+  /* There is space available for writing */
+  TEST_ASSERT_TRUE(available);
+  TEST_ASSERT_EQUAL(20, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.nesting);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.queue_max);
+}
+
+void testCheckFreeSpaceRequestJustTheAvailableBytes(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  /* Ring almost full */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE - 4;
+
+  /* Requesting free space */
+  bool_t available = sdlogger_spi_direct_check_free_space(
+                       sdlogger_spi.device.periph,
+                       4);
+  /* There is (just) enough space */
+  TEST_ASSERT_TRUE(available);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, sdlogger_spi.queue_max);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+}
+
+void testCheckFreeSpaceRequestOneTooManyBytes(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  /* Ring almost full */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE - 4;
+
+  /* Requesting free space */
+  bool_t available = sdlogger_spi_direct_check_free_space(
+                       sdlogger_spi.device.periph,
+                       5);
+  /* There is (just) not enough space, nothing reserved */
+  TEST_ASSERT_FALSE(available);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE - 4, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.nesting);
+  /* The message is lost */
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.dropped);
+}
+
+void testCheckFreeSpaceAcrossBlockBoundary(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 509;
+
+  /* Requesting free space */
+  bool_t available = sdlogger_spi_direct_check_free_space(
+                       sdlogger_spi.device.periph,
+                       67);
+  /* Continues in the next block of the ring */
+  TEST_ASSERT_TRUE(available);
+  TEST_ASSERT_EQUAL(576, sdlogger_spi.head);
+}
+
+void testCheckFreeSpaceAcrossBlockBoundaryJustNotPossible(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = SDLOGGER_RING_SIZE - SD_BLOCK_SIZE;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE + 509 - SD_BLOCK_SIZE;
+  sdlogger_spi.space_end = sdlogger_spi.tail + SDLOGGER_RING_SIZE;
 
   /* Requesting free space */
   bool_t available = sdlogger_spi_direct_check_free_space(
                        sdlogger_spi.device.periph,
-                       4+SDLOGGER_BUFFER_SIZE);
+                       SDLOGGER_RING_SIZE - 509 + 1);
   /* There is (just) not enough space */
   TEST_ASSERT_FALSE(available);
 }
 
 /**
- * @brief testPutByteWhileNoSpaceLeft
- * No tests are done inside the logger to check if there is still space left
- * when writing a byte. This check should be done outside the logger. It is
- * normally checked in messages.h, by calling check_free_space.
+ * @brief testCheckFreeSpaceCountersWrapAround
+ * Head and tail are free running byte counters, only their difference
+ * matters. Nothing changes when they wrap around at 2^32.
+ */
+void testCheckFreeSpaceCountersWrapAround(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = 0xFFFFFE00;
+  sdlogger_spi.head = sdlogger_spi.tail + SDLOGGER_RING_SIZE - 256;
+  sdlogger_spi.space_end = sdlogger_spi.tail + SDLOGGER_RING_SIZE;
+
+  TEST_ASSERT_FALSE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 257));
+  TEST_ASSERT_TRUE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 256));
+}
+
+/**
+ * @brief testCheckFreeSpaceNestedTooDeep
+ * Every context that is halfway a message holds one open reservation. There
+ * are SDLOGGER_NESTING of them.
+ */
+void testCheckFreeSpaceNestedTooDeep(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.nesting = SDLOGGER_NESTING;
+
+  TEST_ASSERT_FALSE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 20));
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SDLOGGER_NESTING, sdlogger_spi.nesting);
+}
+
+/**
+ * @brief testPutByteWithoutReservation
+ * Bytes are only written into space reserved by check_free_space. Without
+ * an open reservation, or beyond its length, they are ignored.
  */
-void testPutByteWhileNoSpaceLeft(void)
+void testPutByteWithoutReservation(void)
 {
-  /* Empty on purpose */
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.ring[0][0] = 0x42;
+  sdlogger_spi.ring[0][1] = 0x42;
+
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+
+  TEST_ASSERT_EQUAL(0x42, sdlogger_spi.ring[0][0]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.head);
+
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 1);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xCD);
+
+  TEST_ASSERT_EQUAL(0xAB, sdlogger_spi.ring[0][0]);
+  TEST_ASSERT_EQUAL(0x42, sdlogger_spi.ring[0][1]);
 }
 
 /**
- * @brief testPutByteIntoSDBuffer
- * Put bytes in the SD Card buffer directly
+ * @brief testPutByteIntoRing
+ * Put bytes in the reserved space of the ring, straight into the block
+ * buffer of the card. send_message commits them.
  */
-void testPutByteIntoSDBuffer(void)
+void testPutByteIntoRing(void)
 {
   /* Preconditions */
   helperInitializeLogger();
   sdlogger_spi.status = SDLogger_Logging;
 
-  /* Put byte call through messages.h and pprzlog_tp */
+  /* Call sequence through messages.h and pprzlog_tp */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 3);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xEF);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0x33);
 
-  /* Check if the byte was successfully stuffed in SD Card output buffer */
-  TEST_ASSERT_EQUAL(0xAB, sdcard1.output_buf[1]);
-  TEST_ASSERT_EQUAL(0xEF, sdcard1.output_buf[2]);
-  TEST_ASSERT_EQUAL(0x33, sdcard1.output_buf[3]);
+  /* Written, but not committed yet */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[0]);
+
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  /* Check if the byte was successfully stuffed in the first block */
+  TEST_ASSERT_EQUAL(0xAB, sdlogger_spi.ring[0][0]);
+  TEST_ASSERT_EQUAL(0xEF, sdlogger_spi.ring[0][1]);
+  TEST_ASSERT_EQUAL(0x33, sdlogger_spi.ring[0][2]);
+  TEST_ASSERT_EQUAL(3, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(3, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.nesting);
 }
 
 /**
- * @brief testSDBufferGetsFull
- * If the SD Card buffer is full, it will be busy writing this stuff. Until the
- * SPI transaction is finished, any further write requests are saved in the
- * logger buffer. If then the SPI transaction is finished, this logger buffer is
- * copied into the SD Card buffer.
+ * @brief testNestedMessageFromInterrupt
+ * An interrupt that logs a complete message while the main loop is halfway
+ * its own message gets its own reservation. Both messages stay intact, the
+ * interrupt one ends up behind the other in the ring.
  */
-void testSDBufferGetsFull(void)
+void testNestedMessageFromInterrupt(void)
 {
-  /* Pre-conditions */
+  /* Preconditions */
   helperInitializeLogger();
   sdlogger_spi.status = SDLogger_Logging;
-  /* Last element in the buffer: */
-  sdlogger_spi.sdcard_buf_idx = 512;
-  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.status = SDCard_MultiWriteBusy;
 
-  /* Expectations */
-  sdcard_spi_multiwrite_next_Expect(&sdcard1,
-                                    &sdlogger_spi_direct_multiwrite_written);
+  /* Main loop */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 10);
+  for (uint8_t i = 1; i <= 3; i++) {
+    sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, i);
+  }
 
-  /* Put byte call through messages.h and pprzlog_tp */
-  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+  /* Interrupt */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 5);
+  for (uint8_t i = 0; i < 5; i++) {
+    sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xB0 + i);
+  }
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  /* Main loop continues */
+  for (uint8_t i = 4; i <= 10; i++) {
+    sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, i);
+  }
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  for (uint8_t i = 1; i <= 10; i++) {
+    TEST_ASSERT_EQUAL_MESSAGE(i, sdlogger_spi.ring[0][i - 1], S__LINE__);
+  }
+  for (uint8_t i = 0; i < 5; i++) {
+    TEST_ASSERT_EQUAL_HEX(0xB0 + i, sdlogger_spi.ring[0][10 + i]);
+  }
+  TEST_ASSERT_EQUAL(15, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.nesting);
+}
 
-  /* Values set in sd buffer, index reset */
-  TEST_ASSERT_EQUAL(0xAB, sdcard1.output_buf[512]);
+/**
+ * @brief testRingBlockGetsFull
+ * The block in the ring is a block buffer of the card. Once all of its bytes
+ * are committed, it is submitted as it is, without copying. Until the card
+ * wrote it, further bytes go into the next block.
+ */
+void testRingBlockGetsFull(void)
+{
+  /* Pre-conditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  /* Last byte of the first block: */
+  sdlogger_spi.head = 511;
+  sdlogger_spi.committed[0] = 511;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
 
-  /* Write another byte after SD Card buffer is full */
+  /* Call sequence through messages.h and pprzlog_tp */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 3);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xEF);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0x4F);
 
-  /* It should end up in the loggers internal buffer to copy later */
-  TEST_ASSERT_EQUAL(0xEF, sdlogger_spi.buffer[0]);
-  TEST_ASSERT_EQUAL(0x4F, sdlogger_spi.buffer[1]);
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  TEST_ASSERT_EQUAL(0xAB, sdlogger_spi.ring[0][511]);
+  /* The rest ends up in the next block of the ring */
+  TEST_ASSERT_EQUAL(0xEF, sdlogger_spi.ring[1][0]);
+  TEST_ASSERT_EQUAL(0x4F, sdlogger_spi.ring[1][1]);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(2, sdlogger_spi.committed[1]);
+  /* Not released before the card wrote it */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
 }
 
 /**
- * @brief testSDBufferGetsFullButCardIsNotReady
- * If the SD Card buffer is full, it wants to write to the card. This can only
- * be done if the SD Card is ready to accept a data block.
+ * @brief testRingBlockGetsFullWhileCardIsBusy
+ * The card does not have to be ready for the block, the driver queues it
+ * behind the one it is writing.
  */
-void testSDBufferGetsFullButCardIsNotReady(void)
+void testRingBlockGetsFullWhileCardIsBusy(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  /* Last element in the buffer: */
-  sdlogger_spi.sdcard_buf_idx = 512;
+  sdlogger_spi.status = SDLogger_Logging;
+  /* Last byte of the first block: */
+  sdlogger_spi.head = 511;
+  sdlogger_spi.committed[0] = 511;
+  sdlogger_spi.tail = 0;
   /* SD Card is busy with previous block */
   sdcard1.status = SDCard_MultiWriteBusy;
 
   /* Expectations */
-  /* SD Card busy, so don't call now */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
 
-  /* Put byte call through messages.h and pprzlog_tp */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 1);
   sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
-  /* The SD Card output buffer is now FULL */
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+  /* The first block is now FULL */
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
 }
 
 /**
- * @brief testPeriodicIfSDCardIsReadyAndSDBufferIsFull
- * If the SD Card buffer is not written immediately when it got full (because
- * the card was still working on something else), check the sdcard status every
- * periodic loop and write it when the card is back to idle
+ * @brief testPutByteWrapsToFirstBlock
+ * After the last block of the ring, the head continues in the first block.
  */
-void testPeriodicIfSDCardIsReadyAndSDBufferIsFull(void)
+void testPutByteWrapsToFirstBlock(void)
 {
   /* Preconditions */
   helperInitializeLogger();
   sdlogger_spi.status = SDLogger_Logging;
-  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
-  /* Buffer is full */
-  sdlogger_spi.sdcard_buf_idx = 513;
+  sdlogger_spi.tail = SD_BLOCK_SIZE;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE - 1;
+  sdlogger_spi.space_end = SD_BLOCK_SIZE + SDLOGGER_RING_SIZE;
   sdcard1.status = SDCard_MultiWriteBusy;
 
-  /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 2);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xCD);
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
 
-  /* Periodic loop #1 */
-  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(0xAB, sdlogger_spi.ring[SDLOGGER_RING_BLOCKS - 1][511]);
+  TEST_ASSERT_EQUAL(0xCD, sdlogger_spi.ring[0][0]);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE + 1, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.committed[0]);
+}
 
-  /* SD Card status changed */
-  sdcard1.status = SDCard_MultiWriteIdle;
+/**
+ * @brief testReserveNotLogging
+ * Reserve/commit is the zero-copy alternative to check_free_space and
+ * put_byte. sdlogger_spi_direct_reserve() returns the number of spans, zero if
+ * the message does not fit, just like check_free_space returns FALSE.
+ */
+void testReserveNotLogging(void)
+{
+  struct sdlogger_spi_span spans[2];
 
-  /* New expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_next_Expect(&sdcard1,
-                                    &sdlogger_spi_direct_multiwrite_written);
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Ready;
 
-  /* Periodic loop #2 */
-  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(0, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 20, spans));
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
 }
 
 /**
- * @brief testDoNotWriteIfLoggerBufferIsFull
- * If correctly implemented, the internal buffer will never get full because
- * proper implementation calls check_free_space. But if it is badly implemented,
- * it can be desastrous to write outside the buffer, so lets check it just in
- * case.
+ * @brief testReserveSingleSpanInRing
+ * The span points straight into the ring, where put_byte would have written
+ * the bytes. The space is taken right away, the next producer gets the
+ * bytes behind it.
  */
-void testDoNotWriteIfLoggerBufferIsFull(void)
+void testReserveSingleSpanInRing(void)
 {
-  /* Pre-conditions */
-  helperInitializeLogger();
-  /* Last element in the buffer: */
-  sdlogger_spi.sdcard_buf_idx = 513;
-  sdlogger_spi.idx = SDLOGGER_BUFFER_SIZE - 1;
+  struct sdlogger_spi_span spans[2];
 
-  /* Put byte call through messages.h and pprzlog_tp */
-  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
-  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xCD);
-
-  TEST_ASSERT_EQUAL(0xAB, sdlogger_spi.buffer[SDLOGGER_BUFFER_SIZE-1]);
-  /* The index would get overwritten if not checking for end of buffer */
-  TEST_ASSERT_EQUAL(SDLOGGER_BUFFER_SIZE, sdlogger_spi.idx);
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 20, spans));
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.ring[0], spans[0].buf);
+  TEST_ASSERT_EQUAL(20, spans[0].len);
+  TEST_ASSERT_EQUAL(0, spans[1].len);
+  TEST_ASSERT_EQUAL(20, sdlogger_spi.head);
+  /* Nothing is committed yet */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[0]);
+
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 30, spans));
+  TEST_ASSERT_EQUAL_PTR(&sdlogger_spi.ring[0][20], spans[0].buf);
+  TEST_ASSERT_EQUAL(50, sdlogger_spi.head);
 }
 
 /**
- * @brief testCopyLoggerBufferToSDCardWhenSpiTransactionFinished
- * The callback is called when the SPI transaction is complete. The SD Card will
- * still be in a busy state, but the output buffer can be used again for writing
- * data to.
+ * @brief testReserveSpansBlockBoundary
+ * A message that does not fit in the rest of the block continues in the next
+ * block of the ring, in a second span.
  */
-void testCopyLoggerBufferToSDCardWhenSpiTransactionFinished(void)
+void testReserveSpansBlockBoundary(void)
 {
-  /* Pre-conditions */
-  helperInitializeLogger();
-  /* Some stuff in the SD Logger buffer */
-  sdlogger_spi.buffer[0] = 0xA2;
-  sdlogger_spi.buffer[5] = 0xA7;
-  sdlogger_spi.buffer[SDLOGGER_BUFFER_SIZE-1] = 0x42;
-  sdlogger_spi.idx = SDLOGGER_BUFFER_SIZE;
-  sdlogger_spi.sdcard_buf_idx = 513;
-  sdlogger_spi.log_len = 5000;
+  struct sdlogger_spi_span spans[2];
 
-  /* Callback when SPI transaction is complete */
-  sdlogger_spi_direct_multiwrite_written();
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 509;
+  sdlogger_spi.tail = 0;
+
+  TEST_ASSERT_EQUAL(2, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 67, spans));
+  TEST_ASSERT_EQUAL_PTR(&sdlogger_spi.ring[0][509], spans[0].buf);
+  TEST_ASSERT_EQUAL(3, spans[0].len);
+  TEST_ASSERT_EQUAL(509, spans[0].pos);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.ring[1], spans[1].buf);
+  TEST_ASSERT_EQUAL(64, spans[1].len);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, spans[1].pos);
+}
 
-  /* Check if stuff is copied from logger buffer to sdcard buffer */
-  TEST_ASSERT_EQUAL_HEX(0xA2, sdcard1.output_buf[0+1]);
-  TEST_ASSERT_EQUAL_HEX(0xA7, sdcard1.output_buf[5+1]);
-  TEST_ASSERT_EQUAL_HEX(0x42, sdcard1.output_buf[SDLOGGER_BUFFER_SIZE-1+1]);
+void testReserveSpansEndOfRing(void)
+{
+  struct sdlogger_spi_span spans[2];
 
-  /* Also make sure both indexes are now set to new correct values */
-  TEST_ASSERT_EQUAL(SDLOGGER_BUFFER_SIZE+1, sdlogger_spi.sdcard_buf_idx);
-  TEST_ASSERT_EQUAL(0, sdlogger_spi.idx);
-  /* Check increment in log length, because another block was logged */
-  TEST_ASSERT_EQUAL(5001, sdlogger_spi.log_len);
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = SDLOGGER_RING_SIZE - SD_BLOCK_SIZE;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE - 3;
+  sdlogger_spi.space_end = sdlogger_spi.tail + SDLOGGER_RING_SIZE;
+
+  TEST_ASSERT_EQUAL(2, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 67, spans));
+  TEST_ASSERT_EQUAL_PTR(&sdlogger_spi.ring[SDLOGGER_RING_BLOCKS - 1][509], spans[0].buf);
+  TEST_ASSERT_EQUAL(3, spans[0].len);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.ring[0], spans[1].buf);
+  TEST_ASSERT_EQUAL(64, spans[1].len);
 }
 
-void testStopLogging(void)
+void testReserveOneTooManyBytes(void)
 {
+  struct sdlogger_spi_span spans[2];
+
   /* Preconditions */
+  helperInitializeLogger();
   sdlogger_spi.status = SDLogger_Logging;
-  /* New switch state is OFF: */
-  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE - 4;
 
-  /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 5, spans));
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.dropped);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 4, spans));
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.dropped);
+}
 
-  /* Check in periodic loop */
-  sdlogger_spi_direct_periodic();
+/**
+ * @brief testReserveMoreThanOneBlock
+ * Two spans cover at most one block worth of data.
+ */
+void testReserveMoreThanOneBlock(void)
+{
+  struct sdlogger_spi_span spans[2];
 
-  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 0;
+
+  TEST_ASSERT_EQUAL(0, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph,
+                                                   SD_BLOCK_SIZE + 1, spans));
 }
 
-void testLoggingFinalBlockWithFullBuffersCardBusy(void)
+/**
+ * @brief testCommitWithinBlock
+ * Committing counts the bytes of the message in its block, the block is not
+ * full yet.
+ */
+void testCommitWithinBlock(void)
 {
+  struct sdlogger_spi_span spans[2];
+
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
-  sdcard1.status = SDCard_MultiWriteBusy;
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.ring[0][20] = 123;
+  sdcard1.status = SDCard_MultiWriteIdle;
 
-  /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 20, spans);
+  memset(spans[0].buf, 0x5A, spans[0].len);
+  /* Expect no calls */
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, 20);
+
+  TEST_ASSERT_EQUAL(20, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(20, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL_HEX(0x5A, sdlogger_spi.ring[0][19]);
+  TEST_ASSERT_EQUAL_HEX(123, sdlogger_spi.ring[0][20]);
+}
+
+/**
+ * @brief testCommitFillingBlockSubmitsIt
+ * Like put_byte of the last byte of a block, the commit that fills a block
+ * submits it to the SD Card.
+ */
+void testCommitFillingBlockSubmitsIt(void)
+{
+  struct sdlogger_spi_span spans[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 509;
+  sdlogger_spi.committed[0] = 509;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  TEST_ASSERT_EQUAL(2, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 67, spans));
+  for (uint8_t i = 0; i < 67; i++) {
+    if (i < spans[0].len) {
+      spans[0].buf[i] = i;
+    } else {
+      spans[1].buf[i - spans[0].len] = i;
+    }
+  }
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, 67);
+
+  TEST_ASSERT_EQUAL(576, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(64, sdlogger_spi.committed[1]);
+  /* Same place as the bytes would have been put one by one */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.ring[0][509]);
+  TEST_ASSERT_EQUAL(2, sdlogger_spi.ring[0][511]);
+  TEST_ASSERT_EQUAL(3, sdlogger_spi.ring[1][0]);
+  TEST_ASSERT_EQUAL(66, sdlogger_spi.ring[1][63]);
+}
+
+void testCommitFillingBlockCardBusy(void)
+{
+  struct sdlogger_spi_span spans[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 509;
+  sdlogger_spi.committed[0] = 509;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 67, spans);
+
+  /* Expectations, the driver queues it behind the block it is writing */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, 67);
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+}
+
+/**
+ * @brief testCommitLessThanReserved
+ * A serializer may reserve the maximum size of a message and commit what it
+ * actually wrote. Other producers may already have taken the space behind
+ * it, so the rest is filled with zeros. The log parser skips those while
+ * looking for the next start byte.
+ */
+void testCommitLessThanReserved(void)
+{
+  struct sdlogger_spi_span spans[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 509;
+  sdlogger_spi.committed[0] = 509;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 67, spans);
+  memset(spans[0].buf, 0xAA, spans[0].len);
+  memset(spans[1].buf, 0xAA, spans[1].len);
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, spans, 2);
+
+  TEST_ASSERT_EQUAL(576, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(64, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL_HEX(0xAA, sdlogger_spi.ring[0][510]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][511]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[1][0]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[1][63]);
+}
+
+/**
+ * @brief testCommitOutOfOrder
+ * Producers commit in any order. The block is submitted by whoever commits
+ * its last byte.
+ */
+void testCommitOutOfOrder(void)
+{
+  struct sdlogger_spi_span first[2], second[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 500;
+  sdlogger_spi.committed[0] = 500;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 6, first);
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 20, second);
+
+  /* Block not complete, expect no calls */
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, second, 20);
+  TEST_ASSERT_EQUAL(506, sdlogger_spi.committed[0]);
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, first, 6);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+}
+
+/**
+ * @brief testSubmitBlocksOutOfOrder
+ * A later block may be complete before an earlier one. It is submitted right
+ * away, the driver writes the blocks in the order they were acquired, which
+ * is their order in the log.
+ */
+void testSubmitBlocksOutOfOrder(void)
+{
+  struct sdlogger_spi_span first[2], second[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.head = 500;
+  sdlogger_spi.committed[0] = 500;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 12, first);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph,
+                                                   SD_BLOCK_SIZE, second));
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, second, SD_BLOCK_SIZE);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL(500, sdlogger_spi.committed[0]);
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, first, 12);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+}
+
+void testPeriodicDoesNotWritePartialBlock(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 100;
+  sdlogger_spi.committed[0] = 100;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop, nothing to write yet */
+  sdlogger_spi_direct_periodic();
+}
+
+/**
+ * @brief testPeriodicWaitsForOpenReservation
+ * A block that is completely reserved is not written while a producer is
+ * still filling its part of it.
+ */
+void testPeriodicWaitsForOpenReservation(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE + 8;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE - 12;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop, nothing to write yet */
+  sdlogger_spi_direct_periodic();
+}
+
+/**
+ * @brief testStaleReservationIsCountedNotAbandoned
+ * A reservation that is not committed within SDLOGGER_RESERVATION_TIMEOUT
+ * breaks the contract. It is counted once, but its block still waits: the
+ * producer may be writing into it. The late commit completes the block.
+ */
+void testStaleReservationIsCountedNotAbandoned(void)
+{
+  struct sdlogger_spi_span stale[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  /* First block submitted, the second one waits for the last 12 bytes */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE + 500;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = 500;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  FakeSysTimeUsec = 1000;
+
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 12, stale));
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop, the block waits from now on */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_TRUE(sdlogger_spi.stalled);
+
+  /* Still in time at the timeout */
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.stale);
+
+  /* Counted after it, the block is not submitted */
+  FakeSysTimeUsec++;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(500, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.stale);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+  TEST_ASSERT_TRUE(sdlogger_spi.stalled);
+
+  /* Only once for the same block */
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.stale);
+
+  /* Late commit, the block goes to the card with the message in it */
+  memset(stale[0].buf, 0x5A, 12);
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, stale, 12);
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, sdlogger_spi.ring[1][SD_BLOCK_SIZE - 1]);
+
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_FALSE(sdlogger_spi.stalled);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.stale);
+}
+
+/**
+ * @brief testMessageWithoutSendMessageIsCounted
+ * A check_free_space without its send_message is counted like a reservation
+ * that is not committed. Its put_byte reservation stays open.
+ */
+void testMessageWithoutSendMessageIsCounted(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 500;
+  sdlogger_spi.committed[0] = 500;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  FakeSysTimeUsec = 1000;
+
+  /* Message that is never sent */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 12);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0x99);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 12);
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT + 1;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(500, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.nesting);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.stale);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+}
+
+/**
+ * @brief testStaleReservationTimerRestartsWithNextBlock
+ * The timeout runs for one block. Once it is complete, the next block that
+ * waits gets the whole timeout again.
+ */
+void testStaleReservationTimerRestartsWithNextBlock(void)
+{
+  struct sdlogger_spi_span first[2], second[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 500;
+  sdlogger_spi.committed[0] = 500;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  FakeSysTimeUsec = 1000;
+
+  /* A message in each block, both open */
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 12, first);
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, SD_BLOCK_SIZE, second);
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  /* First block completed just in time */
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT;
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, first, 12);
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  /* The second one waits since then */
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.stale);
+  TEST_ASSERT_TRUE(sdlogger_spi.stalled);
+}
+
+/**
+ * @brief testDoNotWriteIfRingIsFull
+ * If correctly implemented, the ring will never get full because proper
+ * implementation calls check_free_space. But if it is badly implemented, it
+ * can be desastrous to overwrite a block the card is still reading, so lets
+ * check it just in case.
+ */
+void testDoNotWriteIfRingIsFull(void)
+{
+  /* Pre-conditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SDLOGGER_RING_SIZE;
+  sdlogger_spi.ring[0][0] = 0x42;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Call sequence through messages.h and pprzlog_tp, ignoring the result */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 2);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xCD);
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  /* The oldest block would get overwritten if not checking for a full ring */
+  TEST_ASSERT_EQUAL(0x42, sdlogger_spi.ring[0][0]);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.nesting);
+}
+
+/**
+ * @brief testBlockWrittenGetsNewBuffer
+ * The callback is called from the SPI interrupt when the card accepted the
+ * block. The buffer belongs to the driver again, its place in the ring is
+ * taken by a new block buffer of the card. Nothing is copied.
+ */
+void testBlockWrittenGetsNewBuffer(void)
+{
+  uint8_t *second;
+
+  /* Pre-conditions */
+  helperInitializeLogger();
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE + 20;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = 20;
+  sdlogger_spi.ring[1][0] = 0xA2;
+  second = sdlogger_spi.ring[1];
+  sdlogger_spi.log_len = 5000;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Callback when SPI transaction is complete */
+  sdlogger_spi_direct_multiwrite_written();
+
+  /* Only the tail moves, the producer side is left alone */
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE + 20, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(20, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL_PTR(&TestBlocks[SDLOGGER_RING_BLOCKS][1], sdlogger_spi.ring[0]);
+  TEST_ASSERT_EQUAL_PTR(second, sdlogger_spi.ring[1]);
+  /* Zeroed, a commit shorter than its reservation leaves zeros */
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][i]);
+  }
+  TEST_ASSERT_EQUAL_HEX(0xA2, sdlogger_spi.ring[1][0]);
+  /* A block further than the tail can be reserved */
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE + SDLOGGER_RING_SIZE, sdlogger_spi.space_end);
+  /* Check increment in log length, because another block was logged */
+  TEST_ASSERT_EQUAL(5001, sdlogger_spi.log_len);
+}
+
+/**
+ * @brief testBlockWrittenLimitsRingAtEndOfLogSpace
+ * Close to the end of the log space, no more of the ring is reserved than
+ * there are blocks left on the card.
+ */
+void testBlockWrittenLimitsRingAtEndOfLogSpace(void)
+{
+  /* Pre-conditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.log_space_end = 0x100000;
+  sdlogger_spi.next_available_address = 0x100000 - 100;
+  sdlogger_spi.log_len = 97;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE + 20;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = 20;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  sdlogger_spi_direct_multiwrite_written();
+
+  /* Blocks 98 and 99 of the 100 are left */
+  TEST_ASSERT_EQUAL(98, sdlogger_spi.log_len);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE + 2 * SD_BLOCK_SIZE, sdlogger_spi.space_end);
+}
+
+/**
+ * @brief testRingBlocksIsPowerOfTwo
+ * head and tail wrap at 2^32, block and offset are taken from them with a
+ * mask. That only works for a power of two number of blocks. Every block of
+ * the ring is a block buffer of the card, it has to have that many.
+ */
+void testRingBlocksIsPowerOfTwo(void)
+{
+  TEST_ASSERT_TRUE(SDLOGGER_RING_BLOCKS >= 2);
+  TEST_ASSERT_EQUAL(0, SDLOGGER_RING_BLOCKS & (SDLOGGER_RING_BLOCKS - 1));
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS * SD_BLOCK_SIZE, SDLOGGER_RING_SIZE);
+  TEST_ASSERT_TRUE(SDLOGGER_RING_BLOCKS <= SDCARD_BLOCK_BUFFERS);
+}
+
+/**
+ * @brief testQueueHighWaterMark
+ * queue_max holds the most ring blocks ever in use, partly filled ones
+ * included. It does not go down when the card catches up.
+ */
+void testQueueHighWaterMark(void)
+{
+  struct sdlogger_spi_span spans[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.tail = SD_BLOCK_SIZE;
+  sdlogger_spi.head = SD_BLOCK_SIZE + SDLOGGER_RING_SIZE - 12;
+  sdlogger_spi.space_end = SD_BLOCK_SIZE + SDLOGGER_RING_SIZE;
+
+  sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 8, spans);
+
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, sdlogger_spi.queue_max);
+
+  /* Card caught up */
+  sdlogger_spi.tail = SDLOGGER_RING_SIZE;
+  sdlogger_spi.space_end = 2 * SDLOGGER_RING_SIZE;
+
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 20);
+
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, sdlogger_spi.queue_max);
+}
+
+/**
+ * @brief testCardStallAbsorbedByRing
+ * While the card is busy, messages fill the whole ring and only the ones
+ * that do not fit anymore are dropped. Every block is submitted when it is
+ * full, the driver queues them. They come back in the order they were
+ * filled, one per SPI callback.
+ */
+void testCardStallAbsorbedByRing(void)
+{
+  uint16_t accepted = 0;
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.log_len = 0;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Expectations */
+  for (uint16_t b = 0; b < SDLOGGER_RING_BLOCKS; b++) {
+    sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[b],
+                                   &sdlogger_spi_direct_multiwrite_written);
+  }
+
+  /* Messages of 64 bytes while the card stalls */
+  for (uint16_t m = 0; m < SDLOGGER_RING_SIZE / 64 + 3; m++) {
+    if (sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 64)) {
+      for (uint8_t i = 0; i < 64; i++) {
+        sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, m);
+      }
+      sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+      accepted++;
+    }
+  }
+
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE / 64, accepted);
+  TEST_ASSERT_EQUAL(3, sdlogger_spi.dropped);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, sdlogger_spi.queue_max);
+  for (uint16_t b = 0; b < SDLOGGER_RING_BLOCKS; b++) {
+    TEST_ASSERT_EQUAL((uint8_t)(b * SD_BLOCK_SIZE / 64), sdlogger_spi.ring[b][0]);
+  }
+
+  /* Card ready again, written in order */
+  for (uint16_t b = 0; b < SDLOGGER_RING_BLOCKS; b++) {
+    sdlogger_spi_direct_multiwrite_written();
+  }
+
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_SIZE, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, sdlogger_spi.log_len);
+  TEST_ASSERT_EQUAL(3, sdlogger_spi.dropped);
+}
+
+#ifdef SDLOGGER_COMPRESS
+/**
+ * @brief helperStartCompressedLog
+ * Logging a compressed log, nothing compressed yet.
+ */
+void helperStartCompressedLog(void)
+{
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.compressing = TRUE;
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    sdlogger_spi.ring[i] = sdlogger_spi.comp_raw[i];
+  }
+  sdlog_compress_init(&sdlogger_spi.comp);
+  sdlog_compress_start(&sdlogger_spi.comp, sdlogger_spi.comp_buf);
+  NextTestBlock = 0;
+}
+
+/**
+ * @brief helperFillRingBlock
+ * Fill a ring block with 16 frames of 32 bytes, the same message with
+ * increasing timestamps.
+ */
+void helperFillRingBlock(uint8_t block, uint32_t timestamp)
+{
+  for (uint8_t f = 0; f < 16; f++) {
+    uint8_t *frame = &sdlogger_spi.ring[block][f * 32];
+    frame[0] = 0x99;
+    frame[1] = 32;
+    frame[2] = 0;
+    helperAssignUint(&frame[3], timestamp + f);
+    frame[7] = 1;
+    frame[8] = 42;
+    for (uint8_t i = 9; i < 31; i++) {
+      frame[i] = i;
+    }
+    frame[31] = f;
+  }
+}
+
+/**
+ * @brief helperFillRingBlockNoFrames
+ * Bytes that are not part of a frame hardly compress: an output block holds
+ * 506 of them.
+ */
+void helperFillRingBlockNoFrames(uint8_t block)
+{
+  for (uint16_t i = 1; i <= SD_BLOCK_SIZE; i++) {
+    sdlogger_spi.ring[block][i - 1] = i % 0x80;
+  }
+}
+
+/**
+ * @brief testStartCompressedLog
+ * The compress setting is taken when the log starts and holds for the whole
+ * log. The ring is in the memory of the logger then, block buffers of the
+ * card are only taken for full output blocks.
+ */
+void testStartCompressedLog(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdcard1.status = SDCard_Idle;
+  sdlogger_spi.status = SDLogger_Ready;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.compress = TRUE;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  TEST_ASSERT_TRUE(sdlogger_spi.compressing);
+  for (uint8_t i = 0; i < SDLOGGER_RING_BLOCKS; i++) {
+    TEST_ASSERT_EQUAL_PTR(sdlogger_spi.comp_raw[i], sdlogger_spi.ring[i]);
+  }
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, NextTestBlock);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.comp_buf, sdlogger_spi.comp.out);
+  TEST_ASSERT_TRUE(sdlog_compress_empty(&sdlogger_spi.comp));
+
+  /* Changing the setting has no effect on the running log */
+  sdlogger_spi.compress = FALSE;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_TRUE(sdlogger_spi.compressing);
+}
+
+/**
+ * @brief testCompressedLogBlockNotSubmittedByProducer
+ * Compression is too slow for an interrupt that completes a block, complete
+ * ring blocks wait for the periodic loop.
+ */
+void testCompressedLogBlockNotSubmittedByProducer(void)
+{
+  /* Preconditions */
+  helperStartCompressedLog();
+  sdlogger_spi.head = 511;
+  sdlogger_spi.committed[0] = 511;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* No call to the SD Card */
+  sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 1);
+  sdlogger_spi_direct_put_byte(sdlogger_spi.device.periph, 0xAB);
+  sdlogger_spi_direct_send_message(sdlogger_spi.device.periph);
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+}
+
+/**
+ * @brief testPeriodicCompressesOldestBlock
+ * One complete ring block per periodic call is compressed and released right
+ * away, the output block is only written when it is full.
+ */
+void testPeriodicCompressesOldestBlock(void)
+{
+  uint8_t out[4 * SD_BLOCK_SIZE];
+
+  /* Preconditions */
+  helperStartCompressedLog();
+  helperFillRingBlock(0, 1000);
+  helperFillRingBlock(1, 2000);
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 2 * SD_BLOCK_SIZE;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = SD_BLOCK_SIZE;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[1]);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_raw_pos);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_head);
+
+  /* 16 frames take the space of less than 5 */
+  sdlog_compress_finish(&sdlogger_spi.comp);
+  TEST_ASSERT_TRUE(((sdlogger_spi.comp_buf[0] << 8) | sdlogger_spi.comp_buf[1]) < 5 * 32);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlog_decompress(sdlogger_spi.comp_buf, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(sdlogger_spi.ring[0], out, SD_BLOCK_SIZE);
+}
+
+/**
+ * @brief testFullOutputBlockIsSubmitted
+ * A full output block is copied into a block buffer of the card and
+ * submitted. The rest of the ring block goes into the next output block.
+ */
+void testFullOutputBlockIsSubmitted(void)
+{
+  uint8_t out[4 * SD_BLOCK_SIZE];
+
+  /* Preconditions */
+  helperStartCompressedLog();
+  helperFillRingBlockNoFrames(0);
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_block_submit_Expect(&sdcard1, &TestBlocks[0][1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.comp_head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_tail);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.comp_buf, sdlogger_spi.comp.out);
+  TEST_ASSERT_EQUAL(506, sdlog_decompress(&TestBlocks[0][1], out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(sdlogger_spi.ring[0], out, 506);
+}
+
+/**
+ * @brief testCompressWaitsForFreeOutputBlock
+ * If the card has no block buffer left for a full output block, it waits in
+ * the output buffer and the rest of the ring block stays in the ring. The
+ * periodic loop tries again.
+ */
+void testCompressWaitsForFreeOutputBlock(void)
+{
+  uint8_t literals[400];
+
+  /* Preconditions */
+  helperStartCompressedLog();
+  helperFillRingBlockNoFrames(0);
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  /* First output block is being written, the next one is nearly full */
+  sdlogger_spi.comp_head = 1;
+  sdlogger_spi.comp_tail = 0;
+  memset(literals, 0x11, sizeof(literals));
+  sdlog_compress(&sdlogger_spi.comp, literals, sizeof(literals));
+  sdcard1.status = SDCard_MultiWriteBusy;
+  AcquireLeft = 0;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  /* 106 bytes still fit */
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.comp_head);
+  TEST_ASSERT_EQUAL(106, sdlogger_spi.comp_raw_pos);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+
+  /* First output block written, its buffer is free again */
+  sdlogger_spi.comp_tail = 1;
+  AcquireLeft = 1;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_block_submit_Expect(&sdcard1, &TestBlocks[0][1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(2, sdlogger_spi.comp_head);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.comp_raw_pos);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.comp_buf, sdlogger_spi.comp.out);
+}
+
+/**
+ * @brief testCompressedBlockWritten
+ * The SPI callback only counts the written output block, its buffer belongs
+ * to the driver again. The ring is not touched.
+ */
+void testCompressedBlockWritten(void)
+{
+  /* Preconditions */
+  helperStartCompressedLog();
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 100;
+  sdlogger_spi.committed[0] = 100;
+  sdlogger_spi.comp_head = 2;
+  sdlogger_spi.comp_tail = 0;
+  sdlogger_spi.log_len = 5000;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Callback when SPI transaction is complete, no calls to the card */
+  sdlogger_spi_direct_multiwrite_written();
+
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.comp_tail);
+  TEST_ASSERT_EQUAL(5001, sdlogger_spi.log_len);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(100, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL_PTR(sdlogger_spi.comp_raw[0], sdlogger_spi.ring[0]);
+}
+
+/**
+ * @brief testCompressedLogFinalBlock
+ * The last bytes are compressed without padding the ring block, the output
+ * block is padded instead.
+ */
+void testCompressedLogFinalBlock(void)
+{
+  uint8_t out[4 * SD_BLOCK_SIZE];
+
+  /* Preconditions */
+  helperStartCompressedLog();
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  helperFillRingBlock(0, 1000);
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 3 * 32;
+  sdlogger_spi.committed[0] = 3 * 32;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_block_submit_Expect(&sdcard1, &TestBlocks[0][1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(3 * 32, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(3 * 32, sdlogger_spi.tail);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.comp_head);
+  TEST_ASSERT_EQUAL(3 * 32, sdlog_decompress(&TestBlocks[0][1], out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(sdlogger_spi.ring[0], out, 3 * 32);
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+}
+
+/**
+ * @brief testCompressedLogFinalBlockEmpty
+ * The multiwrite is stopped once the ring and the output blocks are empty.
+ * The logger holds no block buffers of the card, there are none to release.
+ */
+void testCompressedLogFinalBlockEmpty(void)
+{
+  /* Preconditions */
+  helperStartCompressedLog();
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdlogger_spi.tail = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.head = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.comp_head = 5;
+  sdlogger_spi.comp_tail = 4;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop, last output block is still being written */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+
+  /* Written */
+  sdlogger_spi.comp_tail = 5;
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, &sdlogger_spi_direct_multiwrite_stopped);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_StoppedLogging, sdlogger_spi.status);
+}
+
+/**
+ * @brief testWrapCompressedLogWhenLogSpaceFull
+ * log_len counts the compressed blocks on the card, a compressed log wraps
+ * when those reach the end of the log space like an uncompressed one.
+ */
+void testWrapCompressedLogWhenLogSpaceFull(void)
+{
+  /* Preconditions */
+  helperStartCompressedLog();
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 100;
+  sdlogger_spi.log_len = 99;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+
+  /* One more block written */
+  sdlogger_spi.log_len++;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, NULL);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Wrapping, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(100, sdlogger_spi.wrap_len);
+  TEST_ASSERT_TRUE(sdlogger_spi.compressing);
+}
+
+#else
+#warning Not testing log compression
+#endif
+
+void testStopLogging(void)
+{
+  /* Preconditions */
+  sdlogger_spi.status = SDLogger_Logging;
+  /* New switch state is OFF: */
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Check in periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+}
+
+/**
+ * @brief helperExpectRingReleased
+ * The blocks of the ring go back to the driver newest first, starting with
+ * the one before the tail block.
+ */
+void helperExpectRingReleased(void)
+{
+  uint8_t first = (sdlogger_spi.tail / SD_BLOCK_SIZE) % SDLOGGER_RING_BLOCKS;
+
+  for (uint8_t k = SDLOGGER_RING_BLOCKS; k > 0; k--) {
+    sdcard_spi_block_release_Expect(&sdcard1,
+                                    sdlogger_spi.ring[(first + k - 1) % SDLOGGER_RING_BLOCKS]);
+  }
+}
+
+/**
+ * @brief testWrapLogWhenLogSpaceFull
+ * A log that reaches the end of the log space goes on at its start, with the
+ * switch still on. The block buffers go back to the driver and the
+ * multiwrite is stopped, then started again at 0x4000 with new buffers.
+ * Messages are dropped in between. wrap_len remembers how many blocks were
+ * written before the wrap, for the index.
+ */
+void testWrapLogWhenLogSpaceFull(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 100;
+  sdlogger_spi.log_len = 100;
+  sdlogger_spi.head = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.tail = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.space_end = 3 * SD_BLOCK_SIZE;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  helperExpectRingReleased();
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, NULL);
+
+  /* Periodic loop, the last block of the card is written */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Wrapping, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(100, sdlogger_spi.wrap_len);
+  TEST_ASSERT_FALSE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 1));
+
+  /* Multiwrite stopped */
+  sdcard1.status = SDCard_Idle;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(100, sdlogger_spi.log_len);
+  /* New buffers, in ring order from the tail block on */
+  for (uint8_t k = 0; k < SDLOGGER_RING_BLOCKS; k++) {
+    TEST_ASSERT_EQUAL_PTR(&TestBlocks[SDLOGGER_RING_BLOCKS + k][1],
+                          sdlogger_spi.ring[(3 + k) % SDLOGGER_RING_BLOCKS]);
+  }
+  TEST_ASSERT_EQUAL(3 * SD_BLOCK_SIZE + SDLOGGER_RING_SIZE, sdlogger_spi.space_end);
+}
+
+/**
+ * @brief testNoWrapBeforeEndOfLogSpace
+ * Blocks that still fit before the end of the card are written there.
+ */
+void testNoWrapBeforeEndOfLogSpace(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 100;
+  sdlogger_spi.log_len = 99;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.wrap_len);
+}
+
+/**
+ * @brief testNoReservationBeyondEndOfLogSpace
+ * The ring is not reserved beyond the last block of the log space, a block
+ * there would land beyond the card. A message that does not fit anymore
+ * completes the last block with zeros, so it gets written, and is dropped.
+ */
+void testNoReservationBeyondEndOfLogSpace(void)
+{
+  /* Pre-conditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 100;
+  sdlogger_spi.log_len = 99;
+  sdlogger_spi.head = 500;
+  sdlogger_spi.committed[0] = 500;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.space_end = SD_BLOCK_SIZE;
+  sdlogger_spi.ring[0][500] = 0xAA;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Expectations */
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  TEST_ASSERT_FALSE(sdlogger_spi_direct_check_free_space(sdlogger_spi.device.periph, 20));
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][500]);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.dropped);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.tail);
+}
+
+/**
+ * @brief testLogCrossesEndOfCard
+ * A log started two blocks before the end of the card: two blocks at the end,
+ * the wrap, three blocks from 0x4000 on, then the switch goes off. The index
+ * update splits the log in two entries and the next log starts after the
+ * part at the start of the log space.
+ */
+void testLogCrossesEndOfCard(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = 500;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 2;
+  sdlogger_spi.log_len = 1;
+  sdlogger_spi.head = 0;
+  sdlogger_spi.tail = 0;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* One block before the end */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+
+  /* Last block of the card written */
+  sdlogger_spi.log_len++;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  helperExpectRingReleased();
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, NULL);
+  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(SDLogger_Wrapping, sdlogger_spi.status);
+
+  sdcard1.status = SDCard_Idle;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_multiwrite_start_Expect(&sdcard1, 0x00004000, NULL);
+  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+
+  /* Three blocks at the start of the log space, no second wrap */
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdlogger_spi.log_len += 3;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+
+  /* Switch off */
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdlogger_spi_direct_periodic();
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+
+  /* Index update */
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 7;
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
+
+  sdlogger_spi_direct_index_received();
+
+  /* Log 8 at the end of the card, log 9 continues it at 0x4000 */
+  TEST_ASSERT_EQUAL(9, sdcard1.output_buf[4 + 6]);
+  TEST_ASSERT_EQUAL_HEX(0x00100000 - 2, helperUint(&sdcard1.output_buf[5 + 7 * 12 + 6]));
+  TEST_ASSERT_EQUAL(2, helperUint(&sdcard1.output_buf[5 + 7 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 7 * 12 + 10 + 6] & 0x02);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, helperUint(&sdcard1.output_buf[5 + 8 * 12 + 6]));
+  TEST_ASSERT_EQUAL(3, helperUint(&sdcard1.output_buf[5 + 8 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x02, sdcard1.output_buf[5 + 8 * 12 + 10 + 6] & 0x02);
+  TEST_ASSERT_EQUAL_HEX(0x00004003, sdlogger_spi.next_available_address);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.wrap_len);
+}
+
+/**
+ * @brief testLoggingFinalBlockWaitsForWrittenBlocks
+ * All blocks are submitted, the multiwrite is not stopped before the card
+ * wrote them.
+ */
+void testLoggingFinalBlockWaitsForWrittenBlocks(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 2 * SD_BLOCK_SIZE;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = SD_BLOCK_SIZE;
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  /* Status unchanged */
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+}
+
+/**
+ * @brief testLoggingFinalBlockPadsLastBlock
+ * The partly filled block behind the full ones is padded and submitted right
+ * away, whatever the card is doing.
+ */
+void testLoggingFinalBlockPadsLastBlock(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  /* Still a lot of data in the ring */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE + 20;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE;
+  sdlogger_spi.committed[1] = 20;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[1],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  /* Last block padded and complete */
+  TEST_ASSERT_EQUAL(2 * SD_BLOCK_SIZE, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[1]);
+}
+
+/**
+ * @brief testLoggingFinalBlockWithHalfFullBufferCardAvailalble
+ * If there is some data in the last block, then fill the rest with trailing
+ * zero's and submit it.
+ */
+void testLoggingFinalBlockWithHalfFullBufferCardAvailalble(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdcard1.status = SDCard_MultiWriteIdle;
+  /* Some data in the block */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = 29;
+  sdlogger_spi.committed[0] = 29;
+  /* Until this value should not be overwritten with zero's */
+  sdlogger_spi.ring[0][28] = 0xEE;
+  /* Set wrong values here, should be converted to trailing zero's */
+  sdlogger_spi.ring[0][29] = 0xB0;
+  sdlogger_spi.ring[0][30] = 0xAA;
+  sdlogger_spi.ring[0][511] = 0xDD;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL_HEX(0xEE, sdlogger_spi.ring[0][28]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][29]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][30]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdlogger_spi.ring[0][511]);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.head);
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+}
+
+/**
+ * @brief testLoggingFinalBlockBuffersEmpty
+ * When the ring is empty in the LogginFinalBlock state, its block buffers go
+ * back to the driver and it is time to call the multiwrite_stop function.
+ */
+void testLoggingFinalBlockBuffersEmpty(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.tail = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.head = 3 * SD_BLOCK_SIZE;
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  helperExpectRingReleased();
+  sdcard_spi_multiwrite_stop_Expect(&sdcard1, &sdlogger_spi_direct_multiwrite_stopped);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_StoppedLogging, sdlogger_spi.status);
+}
+
+/**
+ * @brief testLoggingFinalBlockWaitsForOpenReservation
+ * Stopping the log does not abandon a reservation either. The last block
+ * is written once it is committed, late or not.
+ */
+void testLoggingFinalBlockWaitsForOpenReservation(void)
+{
+  struct sdlogger_spi_span late[2];
+
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  /* Last block, its final 12 bytes not committed yet */
+  sdlogger_spi.tail = 0;
+  sdlogger_spi.head = SD_BLOCK_SIZE - 12;
+  sdlogger_spi.committed[0] = SD_BLOCK_SIZE - 12;
+  TEST_ASSERT_EQUAL(1, sdlogger_spi_direct_reserve(sdlogger_spi.device.periph, 12, late));
+  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
+  sdcard1.status = SDCard_MultiWriteIdle;
+  FakeSysTimeUsec = 1000;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  FakeSysTimeUsec += SDLOGGER_RESERVATION_TIMEOUT + 1;
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE - 12, sdlogger_spi.committed[0]);
+  TEST_ASSERT_EQUAL(1, sdlogger_spi.stale);
+  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+
+  sdcard_spi_block_submit_Expect(&sdcard1, sdlogger_spi.ring[0],
+                                 &sdlogger_spi_direct_multiwrite_written);
+
+  sdlogger_spi_direct_commit(sdlogger_spi.device.periph, late, 12);
+
+  TEST_ASSERT_EQUAL(SD_BLOCK_SIZE, sdlogger_spi.committed[0]);
+}
+
+void testWaitWhileReadyWithStoppingMultiWrite(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_StoppedLogging;
+  sdcard1.status = SDCard_Busy;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_StoppedLogging, sdlogger_spi.status);
+}
+
+/**
+ * @brief testReadyFinishingMultiWriteThenRequestIndexPage
+ * As soon as the entire log is successfully written after a stop command, the
+ * information on this new log needs to be put in the index. Therefore, the
+ * index is downloaded first.
+ */
+void testReadyFinishingMultiWriteThenRequestIndexPage(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_StoppedLogging;
+  sdcard1.status = SDCard_Idle;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_read_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_received);
+
+  /* Periodic loop */
+  sdlogger_spi_direct_periodic();
+
+  TEST_ASSERT_EQUAL(SDLogger_GettingIndexForUpdate, sdlogger_spi.status);
+}
+
+/**
+ * @brief callbackIndexReceivedWhileReadyForUpdatingIt
+ * @param sdcard
+ * @param addr
+ * @param callback
+ * @param cmock_num_calls
+ * Callback to test values in sdcard_spi call in the unittest below.
+ */
+void callbackIndexReceivedWhileReadyForUpdatingIt(struct SDCard* sdcard, uint32_t addr, SDCardCallback callback, int cmock_num_calls)
+{
+  (void) sdcard; (void) addr; (void) callback; (void) cmock_num_calls;
+
+  /* Check values in the output buffer */
+  /* Next_available_address incremented by 1024: */
+  TEST_ASSERT_EQUAL_HEX(0x12, sdcard1.output_buf[0+6]);
+  TEST_ASSERT_EQUAL_HEX(0x34, sdcard1.output_buf[1+6]);
+  TEST_ASSERT_EQUAL_HEX(0x5A, sdcard1.output_buf[2+6]);
+  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[3+6]);
+  TEST_ASSERT_EQUAL(2, sdcard1.output_buf[4+6]);
+
+  /* Start address and length written at dedicated location for log number 2 */
+  TEST_ASSERT_EQUAL_HEX(0x12, sdcard1.output_buf[17+6]);
+  TEST_ASSERT_EQUAL_HEX(0x34, sdcard1.output_buf[18+6]);
+  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[19+6]);
+  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[20+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[21+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[22+6]);
+  TEST_ASSERT_EQUAL_HEX(0x04, sdcard1.output_buf[23+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[24+6]);
+  /* A single card */
+  TEST_ASSERT_EQUAL(0, sdcard1.output_buf[25+6]);
+  TEST_ASSERT_EQUAL(0, sdcard1.output_buf[26+6]);
+}
+
+/**
+ * @brief testIndexReceivedWhileReadyForUpdatingIt
+ * Logging was finished, now the index is received. The input buffer is copied
+ * to the output buffer and appropriate values are updated.
+ */
+void testIndexReceivedWhileReadyForUpdatingIt(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdcard1.status = SDCard_Idle;
+  /* Previous data in the index: */
+  sdlogger_spi.next_available_address = 0x12345656;
+  sdlogger_spi.last_completed = 1;
+  sdcard1.input_buf[4] = 1;
+  sdlogger_spi.log_len = 1024;
+  for (uint16_t i = 5; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+
+  /* Expectations */
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
+  sdcard_spi_write_block_StubWithCallback(&callbackIndexReceivedWhileReadyForUpdatingIt);
+
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
+
+  /* Next address updated for next log */
+  TEST_ASSERT_EQUAL(0x12345A56, sdlogger_spi.next_available_address);
+  /* Log length reset */
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.log_len);
+  TEST_ASSERT_EQUAL(SDLogger_UpdatingIndex, sdlogger_spi.status);
+}
+
+/**
+ * @brief helperIndexEntry
+ * Put a log entry in the received index
+ */
+void helperIndexEntry(uint8_t id, uint32_t start, uint32_t length)
+{
+  helperAssignUint(&sdcard1.input_buf[5 + (id - 1) * 12], start);
+  helperAssignUint(&sdcard1.input_buf[5 + (id - 1) * 12 + 4], length);
+}
+
+/**
+ * @brief helperUint
+ * Read a value from the index that is written back
+ */
+uint32_t helperUint(uint8_t location[])
+{
+  return ((uint32_t)location[0] << 24) | ((uint32_t)location[1] << 16) |
+         ((uint32_t)location[2] << 8) | location[3];
+}
+
+/**
+ * @brief testIndexEntryRecordsStripe
+ * On a stripe the entry of the new log holds the number of cards and the
+ * card the index block is on, the start and length are logical blocks.
+ */
+void testIndexEntryRecordsStripe(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.card.nb_members = 3;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.last_completed = 0;
+  sdlogger_spi.log_len = 0x300;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+
+  /* Expectations */
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
+
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
+
+  uint8_t *entry = &sdcard1.output_buf[5 + 6];
+  uint32_t start, length;
+  uint8_t nb_cards, member;
+  sdlogger_stripe_index_parse(entry, &start, &length, &nb_cards, &member);
+  TEST_ASSERT_EQUAL(1, sdcard1.output_buf[4+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, start);
+  TEST_ASSERT_EQUAL(0x300, length);
+  TEST_ASSERT_EQUAL(3, entry[8]);
+  TEST_ASSERT_EQUAL(0x2000 % 3, entry[9]);
+  TEST_ASSERT_EQUAL(3, nb_cards);
+  TEST_ASSERT_EQUAL(0x2000 % 3, member);
+  /* No flags */
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[10]);
+}
+
+/**
+ * @brief testIndexUpdateWrapsAroundLogSpace
+ * If the remaining space after this log is too small for the next one, the
+ * next log starts at the beginning of the log space again.
+ */
+void testIndexUpdateWrapsAroundLogSpace(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - SDLOGGER_MIN_LOG_BLOCKS - 1000;
+  sdlogger_spi.log_len = 1001;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 5;
+
+  /* Expectations */
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
+
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00004000, sdlogger_spi.next_available_address);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, helperUint(&sdcard1.output_buf[0+6]));
+  /* The log itself is recorded where it was written */
+  TEST_ASSERT_EQUAL_HEX(0x00100000 - SDLOGGER_MIN_LOG_BLOCKS - 1000,
+                        helperUint(&sdcard1.output_buf[5 + 5 * 12 + 6]));
+  TEST_ASSERT_EQUAL(1001, helperUint(&sdcard1.output_buf[5 + 5 * 12 + 4 + 6]));
+}
+
+/**
+ * @brief testIndexCopyKeepsAllEntries
+ * The index is copied from input_buf to output_buf[6] before it is updated.
+ * With SDCARD_SHARED_BUFFER both are the same memory and the copy overlaps,
+ * so it has to be a memmove. Every entry must come out unchanged.
+ */
+void testIndexCopyKeepsAllEntries(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.next_available_address = 0x00010000;
+  sdlogger_spi.log_len = 1000;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 30;
+  for (uint8_t id = 1; id <= 30; id++) {
+    helperIndexEntry(id, 0x00004000 + id * 0x100, id * 7);
+  }
+
+  /* Expectations */
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
-  /* Periodic loop */
-  sdlogger_spi_direct_periodic();
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
 
-  /* Status unchanged */
-  TEST_ASSERT_EQUAL(SDLogger_LoggingFinalBlock, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(31, sdcard1.output_buf[4 + 6]);
+  for (uint8_t id = 1; id <= 30; id++) {
+    TEST_ASSERT_EQUAL_HEX(0x00004000 + id * 0x100, helperUint(&sdcard1.output_buf[5 + (id - 1) * 12 + 6]));
+    TEST_ASSERT_EQUAL(id * 7, helperUint(&sdcard1.output_buf[5 + (id - 1) * 12 + 4 + 6]));
+  }
+  /* The new log */
+  TEST_ASSERT_EQUAL_HEX(0x00010000, helperUint(&sdcard1.output_buf[5 + 30 * 12 + 6]));
+  TEST_ASSERT_EQUAL(1000, helperUint(&sdcard1.output_buf[5 + 30 * 12 + 4 + 6]));
 }
 
-void testLoggingFinalBlockWithFullBuffersCardAvailable(void)
+/**
+ * @brief testIndexUpdateJustFitsNextLog
+ * No wrap around as long as a log of SDLOGGER_MIN_LOG_BLOCKS still fits.
+ */
+void testIndexUpdateJustFitsNextLog(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
-  sdcard1.status = SDCard_MultiWriteIdle;
-  /* Still a lot of data in the buffers */
-  sdlogger_spi.idx = 20;
-  sdlogger_spi.sdcard_buf_idx = 513;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - SDLOGGER_MIN_LOG_BLOCKS - 1000;
+  sdlogger_spi.log_len = 1000;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
 
   /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_next_Expect(&sdcard1,
-                                    &sdlogger_spi_direct_multiwrite_written);
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
-  /* Periodic loop */
-  sdlogger_spi_direct_periodic();
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00100000 - SDLOGGER_MIN_LOG_BLOCKS, sdlogger_spi.next_available_address);
 }
 
 /**
- * @brief testLoggingFinalBlockWithHalfFullBufferCardAvailalble
- * If there is some data in the buffer and card is idle, then fill the rest
- * with trailing zero's and submit.
+ * @brief testLogNumbersCycleThroughIndex
+ * The index has room for SDLOGGER_INDEX_ENTRIES logs. After the last one,
+ * numbering starts at 1 again and the oldest entry is replaced. The entry of
+ * a log is always at the same place, so finding it stays a direct lookup.
  */
-void testLoggingFinalBlockWithHalfFullBufferCardAvailalble(void)
+void testLogNumbersCycleThroughIndex(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
-  sdcard1.status = SDCard_MultiWriteIdle;
-  /* Some data in buffer */
-  sdlogger_spi.idx = 0;
-  sdlogger_spi.sdcard_buf_idx = 30;
-  /* Until this value should not be overwritten with zero's */
-  sdcard1.output_buf[29] = 0xEE;
-  /* Set wrong values here, should be converted to trailing zero's */
-  sdcard1.output_buf[30] = 0xB0;
-  sdcard1.output_buf[31] = 0xAA;
-  sdcard1.output_buf[512] = 0xDD;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00080000;
+  sdlogger_spi.log_len = 0x400;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = SDLOGGER_INDEX_ENTRIES;
+  helperIndexEntry(1, 0x00004000, 0x800);
 
   /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_next_Expect(&sdcard1, &sdlogger_spi_direct_multiwrite_written);
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
-  /* Periodic loop */
-  sdlogger_spi_direct_periodic();
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
 
-  TEST_ASSERT_EQUAL_HEX(0xEE, sdcard1.output_buf[29]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[30]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[31]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[512]);
+  TEST_ASSERT_EQUAL(1, sdcard1.output_buf[4+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00080000, helperUint(&sdcard1.output_buf[5+6]));
+  TEST_ASSERT_EQUAL(0x400, helperUint(&sdcard1.output_buf[5+4+6]));
 }
 
 /**
- * @brief testLoggingFinalBlockBuffersEmpty
- * When all buffers are empty in the LogginFinalBlock state, it is time to call
- * the multiwrite_stop function.
+ * @brief testOverwrittenLogsRemovedFromIndex
+ * After a wrap around, the new log overwrites the oldest logs, entirely or in
+ * part. Their entries are cleared, so the index never points to data of
+ * another log. Logs that were not touched keep their entry.
  */
-void testLoggingFinalBlockBuffersEmpty(void)
+void testOverwrittenLogsRemovedFromIndex(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.sdcard_buf_idx = 1;
-  sdlogger_spi.idx = 0;
-  sdlogger_spi.status = SDLogger_LoggingFinalBlock;
-  sdcard1.status = SDCard_MultiWriteIdle;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  /* Only the space of the log itself, see testEraseAheadAfterIndexWrap() */
+  sdlogger_spi.erase_blocks = 0;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.log_len = 0x800;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 9;
+  helperIndexEntry(3, 0x00004000, 0x400);   /* Overwritten entirely */
+  helperIndexEntry(4, 0x00004400, 0x1000);  /* Beginning overwritten */
+  helperIndexEntry(5, 0x00004800, 0x100);   /* Just after the new log */
+  helperIndexEntry(9, 0x000F0000, 0x8000);  /* Previous log, at the end */
+  sdcard1.input_buf[5 + 2 * 12 + 8] = 0xAB; /* Reserved bytes of log 3 */
 
   /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_multiwrite_stop_Expect(&sdcard1);
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
-  /* Periodic loop */
-  sdlogger_spi_direct_periodic();
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
 
-  TEST_ASSERT_EQUAL(SDLogger_StoppedLogging, sdlogger_spi.status);
+  for (uint8_t i = 0; i < 12; i++) {
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 2 * 12 + i + 6]);
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 3 * 12 + i + 6]);
+  }
+  TEST_ASSERT_EQUAL_HEX(0x00004800, helperUint(&sdcard1.output_buf[5 + 4 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x100, helperUint(&sdcard1.output_buf[5 + 4 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x000F0000, helperUint(&sdcard1.output_buf[5 + 8 * 12 + 6]));
+  /* The new log is number 10 */
+  TEST_ASSERT_EQUAL(10, sdcard1.output_buf[4+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, helperUint(&sdcard1.output_buf[5 + 9 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x800, helperUint(&sdcard1.output_buf[5 + 9 * 12 + 4 + 6]));
 }
 
-void testWaitWhileReadyWithStoppingMultiWrite(void)
+/**
+ * @brief testWrappedLogSplitInIndex
+ * A log that wrapped is recorded as two entries, the part up to the end of
+ * the log space and the part from 0x4000 on, marked as continuation. Entries
+ * of the logs the second part overwrote are cleared.
+ */
+void testWrappedLogSplitInIndex(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_StoppedLogging;
-  sdcard1.status = SDCard_Busy;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  /* Only the space of the log itself, see testEraseAheadAfterIndexWrap() */
+  sdlogger_spi.erase_blocks = 0;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - 0x100;
+  sdlogger_spi.log_len = 0x100 + 0x500;
+  sdlogger_spi.wrap_len = 0x100;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 4;
+  helperIndexEntry(1, 0x00004000, 0x400);   /* Overwritten entirely */
+  helperIndexEntry(2, 0x00004400, 0x400);   /* Beginning overwritten */
+  helperIndexEntry(3, 0x00004800, 0x1000);  /* Not touched */
+  helperIndexEntry(4, 0x00080000, 0x1000);  /* Not touched */
 
   /* Expectations */
-  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
-  /* Periodic loop */
-  sdlogger_spi_direct_periodic();
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
 
-  TEST_ASSERT_EQUAL(SDLogger_StoppedLogging, sdlogger_spi.status);
+  for (uint8_t i = 0; i < 12; i++) {
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 0 * 12 + i + 6]);
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 1 * 12 + i + 6]);
+  }
+  TEST_ASSERT_EQUAL_HEX(0x00004800, helperUint(&sdcard1.output_buf[5 + 2 * 12 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x00080000, helperUint(&sdcard1.output_buf[5 + 3 * 12 + 6]));
+  /* Log 5 up to the end of the card */
+  TEST_ASSERT_EQUAL_HEX(0x00100000 - 0x100, helperUint(&sdcard1.output_buf[5 + 4 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x100, helperUint(&sdcard1.output_buf[5 + 4 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 4 * 12 + 10 + 6] & 0x02);
+  /* Log 6 continues it */
+  TEST_ASSERT_EQUAL(6, sdcard1.output_buf[4 + 6]);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, helperUint(&sdcard1.output_buf[5 + 5 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x500, helperUint(&sdcard1.output_buf[5 + 5 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x02, sdcard1.output_buf[5 + 5 * 12 + 10 + 6] & 0x02);
+  /* Next log after the second part */
+  TEST_ASSERT_EQUAL_HEX(0x00004500, sdlogger_spi.next_available_address);
 }
 
 /**
- * @brief testReadyFinishingMultiWriteThenRequestIndexPage
- * As soon as the entire log is successfully written after a stop command, the
- * information on this new log needs to be put in the index. Therefore, the
- * index is downloaded first.
+ * @brief testEraseAheadAfterIndexWrap
+ * An index update that wraps the next log to 0x4000 clears the entries of
+ * the logs that the erase-ahead is about to erase there, before the index is
+ * written. The erase-ahead that follows stops at the first log that is still
+ * listed.
  */
-void testReadyFinishingMultiWriteThenRequestIndexPage(void)
+void testEraseAheadAfterIndexWrap(void)
 {
   /* Preconditions */
   helperInitializeLogger();
-  sdlogger_spi.status = SDLogger_StoppedLogging;
-  sdcard1.status = SDCard_Idle;
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdlogger_spi.erase_blocks = 0x800;
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00100000 - SDLOGGER_MIN_LOG_BLOCKS - 1000;
+  sdlogger_spi.log_len = 1001;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  sdcard1.input_buf[4] = 3;
+  helperIndexEntry(1, 0x00004000, 0x400);   /* Erased entirely */
+  helperIndexEntry(2, 0x00004600, 0x400);   /* Reaches beyond the erase */
+  helperIndexEntry(3, 0x00004C00, 0x100);   /* Not touched */
 
   /* Expectations */
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
+
+  /* Index received callback */
+  sdlogger_spi_direct_index_received();
+
+  TEST_ASSERT_EQUAL_HEX(0x00004000, sdlogger_spi.next_available_address);
+  for (uint8_t i = 0; i < 12; i++) {
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 0 * 12 + i + 6]);
+    TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[5 + 1 * 12 + i + 6]);
+  }
+  TEST_ASSERT_EQUAL_HEX(0x00004C00, helperUint(&sdcard1.output_buf[5 + 2 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x100, helperUint(&sdcard1.output_buf[5 + 2 * 12 + 4 + 6]));
+  /* The log itself, number 4, at the end of the log space */
+  TEST_ASSERT_EQUAL(4, sdcard1.output_buf[4 + 6]);
+  TEST_ASSERT_EQUAL_HEX(0x00100000 - SDLOGGER_MIN_LOG_BLOCKS - 1000,
+                        helperUint(&sdcard1.output_buf[5 + 3 * 12 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x00004C00, sdlogger_spi.erase_end);
+
+  /* Index written, waiting for the switch */
+  sdlogger_spi.status = SDLogger_Ready;
+  sdcard1.status = SDCard_Idle;
+  radio_control.values[SDLOGGER_CONTROL_SWITCH] = -500;
   sdcard_spi_periodic_Expect(&sdcard1);
-  sdcard_spi_read_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_received);
+  sdcard_spi_erase_Expect(&sdcard1, 0x00004000, 0x00004000 + 0x800 - 1, NULL);
 
-  /* Periodic loop */
   sdlogger_spi_direct_periodic();
 
-  TEST_ASSERT_EQUAL(SDLogger_GettingIndexForUpdate, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(0x00004000, sdlogger_spi.erased_address);
 }
 
 /**
- * @brief callbackIndexReceivedWhileReadyForUpdatingIt
- * @param sdcard
- * @param addr
- * @param callback
- * @param cmock_num_calls
- * Callback to test values in sdcard_spi call in the unittest below.
+ * @brief testIndexReadAtStartLimitsEraseAhead
+ * The index read after initialization is not written back, so nothing is
+ * cleared. The erase-ahead stops where the first log after the next
+ * available address begins.
  */
-void callbackIndexReceivedWhileReadyForUpdatingIt(struct SDCard* sdcard, uint32_t addr, int cmock_num_calls)
+void testIndexReadAtStartLimitsEraseAhead(void)
 {
-  (void) sdcard; (void) addr; (void) cmock_num_calls;
+  /* Preconditions */
+  sdlogger_spi.status = SDLogger_RetreivingIndex;
+  sdcard1.nb_blocks = 0x00100000;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    sdcard1.input_buf[i] = 0x00;
+  }
+  helperAssignUint(&sdcard1.input_buf[0], 0x00010000);
+  sdcard1.input_buf[4] = 2;
+  helperIndexEntry(1, 0x00004000, 0xC000);  /* Before the next log */
+  helperIndexEntry(2, 0x00010400, 0x100);   /* Oldest log, after a wrap */
 
-  /* Check values in the output buffer */
-  /* Next_available_address incremented by 1024: */
-  TEST_ASSERT_EQUAL_HEX(0x12, sdcard1.output_buf[0+6]);
-  TEST_ASSERT_EQUAL_HEX(0x34, sdcard1.output_buf[1+6]);
-  TEST_ASSERT_EQUAL_HEX(0x5A, sdcard1.output_buf[2+6]);
-  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[3+6]);
-  TEST_ASSERT_EQUAL(2, sdcard1.output_buf[4+6]);
+  sdlogger_spi_direct_index_received();
 
-  /* Start address and length written at dedicated location for log number 2 */
-  TEST_ASSERT_EQUAL_HEX(0x12, sdcard1.output_buf[17+6]);
-  TEST_ASSERT_EQUAL_HEX(0x34, sdcard1.output_buf[18+6]);
-  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[19+6]);
-  TEST_ASSERT_EQUAL_HEX(0x56, sdcard1.output_buf[20+6]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[21+6]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[22+6]);
-  TEST_ASSERT_EQUAL_HEX(0x04, sdcard1.output_buf[23+6]);
-  TEST_ASSERT_EQUAL_HEX(0x00, sdcard1.output_buf[24+6]);
+  TEST_ASSERT_EQUAL_HEX(0x00010000, sdlogger_spi.next_available_address);
+  TEST_ASSERT_EQUAL_HEX(0x00010400, sdlogger_spi.erase_end);
+  TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
 }
 
+#ifdef SDLOGGER_COMPRESS
 /**
- * @brief testIndexReceivedWhileReadyForUpdatingIt
- * Logging was finished, now the index is received. The input buffer is copied
- * to the output buffer and appropriate values are updated.
+ * @brief testIndexMarksCompressedLog
+ * Bit 0 of byte 10 of the index entry tells the download tools to decompress
+ * the log.
  */
-void testIndexReceivedWhileReadyForUpdatingIt(void)
+void testIndexMarksCompressedLog(void)
 {
   /* Preconditions */
-  helperInitializeLogger();
+  helperStartCompressedLog();
   sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
-  sdcard1.status = SDCard_Idle;
-  /* Previous data in the index: */
-  sdlogger_spi.next_available_address = 0x12345656;
-  sdlogger_spi.last_completed = 1;
-  sdcard1.input_buf[4] = 1;
-  sdlogger_spi.log_len = 1024;
-  for (uint16_t i = 5; i < SD_BLOCK_SIZE; i++) {
+  sdlogger_spi.log_space_end = 0x00100000;
+  sdlogger_spi.next_available_address = 0x00004000;
+  sdlogger_spi.log_len = 0x40;
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
     sdcard1.input_buf[i] = 0x00;
   }
+  sdcard1.input_buf[4] = 1;
 
   /* Expectations */
-  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000);
-  sdcard_spi_write_block_StubWithCallback(&callbackIndexReceivedWhileReadyForUpdatingIt);
+  sdcard_spi_write_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_written);
 
   /* Index received callback */
   sdlogger_spi_direct_index_received();
 
-  /* Next address updated for next log */
-  TEST_ASSERT_EQUAL(0x12345A56, sdlogger_spi.next_available_address);
-  /* Log length reset */
-  TEST_ASSERT_EQUAL(0, sdlogger_spi.log_len);
-  TEST_ASSERT_EQUAL(SDLogger_UpdatingIndex, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL_HEX(0x00004000, helperUint(&sdcard1.output_buf[5 + 1 * 12 + 6]));
+  TEST_ASSERT_EQUAL(0x40, helperUint(&sdcard1.output_buf[5 + 1 * 12 + 4 + 6]));
+  TEST_ASSERT_EQUAL_HEX(0x01, sdcard1.output_buf[5 + 1 * 12 + 10 + 6]);
 }
+#endif
 
 void testKeepUpdatingIndex(void)
 {
@@ -994,6 +3491,68 @@ void testReadyUpdatingIndex(void)
 #endif
 }
 
+/**
+ * @brief testMultiWriteStoppedRequestsIndexImmediately
+ * The multiwrite_stop completion callback requests the index right away from
+ * the spi callback, instead of waiting for the periodic loop to see the card
+ * is idle.
+ */
+void testMultiWriteStoppedRequestsIndexImmediately(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_StoppedLogging;
+  sdcard1.status = SDCard_Idle;
+
+  /* Expectations */
+  sdcard_spi_read_block_Expect(&sdcard1, 0x00002000, &sdlogger_spi_direct_index_received);
+
+  /* Completion callback */
+  sdlogger_spi_direct_multiwrite_stopped();
+
+  TEST_ASSERT_EQUAL(SDLogger_GettingIndexForUpdate, sdlogger_spi.status);
+}
+
+/**
+ * @brief testMultiWriteStoppedIgnoredInOtherState
+ * Nothing to do if the logger already moved on.
+ */
+void testMultiWriteStoppedIgnoredInOtherState(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_GettingIndexForUpdate;
+  sdcard1.status = SDCard_Idle;
+
+  /* Completion callback, expect no sdcard calls */
+  sdlogger_spi_direct_multiwrite_stopped();
+
+  TEST_ASSERT_EQUAL(SDLogger_GettingIndexForUpdate, sdlogger_spi.status);
+}
+
+/**
+ * @brief testIndexWrittenBackToReady
+ * The write_block completion callback of the index finishes the log.
+ */
+void testIndexWrittenBackToReady(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_UpdatingIndex;
+  sdcard1.status = SDCard_Idle;
+#ifdef LOGGER_LED
+  LED_SET(LOGGER_LED, TRUE);
+#endif
+
+  /* Completion callback */
+  sdlogger_spi_direct_index_written();
+
+  TEST_ASSERT_EQUAL(SDLogger_Ready, sdlogger_spi.status);
+#ifdef LOGGER_LED
+  TEST_ASSERT_FALSE(LED_STATUS(LOGGER_LED));
+#endif
+}
+
 /**
  * @brief testCommandAlwaysResetToZero
  * Whenever the setting function is called, always reset the command value
@@ -1283,3 +3842,188 @@ void testPeriodicLoopDownloadingLastDataWritten(void)
 #endif
 
 }
+
+/**
+ * @brief helperCheckLatencyMessage
+ * Checks the SDCARD_LATENCY message sent in testSendLatencyTelemetry.
+ */
+void helperCheckLatencyMessage(struct transport_tx *trans, struct link_device *dev, uint8_t ac_id,
+                               uint32_t *_count, uint32_t *_max, uint32_t *_p99, uint16_t *_busy_polls,
+                               uint16_t *_queue_blocks, uint16_t *_queue_max, uint32_t *_dropped,
+                               uint8_t nb_hist, uint32_t *_hist, int cmock_num_calls)
+{
+  (void) ac_id; (void) cmock_num_calls;
+  TEST_ASSERT_EQUAL_PTR(&pprz_tp.trans_tx, trans);
+  TEST_ASSERT_EQUAL_PTR(&uart1.device, dev);
+  TEST_ASSERT_EQUAL(100, *_count);
+  TEST_ASSERT_EQUAL(1500, *_max);
+  TEST_ASSERT_EQUAL(1200, *_p99);
+  TEST_ASSERT_EQUAL(21, *_busy_polls);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, *_queue_blocks);
+  TEST_ASSERT_EQUAL(5, *_queue_max);
+  TEST_ASSERT_EQUAL(17, *_dropped);
+  TEST_ASSERT_EQUAL(SDCARD_LATENCY_BINS, nb_hist);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.latency_hist[0], _hist);
+}
+
+/**
+ * @brief testSendLatencyTelemetry
+ * Periodic telemetry callback with the block write latency histogram of the
+ * SD Card, its maximum and the 99th percentile. The size and use of the ring
+ * go along, to compare the stalls with the headroom.
+ */
+void testSendLatencyTelemetry(void)
+{
+  /* Preconditions */
+  sdcard1.latency_count = 100;
+  sdcard1.latency_max = 1500;
+  sdcard1.busy_polls_max = 21;
+  sdlogger_spi.queue_max = 5;
+  sdlogger_spi.dropped = 17;
+
+  /* Expectations */
+  sdcard_spi_latency_percentile_ExpectAndReturn(&sdcard1, 99, 1200);
+  testable_pprz_msg_send_SDCARD_LATENCY_StubWithCallback(helperCheckLatencyMessage);
+
+  /* Telemetry callback */
+  sdlogger_spi_direct_send_latency(&pprz_tp.trans_tx, &uart1.device);
+}
+
+/**
+ * @brief helperCheckLatencyMessageOtherDevice
+ * Checks the SDCARD_LATENCY message sent in
+ * testSendLatencyTelemetryOnOtherDevice.
+ */
+void helperCheckLatencyMessageOtherDevice(struct transport_tx *trans, struct link_device *dev, uint8_t ac_id,
+                                          uint32_t *_count, uint32_t *_max, uint32_t *_p99, uint16_t *_busy_polls,
+                                          uint16_t *_queue_blocks, uint16_t *_queue_max, uint32_t *_dropped,
+                                          uint8_t nb_hist, uint32_t *_hist, int cmock_num_calls)
+{
+  (void) ac_id; (void) _hist; (void) cmock_num_calls;
+  TEST_ASSERT_EQUAL_PTR(&pprz_tp.trans_tx, trans);
+  TEST_ASSERT_EQUAL_PTR(&uart1.device, dev);
+  TEST_ASSERT_EQUAL(0, *_count);
+  TEST_ASSERT_EQUAL(0, *_max);
+  TEST_ASSERT_EQUAL(0, *_p99);
+  TEST_ASSERT_EQUAL(0, *_busy_polls);
+  TEST_ASSERT_EQUAL(SDLOGGER_RING_BLOCKS, *_queue_blocks);
+  TEST_ASSERT_EQUAL(5, *_queue_max);
+  TEST_ASSERT_EQUAL(17, *_dropped);
+  TEST_ASSERT_EQUAL(0, nb_hist);
+}
+
+/**
+ * @brief testSendLatencyTelemetryOnOtherDevice
+ * The latencies of sdcard1 say nothing about another device, so they are not
+ * sent when the logger runs on one. The use of the ring still is.
+ */
+void testSendLatencyTelemetryOnOtherDevice(void)
+{
+  /* Preconditions */
+  struct BlockDevice other;
+  helperCardDevice(&other, &sdcard2, 0);
+  sdlogger_spi.bd = &other;
+  sdcard1.latency_count = 100;
+  sdcard1.latency_max = 1500;
+  sdcard1.busy_polls_max = 21;
+  sdlogger_spi.queue_max = 5;
+  sdlogger_spi.dropped = 17;
+
+  /* Expectations, no sdcard_spi_latency_percentile */
+  testable_pprz_msg_send_SDCARD_LATENCY_StubWithCallback(helperCheckLatencyMessageOtherDevice);
+
+  /* Telemetry callback */
+  sdlogger_spi_direct_send_latency(&pprz_tp.trans_tx, &uart1.device);
+}
+
+/**
+ * @brief testCommandResetsLatencyHistograms
+ * SDLOGGER_COMMAND_RESET_LATENCY clears the latency histograms, also while logging. The
+ * queue statistics are cleared with them.
+ */
+void testCommandResetsLatencyHistograms(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sdlogger_spi.status = SDLogger_Logging;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdlogger_spi.command = SDLOGGER_COMMAND_RESET_LATENCY;
+  sdlogger_spi.queue_max = 5;
+  sdlogger_spi.dropped = 17;
+
+  /* Expectations */
+  sdcard_spi_latency_reset_Expect(&sdcard1);
+
+  /* Command call */
+  sdlogger_spi_direct_command();
+
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.command);
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.queue_max);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+}
+
+/**
+ * @brief testCommandResetsQueueStatisticsOnOtherDevice
+ * On another device the reset command leaves the histograms of sdcard1 alone
+ * and only clears the queue statistics.
+ */
+void testCommandResetsQueueStatisticsOnOtherDevice(void)
+{
+  /* Preconditions */
+  struct BlockDevice other;
+  helperInitializeLogger();
+  helperCardDevice(&other, &sdcard2, 0);
+  sdlogger_spi.bd = &other;
+  sdlogger_spi.status = SDLogger_Logging;
+  sdcard2.status = SDCard_MultiWriteBusy;
+  sdlogger_spi.command = SDLOGGER_COMMAND_RESET_LATENCY;
+  sdlogger_spi.queue_max = 5;
+  sdlogger_spi.dropped = 17;
+
+  /* Expectations, no sdcard_spi_latency_reset */
+
+  /* Command call */
+  sdlogger_spi_direct_command();
+
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.command);
+  TEST_ASSERT_EQUAL(SDLogger_Logging, sdlogger_spi.status);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.queue_max);
+  TEST_ASSERT_EQUAL(0, sdlogger_spi.dropped);
+}
+
+#ifdef SDCARD_TRACE
+/**
+ * @brief testTraceLoggerStatusTransition
+ * Logger transitions go in the same trace as the SD Card transitions, so the
+ * decoder can put them on one timeline. The bytes field holds the fill level
+ * of the current block.
+ */
+void testTraceLoggerStatusTransition(void)
+{
+  /* Preconditions */
+  helperInitializeLogger();
+  sd_trace_init();
+  sdlogger_spi.status = SDLogger_Initializing;
+  sdcard1.status = SDCard_Idle;
+  FakeSysTimeUsec = 777;
+
+  /* Expectations */
+  sdcard_spi_periodic_Expect(&sdcard1);
+  sdcard_spi_read_csd_Expect(&sdcard1, NULL);
+  sdcard_spi_read_block_Expect(&sdcard1,
+                               0x00002000,
+                               &sdlogger_spi_direct_index_received);
+
+  /* Function call */
+  sdlogger_spi_direct_periodic();
+
+  /* Transition recorded */
+  TEST_ASSERT_EQUAL(1, sd_trace_length());
+  TEST_ASSERT_EQUAL(777, sd_trace_get(0)->timestamp);
+  TEST_ASSERT_EQUAL(SDTraceSource_Logger, sd_trace_get(0)->source);
+  TEST_ASSERT_EQUAL(SDLogger_Initializing, sd_trace_get(0)->old_state);
+  TEST_ASSERT_EQUAL(SDLogger_RetreivingIndex, sd_trace_get(0)->new_state);
+  TEST_ASSERT_EQUAL(1, sd_trace_get(0)->bytes);
+}
+#endif
@@ -0,0 +1,775 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/modules/loggers/sdlogger_stripe_tester.c
+ *  @brief Striping of log blocks over several SD cards.
+ *
+ * Consecutive blocks go round-robin to the cards. There is one layout,
+ * striped from block 0: logical block a is on card a % nb_cards, at block
+ * address a / nb_cards of that card. Addresses given to the stripe are
+ * logical ones, sdlogger_stripe_locate() maps them to a card. Every card runs
+ * its own multiwrite, so with the cards on separate SPI peripherals the busy
+ * times overlap. The cards are struct BlockDevice, see
+ * peripherals/block_device.h, so any device can be a member.
+ *
+ * The stripe is a block device itself, sdlogger_stripe_block_device_init().
+ * This is how the logger writes to it: it runs on a struct BlockDevice and
+ * does not know whether that is one card or several. nb_members of the
+ * device is the number of cards, it is 0 on a single card.
+ * sdlogger_stripe_start() and sdlogger_stripe_read() give the same layout as
+ * the multiwrite and reads of the device. The block buffers of the device
+ * (block_acquire) are those of the card in turn.
+ *
+ * The index entry of a log (12 bytes, see sdlogger_spi_direct_tester.c) holds
+ * the start address and the length in logical blocks. The logger fills it
+ * with sdlogger_stripe_index_entry(): byte 8 holds nb_members of its device,
+ * byte 9 the card the index block is on. Entries of older logs and of logs
+ * on a single card have 0 there, which means a single card.
+ *
+ * The tests run the real driver against simulated cards, see sdcard_sim.h.
+ */
+
+#include "unity.h"
+#include "loggers/sdlogger_stripe.h"
+#include "peripherals/sdcard_spi.h"
+#include "peripherals/sdcard_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_CARDS 3
+
+/* Logical blocks written in the tests, a multiple of NB_CARDS */
+#define STRIPE_BLOCKS 48
+
+/* Frequency at which sdlogger_stripe_periodic is called */
+#define STRIPE_PERIODIC_FREQ 512
+
+/* Logical block the log starts at, block 0x100 of every card */
+#define STRIPE_START_BLOCK (0x100 * NB_CARDS)
+
+/* Declared in spi.c during normal operation */
+struct spi_periph spi1;
+struct spi_periph spi2;
+struct spi_periph spi3;
+
+/* One card on each spi peripheral */
+struct SDCard Cards[NB_CARDS];
+struct BlockDevice Devices[NB_CARDS];
+struct BlockDevice *DevicePtrs[NB_CARDS];
+struct SDCardSim Sims[NB_CARDS];
+uint8_t *Storage[NB_CARDS];
+uint32_t StorageBlocks;
+
+struct sdlogger_stripe stripe;
+struct BlockDevice StripeDevice;
+
+/* Caller buffer for block_device_multiwrite_next_buf() */
+uint8_t StripeBuf[BLOCK_DEVICE_BUF_SIZE];
+
+/* Time of the next call to sdlogger_stripe_periodic */
+uint64_t NextTickNs;
+
+/* Set by helper_ReadCallback() */
+bool_t ReadCallbackWasCalled;
+
+/**
+ * @brief Called before each test by the unity framework
+ */
+void setUp(void)
+{
+  struct spi_periph *periphs[NB_CARDS] = { &spi1, &spi2, &spi3 };
+
+  sdcard_sim_reset();
+  NextTickNs = 0;
+  ReadCallbackWasCalled = FALSE;
+  memset(&stripe, 0, sizeof(stripe));
+
+  /* Large enough for the log on a single card */
+  StorageBlocks = STRIPE_START_BLOCK + STRIPE_BLOCKS + 1;
+  for (uint8_t i = 0; i < NB_CARDS; i++) {
+    Storage[i] = calloc(StorageBlocks, SDCARD_SIM_BLOCK_SIZE);
+    sdcard_sim_init(&Sims[i], periphs[i], SPI_SLAVE3, Storage[i], StorageBlocks);
+    Sims[i].ncr = 2;
+    Sims[i].setup_ns = 2000;
+    Sims[i].busy_model = SDCardSimBusy_Fixed;
+    Sims[i].busy_min_ns = 1000000;
+    sdcard_spi_init(&Cards[i], periphs[i], SPI_SLAVE3);
+    sdcard_spi_block_device_init(&Devices[i], &Cards[i]);
+    DevicePtrs[i] = &Devices[i];
+  }
+}
+
+/**
+ * @brief Called after each test by the unity framework
+ */
+void tearDown(void)
+{
+  for (uint8_t i = 0; i < NB_CARDS; i++) {
+    free(Storage[i]);
+    Storage[i] = NULL;
+  }
+}
+
+/**
+ * @brief Advance simulated time to the next periodic call, then call it
+ */
+void helper_Tick(void)
+{
+  NextTickNs += 1000000000ULL / STRIPE_PERIODIC_FREQ;
+  sdcard_sim_run_until(NextTickNs);
+  sdlogger_stripe_periodic(&stripe);
+}
+
+/**
+ * @brief Tick until all cards of the stripe have the expected status
+ */
+void helper_TickUntilAll(enum SDCardStatus status, uint32_t max_ticks)
+{
+  for (uint32_t t = 0; t < max_ticks; t++) {
+    bool_t all = TRUE;
+    for (uint8_t i = 0; i < stripe.nb_cards; i++) {
+      all = all && (Cards[i].status == status);
+    }
+    if (all) {
+      return;
+    }
+    helper_Tick();
+  }
+  for (uint8_t i = 0; i < stripe.nb_cards; i++) {
+    TEST_ASSERT_EQUAL(status, Cards[i].status);
+  }
+}
+
+void helper_InitStripe(uint8_t nb_cards)
+{
+  sdlogger_stripe_init(&stripe, DevicePtrs, nb_cards);
+  helper_TickUntilAll(SDCard_Idle, 1000);
+}
+
+uint8_t helper_Pattern(uint32_t block, uint16_t i)
+{
+  return (uint8_t)((block * 31) ^ (block >> 8) ^ i);
+}
+
+/**
+ * @brief Data of logical block addr in the storage of its card
+ */
+uint8_t *helper_StripeData(uint32_t addr)
+{
+  uint8_t card;
+  uint32_t card_addr;
+
+  sdlogger_stripe_locate(stripe.nb_cards, 0, addr, &card, &card_addr);
+  return &Storage[card][card_addr * SDCARD_SIM_BLOCK_SIZE];
+}
+
+/**
+ * @brief Write blocks 0..nb-1 of a log at STRIPE_START_BLOCK as fast as the
+ * cards accept them
+ * @return Simulated time it took
+ */
+uint64_t helper_WriteStripe(uint32_t nb)
+{
+  sdlogger_stripe_start(&stripe, STRIPE_START_BLOCK);
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  for (uint32_t ticks = 0; stripe.blocks < nb; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 100 * nb, "Stripe stalled.");
+    while (stripe.blocks < nb && sdlogger_stripe_ready(&stripe)) {
+      uint8_t *block = sdlogger_stripe_block(&stripe);
+      for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+        block[i] = helper_Pattern(stripe.blocks, i);
+      }
+      TEST_ASSERT_TRUE(sdlogger_stripe_write(&stripe));
+    }
+    helper_Tick();
+  }
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+  uint64_t elapsed_ns = sdcard_sim_time_ns() - start_ns;
+
+  sdlogger_stripe_stop(&stripe);
+  helper_TickUntilAll(SDCard_Idle, 100);
+  return elapsed_ns;
+}
+
+void helper_ReadCallback(void)
+{
+  ReadCallbackWasCalled = TRUE;
+}
+
+/**
+ * @brief test_InitializeStripe
+ * The stripe keeps the cards in order. The cards are initialized with their
+ * own spi peripheral beforehand, see setUp().
+ */
+void test_InitializeStripe(void)
+{
+  sdlogger_stripe_init(&stripe, DevicePtrs, NB_CARDS);
+
+  TEST_ASSERT_EQUAL(NB_CARDS, stripe.nb_cards);
+  for (uint8_t i = 0; i < NB_CARDS; i++) {
+    TEST_ASSERT_EQUAL_PTR(&Devices[i], stripe.devices[i]);
+  }
+  TEST_ASSERT_EQUAL(0, stripe.blocks);
+  TEST_ASSERT_EQUAL(0, stripe.next_card);
+
+  helper_TickUntilAll(SDCard_Idle, 1000);
+}
+
+/**
+ * @brief test_InitializeLimitsNumberOfCards
+ * More cards than SDLOGGER_STRIPE_MAX_CARDS are ignored, zero is one card.
+ */
+void test_InitializeLimitsNumberOfCards(void)
+{
+  struct BlockDevice *many[SDLOGGER_STRIPE_MAX_CARDS + 1];
+  for (uint8_t i = 0; i < SDLOGGER_STRIPE_MAX_CARDS + 1; i++) {
+    many[i] = &Devices[0];
+  }
+
+  sdlogger_stripe_init(&stripe, many, SDLOGGER_STRIPE_MAX_CARDS + 1);
+  TEST_ASSERT_EQUAL(SDLOGGER_STRIPE_MAX_CARDS, stripe.nb_cards);
+
+  sdlogger_stripe_init(&stripe, DevicePtrs, 0);
+  TEST_ASSERT_EQUAL(1, stripe.nb_cards);
+}
+
+/**
+ * @brief test_LocateRoundRobin
+ * Block n of a log starting at logical block start is logical block
+ * start + n. Consecutive blocks are on consecutive cards, the address on the
+ * card advances once every nb_cards blocks.
+ */
+void test_LocateRoundRobin(void)
+{
+  uint8_t card;
+  uint32_t addr;
+
+  sdlogger_stripe_locate(3, 0x3000, 0, &card, &addr);
+  TEST_ASSERT_EQUAL(0, card);
+  TEST_ASSERT_EQUAL_HEX(0x1000, addr);
+
+  sdlogger_stripe_locate(3, 0x3000, 2, &card, &addr);
+  TEST_ASSERT_EQUAL(2, card);
+  TEST_ASSERT_EQUAL_HEX(0x1000, addr);
+
+  sdlogger_stripe_locate(3, 0x3000, 3, &card, &addr);
+  TEST_ASSERT_EQUAL(0, card);
+  TEST_ASSERT_EQUAL_HEX(0x1001, addr);
+
+  sdlogger_stripe_locate(3, 0x3000, 3001, &card, &addr);
+  TEST_ASSERT_EQUAL(1, card);
+  TEST_ASSERT_EQUAL_HEX(0x1000 + 1000, addr);
+
+  /* A log does not have to start on the first card */
+  sdlogger_stripe_locate(3, 0x3001, 0, &card, &addr);
+  TEST_ASSERT_EQUAL(1, card);
+  TEST_ASSERT_EQUAL_HEX(0x1000, addr);
+
+  sdlogger_stripe_locate(3, 0x3001, 2, &card, &addr);
+  TEST_ASSERT_EQUAL(0, card);
+  TEST_ASSERT_EQUAL_HEX(0x1001, addr);
+
+  /* A single card is the plain layout */
+  sdlogger_stripe_locate(1, 0x4000, 7, &card, &addr);
+  TEST_ASSERT_EQUAL(0, card);
+  TEST_ASSERT_EQUAL_HEX(0x4007, addr);
+}
+
+/**
+ * @brief test_IndexEntryRecordsLayout
+ * Address and length keep the layout of the existing index, the stripe is
+ * stored in the bytes that were unused so far.
+ */
+void test_IndexEntryRecordsLayout(void)
+{
+  uint8_t entry[12];
+  memset(entry, 0xAA, sizeof(entry));
+
+  sdlogger_stripe_index_entry(entry, 0x12345656, 1024, 3, 2);
+
+  TEST_ASSERT_EQUAL_HEX(0x12, entry[0]);
+  TEST_ASSERT_EQUAL_HEX(0x34, entry[1]);
+  TEST_ASSERT_EQUAL_HEX(0x56, entry[2]);
+  TEST_ASSERT_EQUAL_HEX(0x56, entry[3]);
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[4]);
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[5]);
+  TEST_ASSERT_EQUAL_HEX(0x04, entry[6]);
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[7]);
+  TEST_ASSERT_EQUAL(3, entry[8]);
+  TEST_ASSERT_EQUAL(2, entry[9]);
+  /* Flags, set by the logger afterwards */
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[10]);
+  TEST_ASSERT_EQUAL_HEX(0x00, entry[11]);
+
+  uint32_t start, length;
+  uint8_t nb_cards, member;
+  sdlogger_stripe_index_parse(entry, &start, &length, &nb_cards, &member);
+  TEST_ASSERT_EQUAL_HEX(0x12345656, start);
+  TEST_ASSERT_EQUAL(1024, length);
+  TEST_ASSERT_EQUAL(3, nb_cards);
+  TEST_ASSERT_EQUAL(2, member);
+}
+
+/**
+ * @brief test_IndexEntryOfOldLogIsSingleCard
+ * Logs written before striping have zeros in the stripe bytes.
+ */
+void test_IndexEntryOfOldLogIsSingleCard(void)
+{
+  uint8_t entry[12] = { 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x10, 0, 0, 0, 0 };
+  uint32_t start, length;
+  uint8_t nb_cards, member;
+
+  sdlogger_stripe_index_parse(entry, &start, &length, &nb_cards, &member);
+
+  TEST_ASSERT_EQUAL_HEX(0x4000, start);
+  TEST_ASSERT_EQUAL(16, length);
+  TEST_ASSERT_EQUAL(1, nb_cards);
+  TEST_ASSERT_EQUAL(0, member);
+}
+
+/**
+ * @brief test_StartMultiWriteOnAllCards
+ * Every card starts a multiwrite at its first block of the log, the first
+ * block of the log goes to the card that holds the start address.
+ */
+void test_StartMultiWriteOnAllCards(void)
+{
+  helper_InitStripe(NB_CARDS);
+
+  sdlogger_stripe_start(&stripe, STRIPE_START_BLOCK);
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+
+  TEST_ASSERT_EQUAL_HEX(STRIPE_START_BLOCK, stripe.start_address);
+  TEST_ASSERT_EQUAL(0, stripe.blocks);
+  TEST_ASSERT_EQUAL(0, stripe.next_card);
+  TEST_ASSERT_TRUE(sdlogger_stripe_ready(&stripe));
+  TEST_ASSERT_EQUAL_PTR(Devices[0].multiwrite_buf, sdlogger_stripe_block(&stripe));
+}
+
+/**
+ * @brief test_StartBetweenCards
+ * A log starting in the middle of a stripe begins on the card that holds
+ * its start address, the cards before it start one block further.
+ */
+void test_StartBetweenCards(void)
+{
+  helper_InitStripe(NB_CARDS);
+
+  sdlogger_stripe_start(&stripe, STRIPE_START_BLOCK + 1);
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+
+  TEST_ASSERT_EQUAL_HEX(STRIPE_START_BLOCK + 1, stripe.start_address);
+  TEST_ASSERT_EQUAL(1, stripe.next_card);
+  TEST_ASSERT_EQUAL_PTR(Devices[1].multiwrite_buf, sdlogger_stripe_block(&stripe));
+
+  for (uint32_t b = STRIPE_START_BLOCK + 1; b < STRIPE_START_BLOCK + 1 + NB_CARDS; b++) {
+    uint8_t *block = sdlogger_stripe_block(&stripe);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      block[i] = helper_Pattern(b, i);
+    }
+    TEST_ASSERT_TRUE(sdlogger_stripe_write(&stripe));
+    helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+  }
+  sdlogger_stripe_stop(&stripe);
+  helper_TickUntilAll(SDCard_Idle, 100);
+
+  /* Card 0 got the third block, one block after those of cards 1 and 2 */
+  for (uint32_t b = STRIPE_START_BLOCK + 1; b < STRIPE_START_BLOCK + 1 + NB_CARDS; b++) {
+    uint8_t *data = helper_StripeData(b);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), data[i]);
+    }
+  }
+  TEST_ASSERT_EQUAL_PTR(&Storage[0][0x101 * SDCARD_SIM_BLOCK_SIZE], helper_StripeData(STRIPE_START_BLOCK + 3));
+  for (uint8_t c = 0; c < NB_CARDS; c++) {
+    TEST_ASSERT_EQUAL(1, Sims[c].blocks_written);
+  }
+}
+
+/**
+ * @brief test_WriteRoundRobinAcrossCards
+ * Each card holds every nb_cards-th block of the log, contiguously.
+ */
+void test_WriteRoundRobinAcrossCards(void)
+{
+  helper_InitStripe(NB_CARDS);
+
+  helper_WriteStripe(STRIPE_BLOCKS);
+
+  TEST_ASSERT_EQUAL(STRIPE_BLOCKS, stripe.blocks);
+  for (uint8_t c = 0; c < NB_CARDS; c++) {
+    TEST_ASSERT_EQUAL(STRIPE_BLOCKS / NB_CARDS, Sims[c].blocks_written);
+    TEST_ASSERT_EQUAL(0, Sims[c].blocks_rejected);
+  }
+  for (uint32_t b = 0; b < STRIPE_BLOCKS; b++) {
+    /* Block b % NB_CARDS of the stripe at 0x100 + b / NB_CARDS */
+    uint8_t *data = helper_StripeData(STRIPE_START_BLOCK + b);
+    TEST_ASSERT_EQUAL_PTR(&Storage[b % NB_CARDS][(0x100 + b / NB_CARDS) * SDCARD_SIM_BLOCK_SIZE], data);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), data[i]);
+    }
+  }
+}
+
+/**
+ * @brief test_WriteWaitsForNextCard
+ * Blocks are never reordered. If the next card in turn is still busy, the
+ * block is not written even when another card is ready.
+ */
+void test_WriteWaitsForNextCard(void)
+{
+  helper_InitStripe(NB_CARDS);
+  sdlogger_stripe_start(&stripe, STRIPE_START_BLOCK);
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+
+  /* Block 0 to card 0 */
+  TEST_ASSERT_TRUE(sdlogger_stripe_write(&stripe));
+  TEST_ASSERT_EQUAL(1, stripe.next_card);
+
+  /* Card 1 busy, card 0 ready again */
+  Cards[0].status = SDCard_MultiWriteIdle;
+  Cards[1].status = SDCard_MultiWriteBusy;
+
+  TEST_ASSERT_FALSE(sdlogger_stripe_ready(&stripe));
+  TEST_ASSERT_FALSE(sdlogger_stripe_write(&stripe));
+  TEST_ASSERT_EQUAL(1, stripe.next_card);
+  TEST_ASSERT_EQUAL(1, stripe.blocks);
+}
+
+/**
+ * @brief test_DownloadReassemblesStream
+ * Reading logical blocks in order gives back the original stream.
+ */
+void test_DownloadReassemblesStream(void)
+{
+  helper_InitStripe(NB_CARDS);
+  helper_WriteStripe(STRIPE_BLOCKS);
+
+  for (uint32_t b = 0; b < STRIPE_BLOCKS; b++) {
+    ReadCallbackWasCalled = FALSE;
+    struct BlockDevice *bd = sdlogger_stripe_read(&stripe, STRIPE_START_BLOCK, b, &helper_ReadCallback);
+    TEST_ASSERT_EQUAL_PTR(&Devices[(STRIPE_START_BLOCK + b) % NB_CARDS], bd);
+    helper_TickUntilAll(SDCard_Idle, 100);
+    TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), bd->read_buf[i]);
+    }
+  }
+}
+
+/**
+ * @brief test_StripedThroughput
+ * With the cards on separate spi peripherals, the busy times overlap and the
+ * stripe writes faster than a single card.
+ */
+void test_StripedThroughput(void)
+{
+  helper_InitStripe(1);
+  uint64_t single_ns = helper_WriteStripe(STRIPE_BLOCKS);
+
+  helper_InitStripe(NB_CARDS);
+  uint64_t striped_ns = helper_WriteStripe(STRIPE_BLOCKS);
+
+  printf("stripe: %u blocks, 1 card %.3f ms, %u cards %.3f ms\n", STRIPE_BLOCKS,
+         single_ns / 1e6, NB_CARDS, striped_ns / 1e6);
+  TEST_ASSERT_TRUE(striped_ns * 2 < single_ns);
+}
+
+/**
+ * @brief Tick until the stripe device has the expected status
+ */
+void helper_TickUntilDevice(enum BlockDeviceStatus status, uint32_t max_ticks)
+{
+  for (uint32_t t = 0; t < max_ticks && block_device_status(&StripeDevice) != status; t++) {
+    helper_Tick();
+  }
+  TEST_ASSERT_EQUAL(status, block_device_status(&StripeDevice));
+}
+
+void helper_InitStripeDevice(void)
+{
+  helper_InitStripe(NB_CARDS);
+  sdlogger_stripe_block_device_init(&StripeDevice, &stripe);
+}
+
+/**
+ * @brief Write logical blocks first..first+nb-1 through the stripe device
+ */
+void helper_WriteStripeDevice(uint32_t first, uint32_t nb)
+{
+  block_device_multiwrite_start(&StripeDevice, first, NULL);
+  for (uint32_t b = first; b < first + nb; b++) {
+    helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      StripeBuf[BLOCK_DEVICE_BUF_OFFSET + i] = helper_Pattern(b, i);
+    }
+    block_device_multiwrite_next_buf(&StripeDevice, StripeBuf, NULL);
+  }
+  helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+  block_device_multiwrite_stop(&StripeDevice, &helper_ReadCallback);
+  helper_TickUntilDevice(BlockDevice_Idle, 100);
+}
+
+void test_BlockDeviceInit(void)
+{
+  helper_InitStripeDevice();
+
+  TEST_ASSERT_EQUAL_PTR(&sdlogger_stripe_block_device_ops, StripeDevice.ops);
+  TEST_ASSERT_EQUAL_PTR(&stripe, StripeDevice.dev);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&StripeDevice));
+  TEST_ASSERT_EQUAL(NB_CARDS, StripeDevice.nb_members);
+}
+
+/**
+ * @brief test_BlockDeviceStatus
+ * The stripe takes an operation when all cards do. During a multiwrite only
+ * the card in turn matters, the others may still be programming.
+ */
+void test_BlockDeviceStatus(void)
+{
+  helper_InitStripeDevice();
+
+  Cards[1].status = SDCard_ReadingDataBlock;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&StripeDevice));
+  Cards[1].status = SDCard_Erasing;
+  TEST_ASSERT_EQUAL(BlockDevice_Erasing, block_device_status(&StripeDevice));
+  Cards[1].status = SDCard_Error;
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&StripeDevice));
+  Cards[1].status = SDCard_Idle;
+
+  block_device_multiwrite_start(&StripeDevice, 0x300, NULL);
+  helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+
+  /* Card 0 is in turn */
+  Cards[1].status = SDCard_MultiWriteBusy;
+  TEST_ASSERT_EQUAL(BlockDevice_MultiWriteIdle, block_device_status(&StripeDevice));
+  Cards[0].status = SDCard_MultiWriteBusy;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&StripeDevice));
+  Cards[2].status = SDCard_Error;
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&StripeDevice));
+}
+
+/**
+ * @brief test_BlockDeviceCapacity
+ * Every card holds one block of each stripe, the smallest card limits the
+ * capacity. It is zero until all cards are known.
+ */
+void test_BlockDeviceCapacity(void)
+{
+  helper_InitStripeDevice();
+  TEST_ASSERT_EQUAL(0, block_device_nb_blocks(&StripeDevice));
+
+  block_device_read_capacity(&StripeDevice, NULL);
+  helper_TickUntilAll(SDCard_Idle, 100);
+
+  uint32_t smallest = Cards[0].nb_blocks;
+  for (uint8_t i = 1; i < NB_CARDS; i++) {
+    smallest = (Cards[i].nb_blocks < smallest) ? Cards[i].nb_blocks : smallest;
+  }
+  TEST_ASSERT_TRUE(smallest > 0);
+  TEST_ASSERT_EQUAL(NB_CARDS * smallest, block_device_nb_blocks(&StripeDevice));
+}
+
+/**
+ * @brief test_BlockDeviceMultiWriteLogicalBlocks
+ * A multiwrite on the stripe device starts on every card at the first of
+ * its blocks. The start does not have to be on the first card. The blocks
+ * end up where sdlogger_stripe_locate() puts them.
+ */
+void test_BlockDeviceMultiWriteLogicalBlocks(void)
+{
+  uint32_t first = STRIPE_START_BLOCK * NB_CARDS + 1;
+  helper_InitStripeDevice();
+
+  helper_WriteStripeDevice(first, STRIPE_BLOCKS);
+
+  for (uint8_t c = 0; c < NB_CARDS; c++) {
+    TEST_ASSERT_EQUAL(STRIPE_BLOCKS / NB_CARDS, Sims[c].blocks_written);
+  }
+  for (uint32_t b = first; b < first + STRIPE_BLOCKS; b++) {
+    uint8_t *data = helper_StripeData(b);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), data[i]);
+    }
+  }
+  /* Stopped when all cards were done */
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+}
+
+/**
+ * @brief test_BlockDeviceReadLogicalBlocks
+ * A read is done by the card that holds the block, read_buf of the stripe
+ * device points at the buffer of that card afterwards.
+ */
+void test_BlockDeviceReadLogicalBlocks(void)
+{
+  uint32_t first = STRIPE_START_BLOCK * NB_CARDS;
+  helper_InitStripeDevice();
+  helper_WriteStripeDevice(first, STRIPE_BLOCKS);
+
+  for (uint32_t b = first; b < first + STRIPE_BLOCKS; b++) {
+    ReadCallbackWasCalled = FALSE;
+    block_device_read_block(&StripeDevice, b, &helper_ReadCallback);
+    helper_TickUntilDevice(BlockDevice_Idle, 100);
+
+    TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+    TEST_ASSERT_EQUAL_PTR(Devices[b % NB_CARDS].read_buf, StripeDevice.read_buf);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), StripeDevice.read_buf[i]);
+    }
+  }
+}
+
+/**
+ * @brief test_BlockDeviceWriteBlock
+ * A single block is copied to the card that holds it, like the index of the
+ * logger.
+ */
+void test_BlockDeviceWriteBlock(void)
+{
+  uint32_t addr = STRIPE_START_BLOCK * NB_CARDS + 2;
+  helper_InitStripeDevice();
+
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    StripeDevice.write_buf[i] = helper_Pattern(addr, i);
+  }
+  block_device_write_block(&StripeDevice, addr, &helper_ReadCallback);
+  helper_TickUntilDevice(BlockDevice_Idle, 100);
+
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  TEST_ASSERT_EQUAL(1, Sims[addr % NB_CARDS].blocks_written);
+  uint8_t *data = helper_StripeData(addr);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(helper_Pattern(addr, i), data[i]);
+  }
+}
+
+/**
+ * @brief test_BlockDeviceStopWaitsForBusyCards
+ * The multiwrite can be stopped while cards are still programming, they are
+ * stopped from the periodic loop when they are done.
+ */
+void test_BlockDeviceStopWaitsForBusyCards(void)
+{
+  helper_InitStripeDevice();
+  block_device_multiwrite_start(&StripeDevice, 0x300, NULL);
+  helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+
+  block_device_multiwrite_next_buf(&StripeDevice, StripeBuf, NULL);
+  block_device_multiwrite_stop(&StripeDevice, &helper_ReadCallback);
+
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&StripeDevice));
+  TEST_ASSERT_FALSE(ReadCallbackWasCalled);
+
+  helper_TickUntilDevice(BlockDevice_Idle, 100);
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  helper_TickUntilAll(SDCard_Idle, 1);
+}
+
+/**
+ * @brief Write logical blocks first..first+nb-1 through the block buffers of
+ * the stripe device, acquiring as many as the cards have free
+ */
+void helper_SubmitStripeDevice(uint32_t first, uint32_t nb)
+{
+  uint32_t b = first;
+  block_device_multiwrite_start(&StripeDevice, first, NULL);
+  helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+  for (uint32_t ticks = 0; b < first + nb; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 100 * nb, "Stripe stalled.");
+    uint8_t *block;
+    while (b < first + nb && (block = block_device_block_acquire(&StripeDevice)) != NULL) {
+      for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+        block[i] = helper_Pattern(b, i);
+      }
+      block_device_block_submit(&StripeDevice, block, NULL);
+      b++;
+    }
+    helper_Tick();
+  }
+  helper_TickUntilAll(SDCard_MultiWriteIdle, 100);
+  block_device_multiwrite_stop(&StripeDevice, &helper_ReadCallback);
+  helper_TickUntilDevice(BlockDevice_Idle, 100);
+}
+
+/**
+ * @brief test_BlockDeviceAcquireFromCardInTurn
+ * Block buffers come from the card that writes the next logical block, so
+ * each card gets its blocks in order. A submit or release goes back to the
+ * card the buffer came from.
+ */
+void test_BlockDeviceAcquireFromCardInTurn(void)
+{
+  uint32_t first = STRIPE_START_BLOCK * NB_CARDS + 1;
+  helper_InitStripeDevice();
+  block_device_multiwrite_start(&StripeDevice, first, NULL);
+  helper_TickUntilDevice(BlockDevice_MultiWriteIdle, 100);
+
+  uint8_t *block = block_device_block_acquire(&StripeDevice);
+  uint8_t *next = block_device_block_acquire(&StripeDevice);
+
+  TEST_ASSERT_EQUAL_PTR(&Cards[first % NB_CARDS].block_buf[0][1], block);
+  TEST_ASSERT_EQUAL_PTR(&Cards[(first + 1) % NB_CARDS].block_buf[0][1], next);
+
+  /* Given back, the next acquire is on the same card again */
+  block_device_block_release(&StripeDevice, next);
+  TEST_ASSERT_EQUAL(SDCardBlock_Free, Cards[(first + 1) % NB_CARDS].block_state[0]);
+  TEST_ASSERT_EQUAL_PTR(next, block_device_block_acquire(&StripeDevice));
+
+  block_device_block_submit(&StripeDevice, block, NULL);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, Cards[first % NB_CARDS].block_state[0]);
+  TEST_ASSERT_EQUAL(SDCardBlock_Acquired, Cards[(first + 1) % NB_CARDS].block_state[0]);
+
+  /* No buffer on the card in turn, the other cards are not asked */
+  for (uint8_t i = 0; i < SDCARD_BLOCK_BUFFERS; i++) {
+    Cards[(first + 2) % NB_CARDS].block_state[i] = SDCardBlock_Submitted;
+  }
+  TEST_ASSERT_NULL(block_device_block_acquire(&StripeDevice));
+}
+
+/**
+ * @brief test_BlockDeviceSubmitLogicalBlocks
+ * Blocks filled in the buffers of the cards land at the same place as with
+ * multiwrite_next_buf.
+ */
+void test_BlockDeviceSubmitLogicalBlocks(void)
+{
+  uint32_t first = STRIPE_START_BLOCK * NB_CARDS + 1;
+  helper_InitStripeDevice();
+
+  helper_SubmitStripeDevice(first, STRIPE_BLOCKS);
+
+  for (uint8_t c = 0; c < NB_CARDS; c++) {
+    TEST_ASSERT_EQUAL(STRIPE_BLOCKS / NB_CARDS, Sims[c].blocks_written);
+  }
+  for (uint32_t b = first; b < first + STRIPE_BLOCKS; b++) {
+    uint8_t *data = helper_StripeData(b);
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), data[i]);
+    }
+  }
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/block_device_mmap.c
+ *  @brief Block device on a memory-mapped image file, for Linux hosts.
+ */
+
+/* ftruncate() and msync() with -std=c99 */
+#define _POSIX_C_SOURCE 200112L
+
+#include "block_device_mmap.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void block_device_mmap_periodic(void *dev)
+{
+  (void) dev;
+}
+
+/** The size is known from the start, there is nothing to read */
+static void block_device_mmap_read_capacity(void *dev, BlockDeviceCallback callback)
+{
+  (void) dev;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+static uint32_t block_device_mmap_nb_blocks(void *dev)
+{
+  return ((struct BlockDeviceMmap *) dev)->nb_blocks;
+}
+
+static void block_device_mmap_read_block(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  if (image->status != BlockDevice_Idle) {
+    return;
+  }
+  if (addr >= image->nb_blocks) {
+    image->status = BlockDevice_Error;
+    return;
+  }
+  memcpy(image->read_buf, &image->map[(size_t) addr * BLOCK_DEVICE_BLOCK_SIZE], BLOCK_DEVICE_BLOCK_SIZE);
+  image->blocks_read++;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+static void block_device_mmap_write_block(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  if (image->status != BlockDevice_Idle) {
+    return;
+  }
+  if (addr >= image->nb_blocks) {
+    image->status = BlockDevice_Error;
+    return;
+  }
+  memcpy(&image->map[(size_t) addr * BLOCK_DEVICE_BLOCK_SIZE], image->write_buf, BLOCK_DEVICE_BLOCK_SIZE);
+  image->blocks_written++;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+static void block_device_mmap_flush(struct BlockDeviceMmap *image);
+
+static void block_device_mmap_multiwrite_start(void *dev, uint32_t addr, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  if (image->status != BlockDevice_Idle) {
+    return;
+  }
+  image->multiwrite_addr = addr;
+  image->status = BlockDevice_MultiWriteIdle;
+  if (callback != NULL) {
+    callback();
+  }
+  /* Buffers submitted before the start */
+  block_device_mmap_flush(image);
+}
+
+/** Write the next block of the multiwrite from data */
+static void block_device_mmap_write_next(struct BlockDeviceMmap *image, const uint8_t *data,
+                                         BlockDeviceCallback callback)
+{
+  if (image->status != BlockDevice_MultiWriteIdle) {
+    return;
+  }
+  if (image->multiwrite_addr >= image->nb_blocks) {
+    image->status = BlockDevice_Error;
+    return;
+  }
+  memcpy(&image->map[(size_t) image->multiwrite_addr * BLOCK_DEVICE_BLOCK_SIZE], data, BLOCK_DEVICE_BLOCK_SIZE);
+  image->multiwrite_addr++;
+  image->blocks_written++;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+static void block_device_mmap_multiwrite_next(void *dev, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  block_device_mmap_write_next(image, image->write_buf, callback);
+}
+
+/** The data of a caller buffer starts at BLOCK_DEVICE_BUF_OFFSET, see block_device.h */
+static void block_device_mmap_multiwrite_next_buf(void *dev, uint8_t *buf, BlockDeviceCallback callback)
+{
+  block_device_mmap_write_next((struct BlockDeviceMmap *) dev, &buf[BLOCK_DEVICE_BUF_OFFSET], callback);
+}
+
+static void block_device_mmap_multiwrite_stop(void *dev, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  if (image->status != BlockDevice_MultiWriteIdle) {
+    return;
+  }
+  image->status = BlockDevice_Idle;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+/**
+ * Write the submitted buffers in acquisition order, up to the first one that
+ * is still acquired. Released buffers are skipped and only become free here,
+ * so they are not handed out again ahead of older buffers. Callbacks may
+ * acquire and submit again, the loop picks those up instead of recursing.
+ */
+static void block_device_mmap_flush(struct BlockDeviceMmap *image)
+{
+  if (image->flushing) {
+    return;
+  }
+  image->flushing = TRUE;
+  while (TRUE) {
+    uint8_t idx = image->write_idx;
+    BlockDeviceCallback callback = image->buf_callback[idx];
+    if (image->buf_state[idx] == BlockDeviceMmapBuf_Released) {
+      image->buf_state[idx] = BlockDeviceMmapBuf_Free;
+      image->write_idx = (idx + 1) % BLOCK_DEVICE_MMAP_BUFFERS;
+      continue;
+    }
+    if (image->status != BlockDevice_MultiWriteIdle ||
+        image->buf_state[idx] != BlockDeviceMmapBuf_Submitted) {
+      break;
+    }
+    block_device_mmap_write_next(image, image->buffers[idx], NULL);
+    if (image->status != BlockDevice_MultiWriteIdle) {
+      break;
+    }
+    image->buf_state[idx] = BlockDeviceMmapBuf_Free;
+    image->write_idx = (idx + 1) % BLOCK_DEVICE_MMAP_BUFFERS;
+    if (callback != NULL) {
+      callback();
+    }
+  }
+  image->flushing = FALSE;
+}
+
+static uint8_t *block_device_mmap_block_acquire(void *dev)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  uint8_t idx = image->acquire_idx;
+  if (image->buf_state[idx] != BlockDeviceMmapBuf_Free) {
+    return NULL;
+  }
+  image->buf_state[idx] = BlockDeviceMmapBuf_Acquired;
+  image->acquire_idx = (idx + 1) % BLOCK_DEVICE_MMAP_BUFFERS;
+  return image->buffers[idx];
+}
+
+/** Index of a buffer returned by block_acquire, -1 for anything else */
+static int16_t block_device_mmap_buf_idx(struct BlockDeviceMmap *image, const uint8_t *block)
+{
+  uint8_t i;
+  for (i = 0; i < BLOCK_DEVICE_MMAP_BUFFERS; i++) {
+    if (block == image->buffers[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void block_device_mmap_block_submit(void *dev, uint8_t *block, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  int16_t idx = block_device_mmap_buf_idx(image, block);
+  if (idx < 0 || image->buf_state[idx] != BlockDeviceMmapBuf_Acquired) {
+    return;
+  }
+  image->buf_callback[idx] = callback;
+  image->buf_state[idx] = BlockDeviceMmapBuf_Submitted;
+  block_device_mmap_flush(image);
+}
+
+/**
+ * Give back an acquired buffer without writing it. The newest one is handed
+ * out again by the next block_acquire, together with the released ones just
+ * before it. Any other one stays out until the writer has passed it.
+ */
+static void block_device_mmap_block_release(void *dev, uint8_t *block)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  int16_t idx = block_device_mmap_buf_idx(image, block);
+  if (idx < 0 || image->buf_state[idx] != BlockDeviceMmapBuf_Acquired) {
+    return;
+  }
+  image->buf_state[idx] = BlockDeviceMmapBuf_Released;
+  while (TRUE) {
+    uint8_t newest = (image->acquire_idx + BLOCK_DEVICE_MMAP_BUFFERS - 1) % BLOCK_DEVICE_MMAP_BUFFERS;
+    if (image->buf_state[newest] != BlockDeviceMmapBuf_Released) {
+      break;
+    }
+    image->buf_state[newest] = BlockDeviceMmapBuf_Free;
+    image->acquire_idx = newest;
+  }
+  /* Buffers submitted after it no longer wait for it */
+  block_device_mmap_flush(image);
+}
+
+/** Erased blocks read as zeros, as on most cards */
+static void block_device_mmap_erase(void *dev, uint32_t first, uint32_t last, BlockDeviceCallback callback)
+{
+  struct BlockDeviceMmap *image = (struct BlockDeviceMmap *) dev;
+  if (image->status != BlockDevice_Idle) {
+    return;
+  }
+  if (last < first || last >= image->nb_blocks) {
+    image->status = BlockDevice_Error;
+    return;
+  }
+  memset(&image->map[(size_t) first * BLOCK_DEVICE_BLOCK_SIZE], 0,
+         (size_t)(last - first + 1) * BLOCK_DEVICE_BLOCK_SIZE);
+  image->blocks_erased += last - first + 1;
+  if (callback != NULL) {
+    callback();
+  }
+}
+
+/** The erase is done before it returns, so there is never one to cancel */
+static void block_device_mmap_erase_cancel(void *dev)
+{
+  (void) dev;
+}
+
+static enum BlockDeviceStatus block_device_mmap_status(void *dev)
+{
+  return ((struct BlockDeviceMmap *) dev)->status;
+}
+
+const struct BlockDeviceOps block_device_mmap_ops = {
+  .periodic = block_device_mmap_periodic,
+  .read_capacity = block_device_mmap_read_capacity,
+  .nb_blocks = block_device_mmap_nb_blocks,
+  .read_block = block_device_mmap_read_block,
+  .write_block = block_device_mmap_write_block,
+  .multiwrite_start = block_device_mmap_multiwrite_start,
+  .multiwrite_next = block_device_mmap_multiwrite_next,
+  .multiwrite_next_buf = block_device_mmap_multiwrite_next_buf,
+  .multiwrite_stop = block_device_mmap_multiwrite_stop,
+  .erase = block_device_mmap_erase,
+  .erase_cancel = block_device_mmap_erase_cancel,
+  .block_acquire = block_device_mmap_block_acquire,
+  .block_submit = block_device_mmap_block_submit,
+  .block_release = block_device_mmap_block_release,
+  .status = block_device_mmap_status,
+};
+
+int block_device_mmap_open(struct BlockDeviceMmap *image, struct BlockDevice *bd,
+                           const char *path, uint32_t nb_blocks)
+{
+  struct stat st;
+
+  memset(image, 0, sizeof(*image));
+  image->fd = -1;
+  image->status = BlockDevice_UnInit;
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (nb_blocks == 0) {
+    nb_blocks = st.st_size / BLOCK_DEVICE_BLOCK_SIZE;
+  } else if ((uint64_t) st.st_size < (uint64_t) nb_blocks * BLOCK_DEVICE_BLOCK_SIZE &&
+             ftruncate(fd, (off_t) nb_blocks * BLOCK_DEVICE_BLOCK_SIZE) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (nb_blocks == 0) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, (size_t) nb_blocks * BLOCK_DEVICE_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  image->fd = fd;
+  image->map = (uint8_t *) map;
+  image->nb_blocks = nb_blocks;
+  image->status = BlockDevice_Idle;
+
+  bd->ops = &block_device_mmap_ops;
+  bd->dev = image;
+  bd->read_buf = image->read_buf;
+  bd->write_buf = image->write_buf;
+  bd->multiwrite_buf = image->write_buf;
+  /* A single image, not a stripe */
+  bd->nb_members = 0;
+  return 0;
+}
+
+void block_device_mmap_sync(struct BlockDeviceMmap *image)
+{
+  if (image->map != NULL) {
+    msync(image->map, (size_t) image->nb_blocks * BLOCK_DEVICE_BLOCK_SIZE, MS_SYNC);
+  }
+}
+
+void block_device_mmap_close(struct BlockDeviceMmap *image)
+{
+  if (image->map != NULL) {
+    munmap(image->map, (size_t) image->nb_blocks * BLOCK_DEVICE_BLOCK_SIZE);
+    image->map = NULL;
+  }
+  if (image->fd >= 0) {
+    close(image->fd);
+    image->fd = -1;
+  }
+  image->status = BlockDevice_UnInit;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/block_device_mmap.h
+ *  @brief Block device on a memory-mapped image file, for Linux hosts.
+ *
+ * Implements the operations of peripherals/block_device.h on an image file,
+ * so code written against the generic interface (the logger, host tools) can
+ * run on a workstation and produce card images at the speed of the disk.
+ *
+ * All operations complete immediately: the data is copied from or to the
+ * mapping and the callback is called before the operation returns. The device
+ * is never busy, an erase fills the blocks with zeros and the capacity is the
+ * size of the image. Addresses are block numbers, as with block addressed
+ * cards.
+ *
+ * For block_acquire/submit the device has BLOCK_DEVICE_MMAP_BUFFERS
+ * buffers. A submitted buffer is copied to the image as soon as the buffers
+ * acquired before it are submitted too, so the blocks land in acquisition
+ * order like on the card. A released buffer is skipped. It is only handed
+ * out again once the buffers acquired before it are written, unless it was
+ * the newest one.
+ *
+ * Usage:
+ * struct BlockDeviceMmap image;
+ * struct BlockDevice bd;
+ * block_device_mmap_open(&image, &bd, "card.img", nb_blocks);
+ * memcpy(bd.write_buf, data, BLOCK_DEVICE_BLOCK_SIZE);
+ * block_device_write_block(&bd, addr, callback);
+ * ...
+ * block_device_mmap_close(&image);
+ */
+
+#ifndef BLOCK_DEVICE_MMAP_H
+#define BLOCK_DEVICE_MMAP_H
+
+#include "std.h"
+#include "peripherals/block_device.h"
+
+/** Buffers for block_acquire/submit */
+#ifndef BLOCK_DEVICE_MMAP_BUFFERS
+#define BLOCK_DEVICE_MMAP_BUFFERS 16
+#endif
+
+enum BlockDeviceMmapBufState {
+  BlockDeviceMmapBuf_Free,
+  BlockDeviceMmapBuf_Acquired,
+  BlockDeviceMmapBuf_Submitted,
+  BlockDeviceMmapBuf_Released   /**< Given back, free once the writer passes it */
+};
+
+struct BlockDeviceMmap {
+  int fd;
+  uint8_t *map;
+  uint32_t nb_blocks;
+  enum BlockDeviceStatus status;
+  uint32_t multiwrite_addr;     /**< Block written by the next multiwrite_next */
+  uint8_t read_buf[BLOCK_DEVICE_BLOCK_SIZE];
+  uint8_t write_buf[BLOCK_DEVICE_BLOCK_SIZE];  /**< For write_block and multiwrite_next */
+
+  uint8_t buffers[BLOCK_DEVICE_MMAP_BUFFERS][BLOCK_DEVICE_BLOCK_SIZE];
+  enum BlockDeviceMmapBufState buf_state[BLOCK_DEVICE_MMAP_BUFFERS];
+  BlockDeviceCallback buf_callback[BLOCK_DEVICE_MMAP_BUFFERS];
+  uint8_t acquire_idx;          /**< Buffer returned by the next block_acquire */
+  uint8_t write_idx;            /**< Oldest acquired buffer, written first */
+  bool_t flushing;              /**< Writing submitted buffers, a submit from a callback only marks its buffer */
+
+  /* Statistics */
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint32_t blocks_erased;
+};
+
+extern const struct BlockDeviceOps block_device_mmap_ops;
+
+/**
+ * @brief Open or create an image and fill in the block device
+ * @param nb_blocks Size of the image, the file is extended if it is smaller.
+ * Zero to use the size of an existing file.
+ * @return 0 on success, -1 if the file cannot be opened or mapped
+ */
+extern int block_device_mmap_open(struct BlockDeviceMmap *image, struct BlockDevice *bd,
+                                  const char *path, uint32_t nb_blocks);
+/** Flush the written blocks to the file */
+extern void block_device_mmap_sync(struct BlockDeviceMmap *image);
+extern void block_device_mmap_close(struct BlockDeviceMmap *image);
+
+#endif /* BLOCK_DEVICE_MMAP_H */
@@ -0,0 +1,586 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/block_device_mmap_tester.c
+ *  @brief Test code for the memory-mapped image block device.
+ */
+
+/* mkstemp() with -std=c99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "peripherals/block_device_mmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEST_IMAGE_BLOCKS 64
+
+struct BlockDeviceMmap image;
+struct BlockDevice bd;
+char ImagePath[32];
+
+/* Set by helper_Callback() */
+uint8_t CallbackCalls;
+
+/* Blocks still to be written from helper_WriteNextFromCallback() */
+uint8_t ChainedBlocksLeft;
+
+void setUp(void)
+{
+  strcpy(ImagePath, "/tmp/bdmmapXXXXXX");
+  int fd = mkstemp(ImagePath);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+
+  CallbackCalls = 0;
+  ChainedBlocksLeft = 0;
+  TEST_ASSERT_EQUAL(0, block_device_mmap_open(&image, &bd, ImagePath, TEST_IMAGE_BLOCKS));
+}
+
+void tearDown(void)
+{
+  block_device_mmap_close(&image);
+  unlink(ImagePath);
+}
+
+void helper_Callback(void)
+{
+  CallbackCalls++;
+}
+
+void helper_FillBlock(uint8_t *data, uint32_t block)
+{
+  for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    data[i] = (uint8_t)((block * 31) ^ i);
+  }
+}
+
+/**
+ * @brief Check a block in the image file itself, not through the mapping
+ */
+void helper_VerifyFileBlock(uint32_t block)
+{
+  uint8_t expected[BLOCK_DEVICE_BLOCK_SIZE];
+  uint8_t data[BLOCK_DEVICE_BLOCK_SIZE];
+  helper_FillBlock(expected, block);
+
+  FILE *f = fopen(ImagePath, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  fseek(f, (long) block * BLOCK_DEVICE_BLOCK_SIZE, SEEK_SET);
+  TEST_ASSERT_EQUAL(BLOCK_DEVICE_BLOCK_SIZE, fread(data, 1, BLOCK_DEVICE_BLOCK_SIZE, f));
+  fclose(f);
+  for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(expected[i], data[i]);
+  }
+}
+
+void test_OpenCreatesImageOfRequestedSize(void)
+{
+  struct stat st;
+  TEST_ASSERT_EQUAL(0, stat(ImagePath, &st));
+  TEST_ASSERT_EQUAL(TEST_IMAGE_BLOCKS * BLOCK_DEVICE_BLOCK_SIZE, st.st_size);
+
+  TEST_ASSERT_EQUAL(TEST_IMAGE_BLOCKS, image.nb_blocks);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+  TEST_ASSERT_EQUAL_PTR(&block_device_mmap_ops, bd.ops);
+  TEST_ASSERT_EQUAL_PTR(&image, bd.dev);
+  TEST_ASSERT_EQUAL_PTR(image.read_buf, bd.read_buf);
+  TEST_ASSERT_EQUAL_PTR(image.write_buf, bd.write_buf);
+  TEST_ASSERT_EQUAL_PTR(image.write_buf, bd.multiwrite_buf);
+  TEST_ASSERT_EQUAL(0, bd.nb_members);
+}
+
+/**
+ * Without a size, the size of an existing image is used.
+ */
+void test_OpenExistingImage(void)
+{
+  block_device_mmap_close(&image);
+
+  TEST_ASSERT_EQUAL(0, block_device_mmap_open(&image, &bd, ImagePath, 0));
+
+  TEST_ASSERT_EQUAL(TEST_IMAGE_BLOCKS, image.nb_blocks);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+}
+
+void test_OpenEmptyImageWithoutSizeFails(void)
+{
+  block_device_mmap_close(&image);
+  TEST_ASSERT_EQUAL(0, truncate(ImagePath, 0));
+
+  TEST_ASSERT_EQUAL(-1, block_device_mmap_open(&image, &bd, ImagePath, 0));
+  TEST_ASSERT_EQUAL(BlockDevice_UnInit, image.status);
+}
+
+void test_OpenFailsInMissingDirectory(void)
+{
+  struct BlockDeviceMmap other;
+  struct BlockDevice other_bd;
+
+  TEST_ASSERT_EQUAL(-1, block_device_mmap_open(&other, &other_bd, "/nonexistent/dir/card.img", 8));
+}
+
+/**
+ * Operations complete before they return, the callback is called right away.
+ */
+void test_WriteAndReadBlock(void)
+{
+  helper_FillBlock(bd.write_buf, 5);
+  block_device_write_block(&bd, 5, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+
+  memset(bd.write_buf, 0, BLOCK_DEVICE_BLOCK_SIZE);
+  block_device_read_block(&bd, 5, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(2, CallbackCalls);
+  uint8_t expected[BLOCK_DEVICE_BLOCK_SIZE];
+  helper_FillBlock(expected, 5);
+  for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(expected[i], bd.read_buf[i]);
+  }
+  TEST_ASSERT_EQUAL(1, image.blocks_written);
+  TEST_ASSERT_EQUAL(1, image.blocks_read);
+}
+
+void test_NewImageReadsZero(void)
+{
+  block_device_read_block(&bd, TEST_IMAGE_BLOCKS - 1, NULL);
+
+  for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0x00, bd.read_buf[i]);
+  }
+}
+
+void test_ReadPastEndIsError(void)
+{
+  block_device_read_block(&bd, TEST_IMAGE_BLOCKS, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&bd));
+}
+
+void test_WritePastEndIsError(void)
+{
+  block_device_write_block(&bd, TEST_IMAGE_BLOCKS, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&bd));
+}
+
+void test_MultiWriteConsecutiveBlocks(void)
+{
+  block_device_multiwrite_start(&bd, 10, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(BlockDevice_MultiWriteIdle, block_device_status(&bd));
+
+  for (uint32_t b = 10; b < 13; b++) {
+    helper_FillBlock(bd.multiwrite_buf, b);
+    block_device_multiwrite_next(&bd, &helper_Callback);
+  }
+  block_device_multiwrite_stop(&bd, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(5, CallbackCalls);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+  TEST_ASSERT_EQUAL(3, image.blocks_written);
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(10);
+  helper_VerifyFileBlock(11);
+  helper_VerifyFileBlock(12);
+}
+
+/**
+ * Zero-copy variant, the data is taken from a buffer of the caller at
+ * BLOCK_DEVICE_BUF_OFFSET, the way the logger hands over its blocks.
+ */
+void test_MultiWriteFromCallerBuffer(void)
+{
+  uint8_t buf[BLOCK_DEVICE_BUF_SIZE];
+  block_device_multiwrite_start(&bd, 10, NULL);
+
+  helper_FillBlock(&buf[BLOCK_DEVICE_BUF_OFFSET], 10);
+  block_device_multiwrite_next_buf(&bd, buf, &helper_Callback);
+  helper_FillBlock(&buf[BLOCK_DEVICE_BUF_OFFSET], 11);
+  block_device_multiwrite_next_buf(&bd, buf, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(2, CallbackCalls);
+  TEST_ASSERT_EQUAL(12, image.multiwrite_addr);
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(10);
+  helper_VerifyFileBlock(11);
+}
+
+/**
+ * The capacity is the size of the image, known as soon as it is open.
+ */
+void test_CapacityIsImageSize(void)
+{
+  block_device_read_capacity(&bd, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL(TEST_IMAGE_BLOCKS, block_device_nb_blocks(&bd));
+  /* Nothing to poll */
+  block_device_periodic(&bd);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+}
+
+/**
+ * Erased blocks read as zeros. The erase completes right away, a cancel
+ * afterwards does nothing.
+ */
+void test_EraseFillsZeros(void)
+{
+  for (uint32_t b = 4; b < 8; b++) {
+    helper_FillBlock(bd.write_buf, b);
+    block_device_write_block(&bd, b, NULL);
+  }
+
+  block_device_erase(&bd, 5, 6, &helper_Callback);
+  block_device_erase_cancel(&bd);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL(2, image.blocks_erased);
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&bd));
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(4);
+  helper_VerifyFileBlock(7);
+  for (uint32_t b = 5; b < 7; b++) {
+    block_device_read_block(&bd, b, NULL);
+    for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(0x00, bd.read_buf[i]);
+    }
+  }
+}
+
+void test_ErasePastEndIsError(void)
+{
+  block_device_erase(&bd, TEST_IMAGE_BLOCKS - 2, TEST_IMAGE_BLOCKS, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(0, image.blocks_erased);
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&bd));
+}
+
+/**
+ * Like with the SD card, operations that do not fit the current state are
+ * ignored.
+ */
+void test_IgnoreOperationsInWrongState(void)
+{
+  block_device_multiwrite_next(&bd, &helper_Callback);
+  block_device_multiwrite_stop(&bd, &helper_Callback);
+
+  block_device_multiwrite_start(&bd, 10, NULL);
+  block_device_read_block(&bd, 0, &helper_Callback);
+  block_device_write_block(&bd, 0, &helper_Callback);
+  block_device_erase(&bd, 0, 1, &helper_Callback);
+  block_device_multiwrite_start(&bd, 20, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(10, image.multiwrite_addr);
+  TEST_ASSERT_EQUAL(0, image.blocks_written);
+  TEST_ASSERT_EQUAL(0, image.blocks_read);
+  TEST_ASSERT_EQUAL(0, image.blocks_erased);
+}
+
+void test_MultiWritePastEndIsError(void)
+{
+  block_device_multiwrite_start(&bd, TEST_IMAGE_BLOCKS - 1, NULL);
+  block_device_multiwrite_next(&bd, &helper_Callback);
+  block_device_multiwrite_next(&bd, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&bd));
+}
+
+void helper_WriteNextFromCallback(void)
+{
+  if (ChainedBlocksLeft == 0) {
+    return;
+  }
+  ChainedBlocksLeft--;
+  helper_FillBlock(bd.multiwrite_buf, image.multiwrite_addr);
+  block_device_multiwrite_next(&bd, &helper_WriteNextFromCallback);
+}
+
+/**
+ * A callback can start the next operation, the way the logger does.
+ */
+void test_NextOperationFromCallback(void)
+{
+  ChainedBlocksLeft = 8;
+  block_device_multiwrite_start(&bd, 32, &helper_WriteNextFromCallback);
+
+  TEST_ASSERT_EQUAL(0, ChainedBlocksLeft);
+  TEST_ASSERT_EQUAL(8, image.blocks_written);
+  TEST_ASSERT_EQUAL(40, image.multiwrite_addr);
+  block_device_mmap_sync(&image);
+  for (uint32_t b = 32; b < 40; b++) {
+    helper_VerifyFileBlock(b);
+  }
+}
+
+/**
+ * The image keeps the data after it is closed, to be read by host tools.
+ */
+void test_DataPersistsAfterClose(void)
+{
+  helper_FillBlock(bd.write_buf, 3);
+  block_device_write_block(&bd, 3, NULL);
+  block_device_mmap_close(&image);
+
+  helper_VerifyFileBlock(3);
+
+  TEST_ASSERT_EQUAL(0, block_device_mmap_open(&image, &bd, ImagePath, 0));
+  block_device_read_block(&bd, 3, NULL);
+  uint8_t expected[BLOCK_DEVICE_BLOCK_SIZE];
+  helper_FillBlock(expected, 3);
+  for (uint16_t i = 0; i < BLOCK_DEVICE_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(expected[i], bd.read_buf[i]);
+  }
+}
+
+/**
+ * The device hands out its buffers until all of them wait to be written.
+ */
+void test_AcquireUntilNoBufferLeft(void)
+{
+  uint8_t *blocks[BLOCK_DEVICE_MMAP_BUFFERS];
+  for (uint8_t i = 0; i < BLOCK_DEVICE_MMAP_BUFFERS; i++) {
+    blocks[i] = block_device_block_acquire(&bd);
+    TEST_ASSERT_EQUAL_PTR(image.buffers[i], blocks[i]);
+  }
+
+  TEST_ASSERT_NULL(block_device_block_acquire(&bd));
+
+  block_device_multiwrite_start(&bd, 0, NULL);
+  helper_FillBlock(blocks[0], 0);
+  block_device_block_submit(&bd, blocks[0], &helper_Callback);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL_PTR(image.buffers[0], block_device_block_acquire(&bd));
+}
+
+/**
+ * Blocks land on the image in the order they were acquired, whatever the
+ * order they are submitted in.
+ */
+void test_SubmittedBlocksWrittenInAcquisitionOrder(void)
+{
+  uint8_t *first, *second, *third;
+  block_device_multiwrite_start(&bd, 20, NULL);
+  first = block_device_block_acquire(&bd);
+  second = block_device_block_acquire(&bd);
+  third = block_device_block_acquire(&bd);
+
+  helper_FillBlock(third, 22);
+  block_device_block_submit(&bd, third, &helper_Callback);
+  helper_FillBlock(second, 21);
+  block_device_block_submit(&bd, second, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(0, image.blocks_written);
+
+  helper_FillBlock(first, 20);
+  block_device_block_submit(&bd, first, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(3, CallbackCalls);
+  TEST_ASSERT_EQUAL(23, image.multiwrite_addr);
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(20);
+  helper_VerifyFileBlock(21);
+  helper_VerifyFileBlock(22);
+}
+
+/**
+ * Blocks submitted before the multiwrite starts are written by the start.
+ */
+void test_SubmitBeforeMultiWriteStart(void)
+{
+  uint8_t *block = block_device_block_acquire(&bd);
+  helper_FillBlock(block, 30);
+  block_device_block_submit(&bd, block, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+
+  block_device_multiwrite_start(&bd, 30, NULL);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(30);
+}
+
+void helper_SubmitNextFromCallback(void)
+{
+  if (ChainedBlocksLeft == 0) {
+    return;
+  }
+  ChainedBlocksLeft--;
+  uint8_t *block = block_device_block_acquire(&bd);
+  TEST_ASSERT_NOT_NULL(block);
+  helper_FillBlock(block, image.multiwrite_addr);
+  block_device_block_submit(&bd, block, &helper_SubmitNextFromCallback);
+}
+
+/**
+ * The written callback can acquire and submit the next block, the way the
+ * logger refills its ring, without recursing once per block.
+ */
+void test_SubmitNextFromWrittenCallback(void)
+{
+  ChainedBlocksLeft = 2 * BLOCK_DEVICE_MMAP_BUFFERS;
+  block_device_multiwrite_start(&bd, 8, &helper_SubmitNextFromCallback);
+
+  TEST_ASSERT_EQUAL(0, ChainedBlocksLeft);
+  TEST_ASSERT_EQUAL(2 * BLOCK_DEVICE_MMAP_BUFFERS, image.blocks_written);
+  block_device_mmap_sync(&image);
+  for (uint32_t b = 8; b < 8 + 2 * BLOCK_DEVICE_MMAP_BUFFERS; b++) {
+    helper_VerifyFileBlock(b);
+  }
+}
+
+/**
+ * Released buffers are not written. Given back newest first, they are handed
+ * out again in the same order.
+ */
+void test_ReleasedBlocksNotWritten(void)
+{
+  uint8_t *first, *second, *third;
+  block_device_multiwrite_start(&bd, 40, NULL);
+  first = block_device_block_acquire(&bd);
+  second = block_device_block_acquire(&bd);
+  third = block_device_block_acquire(&bd);
+
+  helper_FillBlock(first, 40);
+  block_device_block_submit(&bd, first, &helper_Callback);
+  block_device_block_release(&bd, third);
+  block_device_block_release(&bd, second);
+  block_device_multiwrite_stop(&bd, NULL);
+
+  TEST_ASSERT_EQUAL(1, CallbackCalls);
+  TEST_ASSERT_EQUAL(1, image.blocks_written);
+  TEST_ASSERT_EQUAL_PTR(second, block_device_block_acquire(&bd));
+  TEST_ASSERT_EQUAL_PTR(third, block_device_block_acquire(&bd));
+}
+
+/**
+ * A buffer released while older ones still wait does not hold back the
+ * blocks submitted after it.
+ */
+void test_ReleaseBetweenSubmittedBlocks(void)
+{
+  uint8_t *first, *second, *third;
+  block_device_multiwrite_start(&bd, 50, NULL);
+  first = block_device_block_acquire(&bd);
+  second = block_device_block_acquire(&bd);
+  third = block_device_block_acquire(&bd);
+
+  helper_FillBlock(third, 51);
+  block_device_block_submit(&bd, third, &helper_Callback);
+  block_device_block_release(&bd, second);
+  helper_FillBlock(first, 50);
+  block_device_block_submit(&bd, first, &helper_Callback);
+
+  TEST_ASSERT_EQUAL(2, CallbackCalls);
+  TEST_ASSERT_EQUAL(52, image.multiwrite_addr);
+  block_device_mmap_sync(&image);
+  helper_VerifyFileBlock(50);
+  helper_VerifyFileBlock(51);
+}
+
+/**
+ * A released buffer that is not the newest one is handed out again after the
+ * ones acquired before it. Here it is the oldest one and the ring is full, so
+ * it comes back as the newest and is written last.
+ */
+void test_ReleasedOldestBlockWrittenLast(void)
+{
+  uint8_t *blocks[BLOCK_DEVICE_MMAP_BUFFERS];
+  block_device_multiwrite_start(&bd, 10, NULL);
+  for (uint8_t i = 0; i < BLOCK_DEVICE_MMAP_BUFFERS; i++) {
+    blocks[i] = block_device_block_acquire(&bd);
+  }
+
+  block_device_block_release(&bd, blocks[0]);
+
+  TEST_ASSERT_EQUAL_PTR(blocks[0], block_device_block_acquire(&bd));
+  TEST_ASSERT_NULL(block_device_block_acquire(&bd));
+
+  helper_FillBlock(blocks[0], 10 + BLOCK_DEVICE_MMAP_BUFFERS - 1);
+  block_device_block_submit(&bd, blocks[0], &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+
+  for (uint8_t i = 1; i < BLOCK_DEVICE_MMAP_BUFFERS; i++) {
+    helper_FillBlock(blocks[i], 10 + i - 1);
+    block_device_block_submit(&bd, blocks[i], &helper_Callback);
+  }
+
+  TEST_ASSERT_EQUAL(BLOCK_DEVICE_MMAP_BUFFERS, CallbackCalls);
+  block_device_mmap_sync(&image);
+  for (uint32_t b = 10; b < 10 + BLOCK_DEVICE_MMAP_BUFFERS; b++) {
+    helper_VerifyFileBlock(b);
+  }
+}
+
+/**
+ * A buffer released between acquired ones is not handed out before the older
+ * ones are written.
+ */
+void test_ReleasedMiddleBlockHandedOutInTurn(void)
+{
+  uint8_t *blocks[BLOCK_DEVICE_MMAP_BUFFERS];
+  block_device_multiwrite_start(&bd, 30, NULL);
+  for (uint8_t i = 0; i < BLOCK_DEVICE_MMAP_BUFFERS; i++) {
+    blocks[i] = block_device_block_acquire(&bd);
+  }
+
+  block_device_block_release(&bd, blocks[1]);
+
+  TEST_ASSERT_NULL(block_device_block_acquire(&bd));
+
+  helper_FillBlock(blocks[0], 30);
+  block_device_block_submit(&bd, blocks[0], &helper_Callback);
+
+  TEST_ASSERT_EQUAL_PTR(blocks[0], block_device_block_acquire(&bd));
+  TEST_ASSERT_EQUAL_PTR(blocks[1], block_device_block_acquire(&bd));
+  TEST_ASSERT_NULL(block_device_block_acquire(&bd));
+}
+
+/**
+ * Only buffers of the device that are acquired can be submitted.
+ */
+void test_SubmitUnknownBufferIgnored(void)
+{
+  uint8_t other[BLOCK_DEVICE_BLOCK_SIZE];
+  block_device_multiwrite_start(&bd, 0, NULL);
+
+  block_device_block_submit(&bd, other, &helper_Callback);
+  block_device_block_submit(&bd, image.buffers[0], &helper_Callback);
+
+  TEST_ASSERT_EQUAL(0, CallbackCalls);
+  TEST_ASSERT_EQUAL(0, image.blocks_written);
+}
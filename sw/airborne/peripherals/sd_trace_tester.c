@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sd_trace_tester.c
+ *  @brief Test code for the sdcard/logger state transition trace.
+ *
+ * Usage:
+ * SD_TRACE_STATE(SDTraceSource_SDCard, sdcard->status, SDCard_SendingCMD24, 6);
+ *
+ * Compiles to nothing unless SDCARD_TRACE is defined. The trace is a ring of
+ * SD_TRACE_SIZE entries in struct SDTrace, the oldest entries get overwritten.
+ * The struct is dumped as is from the debugger:
+ * (gdb) dump binary value sd_trace.bin sd_trace
+ * and decoded with sw/tools/sdcard_trace_decode.py.
+ */
+
+/* TEST_DEFINES: SDCARD_TRACE */
+
+#include "unity.h"
+#include "peripherals/sd_trace.h"
+
+/* Defined in sys_time_arch.c during normal operation */
+uint32_t FakeSysTimeUsec;
+uint32_t get_sys_time_usec(void)
+{
+  return FakeSysTimeUsec;
+}
+
+void setUp(void)
+{
+  FakeSysTimeUsec = 0;
+
+  /* Incorrect values to make sure everything gets initialized */
+  sd_trace.magic = 123;
+  sd_trace.size = 123;
+  sd_trace.head = 123;
+  sd_trace.count = 123;
+
+  sd_trace_init();
+}
+
+void tearDown(void)
+{
+}
+
+void test_InitializeEmptyTrace(void)
+{
+  TEST_ASSERT_EQUAL_HEX32(SD_TRACE_MAGIC, sd_trace.magic);
+  TEST_ASSERT_EQUAL(SD_TRACE_SIZE, sd_trace.size);
+  TEST_ASSERT_EQUAL(0, sd_trace.head);
+  TEST_ASSERT_EQUAL(0, sd_trace.count);
+  TEST_ASSERT_EQUAL(0, sd_trace_length());
+}
+
+/**
+ * The host decoder reads the dumped struct with a fixed layout: a 12 byte
+ * header followed by 12 byte entries, little endian.
+ */
+void test_FixedLayoutForDecoder(void)
+{
+  TEST_ASSERT_EQUAL(12, sizeof(struct SDTraceEntry));
+  TEST_ASSERT_EQUAL(12 + 12 * SD_TRACE_SIZE, sizeof(struct SDTrace));
+  TEST_ASSERT_EQUAL(0, SD_TRACE_SIZE & (SD_TRACE_SIZE - 1)); /* Power of two */
+}
+
+uint32_t helper_Le32(const uint8_t *b)
+{
+  return b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+uint16_t helper_Le16(const uint8_t *b)
+{
+  return b[0] | (b[1] << 8);
+}
+
+/**
+ * Byte offsets as read by sdcard_trace_decode.py:
+ * HEADER '<IHHI'    magic, size, head, count
+ * ENTRY  '<IHBBB3x' timestamp, bytes, source, old state, new state
+ */
+void test_FieldOrderForDecoder(void)
+{
+  FakeSysTimeUsec = 0x11223344;
+  sd_trace_record(SDTraceSource_Logger, 0x05, 0x06, 0x0708);
+
+  const uint8_t *raw = (const uint8_t *) &sd_trace;
+  TEST_ASSERT_EQUAL_HEX32(SD_TRACE_MAGIC, helper_Le32(&raw[0]));
+  TEST_ASSERT_EQUAL(SD_TRACE_SIZE, helper_Le16(&raw[4]));
+  TEST_ASSERT_EQUAL(1, helper_Le16(&raw[6]));
+  TEST_ASSERT_EQUAL(1, helper_Le32(&raw[8]));
+
+  const uint8_t *entry = &raw[12];
+  TEST_ASSERT_EQUAL_HEX32(0x11223344, helper_Le32(&entry[0]));
+  TEST_ASSERT_EQUAL_HEX16(0x0708, helper_Le16(&entry[4]));
+  TEST_ASSERT_EQUAL(SDTraceSource_Logger, entry[6]);
+  TEST_ASSERT_EQUAL(1, SDTraceSource_Logger); /* SOURCES in the decoder */
+  TEST_ASSERT_EQUAL_HEX8(0x05, entry[7]);
+  TEST_ASSERT_EQUAL_HEX8(0x06, entry[8]);
+}
+
+void test_RecordTransition(void)
+{
+  FakeSysTimeUsec = 123456;
+
+  sd_trace_record(SDTraceSource_Logger, 3, 7, 516);
+
+  TEST_ASSERT_EQUAL(1, sd_trace_length());
+  TEST_ASSERT_EQUAL(1, sd_trace.count);
+  struct SDTraceEntry *entry = sd_trace_get(0);
+  TEST_ASSERT_NOT_NULL(entry);
+  TEST_ASSERT_EQUAL(123456, entry->timestamp);
+  TEST_ASSERT_EQUAL(SDTraceSource_Logger, entry->source);
+  TEST_ASSERT_EQUAL(3, entry->old_state);
+  TEST_ASSERT_EQUAL(7, entry->new_state);
+  TEST_ASSERT_EQUAL(516, entry->bytes);
+}
+
+void test_GetEntriesOldestFirst(void)
+{
+  for (uint8_t i = 0; i < 5; i++) {
+    FakeSysTimeUsec = 100 * i;
+    sd_trace_record(SDTraceSource_SDCard, i, i + 1, 0);
+  }
+
+  TEST_ASSERT_EQUAL(5, sd_trace_length());
+  for (uint8_t i = 0; i < 5; i++) {
+    TEST_ASSERT_EQUAL(100 * i, sd_trace_get(i)->timestamp);
+    TEST_ASSERT_EQUAL(i, sd_trace_get(i)->old_state);
+  }
+}
+
+void test_OverwriteOldestEntriesWhenFull(void)
+{
+  for (uint16_t i = 0; i < SD_TRACE_SIZE + 3; i++) {
+    FakeSysTimeUsec = i;
+    sd_trace_record(SDTraceSource_SDCard, 0, 1, 0);
+  }
+
+  /* All transitions are counted, only the last SD_TRACE_SIZE are kept */
+  TEST_ASSERT_EQUAL(SD_TRACE_SIZE + 3, sd_trace.count);
+  TEST_ASSERT_EQUAL(SD_TRACE_SIZE, sd_trace_length());
+  TEST_ASSERT_EQUAL(3, sd_trace.head);
+  TEST_ASSERT_EQUAL(3, sd_trace_get(0)->timestamp);
+  TEST_ASSERT_EQUAL(SD_TRACE_SIZE + 2, sd_trace_get(SD_TRACE_SIZE - 1)->timestamp);
+}
+
+void test_GetBeyondLengthReturnsNull(void)
+{
+  sd_trace_record(SDTraceSource_SDCard, 0, 1, 0);
+
+  TEST_ASSERT_NULL(sd_trace_get(1));
+}
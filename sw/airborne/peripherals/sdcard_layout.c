@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sdcard_layout.c
+ *  @brief Size of struct SDCard with the buffer layout this build does not use.
+ */
+
+/* Flip the layout before sdcard_spi.h sees it */
+#ifdef SDCARD_SHARED_BUFFER
+#undef SDCARD_SHARED_BUFFER
+#else
+#define SDCARD_SHARED_BUFFER
+#endif
+
+#include "sdcard_layout.h"
+#include "peripherals/sdcard_spi.h"
+
+const uint32_t sdcard_layout_other_size = sizeof(struct SDCard);
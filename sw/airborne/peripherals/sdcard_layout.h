@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sdcard_layout.h
+ *  @brief Size of struct SDCard with the buffer layout this build does not use.
+ *
+ * SDCARD_SHARED_BUFFER changes struct SDCard at compile time, so one build
+ * only knows one layout. sdcard_layout.c includes sdcard_spi.h with the
+ * define flipped, which lets a test compare both layouts in one run:
+ *
+ * #ifdef SDCARD_SHARED_BUFFER
+ * saved = sdcard_layout_other_size - sizeof(struct SDCard);
+ * #endif
+ */
+
+#ifndef SDCARD_LAYOUT_H
+#define SDCARD_LAYOUT_H
+
+#include "std.h"
+
+/** sizeof(struct SDCard) with the other buffer layout */
+extern const uint32_t sdcard_layout_other_size;
+
+#endif /* SDCARD_LAYOUT_H */
@@ -0,0 +1,611 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sdcard_sim.c
+ *  @brief Host-side model of an SD card in SPI mode.
+ */
+
+/* clock_gettime() with -std=c99 */
+#define _POSIX_C_SOURCE 199309L
+
+#include "sdcard_sim.h"
+#include <string.h>
+#include <time.h>
+
+/* Attached cards */
+static struct SDCardSim *sdcard_sim_cards[SDCARD_SIM_MAX_CARDS];
+static uint8_t sdcard_sim_nb_cards;
+
+/* Submitted transactions, waiting for their after_cb */
+struct SDCardSimPending {
+  struct spi_transaction *t;
+  uint64_t end_ns;
+  uint32_t seq;
+};
+static struct SDCardSimPending sdcard_sim_queue[SDCARD_SIM_QUEUE_SIZE];
+static uint8_t sdcard_sim_queue_len;
+static uint32_t sdcard_sim_seq;
+
+/* Peripherals work in parallel, transactions on one peripheral one after the other */
+static struct spi_periph *sdcard_sim_periph[SDCARD_SIM_MAX_CARDS];
+static uint64_t sdcard_sim_periph_free_ns[SDCARD_SIM_MAX_CARDS];
+
+static uint64_t sdcard_sim_now_ns;
+
+struct SDCardSimCallbackStats sdcard_sim_callback_stats;
+void (*sdcard_sim_callback)(struct spi_transaction *t);
+
+/* Wall clock time of the host, to measure the callbacks themselves */
+static uint64_t sdcard_sim_host_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint8_t sdcard_sim_crc7(const uint8_t *data, uint8_t len)
+{
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc <<= 1;
+      if (((data[i] << bit) ^ crc) & 0x80) {
+        crc ^= 0x09;
+      }
+    }
+    crc &= 0x7F;
+  }
+  return crc;
+}
+
+static uint16_t sdcard_sim_crc16(const uint8_t *data, uint16_t len)
+{
+  uint16_t crc = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+/**
+ * Configure a card and attach it to a peripheral and slave.
+ * The default card is a high capacity card that answers quickly and is never
+ * busy, tests change the configuration fields afterwards.
+ */
+void sdcard_sim_init(struct SDCardSim *sim, struct spi_periph *spi_p, uint8_t slave_idx,
+                     uint8_t *storage, uint32_t nb_blocks)
+{
+  memset(sim, 0, sizeof(struct SDCardSim));
+  sim->spi_p = spi_p;
+  sim->slave_idx = slave_idx;
+  sim->storage = storage;
+  sim->nb_blocks = nb_blocks;
+  sim->high_capacity = TRUE;
+  sim->ncr = 1;
+  sim->acmd41_polls = 0;
+  sim->busy_model = SDCardSimBusy_Fixed;
+  sim->spi_base_hz = 42000000; /* APB1 of an STM32F4 */
+  sim->seed = 1;
+  sim->state = SDCardSim_Listening;
+  sim->in_idle = TRUE;
+
+  for (uint8_t i = 0; i < sdcard_sim_nb_cards; i++) {
+    if (sdcard_sim_cards[i] == sim) {
+      return;
+    }
+  }
+  if (sdcard_sim_nb_cards < SDCARD_SIM_MAX_CARDS) {
+    sdcard_sim_cards[sdcard_sim_nb_cards++] = sim;
+  }
+}
+
+/**
+ * Detach all cards, drop pending transactions and set time back to zero.
+ * To be called from setUp().
+ */
+void sdcard_sim_reset(void)
+{
+  sdcard_sim_nb_cards = 0;
+  sdcard_sim_queue_len = 0;
+  sdcard_sim_seq = 0;
+  sdcard_sim_now_ns = 0;
+  memset(&sdcard_sim_callback_stats, 0, sizeof(sdcard_sim_callback_stats));
+  sdcard_sim_callback = NULL;
+  for (uint8_t i = 0; i < SDCARD_SIM_MAX_CARDS; i++) {
+    sdcard_sim_periph[i] = NULL;
+    sdcard_sim_periph_free_ns[i] = 0;
+  }
+}
+
+uint64_t sdcard_sim_time_ns(void)
+{
+  return sdcard_sim_now_ns;
+}
+
+uint8_t sdcard_sim_pending(void)
+{
+  return sdcard_sim_queue_len;
+}
+
+uint32_t get_sys_time_usec(void)
+{
+  return (uint32_t)(sdcard_sim_now_ns / 1000);
+}
+
+static uint32_t sdcard_sim_busy_ns(struct SDCardSim *sim)
+{
+  switch (sim->busy_model) {
+    case SDCardSimBusy_Uniform:
+      /* xorshift32 */
+      sim->seed ^= sim->seed << 13;
+      sim->seed ^= sim->seed >> 17;
+      sim->seed ^= sim->seed << 5;
+      if (sim->busy_max_ns <= sim->busy_min_ns) {
+        return sim->busy_min_ns;
+      }
+      return sim->busy_min_ns + sim->seed % (sim->busy_max_ns - sim->busy_min_ns + 1);
+    case SDCardSimBusy_Trace:
+      if (sim->busy_trace_len == 0) {
+        return sim->busy_min_ns;
+      }
+      if (sim->trace_idx >= sim->busy_trace_len) {
+        sim->trace_idx = 0;
+      }
+      return sim->busy_trace_ns[sim->trace_idx++];
+    case SDCardSimBusy_Fixed:
+    default:
+      return sim->busy_min_ns;
+  }
+}
+
+/* Queue bytes the card sends, preceded by Ncr - 1 times 0xFF */
+static void sdcard_sim_respond(struct SDCardSim *sim, const uint8_t *resp, uint8_t len)
+{
+  uint8_t ncr = sim->ncr < 1 ? 1 : (sim->ncr > 8 ? 8 : sim->ncr);
+  sim->out_len = 0;
+  sim->out_idx = 0;
+  for (uint8_t i = 1; i < ncr; i++) {
+    sim->out[sim->out_len++] = 0xFF;
+  }
+  memcpy(&sim->out[sim->out_len], resp, len);
+  sim->out_len += len;
+}
+
+static uint8_t sdcard_sim_r1(struct SDCardSim *sim)
+{
+  return sim->in_idle ? 0x01 : 0x00;
+}
+
+static bool_t sdcard_sim_block_addr(struct SDCardSim *sim, uint32_t arg, uint32_t *block)
+{
+  *block = sim->high_capacity ? arg : arg / SDCARD_SIM_BLOCK_SIZE;
+  return *block < sim->nb_blocks;
+}
+
+/* CSD register for the configured capacity, version 2.0 layout for high
+ * capacity cards and version 1.0 with 512 byte blocks otherwise. The capacity
+ * is rounded down to what the layout can express. */
+static void sdcard_sim_csd(struct SDCardSim *sim, uint8_t *csd)
+{
+  static const uint8_t csd_v2[16] = {
+    0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+    0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x40, 0x00
+  };
+  static const uint8_t csd_v1[16] = {
+    0x00, 0x26, 0x00, 0x32, 0x5F, 0x59, 0x80, 0x00,
+    0x00, 0x03, 0x80, 0x0E, 0x7E, 0x00, 0x00, 0x00
+  };
+  uint32_t c_size;
+
+  if (sim->high_capacity) {
+    memcpy(csd, csd_v2, 16);
+    c_size = sim->nb_blocks / 1024;
+    c_size = c_size > 0 ? c_size - 1 : 0;
+    csd[7] = (c_size >> 16) & 0x3F;
+    csd[8] = c_size >> 8;
+    csd[9] = c_size;
+  } else {
+    /* C_SIZE_MULT = 7: 512 blocks per unit of C_SIZE */
+    memcpy(csd, csd_v1, 16);
+    c_size = sim->nb_blocks / 512;
+    c_size = c_size > 0 ? c_size - 1 : 0;
+    c_size = c_size > 0xFFF ? 0xFFF : c_size;
+    csd[6] |= (c_size >> 10) & 0x03;
+    csd[7] = c_size >> 2;
+    csd[8] = (c_size & 0x03) << 6;
+  }
+  csd[15] = (sdcard_sim_crc7(csd, 15) << 1) | 0x01;
+}
+
+static void sdcard_sim_command(struct SDCardSim *sim, uint64_t time_ns)
+{
+  uint8_t resp[5];
+  uint8_t csd_resp[1 + 1 + 1 + 16 + 2];
+  uint16_t crc;
+  uint8_t idx = sim->cmd[0] & 0x3F;
+  uint32_t arg = ((uint32_t)sim->cmd[1] << 24) | ((uint32_t)sim->cmd[2] << 16) |
+                 ((uint32_t)sim->cmd[3] << 8) | sim->cmd[4];
+  bool_t app_cmd = sim->app_cmd;
+
+  sim->commands++;
+  sim->app_cmd = FALSE;
+  sim->state = SDCardSim_Listening;
+
+  /* CMD0 and CMD8 always carry a valid CRC, the others only when CRC is on */
+  if ((sim->crc_on || idx == 0 || idx == 8) &&
+      ((sdcard_sim_crc7(sim->cmd, 5) << 1) | 0x01) != sim->cmd[5]) {
+    resp[0] = sdcard_sim_r1(sim) | 0x08;
+    sdcard_sim_respond(sim, resp, 1);
+    return;
+  }
+
+  switch (idx) {
+    case 0:
+      sim->in_idle = TRUE;
+      sim->crc_on = FALSE;
+      sim->multiwrite = FALSE;
+      sim->single_write = FALSE;
+      sim->acmd41_count = 0;
+      resp[0] = 0x01;
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+    case 8:
+      resp[0] = sdcard_sim_r1(sim);
+      resp[1] = 0x00;
+      resp[2] = 0x00;
+      resp[3] = sim->cmd[3] & 0x0F;
+      resp[4] = sim->cmd[4];
+      sdcard_sim_respond(sim, resp, 5);
+      break;
+    case 9:
+      /* Register follows the R1 response as a data block */
+      if (sim->in_idle) {
+        resp[0] = sdcard_sim_r1(sim) | 0x04;
+        sdcard_sim_respond(sim, resp, 1);
+        break;
+      }
+      csd_resp[0] = 0x00;
+      csd_resp[1] = 0xFF;
+      csd_resp[2] = 0xFE;
+      sdcard_sim_csd(sim, &csd_resp[3]);
+      crc = sdcard_sim_crc16(&csd_resp[3], 16);
+      csd_resp[19] = crc >> 8;
+      csd_resp[20] = crc & 0xFF;
+      sdcard_sim_respond(sim, csd_resp, sizeof(csd_resp));
+      break;
+    case 16:
+      resp[0] = sdcard_sim_r1(sim) | (arg != SDCARD_SIM_BLOCK_SIZE ? 0x40 : 0x00);
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+    case 17:
+      if (sim->in_idle || !sdcard_sim_block_addr(sim, arg, &sim->addr)) {
+        resp[0] = sdcard_sim_r1(sim) | 0x40;
+        sdcard_sim_respond(sim, resp, 1);
+        break;
+      }
+      resp[0] = 0x00;
+      sdcard_sim_respond(sim, resp, 1);
+      sim->ready_ns = time_ns + sim->read_delay_ns;
+      sim->state = SDCardSim_WaitingToRead;
+      break;
+    case 24:
+    case 25:
+      if (sim->in_idle || !sdcard_sim_block_addr(sim, arg, &sim->addr)) {
+        resp[0] = sdcard_sim_r1(sim) | 0x40;
+        sdcard_sim_respond(sim, resp, 1);
+        break;
+      }
+      resp[0] = 0x00;
+      sdcard_sim_respond(sim, resp, 1);
+      sim->single_write = (idx == 24);
+      sim->multiwrite = (idx == 25);
+      break;
+    case 41:
+      if (!app_cmd) {
+        resp[0] = sdcard_sim_r1(sim) | 0x04;
+      } else {
+        if (sim->acmd41_count >= sim->acmd41_polls) {
+          sim->in_idle = FALSE;
+        }
+        sim->acmd41_count++;
+        resp[0] = sdcard_sim_r1(sim);
+      }
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+    case 55:
+      sim->app_cmd = TRUE;
+      resp[0] = sdcard_sim_r1(sim);
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+    case 58:
+      resp[0] = sdcard_sim_r1(sim);
+      resp[1] = (sim->in_idle ? 0x00 : 0x80) | (sim->high_capacity ? 0x40 : 0x00);
+      resp[2] = 0xFF;
+      resp[3] = 0x80;
+      resp[4] = 0x00;
+      sdcard_sim_respond(sim, resp, 5);
+      break;
+    case 59:
+      sim->crc_on = arg & 0x01;
+      resp[0] = sdcard_sim_r1(sim);
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+    default:
+      resp[0] = sdcard_sim_r1(sim) | 0x04;
+      sdcard_sim_respond(sim, resp, 1);
+      break;
+  }
+}
+
+/* Complete data block received, answer with a data response token */
+static void sdcard_sim_data_block(struct SDCardSim *sim, uint64_t time_ns)
+{
+  uint8_t resp;
+  uint16_t crc = ((uint16_t)sim->data[SDCARD_SIM_BLOCK_SIZE] << 8) | sim->data[SDCARD_SIM_BLOCK_SIZE + 1];
+
+  if (sim->crc_on && sdcard_sim_crc16(sim->data, SDCARD_SIM_BLOCK_SIZE) != crc) {
+    resp = 0x0B;
+    sim->blocks_rejected++;
+  } else if (sim->addr >= sim->nb_blocks ||
+             (sim->reject_every != 0 && (sim->blocks_written + sim->blocks_rejected + 1) % sim->reject_every == 0)) {
+    resp = 0x0D;
+    sim->blocks_rejected++;
+  } else {
+    resp = 0x05;
+    if (sim->storage != NULL) {
+      memcpy(&sim->storage[sim->addr * SDCARD_SIM_BLOCK_SIZE], sim->data, SDCARD_SIM_BLOCK_SIZE);
+    }
+    sim->blocks_written++;
+    sim->addr++;
+  }
+
+  /* Response directly after the CRC, then busy while programming */
+  sim->out[0] = resp;
+  sim->out_len = 1;
+  sim->out_idx = 0;
+  sim->single_write = FALSE;
+  sim->ready_ns = time_ns + sdcard_sim_busy_ns(sim);
+  sim->state = (resp == 0x05) ? SDCardSim_Busy : SDCardSim_Listening;
+}
+
+/**
+ * Exchange one byte with the card while it is selected.
+ * @param in Byte clocked out by the host
+ * @param time_ns Time at which the byte is clocked
+ * @return Byte clocked in by the host
+ */
+uint8_t sdcard_sim_exchange(struct SDCardSim *sim, uint8_t in, uint64_t time_ns)
+{
+  uint8_t out = 0xFF;
+  uint16_t crc;
+  sim->bytes++;
+
+  /* Pending response bytes go first, the card ignores its input meanwhile */
+  if (sim->out_idx < sim->out_len) {
+    out = sim->out[sim->out_idx++];
+    if (sim->state != SDCardSim_ReceivingCmd && sim->state != SDCardSim_ReceivingData) {
+      return out;
+    }
+  }
+
+  switch (sim->state) {
+    case SDCardSim_Busy:
+      if (time_ns < sim->ready_ns) {
+        sim->busy_polls++;
+        if (in == 0xFC || in == 0xFE) {
+          sim->tokens_while_busy++;
+        }
+        return 0x00;
+      }
+      sim->state = SDCardSim_Listening;
+      return 0xFF;
+
+    case SDCardSim_WaitingToRead:
+      if (time_ns < sim->ready_ns) {
+        return 0xFF;
+      }
+      /* Token now, block and CRC on the following bytes */
+      if (sim->storage != NULL) {
+        memcpy(&sim->out[0], &sim->storage[sim->addr * SDCARD_SIM_BLOCK_SIZE], SDCARD_SIM_BLOCK_SIZE);
+      } else {
+        memset(&sim->out[0], 0xFF, SDCARD_SIM_BLOCK_SIZE);
+      }
+      crc = sdcard_sim_crc16(sim->out, SDCARD_SIM_BLOCK_SIZE);
+      sim->out[SDCARD_SIM_BLOCK_SIZE] = crc >> 8;
+      sim->out[SDCARD_SIM_BLOCK_SIZE + 1] = crc & 0xFF;
+      sim->out_len = SDCARD_SIM_BLOCK_SIZE + 2;
+      sim->out_idx = 0;
+      sim->blocks_read++;
+      sim->state = SDCardSim_Listening;
+      return 0xFE;
+
+    case SDCardSim_ReceivingCmd:
+      sim->cmd[sim->cmd_len++] = in;
+      if (sim->cmd_len == 6) {
+        sdcard_sim_command(sim, time_ns);
+      }
+      return out;
+
+    case SDCardSim_ReceivingData:
+      sim->data[sim->data_len++] = in;
+      if (sim->data_len == SDCARD_SIM_BLOCK_SIZE + 2) {
+        sdcard_sim_data_block(sim, time_ns);
+      }
+      return out;
+
+    case SDCardSim_Listening:
+    default:
+      if (sim->multiwrite) {
+        if (in == 0xFC) {
+          sim->data_len = 0;
+          sim->state = SDCardSim_ReceivingData;
+        } else if (in == 0xFD) {
+          /* Stop tran: one more byte, then busy */
+          sim->multiwrite = FALSE;
+          sim->out[0] = 0xFF;
+          sim->out_len = 1;
+          sim->out_idx = 0;
+          sim->ready_ns = time_ns + sdcard_sim_busy_ns(sim);
+          sim->state = SDCardSim_Busy;
+        }
+        return 0xFF;
+      }
+      if (sim->single_write && in == 0xFE) {
+        sim->data_len = 0;
+        sim->state = SDCardSim_ReceivingData;
+        return 0xFF;
+      }
+      if ((in & 0xC0) == 0x40) {
+        sim->cmd[0] = in;
+        sim->cmd_len = 1;
+        sim->state = SDCardSim_ReceivingCmd;
+      }
+      return 0xFF;
+  }
+}
+
+static struct SDCardSim *sdcard_sim_find(struct spi_periph *p, uint8_t slave_idx)
+{
+  for (uint8_t i = 0; i < sdcard_sim_nb_cards; i++) {
+    if (sdcard_sim_cards[i]->spi_p == p && sdcard_sim_cards[i]->slave_idx == slave_idx) {
+      return sdcard_sim_cards[i];
+    }
+  }
+  return NULL;
+}
+
+static uint8_t sdcard_sim_periph_idx(struct spi_periph *p)
+{
+  uint8_t i;
+  for (i = 0; i < SDCARD_SIM_MAX_CARDS && sdcard_sim_periph[i] != NULL; i++) {
+    if (sdcard_sim_periph[i] == p) {
+      return i;
+    }
+  }
+  if (i == SDCARD_SIM_MAX_CARDS) {
+    i = SDCARD_SIM_MAX_CARDS - 1;
+  }
+  sdcard_sim_periph[i] = p;
+  return i;
+}
+
+/**
+ * Clock the bytes of the transaction through the card right away, but only
+ * call after_cb once the simulated time has passed the end of the transaction.
+ */
+bool_t spi_submit(struct spi_periph *p, struct spi_transaction *t)
+{
+  if (sdcard_sim_queue_len >= SDCARD_SIM_QUEUE_SIZE) {
+    return FALSE;
+  }
+
+  uint8_t pidx = sdcard_sim_periph_idx(p);
+  uint64_t start_ns = sdcard_sim_now_ns;
+  if (sdcard_sim_periph_free_ns[pidx] > start_ns) {
+    start_ns = sdcard_sim_periph_free_ns[pidx];
+  }
+
+  /* SPI clock is the base clock divided by 2, 4, ..., 256 */
+  struct SDCardSim *sim = sdcard_sim_find(p, t->slave_idx);
+  uint32_t base_hz = (sim != NULL) ? sim->spi_base_hz : 42000000;
+  uint64_t byte_ns = (8ULL * 1000000000ULL * (2ULL << t->cdiv)) / base_hz;
+  uint16_t len = t->input_length > t->output_length ? t->input_length : t->output_length;
+  bool_t selected = (sim != NULL && t->select != SPINoSelect);
+
+  if (t->before_cb != NULL) {
+    t->before_cb(t);
+  }
+  if (selected) {
+    sim->transactions++;
+  }
+
+  uint64_t byte_time_ns = start_ns + (sim != NULL ? sim->setup_ns : 0);
+  for (uint16_t i = 0; i < len; i++) {
+    byte_time_ns += byte_ns;
+    uint8_t out = (i < t->output_length) ? t->output_buf[i] : 0xFF;
+    uint8_t in = selected ? sdcard_sim_exchange(sim, out, byte_time_ns) : 0xFF;
+    if (i < t->input_length) {
+      t->input_buf[i] = in;
+    }
+  }
+
+  sdcard_sim_periph_free_ns[pidx] = byte_time_ns;
+  t->status = SPITransPending;
+  sdcard_sim_queue[sdcard_sim_queue_len].t = t;
+  sdcard_sim_queue[sdcard_sim_queue_len].end_ns = byte_time_ns;
+  sdcard_sim_queue[sdcard_sim_queue_len].seq = sdcard_sim_seq++;
+  sdcard_sim_queue_len++;
+  return TRUE;
+}
+
+/**
+ * Advance simulated time, calling the after_cb of every transaction that
+ * completes on the way. Callbacks may submit new transactions.
+ */
+void sdcard_sim_run_until(uint64_t time_ns)
+{
+  while (sdcard_sim_queue_len > 0) {
+    /* Earliest completion, submission order on a tie */
+    uint8_t first = 0;
+    for (uint8_t i = 1; i < sdcard_sim_queue_len; i++) {
+      if (sdcard_sim_queue[i].end_ns < sdcard_sim_queue[first].end_ns ||
+          (sdcard_sim_queue[i].end_ns == sdcard_sim_queue[first].end_ns &&
+           sdcard_sim_queue[i].seq < sdcard_sim_queue[first].seq)) {
+        first = i;
+      }
+    }
+    if (sdcard_sim_queue[first].end_ns > time_ns) {
+      break;
+    }
+
+    struct spi_transaction *t = sdcard_sim_queue[first].t;
+    if (sdcard_sim_queue[first].end_ns > sdcard_sim_now_ns) {
+      sdcard_sim_now_ns = sdcard_sim_queue[first].end_ns;
+    }
+    sdcard_sim_queue_len--;
+    for (uint8_t i = first; i < sdcard_sim_queue_len; i++) {
+      sdcard_sim_queue[i] = sdcard_sim_queue[i + 1];
+    }
+
+    t->status = SPITransSuccess;
+    if (t->after_cb != NULL) {
+      uint64_t cb_start_ns = sdcard_sim_host_ns();
+      if (sdcard_sim_callback != NULL) {
+        sdcard_sim_callback(t);
+      } else {
+        t->after_cb(t);
+      }
+      uint64_t cb_ns = sdcard_sim_host_ns() - cb_start_ns;
+      sdcard_sim_callback_stats.count++;
+      sdcard_sim_callback_stats.total_ns += cb_ns;
+      if (cb_ns > sdcard_sim_callback_stats.max_ns) {
+        sdcard_sim_callback_stats.max_ns = cb_ns;
+      }
+    }
+  }
+  if (time_ns > sdcard_sim_now_ns) {
+    sdcard_sim_now_ns = time_ns;
+  }
+}
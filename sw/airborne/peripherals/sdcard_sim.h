@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sdcard_sim.h
+ *  @brief Host-side model of an SD card in SPI mode.
+ *
+ * Implements spi_submit, so the real sdcard_spi driver can be run against it
+ * instead of against the spi mock. Every byte clocked out by the driver is fed
+ * to the card model, which answers like a card would: commands with Ncr delay,
+ * data tokens, data responses and busy time after programming.
+ *
+ * Time is simulated. A transaction takes the time of its bytes at the selected
+ * clock divider plus a fixed setup time. The after_cb of a transaction is
+ * called from sdcard_sim_run_until() when the simulated time reaches the end
+ * of the transaction, not from within spi_submit.
+ *
+ * Usage:
+ * struct SDCardSim sim;
+ * sdcard_sim_init(&sim, &spi2, SPI_SLAVE3, storage, nb_blocks);
+ * sim.busy_model = SDCardSimBusy_Uniform;
+ * ...
+ * sdcard_sim_run_until(sdcard_sim_time_ns() + period_ns);
+ * sdcard_spi_periodic(&sdcard1);
+ */
+
+#ifndef SDCARD_SIM_H
+#define SDCARD_SIM_H
+
+#include "std.h"
+#include "mcu_periph/spi.h"
+
+#ifndef SDCARD_SIM_MAX_CARDS
+#define SDCARD_SIM_MAX_CARDS 4
+#endif
+
+#ifndef SDCARD_SIM_QUEUE_SIZE
+#define SDCARD_SIM_QUEUE_SIZE 16
+#endif
+
+#define SDCARD_SIM_BLOCK_SIZE 512
+
+/** How long the card stays busy after a data block or stop token */
+enum SDCardSimBusyModel {
+  SDCardSimBusy_Fixed,    /**< Always busy_min_ns */
+  SDCardSimBusy_Uniform,  /**< Uniformly distributed between busy_min_ns and busy_max_ns */
+  SDCardSimBusy_Trace,    /**< Replay busy_trace_ns, starting over at the end */
+};
+
+enum SDCardSimState {
+  SDCardSim_Listening,      /**< Waiting for a command or data token */
+  SDCardSim_ReceivingCmd,   /**< Collecting the six command bytes */
+  SDCardSim_WaitingToRead,  /**< CMD17 accepted, data token not yet available */
+  SDCardSim_ReceivingData,  /**< Collecting data block and CRC */
+  SDCardSim_Busy,           /**< Programming, DO held low */
+};
+
+struct SDCardSim {
+  /* Configuration, set by sdcard_sim_init() to a fast and well-behaved card */
+  struct spi_periph *spi_p;
+  uint8_t slave_idx;
+  uint8_t *storage;             /**< nb_blocks * SDCARD_SIM_BLOCK_SIZE bytes, or NULL to discard data */
+  uint32_t nb_blocks;
+  bool_t high_capacity;         /**< CCS bit in OCR, block instead of byte addressing */
+  uint8_t ncr;                  /**< Bytes from end of command to response, 1..8 */
+  uint16_t acmd41_polls;        /**< Number of ACMD41 answered with 0x01 before ready */
+  uint32_t read_delay_ns;       /**< Time from CMD17 response to data token */
+  enum SDCardSimBusyModel busy_model;
+  uint32_t busy_min_ns;
+  uint32_t busy_max_ns;
+  const uint32_t *busy_trace_ns;
+  uint32_t busy_trace_len;
+  uint32_t reject_every;        /**< Reject every n-th data block with 0x0D, 0 = never */
+  uint32_t spi_base_hz;         /**< SPI clock before the divider */
+  uint32_t setup_ns;            /**< Overhead per transaction of the SPI driver */
+  uint32_t seed;                /**< For SDCardSimBusy_Uniform */
+
+  /* Card state */
+  enum SDCardSimState state;
+  bool_t in_idle;
+  bool_t app_cmd;
+  bool_t crc_on;
+  bool_t multiwrite;
+  bool_t single_write;
+  uint16_t acmd41_count;
+  uint8_t cmd[6];
+  uint8_t cmd_len;
+  uint32_t addr;                /**< Block address of current or next data block */
+  uint8_t data[SDCARD_SIM_BLOCK_SIZE + 2];
+  uint16_t data_len;
+  uint8_t out[SDCARD_SIM_BLOCK_SIZE + 16];  /**< Bytes the card is going to send */
+  uint16_t out_len;
+  uint16_t out_idx;
+  uint64_t ready_ns;            /**< End of busy time or read delay */
+  uint32_t trace_idx;
+
+  /* Statistics */
+  uint32_t commands;
+  uint32_t blocks_written;
+  uint32_t blocks_read;
+  uint32_t blocks_rejected;
+  uint32_t busy_polls;          /**< Bytes clocked while the card was busy */
+  uint32_t tokens_while_busy;   /**< Data tokens sent while the card was busy, they are lost */
+  uint64_t bytes;               /**< All bytes clocked while selected */
+  uint32_t transactions;        /**< Transactions that selected this card */
+};
+
+/** Host time spent in after_cb, i.e. in the driver's SPI callback */
+struct SDCardSimCallbackStats {
+  uint32_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+extern struct SDCardSimCallbackStats sdcard_sim_callback_stats;
+
+/**
+ * If set, called instead of the after_cb of every transaction, e.g. to look
+ * at the driver around each callback. It has to call after_cb itself.
+ */
+extern void (*sdcard_sim_callback)(struct spi_transaction *t);
+
+extern void sdcard_sim_init(struct SDCardSim *sim, struct spi_periph *spi_p, uint8_t slave_idx,
+                            uint8_t *storage, uint32_t nb_blocks);
+extern void sdcard_sim_reset(void);
+extern uint8_t sdcard_sim_exchange(struct SDCardSim *sim, uint8_t in, uint64_t time_ns);
+extern void sdcard_sim_run_until(uint64_t time_ns);
+extern uint64_t sdcard_sim_time_ns(void);
+extern uint8_t sdcard_sim_pending(void);
+
+/* Implementation of the spi interface */
+extern bool_t spi_submit(struct spi_periph *p, struct spi_transaction *t);
+
+/* Implementation of sys_time, in simulated time */
+extern uint32_t get_sys_time_usec(void);
+
+#endif /* SDCARD_SIM_H */
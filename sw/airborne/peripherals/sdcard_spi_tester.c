@@ -24,10 +24,29 @@
  *  @brief Test code for sdcard_spi using unity and cmock.
  */
 
+/*
+ * Built with the driver defaults, with the optional features switched on, and
+ * with the shared buffer layout.
+ */
+/* TEST_DEFINES: */
+/* TEST_DEFINES: SDCARD_BLOCK_BUFFERS=8 SDCARD_CHAIN_MAX=4 SDCARD_TRACE SDCARD_CACHE_BLOCKS=2 */
+/* TEST_DEFINES: SDCARD_SHARED_BUFFER */
+
 /* By prepending "Mock" to an include, a mock object is generated automatically by cmock. */
 #include "unity.h"
 #include "mcu_periph/Mockspi.h"
 #include "peripherals/sdcard_spi.h"
+#include "peripherals/sd_trace.h"
+#include <string.h>
+
+/* Multiwrite data block sent from output_buf, see the shared buffer layout */
+#ifdef SDCARD_SHARED_BUFFER
+#define OUTPUT_BLOCK_LENGTH 515
+#define OUTPUT_BLOCK_SENT_STATUS SDCard_MultiWriteSendingBlock
+#else
+#define OUTPUT_BLOCK_LENGTH 516
+#define OUTPUT_BLOCK_SENT_STATUS SDCard_MultiWriteWriting
+#endif
 
 /* Variable to check if the spi_submit stub was called */
 uint8_t SpiSubmitNrCalls;
@@ -38,18 +57,85 @@ bool_t CallbackWasCalled;
 /* Is 1 by default, but can be more. Used in SpiSubmitCall_RequestNBytes() */
 uint8_t NBytesToRequest;
 
+/* Block buffer expected to be sent in SpiSubmitCall_SendRingDataBlock() */
+uint8_t ExpectedBlockIdx;
+
+/* Caller-owned block memory, see SpiSubmitCall_SendCallerDataBlock() */
+uint8_t CallerBlock[SD_BLOCK_PADDED_SIZE];
+
 /* Declared in spi.c during normal operation */
 struct spi_periph spi2;
 
 /* Declared in sdcard_spi.c during normal operation */
 struct SDCard sdcard1;
 
+/* Defined in sys_time_arch.c during normal operation */
+uint32_t FakeSysTimeUsec;
+uint32_t get_sys_time_usec(void)
+{
+  return FakeSysTimeUsec;
+}
+
 /* Private function in sdcard_spi.c */
 extern void sdcard_spi_spicallback(struct spi_transaction *t);
 
+void helper_ExampleCallbackFunction(void);
+
 /* Struct to revert to orginial state before each unit test */
 struct SDCard sdcard_original;
 
+/**
+ * @brief Bitwise reference implementation of the CRC7 used for commands
+ * Polynomial x^7 + x^3 + 1. Slow but obviously correct, used to verify the
+ * table driven implementation in the driver.
+ */
+uint8_t helper_ReferenceCrc7(const uint8_t *data, uint16_t len)
+{
+  uint8_t crc = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc <<= 1;
+      if (((data[i] << bit) ^ crc) & 0x80) {
+        crc ^= 0x09;
+      }
+    }
+    crc &= 0x7F;
+  }
+  return crc;
+}
+
+/**
+ * @brief Bitwise reference implementation of the CRC16-CCITT used for data
+ * Polynomial x^16 + x^12 + x^5 + 1, initial value 0.
+ */
+uint16_t helper_ReferenceCrc16(uint16_t crc, const uint8_t *data, uint16_t len)
+{
+  for (uint16_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+/**
+ * @brief Expected last byte of a command
+ * Only the stop bit if CRC checking is disabled, otherwise the CRC7 of the
+ * first five bytes followed by the stop bit.
+ */
+uint8_t helper_CommandCrc(volatile uint8_t *cmd)
+{
+  uint8_t bytes[5];
+  if (!sdcard1.crc_enabled) {
+    return 0x01;
+  }
+  for (uint8_t i = 0; i < 5; i++) {
+    bytes[i] = cmd[i];
+  }
+  return (helper_ReferenceCrc7(bytes, 5) << 1) | 0x01;
+}
+
 /**
  * @brief Called before each test by the unity framework
  */
@@ -67,6 +153,11 @@ void setUp(void)
   /* In SpiSubmitCall_RequestNBytes(), request 1 byte by default */
   NBytesToRequest = 1;
 
+  /* First block buffer of the ring by default */
+  ExpectedBlockIdx = 0;
+
+  FakeSysTimeUsec = 0;
+
   /* Initialize Mock spi interface */
   Mockspi_Init();
 
@@ -74,6 +165,10 @@ void setUp(void)
    * In normal operation, it is called by the user of the sdcard, for example the sd_logger. */
   sdcard_spi_init(&sdcard1, &spi2, SPI_SLAVE3); /* Works also with other peripheral or slave */
 
+#ifdef SDCARD_TRACE
+  /* Start every test with an empty trace */
+  sd_trace_init();
+#endif
 
   sdcard1.response_counter = 57; /* Non-zero value to make sure this gets set to zero everywhere */
   sdcard1.timeout_counter = 5700; /* Non-zero value to make sure this gets set to zero everywhere */
@@ -114,6 +209,34 @@ void test_SdCardInitializeStructInitialValues(void)
   sdcard1.spi_t.input_length = 57;
   sdcard1.spi_t.output_length = 57;
   sdcard1.card_type = 57;
+  sdcard1.queue_idx = 57;
+  sdcard1.queue_len = 57;
+  sdcard1.crc_enabled = 57;
+  sdcard1.output_crc = 57;
+  sdcard1.output_crc_valid = 57;
+  sdcard1.block_acquire_idx = 57;
+  sdcard1.block_write_idx = 57;
+  for (uint8_t i = 0; i < SDCARD_BLOCK_BUFFERS; i++) {
+    sdcard1.block_state[i] = 57;
+  }
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.init_callback = &helper_ExampleCallbackFunction;
+  sdcard1.busy_callback = &helper_ExampleCallbackFunction;
+  sdcard1.error_callback = &helper_ExampleCallbackFunction;
+  sdcard1.busy_seen = 57;
+  sdcard1.init_budget_us = 57;
+  sdcard1.init_time_us = 57;
+  sdcard1.acmd41_start = 57;
+  sdcard1.nb_blocks = 57;
+#if SDCARD_CACHE_BLOCKS > 0
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    sdcard1.cache[i].valid = TRUE;
+  }
+  sdcard1.cache_tick = 57;
+  sdcard1.cache_hits = 57;
+  sdcard1.cache_misses = 57;
+#endif
+  FakeSysTimeUsec = 1234;
 
 
   /* Call the function */
@@ -134,6 +257,44 @@ void test_SdCardInitializeStructInitialValues(void)
   TEST_ASSERT_EQUAL(0, sdcard1.spi_t.input_length);
   TEST_ASSERT_EQUAL(0, sdcard1.spi_t.output_length);
   TEST_ASSERT_EQUAL(SDCardType_Unknown, sdcard1.card_type);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_idx);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len); /* Request queue is empty */
+  TEST_ASSERT_EQUAL(SDCARD_USE_CRC, sdcard1.crc_enabled);
+  TEST_ASSERT_EQUAL(0, sdcard1.output_crc);
+  TEST_ASSERT_FALSE(sdcard1.output_crc_valid);
+  TEST_ASSERT_EQUAL(0, sdcard1.block_acquire_idx);
+  TEST_ASSERT_EQUAL(0, sdcard1.block_write_idx);
+  for (uint8_t i = 0; i < SDCARD_BLOCK_BUFFERS; i++) {
+    TEST_ASSERT_EQUAL(SDCardBlock_Free, sdcard1.block_state[i]);
+  }
+  for (uint8_t i = 0; i < SDCARD_LATENCY_BINS; i++) {
+    TEST_ASSERT_EQUAL(0, sdcard1.latency_hist[i]);
+  }
+  TEST_ASSERT_EQUAL(0, sdcard1.latency_count);
+  TEST_ASSERT_EQUAL(0, sdcard1.latency_max);
+  TEST_ASSERT_EQUAL(0, sdcard1.busy_polls_max);
+  for (uint8_t i = 0; i < SDCARD_BUSY_OPS; i++) {
+    TEST_ASSERT_EQUAL(0, sdcard1.busy_estimate[i]);
+  }
+  TEST_ASSERT_EQUAL(SDCARD_ADAPTIVE_POLL, sdcard1.adaptive_poll);
+  TEST_ASSERT_EQUAL(0, sdcard1.polls_skipped);
+  TEST_ASSERT_FALSE(sdcard1.busy_seen);
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+  TEST_ASSERT_NULL(sdcard1.init_callback);
+  TEST_ASSERT_NULL(sdcard1.busy_callback);
+  TEST_ASSERT_NULL(sdcard1.error_callback);
+  TEST_ASSERT_EQUAL(SDCARD_INIT_BUDGET_US, sdcard1.init_budget_us);
+  TEST_ASSERT_EQUAL(1234, sdcard1.init_start);
+  TEST_ASSERT_EQUAL(0, sdcard1.init_time_us);
+  TEST_ASSERT_EQUAL(0, sdcard1.nb_blocks); /* Unknown until the CSD is read */
+#if SDCARD_CACHE_BLOCKS > 0
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    TEST_ASSERT_FALSE(sdcard1.cache[i].valid);
+  }
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_tick);
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_hits);
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_misses);
+#endif
 
   /* Also, the state for upcoming periodic loop is set */
   TEST_ASSERT_EQUAL(SDCard_BeforeDummyClock, sdcard1.status);
@@ -435,11 +596,12 @@ void test_ReadCMD8ParameterMatch(void)
   TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter); /* Reset the timout counter for ACMD41 */
 }
 
-bool_t SpiSubmitCall_SendACMD41(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+/**
+ * @brief Check an ACMD41 transaction (CMD55 followed by CMD41)
+ * @param arg 0x40000000 (HCS) for version 2 cards, 0 for version 1 cards
+ */
+void helper_CheckACMD41(struct spi_transaction *t, uint32_t arg)
 {
-  (void) p; (void) cmock_num_calls; /* ignore unused variables */
-  SpiSubmitNrCalls++;
-
   /* Perform ACMD call with argument ACMD_ARG */
   TEST_ASSERT_EQUAL(6+8+1+6, t->output_length); /* CMD55 + Ncr (max 8) + R1 + CMD41 */
   TEST_ASSERT_EQUAL(6+8+1+6, t->input_length);
@@ -450,7 +612,7 @@ bool_t SpiSubmitCall_SendACMD41(struct spi_periph *p, struct spi_transaction *t,
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[3]);
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]);
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]);
 
   /* Response time CMD55 (8+1) */
   for(uint8_t i=0; i<9; i++){
@@ -459,14 +621,22 @@ bool_t SpiSubmitCall_SendACMD41(struct spi_periph *p, struct spi_transaction *t,
 
   /* ACMD_CMD */
   TEST_ASSERT_EQUAL_HEX8(0x40 | 41, t->output_buf[15]);
-  TEST_ASSERT_EQUAL_HEX8(0x40000000 >> 24, t->output_buf[16]);
-  TEST_ASSERT_EQUAL_HEX8(0x40000000 >> 16, t->output_buf[17]);
-  TEST_ASSERT_EQUAL_HEX8(0x40000000 >> 8, t->output_buf[18]);
-  TEST_ASSERT_EQUAL_HEX8(0x40000000 >> 0, t->output_buf[19]);
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[20]);
+  TEST_ASSERT_EQUAL_HEX8(arg >> 24, t->output_buf[16]);
+  TEST_ASSERT_EQUAL_HEX8(arg >> 16, t->output_buf[17]);
+  TEST_ASSERT_EQUAL_HEX8(arg >> 8, t->output_buf[18]);
+  TEST_ASSERT_EQUAL_HEX8(arg >> 0, t->output_buf[19]);
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[15]), t->output_buf[20]);
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+}
+
+bool_t SpiSubmitCall_SendACMD41(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls; /* ignore unused variables */
+  SpiSubmitNrCalls++;
+
+  helper_CheckACMD41(t, 0x40000000);
 
   return TRUE;
 }
@@ -555,7 +725,7 @@ bool_t SpiSubmitCall_SendCMD58(struct spi_periph *p, struct spi_transaction *t,
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[3]);
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]); /* Stop bit */
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -629,7 +799,7 @@ bool_t SpiSubmitCall_SendCMD16(struct spi_periph *p, struct spi_transaction *t,
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
   TEST_ASSERT_EQUAL_HEX8(0x02, t->output_buf[3]); /* force blocksize 512 bytes. */
   TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]); /* Stop bit */
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -722,14 +892,231 @@ void test_PollingCMD16ResponseDataReady(void)
   TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
 }
 
+/**
+ * Version 1 cards do not know CMD8 and answer with illegal command (with the
+ * idle bit still set). They are initialized with ACMD41 without the HCS bit
+ * and are always byte addressed, so CMD58 is skipped and CMD16 follows.
+ */
+void test_PollingCMD8ResponseIllegalCommandIsVersion1Card(void)
+{
+  sdcard1.status = SDCard_ReadingCMD8Resp;
+  sdcard1.crc_enabled = FALSE;
+  sdcard1.input_buf[0] = 0x05;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v1, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardType_SdV1, sdcard1.card_type);
+  TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter); /* Reset the timout counter for ACMD41 */
+}
+
+bool_t SpiSubmitCall_SendACMD41v1(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls; /* ignore unused variables */
+  SpiSubmitNrCalls++;
+
+  helper_CheckACMD41(t, 0);
+
+  return TRUE;
+}
+
+void test_SendACMD41v1NextPeriodicLoop(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v1;
+  sdcard1.timeout_counter = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41v1);
+
+  /* Function is called in the periodic loop */
+  sdcard_spi_periodic(&sdcard1);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(1, sdcard1.timeout_counter);
+}
+
+void test_ReadySendingACMD41v1(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v1;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingACMD41v1Resp, sdcard1.status);
+}
+
+void test_PollingACMD41v1ResponseTimeout(void)
+{
+  sdcard1.status = SDCard_ReadingACMD41v1Resp;
+  helper_ResponseTimeout(9);
+}
+
+void test_PollingACMD41v1Response0x01(void)
+{
+  sdcard1.timeout_counter = 0;
+  sdcard1.status = SDCard_ReadingACMD41v1Resp;
+  sdcard1.input_buf[0] = 0x01;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v1, sdcard1.status);
+}
+
+void test_PollingACMD41v1Response0x00SendCMD16(void)
+{
+  sdcard1.status = SDCard_ReadingACMD41v1Resp;
+  sdcard1.card_type = SDCardType_SdV1;
+  sdcard1.timeout_counter = 57;
+  sdcard1.input_buf[0] = 0x00;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD16);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD16, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardType_SdV1, sdcard1.card_type);
+}
+
+/**
+ * MMC cards do not know ACMD41 either. They are initialized with CMD1 and
+ * are byte addressed like version 1 cards.
+ */
+void test_PollingACMD41v1ResponseIllegalCommandIsMmc(void)
+{
+  sdcard1.status = SDCard_ReadingACMD41v1Resp;
+  sdcard1.card_type = SDCardType_SdV1;
+  sdcard1.timeout_counter = 3;
+  sdcard1.input_buf[0] = 0x05;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD1, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardType_Mmc, sdcard1.card_type);
+  TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter);
+}
+
+bool_t SpiSubmitCall_SendCMD1(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls; /* ignore unused variables */
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(6, t->output_length);
+  TEST_ASSERT_EQUAL(6, t->input_length);  /* R1 response */
+
+  TEST_ASSERT_EQUAL_HEX8(0x41, t->output_buf[0]); /* CMD1 */
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[3]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]);
+
+  /* Callback */
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+
+  return TRUE;
+}
+
+void test_SendCMD1NextPeriodicLoop(void)
+{
+  sdcard1.status = SDCard_SendingCMD1;
+  sdcard1.timeout_counter = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD1);
+
+  /* Function is called in the periodic loop */
+  sdcard_spi_periodic(&sdcard1);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(1, sdcard1.timeout_counter);
+}
+
+void test_ReadySendingCMD1(void)
+{
+  sdcard1.status = SDCard_SendingCMD1;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD1Resp, sdcard1.status);
+}
+
+void test_PollingCMD1Response0x01(void)
+{
+  sdcard1.timeout_counter = 0;
+  sdcard1.status = SDCard_ReadingCMD1Resp;
+  sdcard1.input_buf[0] = 0x01;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD1, sdcard1.status);
+}
+
+void test_TryCMD1OnlyLimitedNumberOfTimes(void)
+{
+  sdcard1.status = SDCard_ReadingCMD1Resp;
+  sdcard1.timeout_counter = 499;
+  sdcard1.input_buf[0] = 0x01;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+void test_PollingCMD1Response0x00SendCMD16(void)
+{
+  sdcard1.status = SDCard_ReadingCMD1Resp;
+  sdcard1.card_type = SDCardType_Mmc;
+  sdcard1.input_buf[0] = 0x00;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD16);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD16, sdcard1.status);
+}
+
 void test_DoNotWriteDataIfNotIdle(void)
 {
   sdcard1.status = SDCard_Error;
 
   /* Call the write data function */
-  sdcard_spi_write_block(&sdcard1, 0x00000000);
+  sdcard_spi_write_block(&sdcard1, 0x00000000, NULL);
+
+  /* Expect zero calls to spi_submit */
+  /* Requests are not queued either, the card will not become idle again */
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+/**
+ * If the card is busy with something else, the write request is put in the
+ * queue. It is started as soon as the card becomes idle again.
+ */
+void test_QueueWriteDataIfNotIdle(void)
+{
+  sdcard1.status = SDCard_Busy;
+
+  /* Call the write data function */
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
 
   /* Expect zero calls to spi_submit */
+  TEST_ASSERT_EQUAL(SDCard_Busy, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCardRequest_WriteBlock, sdcard1.queue[0].type);
+  TEST_ASSERT_EQUAL_HEX32(0x00000014, sdcard1.queue[0].addr);
+  TEST_ASSERT_EQUAL_PTR(NULL, sdcard1.queue[0].callback);
+}
+
+void test_DoNotQueueWhenQueueIsFull(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.queue_idx = 1;
+  sdcard1.queue_len = SDCARD_QUEUE_SIZE;
+
+  /* Call the write data function */
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+
+  /* Request is dropped, existing requests are untouched */
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_idx);
+  TEST_ASSERT_EQUAL(SDCARD_QUEUE_SIZE, sdcard1.queue_len);
 }
 
 bool_t SpiSubmitCall_SendCMD24(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
@@ -756,7 +1143,7 @@ bool_t SpiSubmitCall_SendCMD24(struct spi_periph *p, struct spi_transaction *t,
     TEST_ASSERT_EQUAL_HEX8(0x28, t->output_buf[3]);
     TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
   }
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]); /* Stop bit */
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -771,7 +1158,7 @@ void test_WriteDataBlockWithBlockAddress(void)
   spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
 
   /* Call the write data function */
-  sdcard_spi_write_block(&sdcard1, 0x00000014); /* is decimal 20 * 512 */
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL); /* is decimal 20 * 512 */
 
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
   TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
@@ -784,7 +1171,7 @@ void test_WriteDataBlockWithByteAddress(void)
   spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
 
   /* Call the write data function */
-  sdcard_spi_write_block(&sdcard1, 0x00000014); /* = decimal 20 */
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL); /* = decimal 20 */
 
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
   TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
@@ -946,7 +1333,7 @@ bool_t SpiSubmitCall_SendCMD17(struct spi_periph *p, struct spi_transaction *t,
     TEST_ASSERT_EQUAL_HEX8(0x28, t->output_buf[3]); /* is 20 * 512 */
     TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
   }
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]); /* Stop bit */
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -959,7 +1346,7 @@ void helper_ExampleCallbackFunction(void)
   CallbackWasCalled = TRUE;
 }
 
-void test_DoNotReadDataIfNotIdle(void)
+void test_QueueReadDataIfNotIdle(void)
 {
   sdcard1.status = SDCard_Busy;
 
@@ -968,6 +1355,24 @@ void test_DoNotReadDataIfNotIdle(void)
 
   /* Expect zero calls to spi_submit */
   TEST_ASSERT_EQUAL(NULL, sdcard1.external_callback);
+
+  /* Callback is stored with the request, it becomes active when dispatched */
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCardRequest_ReadBlock, sdcard1.queue[0].type);
+  TEST_ASSERT_EQUAL_HEX32(0x00000000, sdcard1.queue[0].addr);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.queue[0].callback);
+}
+
+void test_DoNotReadDataInErrorState(void)
+{
+  sdcard1.status = SDCard_Error;
+
+  /* Call the read data function */
+  sdcard_spi_read_block(&sdcard1, 0x00000000, &helper_ExampleCallbackFunction);
+
+  /* Expect zero calls to spi_submit and nothing queued */
+  TEST_ASSERT_EQUAL(NULL, sdcard1.external_callback);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
 }
 
 void test_ReadDataBlockWithBlockAddress(void)
@@ -1155,7 +1560,7 @@ bool_t SpiSubmitCall_SendCMD25(struct spi_periph *p, struct spi_transaction *t,
     TEST_ASSERT_EQUAL_HEX8(0x28, t->output_buf[3]);
     TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
   }
-  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[5]); /* Stop bit */
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -1170,7 +1575,7 @@ void test_StartMultiWriteStartWhenIdleWithBlockAddress(void)
   spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
 
   /* Call the multiwrite start function */
-  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014); /* is decimal 20 * 512 */
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL); /* is decimal 20 * 512 */
 
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
   TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
@@ -1185,17 +1590,32 @@ void test_StartMultiWriteStartWhenIdleWithByteAddress(void)
   spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
 
   /* Call the write data function */
-  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014); /* = decimal 20 */
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL); /* = decimal 20 */
 
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
   TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
 }
 
-void test_StartMultiWriteOnlyIfIdle(void)
+void test_QueueMultiWriteStartIfNotIdle(void)
 {
   sdcard1.status = SDCard_Busy; /* Not idle */
 
-  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014);
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL);
+
+  /* Expect zero calls to spi_submit */
+  TEST_ASSERT_EQUAL(SDCard_Busy, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCardRequest_MultiWriteStart, sdcard1.queue[0].type);
+  TEST_ASSERT_EQUAL_HEX32(0x00000014, sdcard1.queue[0].addr);
+}
+
+void test_DoNotQueueMultiWriteStartWhenUninitialized(void)
+{
+  sdcard1.status = SDCard_UnInit;
+
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
 }
 
 
@@ -1237,9 +1657,16 @@ bool_t SpiSubmitCall_SendMultiWriteDataBlock(struct spi_periph *p, struct spi_tr
   (void) p; (void) cmock_num_calls;
   SpiSubmitNrCalls++;
 
+  TEST_ASSERT_EQUAL_PTR(sdcard1.output_buf, t->output_buf);
+#ifdef SDCARD_SHARED_BUFFER
+  /* Nothing clocked in over the block, the data response is read next */
+  TEST_ASSERT_EQUAL(SPISelect, t->select);
+  TEST_ASSERT_EQUAL(0, t->input_length);
+#else
   TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
-  TEST_ASSERT_EQUAL(516, t->output_length);
   TEST_ASSERT_EQUAL(516, t->input_length);
+#endif
+  TEST_ASSERT_EQUAL(OUTPUT_BLOCK_LENGTH, t->output_length);
   TEST_ASSERT_EQUAL(SPITransDone, t->status);
   TEST_ASSERT_EQUAL(SPIDiv32, t->cdiv);
 
@@ -1251,7 +1678,9 @@ bool_t SpiSubmitCall_SendMultiWriteDataBlock(struct spi_periph *p, struct spi_tr
   TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[512]);
   TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[513]); /* CRC byte 1 */
   TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[514]); /* CRC byte 2 */
+#ifndef SDCARD_SHARED_BUFFER
   TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[515]); /* Request data response */
+#endif
 
   /* Callback */
   TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
@@ -1274,7 +1703,7 @@ void test_WriteMultiWriteBlockWhenIdle(void)
 
   TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
-  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(OUTPUT_BLOCK_SENT_STATUS, sdcard1.status);
 }
 
 void test_DoNotWriteMultiWriteBlockIfNotIdle(void)
@@ -1316,36 +1745,277 @@ void testReadyMultiWriteSendingBlockAcceptedNoCallback(void)
   TEST_ASSERT_FALSE(CallbackWasCalled);
 }
 
+/**
+ * Multiwrite recovery
+ *
+ * A rejected block does not end the multiwrite. The driver stops the
+ * transmission, waits for the card, restarts it with CMD25 at the address of
+ * the rejected block and sends the retained block again. The block stays
+ * where it was sent from (output_buf, a ring buffer or caller memory), so
+ * the stop token and CMD25 are sent from the spare bytes at the end of
+ * output_buf, after the data response byte. With the shared buffer layout
+ * they also clock in there, see below.
+ *
+ * After SDCARD_MULTIWRITE_RETRIES rejections of the same block, the card goes
+ * to the error state as before.
+ */
+bool_t SpiSubmitCall_SendRecoveryStop(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  /* Behind the retained block */
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[SD_BLOCK_SIZE + 4], t->output_buf);
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(2, t->output_length);
+  TEST_ASSERT_EQUAL(2, t->input_length);
+  TEST_ASSERT_EQUAL(SPIDiv32, t->cdiv);
+  TEST_ASSERT_EQUAL_HEX8(0xFD, t->output_buf[0]); /* Stop Token for CMD25 */
+  TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[1]);
+#ifdef SDCARD_SHARED_BUFFER
+  TEST_ASSERT_EQUAL_PTR(t->output_buf, t->input_buf);
+#endif
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+  return TRUE;
+}
+
 void test_ReadyMultiWriteSendingDataBlockRejected(void)
 {
   sdcard1.status = SDCard_MultiWriteWriting;
   sdcard1.input_buf[515] = 0x0D; /* B00001101 = data rejected */
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.recovering = FALSE;
+  sdcard1.recovery_retries = 0;
+  FakeSysTimeUsec = 1000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRecoveryStop);
 
   /* Run the callback function */
   sdcard_spi_spicallback(&sdcard1.spi_t);
 
-  /* Reset different offset for the output buffer */
-  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, sdcard1.spi_t.output_buf);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  /* Block not written yet, callback kept for when it is */
   TEST_ASSERT_FALSE(CallbackWasCalled);
-  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[0], sdcard1.retry_buf);
+  TEST_ASSERT_TRUE(sdcard1.recovering);
+  TEST_ASSERT_EQUAL(1, sdcard1.recovery_retries);
+  TEST_ASSERT_EQUAL(1000, sdcard1.recovery_start);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverStopping, sdcard1.status);
 }
 
-void test_RequestBytePeriodicallyWhileMultiWriteBusy(void)
+void test_ReadyMultiWriteSendingDataBlockCrcError(void)
 {
-  sdcard1.status = SDCard_MultiWriteBusy;
-  sdcard1.input_buf[0] = 0x00; /* LOW = busy */
-  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x0B; /* B00001011 = CRC error */
+  sdcard1.recovery_retries = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRecoveryStop);
 
-  /* Run the periodic function */
-  sdcard_spi_periodic(&sdcard1);
+  sdcard_spi_spicallback(&sdcard1.spi_t);
 
-  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
-  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverStopping, sdcard1.status);
 }
 
-void test_RevertToIdleWhenNoLongerMultiWriteBusy(void)
+/**
+ * The time of the first rejection is kept when the resent block is rejected
+ * again.
+ */
+void test_RejectedAgainDuringRecovery(void)
 {
-  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x0D;
+  sdcard1.recovering = TRUE;
+  sdcard1.recovery_retries = 1;
+  sdcard1.recovery_start = 1000;
+  FakeSysTimeUsec = 3000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRecoveryStop);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(2, sdcard1.recovery_retries);
+  TEST_ASSERT_EQUAL(1000, sdcard1.recovery_start);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverStopping, sdcard1.status);
+}
+
+void test_RejectedTooOftenIsError(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x0D;
+  sdcard1.recovering = TRUE;
+  sdcard1.recovery_retries = SDCARD_MULTIWRITE_RETRIES;
+  sdcard1.recovery_failures = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  /* Reset different offset for the output buffer */
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, sdcard1.spi_t.output_buf);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(1, sdcard1.recovery_failures);
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+void test_RecoveryStopTokenSentWaitForBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteRecoverStopping;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverBusy, sdcard1.status);
+}
+
+void test_RequestBytePeriodicallyWhileRecoverBusy(void)
+{
+  sdcard1.adaptive_poll = FALSE;
+  sdcard1.status = SDCard_MultiWriteRecoverBusy;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverBusy, sdcard1.status);
+}
+
+void test_RemainRecoverBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteRecoverBusy;
+  sdcard1.input_buf[0] = 0x00; /* line = low = busy */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverBusy, sdcard1.status);
+}
+
+void test_RecoveryRestartsMultiWriteAtRejectedBlock(void)
+{
+  sdcard1.status = SDCard_MultiWriteRecoverBusy;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.recovering = TRUE;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[SD_BLOCK_SIZE + 4], sdcard1.spi_t.output_buf);
+#ifdef SDCARD_SHARED_BUFFER
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[SD_BLOCK_SIZE + 4], sdcard1.spi_t.input_buf);
+#endif
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+}
+
+void test_RecoveryRestartsMultiWriteWithByteAddress(void)
+{
+  sdcard1.status = SDCard_MultiWriteRecoverBusy;
+  sdcard1.card_type = SDCardType_SdV2byte;
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.recovering = TRUE;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+}
+
+/**
+ * CMD25 accepted during recovery: the retained block goes out right away
+ * instead of waiting in MultiWriteIdle for the next block.
+ */
+void test_RecoveryResendsRetainedBlock(void)
+{
+  sdcard1.status = SDCard_ReadingCMD25Resp;
+  sdcard1.input_buf[0] = 0x00; /* Ready */
+  sdcard1.recovering = TRUE;
+  sdcard1.retry_buf = &sdcard1.output_buf[0];
+  for (uint16_t i=0; i<256; i++) {
+    sdcard1.output_buf[1+i] = 0x00;
+    sdcard1.output_buf[1+i+256] = i;
+  }
+  /* Token overwritten by the response polls, the driver puts it back */
+  sdcard1.output_buf[0] = 0xFF;
+  sdcard1.output_buf[513] = 0xFF;
+  sdcard1.output_buf[514] = 0xFF;
+  sdcard1.output_buf[515] = 0xFF;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(OUTPUT_BLOCK_SENT_STATUS, sdcard1.status);
+}
+
+void test_RecoveredBlockAccepted(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x05; /* Accepted */
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.recovering = TRUE;
+  sdcard1.recovery_retries = 2;
+  sdcard1.recovery_start = 1000;
+  sdcard1.recoveries = 4;
+  sdcard1.recovery_time_max = 2000;
+  FakeSysTimeUsec = 4000;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_FALSE(sdcard1.recovering);
+  TEST_ASSERT_EQUAL(0, sdcard1.recovery_retries);
+  TEST_ASSERT_EQUAL(5, sdcard1.recoveries);
+  TEST_ASSERT_EQUAL(3000, sdcard1.recovery_time_last);
+  TEST_ASSERT_EQUAL(3000, sdcard1.recovery_time_max);
+  TEST_ASSERT_EQUAL(0x00000015, sdcard1.multiwrite_addr);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+}
+
+void test_AcceptedBlockAdvancesMultiWriteAddress(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x05;
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.recovering = FALSE;
+  sdcard1.recoveries = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(0x00000015, sdcard1.multiwrite_addr);
+  TEST_ASSERT_EQUAL(0, sdcard1.recoveries);
+}
+
+void test_MultiWriteStartSetsAddress(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.multiwrite_addr = 57;
+  sdcard1.recovering = TRUE;
+  sdcard1.recovery_retries = 57;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL(0x00000014, sdcard1.multiwrite_addr);
+  TEST_ASSERT_FALSE(sdcard1.recovering);
+  TEST_ASSERT_EQUAL(0, sdcard1.recovery_retries);
+}
+
+void test_RequestBytePeriodicallyWhileMultiWriteBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.input_buf[0] = 0x00; /* LOW = busy */
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  /* Run the periodic function */
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+}
+
+void test_RevertToIdleWhenNoLongerMultiWriteBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
   sdcard1.input_buf[0] = 0xFF; // line = high = no longer busy
 
   /* Run the callback function */
@@ -1391,7 +2061,7 @@ void test_StopWithMultiWrite(void)
   spi_submit_StubWithCallback(SpiSubmitCall_SendStopMultiWrite);
 
   /* Stop command */
-  sdcard_spi_multiwrite_stop(&sdcard1);
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
 
   TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
   TEST_ASSERT_EQUAL(SDCard_MultiWriteStopping, sdcard1.status);
@@ -1412,7 +2082,7 @@ void test_DoNotStopIfNotMultiWriteIdleOrBusy(void)
   sdcard1.status = SDCard_Idle;
 
   /* Stop command */
-  sdcard_spi_multiwrite_stop(&sdcard1);
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
   /* Expect nothing to happen */
 }
 
@@ -1420,3 +2090,3339 @@ void test_SendErrorMessage(void)
 {
   //TEST_IGNORE();
 }
+
+/**
+ * Helper to put a request directly in the queue, at the location where
+ * the queue index currently points to.
+ */
+void helper_QueueRequest(enum SDCardRequestType type, uint32_t addr, SDCardCallback callback)
+{
+  uint8_t i = (sdcard1.queue_idx + sdcard1.queue_len) % SDCARD_QUEUE_SIZE;
+  sdcard1.queue[i].type = type;
+  sdcard1.queue[i].addr = addr;
+  sdcard1.queue[i].callback = callback;
+  sdcard1.queue_len++;
+}
+
+/**
+ * The queued request is started from within the spi callback, as soon as the
+ * card reverts to idle. No need to wait for the next periodic loop.
+ */
+void test_DispatchQueuedReadWhenNoLongerBusy(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF; /* line = high = no longer busy */
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_ReadBlock, 0x00000014, &helper_ExampleCallbackFunction);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD17, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+/**
+ * After a completed read, the external callback is called first. Then the
+ * next request from the queue is started.
+ */
+void test_DispatchQueuedWriteAfterReadCompleted(void)
+{
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.card_type = SDCardType_SdV2byte;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_WriteBlock, 0x00000014, NULL);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+void helper_CallbackStartingWrite(void)
+{
+  CallbackWasCalled = TRUE;
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+}
+
+/**
+ * If the external callback immediately starts a new operation, that one runs
+ * first. The queued request keeps waiting until the card is idle again.
+ */
+void test_CallbackChainedRequestGoesBeforeQueue(void)
+{
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.external_callback = &helper_CallbackStartingWrite;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_MultiWriteStart, 0x00000014, NULL);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+}
+
+/**
+ * Requests are handled first-in first-out, also when the queue wraps around.
+ */
+void test_DispatchQueuedRequestsInOrder(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF; /* no longer busy */
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.queue_idx = SDCARD_QUEUE_SIZE - 1;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_MultiWriteStart, 0x00000014, NULL);
+  helper_QueueRequest(SDCardRequest_ReadBlock, 0x00000014, NULL);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_idx);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCardRequest_ReadBlock, sdcard1.queue[0].type);
+}
+
+/**
+ * Requests made during initialization are started when it is finished.
+ */
+void test_DispatchQueuedRequestAfterInitialization(void)
+{
+  sdcard1.status = SDCard_ReadingCMD16Resp;
+  sdcard1.response_counter = 4;
+  sdcard1.input_buf[0] = 0x00; /* correct response = ready */
+  sdcard1.card_type = SDCardType_SdV1;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_ReadBlock, 0x00000014, &helper_ExampleCallbackFunction);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD17, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+/**
+ * The driver owns a ring of SDCARD_BLOCK_BUFFERS block buffers. A producer
+ * acquires a buffer, fills the SD_BLOCK_SIZE data bytes and submits it. The
+ * driver sends submitted buffers in order during multiwrite and releases them
+ * when the card accepted the data. This way the next block can be filled while
+ * the previous one is being written.
+ */
+void test_AcquireBlockBuffersUntilExhausted(void)
+{
+  uint8_t *block[SDCARD_BLOCK_BUFFERS];
+
+  for (uint8_t i = 0; i < SDCARD_BLOCK_BUFFERS; i++) {
+    block[i] = sdcard_spi_block_acquire(&sdcard1);
+    /* Data starts after the reserved data token byte */
+    TEST_ASSERT_EQUAL_PTR(&sdcard1.block_buf[i][1], block[i]);
+    TEST_ASSERT_EQUAL(SDCardBlock_Acquired, sdcard1.block_state[i]);
+  }
+
+  /* All buffers in use */
+  TEST_ASSERT_NULL(sdcard_spi_block_acquire(&sdcard1));
+}
+
+void test_AcquireBlockBufferAgainAfterRelease(void)
+{
+  uint8_t *block[SDCARD_BLOCK_BUFFERS];
+  for (uint8_t i = 0; i < SDCARD_BLOCK_BUFFERS; i++) {
+    block[i] = sdcard_spi_block_acquire(&sdcard1);
+  }
+
+  /* Producer decides not to use the last buffer after all */
+  sdcard_spi_block_release(&sdcard1, block[SDCARD_BLOCK_BUFFERS - 1]);
+
+  TEST_ASSERT_EQUAL(SDCardBlock_Free, sdcard1.block_state[SDCARD_BLOCK_BUFFERS - 1]);
+  TEST_ASSERT_EQUAL_PTR(block[SDCARD_BLOCK_BUFFERS - 1], sdcard_spi_block_acquire(&sdcard1));
+}
+
+/**
+ * Checks a multiwrite data block that is not sent from sdcard1.output_buf,
+ * followed by gap bytes for a chained ring block (0 otherwise).
+ * Token, CRC, response and gap bytes are written by the driver around the data.
+ */
+void helper_CheckPaddedDataBlockGap(struct spi_transaction *t, uint16_t gap)
+{
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.input_buf, t->input_buf);
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(516 + gap, t->output_length);
+  TEST_ASSERT_EQUAL(516 + gap, t->input_length);
+  TEST_ASSERT_EQUAL(SPITransDone, t->status);
+  TEST_ASSERT_EQUAL(SPIDiv32, t->cdiv);
+
+  TEST_ASSERT_EQUAL_HEX8(0xFC, t->output_buf[0]); /* Data Token for CMD25 */
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[256]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[257]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[258]);
+  TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[512]);
+  TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[513]); /* CRC byte 1 */
+  TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[514]); /* CRC byte 2 */
+  TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[515]); /* Request data response */
+  for (uint16_t i = 0; i < gap; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[516 + i]); /* Busy after the response */
+  }
+
+  /* Callback */
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+}
+
+void helper_CheckPaddedDataBlock(struct spi_transaction *t)
+{
+  helper_CheckPaddedDataBlockGap(t, 0);
+}
+
+bool_t SpiSubmitCall_SendRingDataBlock(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  /* Transmitted directly from the ring buffer, no copy to output_buf */
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.block_buf[ExpectedBlockIdx][0], t->output_buf);
+  if (t->output_length > SD_BLOCK_PADDED_SIZE) {
+    /* Next ring block already submitted, see SpiSubmitCall_SendChainedRingBlock() */
+    helper_CheckPaddedDataBlockGap(t, SDCARD_CHAIN_GAP);
+  } else {
+    helper_CheckPaddedDataBlock(t);
+  }
+
+  return TRUE;
+}
+
+void helper_FillBlock(uint8_t *block)
+{
+  for (uint16_t i=0; i<256; i++) {
+    block[i] = 0x00;
+    block[i+256] = i;
+  }
+}
+
+void test_SubmitBlockStartsWriteWhenMultiWriteIdle(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+
+  uint8_t *block = sdcard_spi_block_acquire(&sdcard1);
+  helper_FillBlock(block);
+
+  /* Hand the block over to the driver */
+  sdcard_spi_block_submit(&sdcard1, block, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[0]);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+/**
+ * While the previous block is programmed, the next block can be acquired,
+ * filled and submitted. It is not sent yet.
+ */
+void test_SubmitBlockWhileMultiWriteBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  uint8_t *block = sdcard_spi_block_acquire(&sdcard1);
+  helper_FillBlock(block);
+  sdcard_spi_block_submit(&sdcard1, block, NULL);
+
+  /* Expect zero calls to spi_submit */
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Submitted, sdcard1.block_state[0]);
+
+  /* And the producer can continue with the next buffer */
+  TEST_ASSERT_NOT_NULL(sdcard_spi_block_acquire(&sdcard1));
+}
+
+void test_ReleaseBlockBufferWhenDataAccepted(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  uint8_t *block = sdcard_spi_block_acquire(&sdcard1);
+  helper_FillBlock(block);
+  sdcard_spi_block_submit(&sdcard1, block, &helper_ExampleCallbackFunction);
+
+  /* Data response */
+  sdcard1.input_buf[515] = 0x05; /* B00000101 = data accepted */
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  /* Buffer can be reused, transaction points to the default buffer again */
+  TEST_ASSERT_EQUAL(SDCardBlock_Free, sdcard1.block_state[0]);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, sdcard1.spi_t.output_buf);
+  TEST_ASSERT_EQUAL(1 % SDCARD_BLOCK_BUFFERS, sdcard1.block_write_idx);
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+}
+
+/**
+ * When the card is no longer busy and the next block was already submitted,
+ * it is sent immediately from the spi callback.
+ */
+void test_SendSubmittedBlockWhenNoLongerMultiWriteBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.input_buf[0] = 0xFF; /* line = high = no longer busy */
+  sdcard1.block_write_idx = 1;
+  sdcard1.block_acquire_idx = 1;
+  uint8_t *block = sdcard_spi_block_acquire(&sdcard1);
+  helper_FillBlock(block);
+  sdcard_spi_block_submit(&sdcard1, block, NULL);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  ExpectedBlockIdx = 1;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[1]);
+}
+
+/**
+ * Blocks submitted before the multiwrite was ready are sent as soon as the
+ * dummy byte after the CMD25 response has been clocked out.
+ */
+void test_SendSubmittedBlockWhenMultiWriteStarted(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.block_state[0] = SDCardBlock_Submitted;
+  sdcard1.block_acquire_idx = 1;
+  helper_FillBlock(&sdcard1.block_buf[0][1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+
+  /* Callback of the dummy byte */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+}
+
+void test_DoNotSendBlockThatIsNotSubmitted(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.input_buf[0] = 0xFF; /* no longer busy */
+  /* Acquired by the producer, but still being filled */
+  TEST_ASSERT_NOT_NULL(sdcard_spi_block_acquire(&sdcard1));
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  /* Expect zero calls to spi_submit */
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Acquired, sdcard1.block_state[0]);
+}
+
+bool_t SpiSubmitCall_SendCallerDataBlock(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  /* Transmitted directly from the memory of the caller */
+  TEST_ASSERT_EQUAL_PTR(&CallerBlock[0], t->output_buf);
+  helper_CheckPaddedDataBlock(t);
+
+  return TRUE;
+}
+
+/**
+ * Zero-copy variant of multiwrite_next. The caller provides
+ * SD_BLOCK_PADDED_SIZE bytes with the data at offset 1. The driver fills in
+ * the data token in front and the CRC and response bytes after the data, then
+ * sends everything straight from this memory.
+ */
+void test_WriteMultiWriteCallerBlockWhenIdle(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCallerDataBlock);
+
+  /* Padding bytes contain garbage, the driver should set them */
+  CallerBlock[0] = 0x57;
+  helper_FillBlock(&CallerBlock[1]);
+  CallerBlock[513] = 0x57;
+  CallerBlock[514] = 0x57;
+  CallerBlock[515] = 0x57;
+
+  /* Call the write function */
+  sdcard_spi_multiwrite_next_buf(&sdcard1, CallerBlock, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+}
+
+void test_DoNotWriteMultiWriteCallerBlockIfNotIdle(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+
+  /* Multiwrite write command */
+  sdcard_spi_multiwrite_next_buf(&sdcard1, CallerBlock, &helper_ExampleCallbackFunction);
+
+  /* Should not do anything */
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(NULL, sdcard1.external_callback);
+}
+
+/**
+ * When the callback is called, the caller is free to use its block memory
+ * again. The transaction points to the driver buffers again.
+ */
+void test_ReadyMultiWriteCallerBlockAccepted(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCallerDataBlock);
+  helper_FillBlock(&CallerBlock[1]);
+  sdcard_spi_multiwrite_next_buf(&sdcard1, CallerBlock, &helper_ExampleCallbackFunction);
+
+  /* Data response */
+  sdcard1.input_buf[515] = 0x05; /* B00000101 = data accepted */
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, sdcard1.spi_t.output_buf);
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+}
+
+/**
+ * The CRC7 for commands is calculated by the driver with a lookup table. The
+ * result is the 7-bit CRC, without the stop bit.
+ */
+void test_Crc7OfKnownCommands(void)
+{
+  uint8_t cmd0[5] = {0x40, 0x00, 0x00, 0x00, 0x00};
+  uint8_t cmd8[5] = {0x48, 0x00, 0x00, 0x01, 0xAA};
+  uint8_t cmd58[5] = {0x7A, 0x00, 0x00, 0x00, 0x00};
+
+  TEST_ASSERT_EQUAL_HEX8(0x95, (sdcard_spi_crc7(cmd0, 5) << 1) | 0x01);
+  TEST_ASSERT_EQUAL_HEX8(0x87, (sdcard_spi_crc7(cmd8, 5) << 1) | 0x01);
+  TEST_ASSERT_EQUAL_HEX8(0xFD, (sdcard_spi_crc7(cmd58, 5) << 1) | 0x01);
+}
+
+void test_Crc7MatchesReference(void)
+{
+  uint8_t cmd[5];
+  for (uint16_t i = 0; i < 256; i++) {
+    cmd[0] = 0x40 | (i & 0x3F);
+    cmd[1] = i;
+    cmd[2] = i * 7;
+    cmd[3] = i * 13;
+    cmd[4] = 255 - i;
+    TEST_ASSERT_EQUAL_HEX8(helper_ReferenceCrc7(cmd, 5), sdcard_spi_crc7(cmd, 5));
+  }
+}
+
+void test_Crc16OfKnownBlock(void)
+{
+  uint8_t block[SD_BLOCK_SIZE];
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    block[i] = 0xFF;
+  }
+
+  /* Value from the SD specification */
+  TEST_ASSERT_EQUAL_HEX16(0x7FA1, sdcard_spi_crc16(0, block, SD_BLOCK_SIZE));
+}
+
+/**
+ * The CRC16 can be updated incrementally while a block is being filled, so the
+ * CRC is ready at the moment the block is submitted.
+ */
+void test_Crc16Incremental(void)
+{
+  uint8_t block[SD_BLOCK_SIZE];
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    block[i] = i * 31 + 7;
+  }
+
+  uint16_t crc = 0;
+  crc = sdcard_spi_crc16(crc, &block[0], 1);
+  crc = sdcard_spi_crc16(crc, &block[1], 16);
+  crc = sdcard_spi_crc16(crc, &block[17], 300);
+  crc = sdcard_spi_crc16(crc, &block[317], SD_BLOCK_SIZE - 317);
+
+  TEST_ASSERT_EQUAL_HEX16(helper_ReferenceCrc16(0, block, SD_BLOCK_SIZE), crc);
+  TEST_ASSERT_EQUAL_HEX16(helper_ReferenceCrc16(0, block, SD_BLOCK_SIZE),
+                          sdcard_spi_crc16(0, block, SD_BLOCK_SIZE));
+}
+
+bool_t SpiSubmitCall_SendCMD59(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(6, t->output_length);
+  TEST_ASSERT_EQUAL(6, t->input_length);  /* R1 response */
+
+  TEST_ASSERT_EQUAL_HEX8(0x7B, t->output_buf[0]); /* CMD59 */
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[3]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, t->output_buf[4]); /* CRC on */
+  TEST_ASSERT_EQUAL_HEX8(0x83, t->output_buf[5]); /* CRC7 for CMD59(1) */
+
+  /* Callback */
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+
+  return TRUE;
+}
+
+/**
+ * With CRC enabled, CMD59 is sent after CMD8 to turn on CRC checking in the
+ * card before the rest of the initialization.
+ */
+void test_ReadCMD8ParameterMatchSendCMD59WhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_ReadingCMD8Parameter;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.input_buf[0] = 0x00;
+  sdcard1.input_buf[1] = 0x00;
+  sdcard1.input_buf[2] = 0x01;
+  sdcard1.input_buf[3] = 0xAA; /* Match! */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD59);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD59, sdcard1.status);
+}
+
+/**
+ * CMD59 does not depend on the card version: a version 1 card (CMD8 illegal)
+ * gets it at the same point. MMC cards are only recognized later by their
+ * answer to ACMD41, so they have CRC checking on by then as well.
+ */
+void test_PollingCMD8ResponseIllegalCommandSendCMD59WhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_ReadingCMD8Resp;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.input_buf[0] = 0x05;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD59);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD59, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardType_SdV1, sdcard1.card_type);
+}
+
+void test_ReadySendingCMD59(void)
+{
+  sdcard1.status = SDCard_SendingCMD59;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD59Resp, sdcard1.status);
+}
+
+void test_PollingCMD59ResponseLater(void)
+{
+  sdcard1.status = SDCard_ReadingCMD59Resp;
+  helper_ResponseLater();
+}
+
+void test_PollingCMD59Timeout(void)
+{
+  sdcard1.status = SDCard_ReadingCMD59Resp;
+  helper_ResponseTimeout(9);
+}
+
+/**
+ * Card is still in idle state, so the response is 0x01. Continue with ACMD41.
+ */
+void test_PollingCMD59ResponseReady(void)
+{
+  sdcard1.status = SDCard_ReadingCMD59Resp;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.input_buf[0] = 0x01;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v2, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter); /* Reset the timout counter for ACMD41 */
+}
+
+void test_PollingCMD59ResponseReadyVersion1Card(void)
+{
+  sdcard1.status = SDCard_ReadingCMD59Resp;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.card_type = SDCardType_SdV1;
+  sdcard1.input_buf[0] = 0x01;
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v1, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter);
+}
+
+/**
+ * ACMD41 and CMD1 of the version 1 and MMC paths carry a CRC7 as well.
+ */
+void test_SendACMD41v1CommandCrcWhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v1;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.timeout_counter = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41v1);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL_HEX8(0xE5, sdcard1.output_buf[20]); /* CRC7 for CMD41(0) */
+}
+
+void test_SendCMD1CommandCrcWhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_SendingCMD1;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.timeout_counter = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD1);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL_HEX8(0xF9, sdcard1.output_buf[5]); /* CRC7 for CMD1(0) */
+}
+
+void test_PollingCMD59ResponseError(void)
+{
+  sdcard1.status = SDCard_ReadingCMD59Resp;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.input_buf[0] = 0x05; /* Illegal command */
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+/**
+ * All commands carry a valid CRC7 when CRC is enabled.
+ */
+void test_WriteDataBlockCommandCrcWhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.crc_enabled = TRUE;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  /* Call the write data function */
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_ReadDataBlockCommandCrcWhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2byte;
+  sdcard1.crc_enabled = TRUE;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  /* Call the read data function */
+  sdcard_spi_read_block(&sdcard1, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_SendACMD41CommandCrcWhenCrcEnabled(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v2;
+  sdcard1.timeout_counter = 0;
+  sdcard1.crc_enabled = TRUE;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41);
+
+  /* Function is called in the periodic loop */
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+/* Data block CRC expected in SpiSubmitCall_SendDataBlockWithCrc() */
+uint16_t ExpectedDataCrc;
+
+bool_t SpiSubmitCall_SendDataBlockWithCrc(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  if (t->output_buf == sdcard1.output_buf) {
+    TEST_ASSERT_EQUAL(OUTPUT_BLOCK_LENGTH, t->output_length);
+  } else {
+    TEST_ASSERT_EQUAL(516, t->output_length);
+  }
+  TEST_ASSERT_EQUAL_HEX8(ExpectedDataCrc >> 8, t->output_buf[513]); /* CRC byte 1 */
+  TEST_ASSERT_EQUAL_HEX8(ExpectedDataCrc & 0xFF, t->output_buf[514]); /* CRC byte 2 */
+  if (t->output_length == 516) {
+    TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[515]); /* Request data response */
+  }
+
+  return TRUE;
+}
+
+void test_SendMultiWriteBlockWithCrc(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.crc_enabled = TRUE;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  ExpectedDataCrc = helper_ReferenceCrc16(0, &sdcard1.output_buf[1], SD_BLOCK_SIZE);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendDataBlockWithCrc);
+
+  /* Call the write function */
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+/**
+ * A producer that kept output_crc up to date while filling the block saves
+ * the driver from computing the CRC over the entire block at submit time.
+ */
+void test_SendMultiWriteBlockWithPrecomputedCrc(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.crc_enabled = TRUE;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  sdcard1.output_crc = 0x1234; /* Not the real CRC, check that it is not recomputed */
+  sdcard1.output_crc_valid = TRUE;
+  ExpectedDataCrc = 0x1234;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendDataBlockWithCrc);
+
+  /* Call the write function */
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  /* Ready for the next block */
+  TEST_ASSERT_EQUAL(0, sdcard1.output_crc);
+  TEST_ASSERT_FALSE(sdcard1.output_crc_valid);
+}
+
+void test_SendMultiWriteCallerBlockWithCrc(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.crc_enabled = TRUE;
+  helper_FillBlock(&CallerBlock[1]);
+  ExpectedDataCrc = helper_ReferenceCrc16(0, &CallerBlock[1], SD_BLOCK_SIZE);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendDataBlockWithCrc);
+
+  /* Call the write function */
+  sdcard_spi_multiwrite_next_buf(&sdcard1, CallerBlock, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_SendDataBlockWithCrc(void)
+{
+  sdcard1.status = SDCard_BeforeSendingDataBlock;
+  sdcard1.crc_enabled = TRUE;
+  helper_FillBlock(&sdcard1.output_buf[6]);
+  ExpectedDataCrc = helper_ReferenceCrc16(0, &sdcard1.output_buf[6], SD_BLOCK_SIZE);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendDataBlockWithCrc);
+
+  /* Run the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingDataBlock, sdcard1.status);
+}
+
+/**
+ * A received block is only passed on when its CRC16 is correct.
+ */
+void test_ReadDataBlockContentCrcMatch(void)
+{
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  helper_FillBlock(&sdcard1.input_buf[0]);
+  uint16_t crc = helper_ReferenceCrc16(0, &sdcard1.input_buf[0], SD_BLOCK_SIZE);
+  sdcard1.input_buf[512] = crc >> 8;
+  sdcard1.input_buf[513] = crc & 0xFF;
+
+  /* Call the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_ReadDataBlockContentCrcMismatch(void)
+{
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  helper_FillBlock(&sdcard1.input_buf[0]);
+  uint16_t crc = helper_ReferenceCrc16(0, &sdcard1.input_buf[0], SD_BLOCK_SIZE);
+  sdcard1.input_buf[512] = crc >> 8;
+  sdcard1.input_buf[513] = (crc & 0xFF) ^ 0x01; /* Corrupted */
+
+  /* Call the callback function */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+#ifdef SDCARD_TRACE
+/**
+ * Every change of sdcard1.status is recorded in the trace, together with the
+ * number of bytes submitted to spi_submit in that same step.
+ */
+void test_TraceTransitionWithSubmittedBytes(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+  FakeSysTimeUsec = 5000;
+
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL(1, sd_trace_length());
+  struct SDTraceEntry *entry = sd_trace_get(0);
+  TEST_ASSERT_EQUAL(5000, entry->timestamp);
+  TEST_ASSERT_EQUAL(SDTraceSource_SDCard, entry->source);
+  TEST_ASSERT_EQUAL(SDCard_Idle, entry->old_state);
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, entry->new_state);
+  TEST_ASSERT_EQUAL(6, entry->bytes);
+}
+
+void test_TraceTransitionWithoutSubmission(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, sd_trace_length());
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sd_trace_get(0)->old_state);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sd_trace_get(0)->new_state);
+  TEST_ASSERT_EQUAL(0, sd_trace_get(0)->bytes);
+}
+
+/**
+ * Polls that do not change the state are not recorded, otherwise the busy
+ * periods would fill the trace.
+ */
+void test_DoNotTracePollWithoutTransition(void)
+{
+  sdcard1.status = SDCard_ReadingCMD24Resp;
+  helper_ResponseLater();
+
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD24Resp, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sd_trace_length());
+}
+#endif
+
+/**
+ * Block write latency is measured from the submission of the data token until
+ * the card is no longer busy, in microseconds. It goes in a histogram with
+ * bins of doubling width: bin i counts latencies from 2^i up to 2^(i+1)
+ * microseconds, bin 0 also counts zero, the last bin everything above.
+ */
+void test_RecordStartOfBlockWrite(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.busy_polls = 12;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+  for (uint16_t i=0; i<256; i++) {
+    sdcard1.output_buf[1+i] = 0x00;
+    sdcard1.output_buf[1+i+256] = i;
+  }
+  FakeSysTimeUsec = 1000;
+
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_EQUAL(1000, sdcard1.latency_start);
+  TEST_ASSERT_EQUAL(0, sdcard1.busy_polls);
+}
+
+void test_RecordStartOfRingBlockWrite(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  uint8_t *block = sdcard_spi_block_acquire(&sdcard1);
+  helper_FillBlock(block);
+  FakeSysTimeUsec = 2000;
+
+  sdcard_spi_block_submit(&sdcard1, block, NULL);
+
+  TEST_ASSERT_EQUAL(2000, sdcard1.latency_start);
+}
+
+void test_CountBusyPolls(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_polls = 4;
+  sdcard1.input_buf[0] = 0x00; /* Busy */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(5, sdcard1.busy_polls);
+  TEST_ASSERT_EQUAL(0, sdcard1.latency_count); /* Not done yet */
+}
+
+/**
+ * @brief Let the card become ready after the given latency and busy polls
+ */
+void helper_CompleteBlockWrite(uint32_t latency, uint16_t polls)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.latency_start = 1000;
+  sdcard1.busy_polls = polls;
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  FakeSysTimeUsec = 1000 + latency;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+void test_RecordLatencyWhenNoLongerMultiWriteBusy(void)
+{
+  helper_CompleteBlockWrite(700, 3);
+
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_count);
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_hist[9]); /* 512 <= 700 < 1024 */
+  TEST_ASSERT_EQUAL(700, sdcard1.latency_max);
+  /* The poll that saw the card ready counts as well */
+  TEST_ASSERT_EQUAL(4, sdcard1.busy_polls_max);
+}
+
+void test_LatencyBinEdges(void)
+{
+  helper_CompleteBlockWrite(0, 0);
+  helper_CompleteBlockWrite(1, 0);
+  TEST_ASSERT_EQUAL(2, sdcard1.latency_hist[0]);
+
+  helper_CompleteBlockWrite(2, 0);
+  helper_CompleteBlockWrite(3, 0);
+  TEST_ASSERT_EQUAL(2, sdcard1.latency_hist[1]);
+
+  helper_CompleteBlockWrite(1023, 0);
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_hist[9]);
+  helper_CompleteBlockWrite(1024, 0);
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_hist[10]);
+
+  /* Everything too long goes in the last bin */
+  helper_CompleteBlockWrite(3000000, 0);
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_hist[SDCARD_LATENCY_BINS - 1]);
+  TEST_ASSERT_EQUAL(3000000, sdcard1.latency_max);
+  TEST_ASSERT_EQUAL(7, sdcard1.latency_count);
+}
+
+void test_KeepLargestLatencyAndPolls(void)
+{
+  helper_CompleteBlockWrite(5000, 20);
+  helper_CompleteBlockWrite(400, 2);
+
+  TEST_ASSERT_EQUAL(5000, sdcard1.latency_max);
+  TEST_ASSERT_EQUAL(21, sdcard1.busy_polls_max);
+}
+
+void test_LatencyAcrossTimerWraparound(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.latency_start = 0xFFFFFF00;
+  sdcard1.input_buf[0] = 0xFF;
+  FakeSysTimeUsec = 0x00000100;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(512, sdcard1.latency_max);
+  TEST_ASSERT_EQUAL(1, sdcard1.latency_hist[9]);
+}
+
+/**
+ * Percentiles are reported as the upper edge of the bin they fall in, but
+ * never above the largest latency seen: no sample is longer than that. The
+ * last bin has no upper edge, there the maximum is reported.
+ */
+void test_LatencyPercentile(void)
+{
+  TEST_ASSERT_EQUAL(0, sdcard_spi_latency_percentile(&sdcard1, 99)); /* No samples */
+
+  sdcard1.latency_hist[3] = 98;
+  sdcard1.latency_hist[10] = 2;
+  sdcard1.latency_count = 100;
+  sdcard1.latency_max = 1500;
+
+  TEST_ASSERT_EQUAL(16, sdcard_spi_latency_percentile(&sdcard1, 50));
+  TEST_ASSERT_EQUAL(16, sdcard_spi_latency_percentile(&sdcard1, 98));
+  TEST_ASSERT_EQUAL(1500, sdcard_spi_latency_percentile(&sdcard1, 99)); /* Bin edge 2048 */
+  TEST_ASSERT_EQUAL(1500, sdcard_spi_latency_percentile(&sdcard1, 100));
+
+  sdcard1.latency_hist[SDCARD_LATENCY_BINS - 1] = 2;
+  sdcard1.latency_hist[10] = 0;
+  sdcard1.latency_max = 3000000;
+  TEST_ASSERT_EQUAL(3000000, sdcard_spi_latency_percentile(&sdcard1, 99));
+}
+
+void test_LatencyPercentileNotAboveMaximum(void)
+{
+  sdcard1.latency_hist[3] = 10;
+  sdcard1.latency_count = 10;
+  sdcard1.latency_max = 12;
+
+  TEST_ASSERT_EQUAL(12, sdcard_spi_latency_percentile(&sdcard1, 50));
+  TEST_ASSERT_EQUAL(12, sdcard_spi_latency_percentile(&sdcard1, 99));
+}
+
+void test_ResetLatencyHistograms(void)
+{
+  helper_CompleteBlockWrite(700, 3);
+  helper_CompleteBlockWrite(70000, 30);
+
+  sdcard_spi_latency_reset(&sdcard1);
+
+  for (uint8_t i = 0; i < SDCARD_LATENCY_BINS; i++) {
+    TEST_ASSERT_EQUAL(0, sdcard1.latency_hist[i]);
+  }
+  TEST_ASSERT_EQUAL(0, sdcard1.latency_count);
+  TEST_ASSERT_EQUAL(0, sdcard1.latency_max);
+  TEST_ASSERT_EQUAL(0, sdcard1.busy_polls_max);
+}
+
+/**
+ * Adaptive polling: the driver learns how long the card typically stays in
+ * each of the polling states (SDCard_Busy, SDCard_MultiWriteBusy and
+ * SDCard_WaitingForDataToken) and skips periodic polls until the expected
+ * completion is less than SDCARD_POLL_MARGIN_US away. From there on it polls
+ * every periodic call, as without adaptive polling. The estimate is a moving
+ * average with weight 1/8 for each new busy period.
+ *
+ * Only a period in which a poll still saw the card busy (busy_seen) has a
+ * known length. If the first poll after the hold-off already finds the card
+ * ready, the card may have been ready long before. Learning that period
+ * would only ever push the estimate up, so instead the estimate decays by
+ * 1/8 and the next hold-off ends earlier.
+ */
+void test_RememberStartOfMultiWriteBusyPeriod(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.busy_seen = TRUE;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+  FakeSysTimeUsec = 3000;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(3000, sdcard1.busy_since);
+  TEST_ASSERT_FALSE(sdcard1.busy_seen);
+}
+
+void test_RememberStartOfBusyPeriodAfterSingleBlockWrite(void)
+{
+  sdcard1.status = SDCard_SendingDataBlock;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+  FakeSysTimeUsec = 3500;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Busy, sdcard1.status);
+  TEST_ASSERT_EQUAL(3500, sdcard1.busy_since);
+}
+
+void test_RememberStartOfWaitingForDataToken(void)
+{
+  sdcard1.status = SDCard_ReadingCMD17Resp;
+  sdcard1.input_buf[0] = 0x00; /* Data ready */
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+  FakeSysTimeUsec = 4000;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_WaitingForDataToken, sdcard1.status);
+  TEST_ASSERT_EQUAL(4000, sdcard1.busy_since);
+}
+
+void test_BusyPollMarksPeriodObserved(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_seen = FALSE;
+  sdcard1.input_buf[0] = 0x00; /* Busy */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(sdcard1.busy_seen);
+}
+
+void test_FirstBusyPeriodIsTheEstimate(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_since = 1000;
+  sdcard1.busy_seen = TRUE;
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  FakeSysTimeUsec = 1800;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(800, sdcard1.busy_estimate[SDCardBusyOp_MultiWrite]);
+}
+
+void test_MovingAverageOfBusyPeriods(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 800;
+  sdcard1.busy_since = 1000;
+  sdcard1.busy_seen = TRUE;
+  sdcard1.input_buf[0] = 0xFF;
+  FakeSysTimeUsec = 1000 + 1600;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(900, sdcard1.busy_estimate[SDCardBusyOp_MultiWrite]);
+
+  /* Shorter than expected */
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_since = 5000;
+  sdcard1.busy_seen = TRUE;
+  FakeSysTimeUsec = 5000 + 100;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(900 - 100, sdcard1.busy_estimate[SDCardBusyOp_MultiWrite]);
+}
+
+/**
+ * The first poll found the card ready, so it was busy for at most 1600 us,
+ * maybe much less. The period is not learned, the estimate decays by 1/8 so
+ * the next hold-off ends earlier.
+ */
+void test_UnobservedPeriodDecaysEstimate(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 800;
+  sdcard1.busy_since = 1000;
+  sdcard1.busy_seen = FALSE;
+  sdcard1.input_buf[0] = 0xFF;
+  FakeSysTimeUsec = 1000 + 1600;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(800 - 100, sdcard1.busy_estimate[SDCardBusyOp_MultiWrite]);
+}
+
+/**
+ * The card gets faster (for example after the first blocks of a multiwrite).
+ * With the hold-off every first poll finds it ready, and the estimate still
+ * has to come down to the new busy time instead of staying where it was.
+ */
+void test_EstimateFollowsFallingBusyTime(void)
+{
+  uint32_t now = 0;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 8000;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  /* Now busy for 2000 us after every block, periodic loop every 100 us */
+  for (uint16_t block = 0; block < 100; block++) {
+    sdcard1.status = SDCard_MultiWriteBusy;
+    sdcard1.busy_since = now;
+    sdcard1.busy_seen = FALSE;
+    while (sdcard1.status == SDCard_MultiWriteBusy) {
+      now += 100;
+      FakeSysTimeUsec = now;
+      SpiSubmitNrCalls = 0;
+      sdcard_spi_periodic(&sdcard1);
+      if (SpiSubmitNrCalls > 0) {
+        sdcard1.input_buf[0] = (now - sdcard1.busy_since < 2000) ? 0x00 : 0xFF;
+        sdcard_spi_spicallback(&sdcard1.spi_t);
+      }
+    }
+  }
+
+  /* At most one decay step below, at most the margin above */
+  TEST_ASSERT_TRUE(sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] >= 2000 - 2000 / 8 - 100);
+  TEST_ASSERT_TRUE(sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] <= 2000 + SDCARD_POLL_MARGIN_US + 100);
+}
+
+void test_EstimatesArePerOperation(void)
+{
+  sdcard1.status = SDCard_WaitingForDataToken;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 5000;
+  sdcard1.busy_since = 1000;
+  sdcard1.busy_seen = TRUE;
+  sdcard1.input_buf[0] = 0xFE; /* Data token */
+  spi_submit_StubWithCallback(SpiSubmitCall_ReadDataBlock);
+  FakeSysTimeUsec = 1300;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(300, sdcard1.busy_estimate[SDCardBusyOp_ReadToken]);
+  TEST_ASSERT_EQUAL(5000, sdcard1.busy_estimate[SDCardBusyOp_MultiWrite]);
+  TEST_ASSERT_EQUAL(0, sdcard1.busy_estimate[SDCardBusyOp_Write]);
+}
+
+void test_HoldOffPollingWhileFarFromExpectedCompletion(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 10000;
+  sdcard1.busy_since = 1000;
+  FakeSysTimeUsec = 1000 + 10000 - SDCARD_POLL_MARGIN_US - 1;
+
+  /* Periodic loop, expect no call to spi_submit */
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.polls_skipped);
+}
+
+void test_PollWhenCloseToExpectedCompletion(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 10000;
+  sdcard1.busy_since = 1000;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+  FakeSysTimeUsec = 1000 + 10000 - SDCARD_POLL_MARGIN_US;
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(0, sdcard1.polls_skipped);
+}
+
+void test_PollEveryPeriodAfterExpectedCompletion(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.busy_estimate[SDCardBusyOp_Write] = 10000;
+  sdcard1.busy_since = 1000;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+  FakeSysTimeUsec = 1000 + 50000;
+
+  sdcard_spi_periodic(&sdcard1);
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(2, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_NoHoldOffWhenAdaptivePollingDisabled(void)
+{
+  sdcard1.adaptive_poll = FALSE;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.busy_estimate[SDCardBusyOp_MultiWrite] = 10000;
+  sdcard1.busy_since = 1000;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+  FakeSysTimeUsec = 1000;
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+/**
+ * A skipped poll counts for the data token timeout as well, so the timeout
+ * stays the same number of periodic calls.
+ */
+void test_HoldOffCountsTowardsDataTokenTimeout(void)
+{
+  sdcard1.status = SDCard_WaitingForDataToken;
+  sdcard1.busy_estimate[SDCardBusyOp_ReadToken] = 10000;
+  sdcard1.busy_since = 1000;
+  sdcard1.timeout_counter = 5;
+  FakeSysTimeUsec = 1000;
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL(6, sdcard1.timeout_counter);
+  TEST_ASSERT_EQUAL(1, sdcard1.polls_skipped);
+}
+
+/**
+ * Recovery of a block sent from the ring: the block is resent from where it
+ * is, it was not copied anywhere.
+ */
+void test_RecoveryResendsRetainedRingBlock(void)
+{
+  sdcard1.status = SDCard_ReadingCMD25Resp;
+  sdcard1.input_buf[0] = 0x00; /* Ready */
+  sdcard1.recovering = TRUE;
+  helper_FillBlock(&sdcard1.block_buf[2][1]);
+  sdcard1.block_buf[2][0] = 0xFF;
+  sdcard1.block_buf[2][513] = 0xFF;
+  sdcard1.block_buf[2][514] = 0xFF;
+  sdcard1.block_buf[2][515] = 0xFF;
+  sdcard1.block_state[2] = SDCardBlock_Writing;
+  sdcard1.block_write_idx = 2;
+  sdcard1.retry_buf = &sdcard1.block_buf[2][0];
+  ExpectedBlockIdx = 2;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+}
+
+#if SDCARD_CHAIN_MAX > 1
+/**
+ * Chained multiwrite: a ring block sent while the next ring block is already
+ * submitted carries SDCARD_CHAIN_GAP bytes of 0xFF behind the data response,
+ * in the same transaction. The callback reads the data response at [515] and
+ * the busy signal at the end of the gap, and sends the next block right away
+ * if the card is ready by then. A chained block costs one transaction and one
+ * callback, where the periodic loop needs the data transaction and at least
+ * one busy poll. Each data token still goes out only after the card was seen
+ * ready. The block that completes a chain of SDCARD_CHAIN_MAX goes out
+ * without the gap and busy is polled from the periodic loop again, so the
+ * callback does not keep the bus to itself. chain_count is the length of the
+ * current (or last) chain, it starts again at 1 with the first block sent
+ * from the periodic loop.
+ *
+ * The gap is clocked out of the ring buffer behind the block, so ring buffers
+ * are SDCARD_CHAIN_GAP bytes longer than SD_BLOCK_PADDED_SIZE and input_buf
+ * takes a full block plus the gap. Caller-owned blocks are never chained and
+ * stay SD_BLOCK_PADDED_SIZE bytes.
+ */
+bool_t SpiSubmitCall_SendChainedRingBlock(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.block_buf[ExpectedBlockIdx][0], t->output_buf);
+  helper_CheckPaddedDataBlockGap(t, SDCARD_CHAIN_GAP);
+
+  return TRUE;
+}
+
+/**
+ * @brief Put n filled blocks in the ring as submitted, starting at first
+ */
+void helper_SubmitRingBlocks(uint8_t first, uint8_t n)
+{
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t idx = (first + i) % SDCARD_BLOCK_BUFFERS;
+    helper_FillBlock(&sdcard1.block_buf[idx][1]);
+    sdcard1.block_state[idx] = SDCardBlock_Submitted;
+    sdcard1.block_callback[idx] = &helper_ExampleCallbackFunction;
+  }
+  sdcard1.block_write_idx = first;
+  sdcard1.block_acquire_idx = (first + n) % SDCARD_BLOCK_BUFFERS;
+}
+
+void test_ChainGapFitsBuffers(void)
+{
+  TEST_ASSERT_EQUAL(516, SD_BLOCK_PADDED_SIZE);
+  TEST_ASSERT_EQUAL(SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP, sizeof(sdcard1.block_buf[0]));
+  TEST_ASSERT_TRUE(sizeof(sdcard1.input_buf) >= SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP);
+  TEST_ASSERT_EQUAL(0, sdcard1.chain_count);
+}
+
+void test_BlockCarriesGapWhenNextBlockSubmitted(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  helper_SubmitRingBlocks(0, 2);
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendChainedRingBlock);
+  ExpectedBlockIdx = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.chain_count);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[0]);
+  TEST_ASSERT_EQUAL(SDCardBlock_Submitted, sdcard1.block_state[1]);
+}
+
+void test_LastSubmittedBlockWithoutGap(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  helper_SubmitRingBlocks(0, 1);
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  ExpectedBlockIdx = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SD_BLOCK_PADDED_SIZE, sdcard1.spi_t.output_length);
+}
+
+void test_ReadyAtEndOfGapSendsNextBlock(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.chain_count = 1;
+  helper_SubmitRingBlocks(0, 3);
+  sdcard1.block_state[0] = SDCardBlock_Writing;
+  sdcard1.spi_t.output_length = SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+  sdcard1.input_buf[515 + SDCARD_CHAIN_GAP] = 0xFF; /* Ready within the gap */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendChainedRingBlock);
+  ExpectedBlockIdx = 1;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(2, sdcard1.chain_count);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Free, sdcard1.block_state[0]);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[1]);
+  TEST_ASSERT_EQUAL(SDCardBlock_Submitted, sdcard1.block_state[2]);
+}
+
+/**
+ * Still busy at the end of the gap: no data token, busy is polled from the
+ * periodic loop as without chaining.
+ */
+void test_BusyAtEndOfGapLeavesBlockToPeriodic(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.chain_count = 2;
+  helper_SubmitRingBlocks(0, 2);
+  sdcard1.block_state[0] = SDCardBlock_Writing;
+  sdcard1.spi_t.output_length = SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+  sdcard1.input_buf[515 + SDCARD_CHAIN_GAP] = 0x00; /* Still busy at the end of the gap */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(2, sdcard1.chain_count);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Submitted, sdcard1.block_state[1]);
+}
+
+/**
+ * Busy polling from the periodic loop ends a chain. The next block sent
+ * after it starts a new one.
+ */
+void test_ChainEndsWhenBusyPolledFromPeriodic(void)
+{
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.chain_count = 3;
+  helper_SubmitRingBlocks(0, 1);
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  ExpectedBlockIdx = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(1, sdcard1.chain_count);
+}
+
+void test_BlockCompletingChainWithoutGap(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.chain_count = SDCARD_CHAIN_MAX - 1;
+  helper_SubmitRingBlocks(0, 3);
+  sdcard1.block_state[0] = SDCardBlock_Writing;
+  sdcard1.spi_t.output_length = SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+  sdcard1.input_buf[515 + SDCARD_CHAIN_GAP] = 0xFF; /* Ready within the gap */
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  ExpectedBlockIdx = 1;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SD_BLOCK_PADDED_SIZE, sdcard1.spi_t.output_length);
+  TEST_ASSERT_EQUAL(SDCARD_CHAIN_MAX, sdcard1.chain_count);
+}
+
+void test_NoChainAfterChainMaxBlocks(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.chain_count = SDCARD_CHAIN_MAX;
+  helper_SubmitRingBlocks(1, 1);
+  sdcard1.spi_t.output_length = SD_BLOCK_PADDED_SIZE;
+  sdcard1.input_buf[515] = 0x05; /* Data accepted */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteBusy, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCARD_CHAIN_MAX, sdcard1.chain_count);
+}
+
+/**
+ * A rejected block in a chain goes through the normal recovery, whatever the
+ * end of the gap says.
+ */
+void test_GapIgnoredAfterRejectedBlock(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.chain_count = 1;
+  helper_SubmitRingBlocks(0, 2);
+  sdcard1.block_state[0] = SDCardBlock_Writing;
+  sdcard1.spi_t.output_buf = &sdcard1.block_buf[0][0];
+  sdcard1.spi_t.output_length = SD_BLOCK_PADDED_SIZE + SDCARD_CHAIN_GAP;
+  sdcard1.input_buf[515] = 0x0D; /* Rejected */
+  sdcard1.input_buf[515 + SDCARD_CHAIN_GAP] = 0xFF;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRecoveryStop);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverStopping, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.chain_count);
+  TEST_ASSERT_EQUAL(SDCardBlock_Submitted, sdcard1.block_state[1]);
+}
+#endif
+
+/**
+ * sdcard_spi_spicallback() looks up the handler of the current status in
+ * sdcard_spi_callback_handlers[] instead of going through a switch. States
+ * in which no transaction of the driver can complete have no handler.
+ * MultiWriteIdle has one as well, so a callback arriving there sends a
+ * block that was submitted meanwhile instead of leaving it for the next
+ * periodic call.
+ */
+void test_CallbackHandlerForEveryTransactionState(void)
+{
+  for (uint8_t s = 0; s < SDCARD_NB_STATES; s++) {
+    switch (s) {
+      case SDCard_UnInit:
+      case SDCard_Error:
+      case SDCard_Idle:
+        TEST_ASSERT_NULL(sdcard_spi_callback_handlers[s]);
+        break;
+      default:
+        TEST_ASSERT_NOT_NULL(sdcard_spi_callback_handlers[s]);
+        break;
+    }
+  }
+}
+
+void test_IgnoreCallbackInStateWithoutHandler(void)
+{
+  sdcard1.status = SDCard_Idle;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_CallbackInMultiWriteIdleWithoutBlockStaysIdle(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+void test_CallbackInMultiWriteIdleSendsSubmittedBlock(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.block_state[0] = SDCardBlock_Submitted;
+  sdcard1.block_write_idx = 0;
+  sdcard1.block_acquire_idx = 1;
+  helper_FillBlock(&sdcard1.block_buf[0][1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+  ExpectedBlockIdx = 0;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[0]);
+}
+
+/**
+ * A corrupted status must not index past the end of the table.
+ */
+void test_CallbackWithInvalidStatusIsError(void)
+{
+  sdcard1.status = (enum SDCardStatus) SDCARD_NB_STATES;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+void test_CallbackWithLargeInvalidStatusIsError(void)
+{
+  sdcard1.status = (enum SDCardStatus) 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+/**
+ * Every operation takes a completion callback, called from the spi callback
+ * as soon as the card is ready for the next operation. Besides that, the
+ * user can register callbacks for events that are not the result of a call:
+ * sdcard_spi_set_event_callbacks(&sdcard1, init_done, busy_released, error);
+ */
+uint8_t InitDoneCalls;
+uint8_t BusyReleasedCalls;
+uint8_t ErrorCalls;
+
+void helper_InitDone(void)
+{
+  InitDoneCalls++;
+}
+
+void helper_BusyReleased(void)
+{
+  BusyReleasedCalls++;
+}
+
+void helper_Error(void)
+{
+  ErrorCalls++;
+}
+
+void helper_RegisterEventCallbacks(void)
+{
+  InitDoneCalls = 0;
+  BusyReleasedCalls = 0;
+  ErrorCalls = 0;
+  sdcard_spi_set_event_callbacks(&sdcard1, &helper_InitDone, &helper_BusyReleased, &helper_Error);
+}
+
+void test_SetEventCallbacks(void)
+{
+  sdcard_spi_set_event_callbacks(&sdcard1, &helper_InitDone, &helper_BusyReleased, &helper_Error);
+
+  TEST_ASSERT_EQUAL_PTR(&helper_InitDone, sdcard1.init_callback);
+  TEST_ASSERT_EQUAL_PTR(&helper_BusyReleased, sdcard1.busy_callback);
+  TEST_ASSERT_EQUAL_PTR(&helper_Error, sdcard1.error_callback);
+}
+
+void test_WriteBlockRemembersCallback(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  sdcard_spi_write_block(&sdcard1, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_QueuedWriteBlockKeepsCallback(void)
+{
+  sdcard1.status = SDCard_Busy;
+
+  sdcard_spi_write_block(&sdcard1, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.queue[0].callback);
+}
+
+/**
+ * A single block write is complete when the card is no longer busy
+ * programming it, not when the data was accepted.
+ */
+void test_WriteBlockCallbackNotCalledWhenDataAccepted(void)
+{
+  sdcard1.status = SDCard_SendingDataBlock;
+  sdcard1.input_buf[515] = 0x05;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Busy, sdcard1.status);
+}
+
+void test_WriteBlockCallbackWhenNoLongerBusy(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_MultiWriteStartRemembersCallback(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_MultiWriteStartCallbackWhenReady(void)
+{
+  sdcard1.status = SDCard_ReadingCMD25Resp;
+  sdcard1.input_buf[0] = 0x00;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+/**
+ * The callback of multiwrite_next is called once, when the block is accepted.
+ */
+void test_MultiWriteNextCallbackOnlyOnce(void)
+{
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.input_buf[515] = 0x05;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+
+  CallbackWasCalled = FALSE;
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+void test_MultiWriteStopRemembersCallback(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendStopMultiWrite);
+
+  sdcard_spi_multiwrite_stop(&sdcard1, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_MultiWriteStopCallbackWhenNoLongerBusy(void)
+{
+  sdcard1.status = SDCard_MultiWriteStopping;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Busy, sdcard1.status);
+
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+/**
+ * A queued request is dispatched after the completion callback, unless the
+ * callback started something itself (see test_CallbackChainedRequestGoesBeforeQueue).
+ */
+void test_CompletionCallbackBeforeQueuedRequest(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard1.external_callback = &helper_CallbackStartingWrite;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  helper_QueueRequest(SDCardRequest_ReadBlock, 0x00000014, NULL);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+}
+
+void test_InitDoneEvent(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_ReadingCMD16Resp;
+  sdcard1.response_counter = 4;
+  sdcard1.input_buf[0] = 0x00;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, InitDoneCalls);
+  TEST_ASSERT_EQUAL(0, BusyReleasedCalls);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_BusyReleasedEventAfterSingleBlock(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, BusyReleasedCalls);
+}
+
+void test_BusyReleasedEventDuringMultiWrite(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, BusyReleasedCalls);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+void test_NoBusyReleasedEventWhileStillBusy(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_MultiWriteBusy;
+  sdcard1.input_buf[0] = 0x00;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(0, BusyReleasedCalls);
+}
+
+void test_ErrorEventWhenDataRejected(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_SendingDataBlock;
+  sdcard1.input_buf[515] = 0x0D;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, ErrorCalls);
+  /* The operation did not complete */
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+void test_ErrorEventWhenInitializationFails(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_ReadingCMD0Resp;
+  helper_ResponseTimeout(9);
+
+  TEST_ASSERT_EQUAL(1, ErrorCalls);
+  TEST_ASSERT_EQUAL(0, InitDoneCalls);
+}
+
+/**
+ * Fast bring-up: while the card answers ACMD41 with 0x01 (still in idle
+ * state), resend ACMD41 straight from the spi callback instead of once per
+ * periodic loop. This is limited to init_budget_us after the first ACMD41,
+ * to not keep the bus busy forever with a slow or broken card. After that,
+ * retries continue from the periodic loop with the usual limit of 500.
+ * An init_budget_us of 0 disables fast bring-up.
+ */
+void test_RememberStartOfFirstACMD41(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v2;
+  sdcard1.timeout_counter = 0;
+  FakeSysTimeUsec = 42000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL(42000, sdcard1.acmd41_start);
+}
+
+void test_KeepStartOfFirstACMD41OnRetry(void)
+{
+  sdcard1.status = SDCard_SendingACMD41v2;
+  sdcard1.timeout_counter = 3;
+  sdcard1.acmd41_start = 42000;
+  FakeSysTimeUsec = 50000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL(42000, sdcard1.acmd41_start);
+}
+
+void test_RetryACMD41FromCallbackWithinBudget(void)
+{
+  sdcard1.init_budget_us = 100000;
+  sdcard1.acmd41_start = 1000;
+  FakeSysTimeUsec = 1000 + 99999;
+  sdcard1.timeout_counter = 3;
+  sdcard1.status = SDCard_ReadingACMD41v2Resp;
+  sdcard1.input_buf[0] = 0x01;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendACMD41);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v2, sdcard1.status);
+  /* Fast retries do not count towards the limit of the periodic retries */
+  TEST_ASSERT_EQUAL(3, sdcard1.timeout_counter);
+}
+
+void test_RetryACMD41NextPeriodicLoopWhenBudgetSpent(void)
+{
+  sdcard1.init_budget_us = 100000;
+  sdcard1.acmd41_start = 1000;
+  FakeSysTimeUsec = 1000 + 100000;
+  sdcard1.status = SDCard_ReadingACMD41v2Resp;
+  sdcard1.input_buf[0] = 0x01;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v2, sdcard1.status);
+}
+
+void test_NoFastRetryWhenBudgetZero(void)
+{
+  sdcard1.init_budget_us = 0;
+  sdcard1.acmd41_start = 1000;
+  FakeSysTimeUsec = 1001;
+  sdcard1.status = SDCard_ReadingACMD41v2Resp;
+  sdcard1.input_buf[0] = 0x01;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingACMD41v2, sdcard1.status);
+}
+
+void test_FastRetryStillGoesToCMD58WhenReady(void)
+{
+  sdcard1.init_budget_us = 100000;
+  sdcard1.acmd41_start = 1000;
+  FakeSysTimeUsec = 2000;
+  sdcard1.status = SDCard_ReadingACMD41v2Resp;
+  sdcard1.input_buf[0] = 0x00;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD58);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD58, sdcard1.status);
+}
+
+/**
+ * Time from sdcard_spi_init() to the end of initialization is kept in
+ * init_time_us, for the user to report.
+ */
+void test_RecordInitTimeAfterCMD16(void)
+{
+  sdcard1.init_start = 1000;
+  FakeSysTimeUsec = 251000;
+  sdcard1.status = SDCard_ReadingCMD16Resp;
+  sdcard1.response_counter = 4;
+  sdcard1.input_buf[0] = 0x00;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_EQUAL(250000, sdcard1.init_time_us);
+}
+
+void test_RecordInitTimeForBlockAddressedCard(void)
+{
+  sdcard1.init_start = 1000;
+  FakeSysTimeUsec = 81000;
+  sdcard1.status = SDCard_ReadingCMD58Parameter;
+  sdcard1.input_buf[0] = 0xCF;
+  sdcard1.input_buf[1] = 0xFF;
+  sdcard1.input_buf[2] = 0xFF;
+  sdcard1.input_buf[3] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_EQUAL(80000, sdcard1.init_time_us);
+}
+
+void test_InitTimeNotTouchedByLaterWrites(void)
+{
+  sdcard1.init_time_us = 250000;
+  sdcard1.status = SDCard_Busy;
+  sdcard1.input_buf[0] = 0xFF;
+  FakeSysTimeUsec = 900000;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(250000, sdcard1.init_time_us);
+}
+
+/**
+ * Background erase: sdcard_spi_erase(&sdcard1, first, last, callback) erases
+ * the blocks first..last with CMD32 (start), CMD33 (end) and CMD38 (erase),
+ * in chunks of at most SDCARD_ERASE_CHUNK_BLOCKS. The card is busy for the
+ * whole erase of a chunk, so chunks keep the time the card is unavailable
+ * bounded. sdcard_spi_erase_cancel() stops after the current chunk, queued
+ * requests go first after that.
+ */
+/* Expected command in SpiSubmitCall_SendEraseCommand() */
+uint8_t ExpectedCommand;
+uint32_t ExpectedArgument;
+
+bool_t SpiSubmitCall_SendEraseCommand(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(SPIDiv32, t->cdiv);
+  TEST_ASSERT_EQUAL(6, t->output_length);
+  TEST_ASSERT_EQUAL(6, t->input_length);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, t->output_buf);
+
+  TEST_ASSERT_EQUAL_HEX8(0x40 | ExpectedCommand, t->output_buf[0]);
+  TEST_ASSERT_EQUAL_HEX8(ExpectedArgument >> 24, t->output_buf[1]);
+  TEST_ASSERT_EQUAL_HEX8(ExpectedArgument >> 16, t->output_buf[2]);
+  TEST_ASSERT_EQUAL_HEX8(ExpectedArgument >> 8, t->output_buf[3]);
+  TEST_ASSERT_EQUAL_HEX8(ExpectedArgument >> 0, t->output_buf[4]);
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]);
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+  return TRUE;
+}
+
+void test_InitializeNoErase(void)
+{
+  TEST_ASSERT_EQUAL(0, sdcard1.erase_next);
+  TEST_ASSERT_EQUAL(0, sdcard1.erase_end);
+  TEST_ASSERT_EQUAL(0, sdcard1.blocks_erased);
+}
+
+void test_EraseStartsWithCMD32WhenIdle(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  ExpectedCommand = 32;
+  ExpectedArgument = 0x00004000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_erase(&sdcard1, 0x00004000, 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS - 1,
+                   &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD32, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00004000, sdcard1.erase_next);
+  TEST_ASSERT_EQUAL(0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_end);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_EraseWithByteAddress(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2byte;
+  ExpectedCommand = 32;
+  ExpectedArgument = 20 * 512;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_erase(&sdcard1, 20, 29, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+/**
+ * Erasing is opportunistic, it is not queued.
+ */
+void test_DoNotEraseIfNotIdle(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  sdcard_spi_erase(&sdcard1, 20, 29, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+void test_DoNotEraseEmptyRegion(void)
+{
+  sdcard1.status = SDCard_Idle;
+
+  sdcard_spi_erase(&sdcard1, 29, 20, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_ReadySendingCMD32(void)
+{
+  sdcard1.status = SDCard_SendingCMD32;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD32Resp, sdcard1.status);
+}
+
+void test_PollingCMD32Timeout(void)
+{
+  sdcard1.status = SDCard_ReadingCMD32Resp;
+  helper_ResponseTimeout(9);
+}
+
+/**
+ * The end of the chunk is limited by SDCARD_ERASE_CHUNK_BLOCKS.
+ */
+void test_CMD32AcceptedSendCMD33WithEndOfChunk(void)
+{
+  sdcard1.status = SDCard_ReadingCMD32Resp;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS;
+  sdcard1.input_buf[0] = 0x00;
+  ExpectedCommand = 33;
+  ExpectedArgument = 0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS - 1;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD33, sdcard1.status);
+}
+
+void test_CMD33WithEndOfRegionInLastChunk(void)
+{
+  sdcard1.status = SDCard_ReadingCMD32Resp;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 10;
+  sdcard1.input_buf[0] = 0x00;
+  ExpectedCommand = 33;
+  ExpectedArgument = 0x00004000 + 9;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_CMD32RejectedIsError(void)
+{
+  sdcard1.status = SDCard_ReadingCMD32Resp;
+  sdcard1.input_buf[0] = 0x04; /* Illegal command */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+void test_ReadySendingCMD33(void)
+{
+  sdcard1.status = SDCard_SendingCMD33;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD33Resp, sdcard1.status);
+}
+
+void test_CMD33AcceptedSendCMD38(void)
+{
+  sdcard1.status = SDCard_ReadingCMD33Resp;
+  sdcard1.input_buf[0] = 0x00;
+  ExpectedCommand = 38;
+  ExpectedArgument = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD38, sdcard1.status);
+}
+
+void test_ReadySendingCMD38(void)
+{
+  sdcard1.status = SDCard_SendingCMD38;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD38Resp, sdcard1.status);
+}
+
+void test_CMD38AcceptedCardErasing(void)
+{
+  sdcard1.status = SDCard_ReadingCMD38Resp;
+  sdcard1.input_buf[0] = 0x00;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Erasing, sdcard1.status);
+}
+
+void test_RequestBytePeriodicallyWhileErasing(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.input_buf[0] = 0x00;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Erasing, sdcard1.status);
+}
+
+void test_RemainErasingWhileBusy(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.input_buf[0] = 0x00;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Erasing, sdcard1.status);
+}
+
+void test_EraseNextChunkWhenChunkErased(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.input_buf[0] = 0xFF;
+  ExpectedCommand = 32;
+  ExpectedArgument = 0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD32, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_next);
+  TEST_ASSERT_EQUAL(SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.blocks_erased);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+}
+
+void test_IdleAndCallbackWhenRegionErased(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 10;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_EQUAL(sdcard1.erase_end, sdcard1.erase_next);
+  TEST_ASSERT_EQUAL(10, sdcard1.blocks_erased);
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+}
+
+/**
+ * Cancelling sets erase_end to the end of the current chunk, which is
+ * min(erase_end, erase_next + SDCARD_ERASE_CHUNK_BLOCKS).
+ */
+void test_CancelEraseStopsAfterCurrentChunk(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+
+  sdcard_spi_erase_cancel(&sdcard1);
+
+  /* The card cannot be interrupted, the region ends with the current chunk */
+  TEST_ASSERT_EQUAL(SDCard_Erasing, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_end);
+  /* Region will not be erased, no completion */
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_EQUAL(SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.blocks_erased);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+}
+
+/**
+ * The chunk being erased is the last one and shorter than
+ * SDCARD_ERASE_CHUNK_BLOCKS: cancelling must not move the end past the
+ * region that was asked for.
+ */
+void test_CancelEraseDuringShortLastChunk(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 10;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+
+  sdcard_spi_erase_cancel(&sdcard1);
+
+  TEST_ASSERT_EQUAL(SDCard_Erasing, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00004000 + 10, sdcard1.erase_end);
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+
+  sdcard1.input_buf[0] = 0xFF;
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_EQUAL(10, sdcard1.blocks_erased);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+}
+
+void test_CancelEraseBeforeCMD38(void)
+{
+  sdcard1.status = SDCard_ReadingCMD33Resp;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS;
+
+  sdcard_spi_erase_cancel(&sdcard1);
+
+  /* Chunk selected already, erase it to leave the card in a known state */
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD33Resp, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_end);
+}
+
+void test_CancelWhenNotErasingDoesNothing(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+
+  sdcard_spi_erase_cancel(&sdcard1);
+
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteIdle, sdcard1.status);
+}
+
+/**
+ * The logger flips the switch during an erase: multiwrite_start is queued,
+ * the erase cancelled, and the multiwrite starts right after the chunk.
+ */
+void test_QueuedRequestAfterCancelledErase(void)
+{
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL);
+  sdcard_spi_erase_cancel(&sdcard1);
+  sdcard1.input_buf[0] = 0xFF;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+void test_BusyReleasedEventAfterErase(void)
+{
+  helper_RegisterEventCallbacks();
+  sdcard1.status = SDCard_Erasing;
+  sdcard1.erase_next = 0x00004000;
+  sdcard1.erase_end = 0x00004000 + 10;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(1, BusyReleasedCalls);
+}
+
+/**
+ * Card capacity
+ *
+ * sdcard_spi_read_csd(&sdcard1, callback) reads the 16 byte CSD register with
+ * CMD9. The register comes as a data block: R1 response, data token 0xFE,
+ * the register and a CRC16. From it the driver calculates the capacity in
+ * blocks of 512 bytes, available in sdcard1.nb_blocks. It stays zero as long
+ * as the capacity is not known.
+ */
+/* Register contents of two real cards, only the fields used are relevant */
+static const uint8_t CsdSdhc8GB[16] = {
+  0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+  0x3B, 0x37, 0x7F, 0x80, 0x0A, 0x40, 0x40, 0x00
+};
+static const uint8_t CsdSdsc1GB[16] = {
+  0x00, 0x26, 0x00, 0x32, 0x5F, 0x59, 0x83, 0xD3,
+  0xC0, 0xF3, 0x80, 0x0E, 0x7E, 0x00, 0x00, 0x00
+};
+
+/**
+ * CSD version 2.0 (SDHC and SDXC): capacity is (C_SIZE + 1) * 512 KiB.
+ */
+void test_CsdBlocksVersion2(void)
+{
+  /* C_SIZE = 0x003B37 */
+  TEST_ASSERT_EQUAL(15523840, sdcard_spi_csd_blocks(CsdSdhc8GB));
+}
+
+/**
+ * CSD version 1.0 (SDSC): capacity is (C_SIZE + 1) * 2^(C_SIZE_MULT + 2)
+ * blocks of 2^READ_BL_LEN bytes.
+ */
+void test_CsdBlocksVersion1(void)
+{
+  /* C_SIZE = 0xF4F, C_SIZE_MULT = 7, READ_BL_LEN = 9 */
+  TEST_ASSERT_EQUAL(2007040, sdcard_spi_csd_blocks(CsdSdsc1GB));
+}
+
+/**
+ * A 2 GB SDSC card has READ_BL_LEN = 10, the capacity is still counted in
+ * blocks of 512 bytes.
+ */
+void test_CsdBlocksVersion1LargeBlocks(void)
+{
+  uint8_t csd[16];
+  memcpy(csd, CsdSdsc1GB, sizeof(csd));
+  csd[5] = 0x5A; /* READ_BL_LEN = 10 */
+  csd[7] = 0xFF; /* C_SIZE = 0xFFF */
+
+  TEST_ASSERT_EQUAL(4194304, sdcard_spi_csd_blocks(csd));
+}
+
+void test_CsdBlocksUnknownVersion(void)
+{
+  uint8_t csd[16];
+  memcpy(csd, CsdSdhc8GB, sizeof(csd));
+  csd[0] = 0x80; /* CSD_STRUCTURE = 2, reserved */
+
+  TEST_ASSERT_EQUAL(0, sdcard_spi_csd_blocks(csd));
+}
+
+bool_t SpiSubmitCall_SendCMD9(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(SPIDiv32, t->cdiv);
+  TEST_ASSERT_EQUAL(6, t->output_length);
+  TEST_ASSERT_EQUAL(6, t->input_length); /* R1 response */
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf, t->output_buf);
+
+  TEST_ASSERT_EQUAL_HEX8(0x49, t->output_buf[0]); /* CMD byte */
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[1]); /* No argument */
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[2]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[3]);
+  TEST_ASSERT_EQUAL_HEX8(0x00, t->output_buf[4]);
+  TEST_ASSERT_EQUAL_HEX8(helper_CommandCrc(&t->output_buf[0]), t->output_buf[5]); /* Stop bit */
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+  return TRUE;
+}
+
+void test_ReadCsdSendsCMD9WhenIdle(void)
+{
+  sdcard1.status = SDCard_Idle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD9);
+
+  sdcard_spi_read_csd(&sdcard1, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD9, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_QueueReadCsdIfNotIdle(void)
+{
+  sdcard1.status = SDCard_Busy;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+
+  sdcard_spi_read_csd(&sdcard1, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(SDCardRequest_ReadCSD, sdcard1.queue[0].type);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.queue[0].callback);
+}
+
+void test_DoNotReadCsdWhenUninitialized(void)
+{
+  sdcard1.status = SDCard_UnInit;
+
+  sdcard_spi_read_csd(&sdcard1, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(0, sdcard1.queue_len);
+}
+
+void test_ReadySendingCMD9(void)
+{
+  sdcard1.status = SDCard_SendingCMD9;
+  helper_RequestFirstResponseByte();
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD9Resp, sdcard1.status);
+}
+
+void test_PollingCMD9ResponseLater(void)
+{
+  sdcard1.status = SDCard_ReadingCMD9Resp;
+  helper_ResponseLater();
+}
+
+void test_PollingCMD9Timeout(void)
+{
+  sdcard1.status = SDCard_ReadingCMD9Resp;
+  helper_ResponseTimeout(9);
+}
+
+void test_PollingCMD9DataReady(void)
+{
+  sdcard1.status = SDCard_ReadingCMD9Resp;
+  sdcard1.input_buf[0] = 0x00;
+  spi_submit_StubWithCallback(SpiSubmitCall_RequestNBytes);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(0, sdcard1.timeout_counter);
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_WaitingForCSDToken, sdcard1.status);
+}
+
+void test_PollingCSDTokenNotReady(void)
+{
+  sdcard1.status = SDCard_WaitingForCSDToken;
+  sdcard1.timeout_counter = 5;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_WaitingForCSDToken, sdcard1.status);
+}
+
+void test_PollingCSDTokenTimeout(void)
+{
+  sdcard1.status = SDCard_WaitingForCSDToken;
+  sdcard1.timeout_counter = 499;
+  sdcard1.input_buf[0] = 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+bool_t SpiSubmitCall_ReadCSD(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPISelectUnselect, t->select);
+  TEST_ASSERT_EQUAL(SPIDiv8, t->cdiv);
+  TEST_ASSERT_EQUAL(16+2, t->output_length);
+  TEST_ASSERT_EQUAL(16+2, t->input_length);
+  for (uint8_t i = 0; i < 16+2; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0xFF, t->output_buf[i]);
+  }
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+  return TRUE;
+}
+
+void test_PollingCSDTokenReady(void)
+{
+  sdcard1.status = SDCard_WaitingForCSDToken;
+  sdcard1.input_buf[0] = 0xFE;
+  spi_submit_StubWithCallback(SpiSubmitCall_ReadCSD);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_ReadingCSD, sdcard1.status);
+}
+
+void test_ReadCSDContent(void)
+{
+  sdcard1.status = SDCard_ReadingCSD;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  memcpy(sdcard1.input_buf, CsdSdhc8GB, 16);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(15523840, sdcard1.nb_blocks);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+}
+
+void test_ReadCSDContentCrcMatch(void)
+{
+  sdcard1.status = SDCard_ReadingCSD;
+  sdcard1.crc_enabled = TRUE;
+  memcpy(sdcard1.input_buf, CsdSdsc1GB, 16);
+  uint16_t crc = helper_ReferenceCrc16(0, &sdcard1.input_buf[0], 16);
+  sdcard1.input_buf[16] = crc >> 8;
+  sdcard1.input_buf[17] = crc & 0xFF;
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(2007040, sdcard1.nb_blocks);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+}
+
+void test_ReadCSDContentCrcMismatch(void)
+{
+  sdcard1.status = SDCard_ReadingCSD;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.nb_blocks = 0;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  memcpy(sdcard1.input_buf, CsdSdsc1GB, 16);
+  uint16_t crc = helper_ReferenceCrc16(0, &sdcard1.input_buf[0], 16);
+  sdcard1.input_buf[16] = crc >> 8;
+  sdcard1.input_buf[17] = (crc & 0xFF) ^ 0x01; /* Corrupted */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(0, sdcard1.nb_blocks);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+}
+
+/**
+ * Block device interface
+ *
+ * sdcard_spi_block_device_init() fills a struct BlockDevice, the generic
+ * interface of peripherals/block_device.h, so users like the logger do not
+ * depend on this driver. The operations map one to one on the driver
+ * functions, the buffers point at the locations in input_buf and output_buf
+ * where the driver expects the data.
+ */
+struct BlockDevice TestBlockDevice;
+
+void test_BlockDeviceInit(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_block_device_ops, TestBlockDevice.ops);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1, TestBlockDevice.dev);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.input_buf[0], TestBlockDevice.read_buf);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[6], TestBlockDevice.write_buf);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.output_buf[1], TestBlockDevice.multiwrite_buf);
+}
+
+void test_BlockDeviceReadBlock(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  block_device_read_block(&TestBlockDevice, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD17, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+void test_BlockDeviceWriteBlock(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  block_device_write_block(&TestBlockDevice, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
+}
+
+void test_BlockDeviceMultiWrite(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  block_device_multiwrite_start(&TestBlockDevice, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+
+  sdcard1.status = SDCard_MultiWriteIdle;
+  for (uint16_t i = 0; i < 256; i++) {
+    TestBlockDevice.multiwrite_buf[i] = 0x00;
+    TestBlockDevice.multiwrite_buf[i + 256] = i;
+  }
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+
+  block_device_multiwrite_next(&TestBlockDevice, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL(OUTPUT_BLOCK_SENT_STATUS, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+
+  sdcard1.status = SDCard_MultiWriteIdle;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendStopMultiWrite);
+
+  block_device_multiwrite_stop(&TestBlockDevice, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(3, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteStopping, sdcard1.status);
+}
+
+/**
+ * Caller buffers have the layout of the driver: the data at
+ * BLOCK_DEVICE_BUF_OFFSET, room for the token in front and the CRC and
+ * response after it.
+ */
+void test_BlockDeviceMultiWriteFromCallerBuffer(void)
+{
+  TEST_ASSERT_EQUAL(SD_BLOCK_PADDED_SIZE, BLOCK_DEVICE_BUF_SIZE);
+  TEST_ASSERT_EQUAL(1, BLOCK_DEVICE_BUF_OFFSET);
+
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_MultiWriteIdle;
+  helper_FillBlock(&CallerBlock[BLOCK_DEVICE_BUF_OFFSET]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCallerDataBlock);
+
+  block_device_multiwrite_next_buf(&TestBlockDevice, CallerBlock, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+/**
+ * The block buffers of the device are the ring of the driver, a producer
+ * behind the generic interface fills them in place.
+ */
+void test_BlockDeviceAcquireSubmitRelease(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_MultiWriteIdle;
+  ExpectedBlockIdx = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendRingDataBlock);
+
+  uint8_t *block = block_device_block_acquire(&TestBlockDevice);
+  uint8_t *unused = block_device_block_acquire(&TestBlockDevice);
+
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.block_buf[0][1], block);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.block_buf[1][1], unused);
+
+  block_device_block_release(&TestBlockDevice, unused);
+  TEST_ASSERT_EQUAL(SDCardBlock_Free, sdcard1.block_state[1]);
+
+  helper_FillBlock(block);
+  block_device_block_submit(&TestBlockDevice, block, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCardBlock_Writing, sdcard1.block_state[0]);
+  TEST_ASSERT_EQUAL_PTR(&helper_ExampleCallbackFunction, sdcard1.external_callback);
+}
+
+/**
+ * The capacity is read from the CSD, until then it is zero.
+ */
+void test_BlockDeviceCapacity(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.nb_blocks = 0;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD9);
+
+  block_device_read_capacity(&TestBlockDevice, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD9, sdcard1.status);
+  TEST_ASSERT_EQUAL(0, block_device_nb_blocks(&TestBlockDevice));
+
+  sdcard1.nb_blocks = 0x00100000;
+  TEST_ASSERT_EQUAL_HEX(0x00100000, block_device_nb_blocks(&TestBlockDevice));
+}
+
+void test_BlockDeviceErase(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  ExpectedCommand = 32;
+  ExpectedArgument = 0x00004000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  block_device_erase(&TestBlockDevice, 0x00004000, 0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS - 1, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(0x00004000 + 3 * SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_end);
+
+  sdcard1.status = SDCard_Erasing;
+  block_device_erase_cancel(&TestBlockDevice);
+
+  TEST_ASSERT_EQUAL(0x00004000 + SDCARD_ERASE_CHUNK_BLOCKS, sdcard1.erase_end);
+}
+
+/**
+ * The periodic function of the device is the one of the driver, it runs the
+ * initialization and polls the card.
+ */
+void test_BlockDevicePeriodicInitializesCard(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+  sdcard1.status = SDCard_BeforeDummyClock;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendDummyClock);
+
+  block_device_periodic(&TestBlockDevice);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingDummyClock, sdcard1.status);
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&TestBlockDevice));
+}
+
+/**
+ * The generic status only tells whether the device takes a new operation.
+ * Everything in between, including initialization, is busy. An erase is
+ * reported as such, it can be cancelled to start a multiwrite.
+ */
+void test_BlockDeviceStatus(void)
+{
+  sdcard_spi_block_device_init(&TestBlockDevice, &sdcard1);
+
+  sdcard1.status = SDCard_UnInit;
+  TEST_ASSERT_EQUAL(BlockDevice_UnInit, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_SendingACMD41v2;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_Idle;
+  TEST_ASSERT_EQUAL(BlockDevice_Idle, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_ReadingDataBlock;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_MultiWriteIdle;
+  TEST_ASSERT_EQUAL(BlockDevice_MultiWriteIdle, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_MultiWriteBusy;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_SendingCMD32;
+  TEST_ASSERT_EQUAL(BlockDevice_Busy, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_Erasing;
+  TEST_ASSERT_EQUAL(BlockDevice_Erasing, block_device_status(&TestBlockDevice));
+  sdcard1.status = SDCard_Error;
+  TEST_ASSERT_EQUAL(BlockDevice_Error, block_device_status(&TestBlockDevice));
+}
+
+#if SDCARD_CACHE_BLOCKS > 0
+/**
+ * Read cache
+ *
+ * Blocks read with sdcard_spi_read_block() are kept in a small cache, keyed
+ * by the address passed to the driver. A read of a cached block is served from
+ * RAM: the data is copied to input_buf and the callback is called right away.
+ * The least recently used entry is replaced on a miss.
+ *
+ * The cache is write-through: sdcard_spi_write_block() updates a cached block,
+ * a multiwrite invalidates each block it sends (at multiwrite_addr), an erase
+ * the blocks in its region. An error invalidates everything.
+ */
+
+void helper_CacheBlock(uint8_t entry, uint32_t addr, uint8_t fill, uint32_t last_used)
+{
+  sdcard1.cache[entry].valid = TRUE;
+  sdcard1.cache[entry].addr = addr;
+  sdcard1.cache[entry].last_used = last_used;
+  memset(sdcard1.cache[entry].data, fill, SD_BLOCK_SIZE);
+}
+
+void helper_EmptyCache(void)
+{
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    sdcard1.cache[i].valid = FALSE;
+  }
+  sdcard1.cache_tick = 0;
+  sdcard1.cache_hits = 0;
+  sdcard1.cache_misses = 0;
+}
+
+void test_ReadMissGoesToCard(void)
+{
+  helper_EmptyCache();
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  sdcard_spi_read_block(&sdcard1, 0x00000014, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD17, sdcard1.status);
+  TEST_ASSERT_EQUAL(0x00000014, sdcard1.read_addr);
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_misses);
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_hits);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+}
+
+void test_ReadBlockCompletedIsCached(void)
+{
+  helper_EmptyCache();
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.crc_enabled = FALSE;
+  sdcard1.read_addr = 0x00002000;
+  sdcard1.external_callback = &helper_ExampleCallbackFunction;
+  helper_FillBlock(&sdcard1.input_buf[0]);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  TEST_ASSERT_TRUE(sdcard1.cache[0].valid);
+  TEST_ASSERT_EQUAL_HEX32(0x00002000, sdcard1.cache[0].addr);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(sdcard1.input_buf[i], sdcard1.cache[0].data[i]);
+  }
+}
+
+void test_CorruptedBlockIsNotCached(void)
+{
+  helper_EmptyCache();
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.crc_enabled = TRUE;
+  sdcard1.read_addr = 0x00002000;
+  helper_FillBlock(&sdcard1.input_buf[0]);
+  uint16_t crc = helper_ReferenceCrc16(0, &sdcard1.input_buf[0], SD_BLOCK_SIZE);
+  sdcard1.input_buf[512] = crc >> 8;
+  sdcard1.input_buf[513] = (crc & 0xFF) ^ 0x01; /* Corrupted */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    TEST_ASSERT_FALSE(sdcard1.cache[i].valid);
+  }
+}
+
+void test_ReadHitServedFromRam(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(SDCARD_CACHE_BLOCKS - 1, 0x00002000, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+  memset(sdcard1.input_buf, 0x00, SD_BLOCK_SIZE);
+
+  sdcard_spi_read_block(&sdcard1, 0x00002000, &helper_ExampleCallbackFunction);
+
+  /* No spi_submit, data and callback right away */
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_TRUE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0xA5, sdcard1.input_buf[i]);
+  }
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_hits);
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_misses);
+  TEST_ASSERT_NULL(sdcard1.external_callback);
+}
+
+void test_ReadHitWithoutCallback(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00002000, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+
+  sdcard_spi_read_block(&sdcard1, 0x00002000, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL_HEX8(0xA5, sdcard1.input_buf[0]);
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_hits);
+}
+
+/**
+ * input_buf may be in use when the card is not idle, the read is queued as
+ * before.
+ */
+void test_QueueReadOfCachedBlockIfNotIdle(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00002000, 0xA5, 0);
+  sdcard1.status = SDCard_Busy;
+  sdcard1.queue_idx = 0;
+  sdcard1.queue_len = 0;
+
+  sdcard_spi_read_block(&sdcard1, 0x00002000, &helper_ExampleCallbackFunction);
+
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL(1, sdcard1.queue_len);
+  TEST_ASSERT_EQUAL(0, sdcard1.cache_hits);
+}
+
+void test_LeastRecentlyUsedEntryIsReplaced(void)
+{
+  helper_EmptyCache();
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    helper_CacheBlock(i, 0x00001000 + i, i, i + 1);
+  }
+  sdcard1.cache_tick = SDCARD_CACHE_BLOCKS + 1;
+  sdcard1.status = SDCard_Idle;
+
+  /* Entry 0 is the oldest, use it */
+  sdcard_spi_read_block(&sdcard1, 0x00001000, NULL);
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_hits);
+
+  /* Complete a read of another block */
+  sdcard1.status = SDCard_ReadingDataBlock;
+  sdcard1.crc_enabled = FALSE;
+  sdcard1.read_addr = 0x00002000;
+  memset(sdcard1.input_buf, 0x5A, SD_BLOCK_SIZE);
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  /* Entry 1 was least recently used now */
+  TEST_ASSERT_TRUE(sdcard1.cache[0].valid);
+  TEST_ASSERT_EQUAL_HEX32(0x00001000, sdcard1.cache[0].addr);
+  TEST_ASSERT_TRUE(sdcard1.cache[1].valid);
+  TEST_ASSERT_EQUAL_HEX32(0x00002000, sdcard1.cache[1].addr);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, sdcard1.cache[1].data[0]);
+}
+
+void test_WriteBlockUpdatesCachedBlock(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00000014, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  memset(&sdcard1.output_buf[6], 0x3C, SD_BLOCK_SIZE);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD24, sdcard1.status);
+  TEST_ASSERT_TRUE(sdcard1.cache[0].valid);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0x3C, sdcard1.cache[0].data[i]);
+  }
+}
+
+/**
+ * Written blocks are not allocated in the cache, only reads are.
+ */
+void test_WriteBlockNotCachedIsNotAdded(void)
+{
+  helper_EmptyCache();
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD24);
+
+  sdcard_spi_write_block(&sdcard1, 0x00000014, NULL);
+
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    TEST_ASSERT_FALSE(sdcard1.cache[i].valid);
+  }
+}
+
+void test_RejectedBlockInvalidatesCache(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00000014, 0x3C, 0);
+  sdcard1.status = SDCard_SendingDataBlock;
+  sdcard1.input_buf[515] = 0x0D; /* B00001101 = data rejected */
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL(SDCard_Error, sdcard1.status);
+  TEST_ASSERT_FALSE(sdcard1.cache[0].valid);
+}
+
+/**
+ * Nothing is written by CMD25 itself, the cache stays as it is until the
+ * blocks go out.
+ */
+void test_MultiWriteStartKeepsCache(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00000014, 0xA5, 0);
+  helper_CacheBlock(1, 0x00000020, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_TRUE(sdcard1.cache[0].valid);
+  TEST_ASSERT_TRUE(sdcard1.cache[1].valid);
+}
+
+void test_MultiWriteInvalidatesWrittenBlock(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00000014, 0xA5, 0);
+  helper_CacheBlock(1, 0x00000015, 0xA5, 0);
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.multiwrite_addr = 0x00000014;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_FALSE(sdcard1.cache[0].valid);
+  TEST_ASSERT_TRUE(sdcard1.cache[1].valid);
+}
+
+void test_MultiWriteInvalidatesEveryWrittenBlock(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00000014, 0xA5, 0);
+  helper_CacheBlock(1, 0x00000015, 0xA5, 0);
+  sdcard1.status = SDCard_MultiWriteWriting;
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.input_buf[515] = 0x05; /* Accepted */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  sdcard1.status = SDCard_MultiWriteIdle;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_EQUAL(0x00000015, sdcard1.multiwrite_addr);
+  TEST_ASSERT_FALSE(sdcard1.cache[1].valid);
+}
+
+/**
+ * A log that wrapped around starts a new multiwrite below blocks that are
+ * cached. Only the blocks written again are invalidated, whatever their
+ * position relative to the start of the multiwrite.
+ */
+void test_WrappedMultiWriteInvalidatesOnlyWrittenBlocks(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00004000, 0xA5, 0);
+  helper_CacheBlock(1, 0x00005000, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD25);
+  sdcard_spi_multiwrite_start(&sdcard1, 0x00004000, NULL);
+  sdcard1.status = SDCard_MultiWriteIdle;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_SendMultiWriteDataBlock);
+
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+
+  TEST_ASSERT_FALSE(sdcard1.cache[0].valid);
+  TEST_ASSERT_TRUE(sdcard1.cache[1].valid);
+}
+
+void test_EraseInvalidatesRegion(void)
+{
+  helper_EmptyCache();
+  helper_CacheBlock(0, 0x00002000, 0xA5, 0);
+  helper_CacheBlock(1, 0x00004010, 0xA5, 0);
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  ExpectedCommand = 32;
+  ExpectedArgument = 0x00004000;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendEraseCommand);
+
+  sdcard_spi_erase(&sdcard1, 0x00004000, 0x000040FF, NULL);
+
+  TEST_ASSERT_TRUE(sdcard1.cache[0].valid);
+  TEST_ASSERT_FALSE(sdcard1.cache[1].valid);
+}
+
+void test_InvalidateCache(void)
+{
+  helper_CacheBlock(0, 0x00002000, 0xA5, 0);
+
+  sdcard_spi_cache_invalidate(&sdcard1);
+
+  for (uint8_t i = 0; i < SDCARD_CACHE_BLOCKS; i++) {
+    TEST_ASSERT_FALSE(sdcard1.cache[i].valid);
+  }
+}
+#endif
+
+#ifdef SDCARD_SHARED_BUFFER
+/**
+ * Shared buffer layout
+ *
+ * With SDCARD_SHARED_BUFFER, input_buf and output_buf are the same memory.
+ * Transactions that only clock in bytes (response polls, busy polls, data
+ * blocks read) take their output from the constant 0xFF source
+ * sdcard_spi_fill instead of from output_buf. Commands and data blocks
+ * written keep using output_buf, the bytes clocked in overwrite what has
+ * been sent already.
+ *
+ * A multiwrite block sent from output_buf is the exception, it is kept there
+ * until it is accepted and may have to be sent again (see Multiwrite
+ * recovery). It goes out without clocking in and with the card still
+ * selected (SDCard_MultiWriteSendingBlock). The data response is read in a
+ * transaction of its own into input_buf[515], behind the CRC. The stop token
+ * and CMD25 of a recovery clock in at the end of the buffer, where they are
+ * sent from. The one byte response and busy polls only overwrite the data
+ * token at input_buf[0], which the driver puts back before it resends.
+ */
+
+bool_t SpiSubmitCall_PollFromFillSource(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL_PTR(sdcard_spi_fill, t->output_buf);
+  TEST_ASSERT_EQUAL_PTR(sdcard1.input_buf, t->input_buf);
+  TEST_ASSERT_EQUAL(NBytesToRequest, t->input_length);
+  TEST_ASSERT_EQUAL(NBytesToRequest, t->output_length);
+  return TRUE;
+}
+
+bool_t SpiSubmitCall_ReadBlockFromFillSource(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL_PTR(sdcard_spi_fill, t->output_buf);
+  TEST_ASSERT_EQUAL_PTR(sdcard1.input_buf, t->input_buf);
+  TEST_ASSERT_EQUAL(512+2, t->input_length);
+  TEST_ASSERT_EQUAL(512+2, t->output_length);
+  return TRUE;
+}
+
+void test_SharedBufferLayout(void)
+{
+  TEST_ASSERT_EQUAL_PTR(sdcard1.input_buf, sdcard1.output_buf);
+  TEST_ASSERT_EQUAL(sizeof(sdcard1.input_buf), sizeof(sdcard1.output_buf));
+
+  /* Long enough for every read-only transaction */
+  for (uint16_t i = 0; i < sizeof(sdcard1.input_buf); i++) {
+    TEST_ASSERT_EQUAL_HEX8(0xFF, sdcard_spi_fill[i]);
+  }
+}
+
+void test_ResponsePollFromFillSource(void)
+{
+  sdcard1.status = SDCard_SendingCMD17;
+  spi_submit_StubWithCallback(SpiSubmitCall_PollFromFillSource);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD17Resp, sdcard1.status);
+}
+
+void test_BusyPollFromFillSource(void)
+{
+  sdcard1.adaptive_poll = FALSE;
+  sdcard1.status = SDCard_MultiWriteBusy;
+  spi_submit_StubWithCallback(SpiSubmitCall_PollFromFillSource);
+
+  sdcard_spi_periodic(&sdcard1);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+}
+
+void test_ReadDataBlockFromFillSource(void)
+{
+  sdcard1.status = SDCard_WaitingForDataToken;
+  sdcard1.input_buf[0] = 0xFE; /* Data token */
+  spi_submit_StubWithCallback(SpiSubmitCall_ReadBlockFromFillSource);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_ReadingDataBlock, sdcard1.status);
+}
+
+/**
+ * Commands are sent from the shared buffer, and the output pointer is set
+ * back to it after a read.
+ */
+void test_CommandAfterReadFromSharedBuffer(void)
+{
+  sdcard1.status = SDCard_Idle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.spi_t.output_buf = (uint8_t *) sdcard_spi_fill;
+  spi_submit_StubWithCallback(SpiSubmitCall_SendCMD17);
+
+  sdcard_spi_read_block(&sdcard1, 0x00000014, NULL);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL_PTR(sdcard1.output_buf, sdcard1.spi_t.output_buf);
+}
+
+bool_t SpiSubmitCall_ReadDataResponse(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  TEST_ASSERT_EQUAL(SPIUnselect, t->select);
+  TEST_ASSERT_EQUAL_PTR(sdcard_spi_fill, t->output_buf);
+  TEST_ASSERT_EQUAL_PTR(&sdcard1.input_buf[515], t->input_buf);
+  TEST_ASSERT_EQUAL(1, t->output_length);
+  TEST_ASSERT_EQUAL(1, t->input_length);
+  TEST_ASSERT_EQUAL_PTR(&sdcard_spi_spicallback, t->after_cb);
+  return TRUE;
+}
+
+void test_ReadDataResponseBehindSentBlock(void)
+{
+  sdcard1.status = SDCard_MultiWriteSendingBlock;
+  spi_submit_StubWithCallback(SpiSubmitCall_ReadDataResponse);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(1, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+}
+
+/**
+ * Plays the card for test_RetainedBlockSurvivesRecovery(): every byte
+ * clocked in is 0xAA until the test puts the response there. Nothing may be
+ * clocked in over the data of the retained block.
+ */
+bool_t SpiSubmitCall_ClockInBesideBlock(struct spi_periph *p, struct spi_transaction *t, int cmock_num_calls)
+{
+  (void) p; (void) cmock_num_calls;
+  SpiSubmitNrCalls++;
+
+  if (t->input_length > 0) {
+    TEST_ASSERT_TRUE(&t->input_buf[t->input_length] <= &sdcard1.output_buf[1] ||
+                     t->input_buf >= &sdcard1.output_buf[1 + SD_BLOCK_SIZE]);
+    for (uint16_t i = 0; i < t->input_length; i++) {
+      t->input_buf[i] = 0xAA;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * A block sent from output_buf is rejected and the multiwrite is restarted.
+ * The block that goes out again is the one that was rejected.
+ */
+void test_RetainedBlockSurvivesRecovery(void)
+{
+  sdcard1.status = SDCard_MultiWriteIdle;
+  sdcard1.card_type = SDCardType_SdV2block;
+  sdcard1.multiwrite_addr = 0x00000014;
+  sdcard1.adaptive_poll = FALSE;
+  helper_FillBlock(&sdcard1.output_buf[1]);
+  spi_submit_StubWithCallback(SpiSubmitCall_ClockInBesideBlock);
+
+  sdcard_spi_multiwrite_next(&sdcard1, &helper_ExampleCallbackFunction);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteSendingBlock, sdcard1.status);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteWriting, sdcard1.status);
+
+  sdcard1.input_buf[515] = 0x0B; /* CRC error */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverStopping, sdcard1.status);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteRecoverBusy, sdcard1.status);
+
+  sdcard_spi_periodic(&sdcard1);
+  sdcard1.input_buf[0] = 0xFF; /* No longer busy */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_EQUAL(SDCard_SendingCMD25, sdcard1.status);
+
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+  TEST_ASSERT_EQUAL(SDCard_ReadingCMD25Resp, sdcard1.status);
+
+  sdcard1.input_buf[0] = 0x00; /* Ready */
+  sdcard_spi_spicallback(&sdcard1.spi_t);
+
+  TEST_ASSERT_EQUAL_MESSAGE(7, SpiSubmitNrCalls, "spi_submit call count mismatch.");
+  TEST_ASSERT_EQUAL(SDCard_MultiWriteSendingBlock, sdcard1.status);
+  TEST_ASSERT_FALSE(CallbackWasCalled);
+  TEST_ASSERT_EQUAL_PTR(sdcard1.output_buf, sdcard1.spi_t.output_buf);
+  TEST_ASSERT_EQUAL(515, sdcard1.spi_t.output_length);
+  TEST_ASSERT_EQUAL_HEX8(0xFC, sdcard1.output_buf[0]); /* Data token put back */
+  for (uint16_t i = 0; i < 256; i++) {
+    TEST_ASSERT_EQUAL_HEX8(0x00, sdcard1.output_buf[1 + i]);
+    TEST_ASSERT_EQUAL_HEX8(i, sdcard1.output_buf[1 + i + 256]);
+  }
+}
+#endif
@@ -0,0 +1,754 @@
+/*
+ * Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+ *
+ * This file is part of paparazzi.
+ *
+ * paparazzi is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * paparazzi is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with paparazzi; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/** @file tests/unittest/sw/airborne/peripherals/sdcard_spi_throughput_tester.c
+ *  @brief Runs the sdcard_spi driver against the simulated card.
+ *
+ * Unlike sdcard_spi_tester.c, spi_submit is not mocked here but implemented
+ * by sdcard_sim.c. The driver goes through the real command sequences, and
+ * the tests measure sustained write throughput in simulated time.
+ *
+ * Longer runs: -DSDCARD_SIM_BENCH_BLOCKS=1000000 -DSDCARD_SIM_BENCH_VERIFY=0
+ */
+
+/*
+ * Built with the driver defaults, with the optional features switched on,
+ * and with the shared buffer layout.
+ */
+/* TEST_DEFINES: */
+/* TEST_DEFINES: SDCARD_BLOCK_BUFFERS=8 SDCARD_CHAIN_MAX=4 SDCARD_TRACE SDCARD_CACHE_BLOCKS=2 */
+/* TEST_DEFINES: SDCARD_SHARED_BUFFER */
+
+#include "unity.h"
+#include "peripherals/sdcard_spi.h"
+#include "peripherals/sdcard_sim.h"
+#include "peripherals/sdcard_layout.h"
+#include "peripherals/sd_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of blocks written in the throughput tests */
+#ifndef SDCARD_SIM_BENCH_BLOCKS
+#define SDCARD_SIM_BENCH_BLOCKS 256
+#endif
+
+/* Keep written data in memory and compare it afterwards */
+#ifndef SDCARD_SIM_BENCH_VERIFY
+#define SDCARD_SIM_BENCH_VERIFY 1
+#endif
+
+/* Frequency at which sdcard_spi_periodic is called */
+#ifndef SDCARD_SIM_PERIODIC_FREQ
+#define SDCARD_SIM_PERIODIC_FREQ 512
+#endif
+
+/* First block of the throughput tests */
+#define BENCH_START_BLOCK 0x100
+
+/* Declared in spi.c during normal operation */
+struct spi_periph spi2;
+
+/* Declared in sdcard_spi.c during normal operation */
+struct SDCard sdcard1;
+
+/* The simulated card and its contents */
+struct SDCardSim card;
+uint8_t *CardStorage;
+uint32_t CardBlocks;
+
+/* Time of the next call to sdcard_spi_periodic */
+uint64_t NextTickNs;
+
+/* Set by helper_ReadCallback() */
+bool_t ReadCallbackWasCalled;
+
+/* Single block writes still to be started from helper_WriteNextBlock() */
+uint32_t ChainedWritesLeft;
+uint32_t ChainedNextBlock;
+
+/**
+ * @brief Called before each test by the unity framework
+ */
+void setUp(void)
+{
+  sdcard_sim_reset();
+  NextTickNs = 0;
+#ifdef SDCARD_TRACE
+  sd_trace_init();
+#endif
+  ReadCallbackWasCalled = FALSE;
+
+  CardBlocks = BENCH_START_BLOCK + SDCARD_SIM_BENCH_BLOCKS + 1;
+  CardStorage = NULL;
+  if (SDCARD_SIM_BENCH_VERIFY) {
+    CardStorage = calloc(CardBlocks, SDCARD_SIM_BLOCK_SIZE);
+  }
+
+  /* Typical card: a few polls before ACMD41 is ready, some Ncr delay */
+  sdcard_sim_init(&card, &spi2, SPI_SLAVE3, CardStorage, CardBlocks);
+  card.ncr = 2;
+  card.acmd41_polls = 10;
+  card.read_delay_ns = 100000;
+  card.setup_ns = 2000;
+}
+
+/**
+ * @brief Called after each test by the unity framework
+ */
+void tearDown(void)
+{
+  free(CardStorage);
+  CardStorage = NULL;
+}
+
+/**
+ * @brief Advance simulated time to the next periodic call, then call it
+ */
+void helper_Tick(void)
+{
+  NextTickNs += 1000000000ULL / SDCARD_SIM_PERIODIC_FREQ;
+  sdcard_sim_run_until(NextTickNs);
+  sdcard_spi_periodic(&sdcard1);
+}
+
+/**
+ * @brief Tick until the card has the expected status, at most max_ticks
+ */
+void helper_TickUntil(enum SDCardStatus status, uint32_t max_ticks)
+{
+  for (uint32_t i = 0; i < max_ticks && sdcard1.status != status; i++) {
+    helper_Tick();
+  }
+  TEST_ASSERT_EQUAL(status, sdcard1.status);
+}
+
+void helper_InitCard(void)
+{
+  sdcard_spi_init(&sdcard1, &spi2, SPI_SLAVE3);
+  helper_TickUntil(SDCard_Idle, 1000);
+}
+
+uint8_t helper_Pattern(uint32_t block, uint16_t i)
+{
+  return (uint8_t)((block * 31) ^ (block >> 8) ^ i);
+}
+
+void helper_FillBlock(uint8_t *data, uint32_t block)
+{
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    data[i] = helper_Pattern(block, i);
+  }
+}
+
+void helper_VerifyBlocks(uint32_t first, uint32_t nb)
+{
+  if (CardStorage == NULL) {
+    return;
+  }
+  for (uint32_t b = first; b < first + nb; b++) {
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+      TEST_ASSERT_EQUAL_HEX8(helper_Pattern(b, i), CardStorage[b * SDCARD_SIM_BLOCK_SIZE + i]);
+    }
+  }
+}
+
+void helper_ReportThroughput(const char *name, uint64_t start_ns, uint32_t blocks)
+{
+  double seconds = (sdcard_sim_time_ns() - start_ns) / 1e9;
+  printf("%s: %u blocks in %.3f s, %.3f MB/s, %u busy polls\n", name, blocks, seconds,
+         blocks * (double)SD_BLOCK_SIZE / seconds / 1e6, card.busy_polls);
+  printf("%s: block latency max %u us, p99 %u us, max %u busy polls\n", name, sdcard1.latency_max,
+         sdcard_spi_latency_percentile(&sdcard1, 99), sdcard1.busy_polls_max);
+}
+
+void helper_ReadCallback(void)
+{
+  ReadCallbackWasCalled = TRUE;
+}
+
+void test_SimulatedCardInitializes(void)
+{
+  helper_InitCard();
+
+  TEST_ASSERT_EQUAL(SDCardType_SdV2block, sdcard1.card_type);
+  TEST_ASSERT_FALSE(card.in_idle);
+  TEST_ASSERT_EQUAL(11, card.acmd41_count);
+}
+
+void test_SimulatedByteAddressedCardInitializes(void)
+{
+  card.high_capacity = FALSE;
+
+  helper_InitCard();
+
+  TEST_ASSERT_EQUAL(SDCardType_SdV2byte, sdcard1.card_type);
+}
+
+/**
+ * A card that takes long to leave idle state. Resending ACMD41 back to back
+ * from the spi callback gets it ready much sooner than once per periodic call.
+ */
+void test_SimulatedFastBringUp(void)
+{
+  card.acmd41_polls = 200;
+  helper_InitCard();
+  uint32_t slow_us = sdcard1.init_time_us;
+
+  sdcard_sim_init(&card, &spi2, SPI_SLAVE3, CardStorage, CardBlocks);
+  card.acmd41_polls = 200;
+  sdcard_spi_init(&sdcard1, &spi2, SPI_SLAVE3);
+  sdcard1.init_budget_us = 500000;
+  helper_TickUntil(SDCard_Idle, 1000);
+  uint32_t fast_us = sdcard1.init_time_us;
+
+  printf("bring-up: %u us once per periodic, %u us back to back\n", slow_us, fast_us);
+  TEST_ASSERT_TRUE(slow_us > 0);
+  TEST_ASSERT_TRUE(fast_us > 0);
+  TEST_ASSERT_TRUE(fast_us * 2 < slow_us);
+}
+
+void test_SimulatedWriteAndReadBlock(void)
+{
+  helper_InitCard();
+
+  /* Single block write, data after the token in output_buf[5] */
+  helper_FillBlock(&sdcard1.output_buf[6], 42);
+  sdcard_spi_write_block(&sdcard1, 42, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+  TEST_ASSERT_EQUAL(1, card.blocks_written);
+  helper_VerifyBlocks(42, 1);
+
+  /* Read it back */
+  memset(sdcard1.input_buf, 0, sizeof(sdcard1.input_buf));
+  sdcard_spi_read_block(&sdcard1, 42, &helper_ReadCallback);
+  helper_TickUntil(SDCard_Idle, 100);
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  TEST_ASSERT_EQUAL(1, card.blocks_read);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(helper_Pattern(42, i), sdcard1.input_buf[i]);
+  }
+}
+
+/**
+ * The capacity is read from the CSD register, for both register layouts.
+ */
+void test_SimulatedCapacity(void)
+{
+  sdcard_sim_init(&card, &spi2, SPI_SLAVE3, NULL, 4194304);
+  card.ncr = 2;
+  helper_InitCard();
+
+  sdcard_spi_read_csd(&sdcard1, &helper_ReadCallback);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  TEST_ASSERT_EQUAL(4194304, sdcard1.nb_blocks);
+}
+
+void test_SimulatedByteAddressedCapacity(void)
+{
+  sdcard_sim_init(&card, &spi2, SPI_SLAVE3, NULL, 2007040);
+  card.ncr = 2;
+  card.high_capacity = FALSE;
+  helper_InitCard();
+
+  sdcard_spi_read_csd(&sdcard1, &helper_ReadCallback);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  TEST_ASSERT_EQUAL(2007040, sdcard1.nb_blocks);
+}
+
+#if SDCARD_CACHE_BLOCKS > 0
+/**
+ * The logger reads its index before every update. Only the first read goes to
+ * the card, the update is written through to the cached copy.
+ */
+void test_SimulatedCachedIndexRead(void)
+{
+  helper_InitCard();
+
+  sdcard_spi_read_block(&sdcard1, BENCH_START_BLOCK, &helper_ReadCallback);
+  helper_TickUntil(SDCard_Idle, 100);
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+
+  /* Update */
+  helper_FillBlock(&sdcard1.output_buf[6], 7);
+  sdcard_spi_write_block(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  /* Read again */
+  ReadCallbackWasCalled = FALSE;
+  uint32_t transactions = card.transactions;
+  sdcard_spi_read_block(&sdcard1, BENCH_START_BLOCK, &helper_ReadCallback);
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  TEST_ASSERT_EQUAL(SDCard_Idle, sdcard1.status);
+
+  TEST_ASSERT_EQUAL(transactions, card.transactions);
+  TEST_ASSERT_EQUAL(1, card.blocks_read);
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_hits);
+  TEST_ASSERT_EQUAL(1, sdcard1.cache_misses);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(helper_Pattern(7, i), sdcard1.input_buf[i]);
+  }
+}
+#endif
+
+/**
+ * @brief Completion callback of a single block write, starts the next one
+ */
+void helper_WriteNextBlock(void)
+{
+  if (ChainedWritesLeft == 0) {
+    return;
+  }
+  ChainedWritesLeft--;
+  helper_FillBlock(&sdcard1.output_buf[6], ChainedNextBlock);
+  sdcard_spi_write_block(&sdcard1, ChainedNextBlock++, &helper_WriteNextBlock);
+}
+
+/**
+ * Starting the next write from the completion callback instead of after the
+ * periodic loop saw the card idle saves up to a periodic interval per block.
+ */
+void test_SimulatedWritesChainedFromCallback(void)
+{
+  card.busy_model = SDCardSimBusy_Fixed;
+  card.busy_min_ns = 300000;
+  helper_InitCard();
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  for (uint32_t b = 0; b < 16; b++) {
+    helper_FillBlock(&sdcard1.output_buf[6], BENCH_START_BLOCK + b);
+    sdcard_spi_write_block(&sdcard1, BENCH_START_BLOCK + b, NULL);
+    helper_TickUntil(SDCard_Idle, 100);
+  }
+  uint64_t polled_ns = sdcard_sim_time_ns() - start_ns;
+
+  start_ns = sdcard_sim_time_ns();
+  ChainedWritesLeft = 16;
+  ChainedNextBlock = BENCH_START_BLOCK;
+  helper_WriteNextBlock();
+  for (uint32_t ticks = 0; ChainedWritesLeft > 0 || sdcard1.status != SDCard_Idle; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 1600, "Chained writes stalled.");
+    helper_Tick();
+  }
+  uint64_t chained_ns = sdcard_sim_time_ns() - start_ns;
+
+  printf("16 single blocks: polled %.1f ms, chained %.1f ms\n", polled_ns / 1e6, chained_ns / 1e6);
+  TEST_ASSERT_EQUAL(32, card.blocks_written);
+  TEST_ASSERT_TRUE(chained_ns < polled_ns);
+  helper_VerifyBlocks(BENCH_START_BLOCK, 16);
+}
+
+/**
+ * Sustained multiwrite with sdcard_spi_multiwrite_next(), the way the logger
+ * uses the driver: one block per periodic call at most.
+ */
+void test_SimulatedMultiWriteThroughput(void)
+{
+  card.busy_model = SDCardSimBusy_Uniform;
+  card.busy_min_ns = 250000;
+  card.busy_max_ns = 1500000;
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  uint32_t written = 0;
+  for (uint32_t ticks = 0; written < SDCARD_SIM_BENCH_BLOCKS; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 100 * SDCARD_SIM_BENCH_BLOCKS, "Multiwrite stalled.");
+    if (sdcard1.status == SDCard_MultiWriteIdle) {
+      helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK + written);
+      sdcard_spi_multiwrite_next(&sdcard1, NULL);
+      written++;
+    }
+    helper_Tick();
+  }
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  helper_ReportThroughput("multiwrite_next", start_ns, written);
+
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  TEST_ASSERT_EQUAL(SDCARD_SIM_BENCH_BLOCKS, card.blocks_written);
+  TEST_ASSERT_EQUAL(0, card.blocks_rejected);
+  helper_VerifyBlocks(BENCH_START_BLOCK, SDCARD_SIM_BENCH_BLOCKS);
+
+  /* Every block is in the latency histogram, at least as long as the card is busy */
+  TEST_ASSERT_EQUAL(SDCARD_SIM_BENCH_BLOCKS, sdcard1.latency_count);
+  TEST_ASSERT_TRUE(sdcard1.latency_max >= card.busy_min_ns / 1000);
+}
+
+/**
+ * Same, but through the ring of block buffers. The producer fills every free
+ * buffer before each periodic call.
+ */
+void test_SimulatedBlockRingThroughput(void)
+{
+  card.busy_model = SDCardSimBusy_Uniform;
+  card.busy_min_ns = 250000;
+  card.busy_max_ns = 1500000;
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  uint32_t submitted = 0;
+  for (uint32_t ticks = 0; card.blocks_written < SDCARD_SIM_BENCH_BLOCKS; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 100 * SDCARD_SIM_BENCH_BLOCKS, "Block ring stalled.");
+    uint8_t *block;
+    while (submitted < SDCARD_SIM_BENCH_BLOCKS && (block = sdcard_spi_block_acquire(&sdcard1)) != NULL) {
+      helper_FillBlock(block, BENCH_START_BLOCK + submitted);
+      sdcard_spi_block_submit(&sdcard1, block, NULL);
+      submitted++;
+    }
+    helper_Tick();
+  }
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  helper_ReportThroughput("block ring", start_ns, submitted);
+
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  TEST_ASSERT_EQUAL(0, card.blocks_rejected);
+  helper_VerifyBlocks(BENCH_START_BLOCK, SDCARD_SIM_BENCH_BLOCKS);
+}
+
+#if SDCARD_CHAIN_MAX > 1
+/**
+ * A fast card that is done programming within the gap after a block. With a
+ * full ring, the driver should send SDCARD_CHAIN_MAX blocks back to back from
+ * the callback, and never send a data token while the card is busy. Checking
+ * busy in the gap of the block transaction takes fewer transactions and
+ * callbacks per block than the same card written through
+ * sdcard_spi_multiwrite_next(), which is never chained.
+ */
+void test_SimulatedChainedMultiWrite(void)
+{
+  card.busy_model = SDCardSimBusy_Fixed;
+  card.busy_min_ns = 20000;
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  uint32_t transactions = card.transactions;
+  uint32_t callbacks = sdcard_sim_callback_stats.count;
+  uint32_t submitted = 0;
+  uint8_t longest_chain = 0;
+  for (uint32_t ticks = 0; card.blocks_written < SDCARD_SIM_BENCH_BLOCKS; ticks++) {
+    TEST_ASSERT_TRUE_MESSAGE(ticks < 100 * SDCARD_SIM_BENCH_BLOCKS, "Block ring stalled.");
+    uint8_t *block;
+    while (submitted < SDCARD_SIM_BENCH_BLOCKS && (block = sdcard_spi_block_acquire(&sdcard1)) != NULL) {
+      helper_FillBlock(block, BENCH_START_BLOCK + submitted);
+      sdcard_spi_block_submit(&sdcard1, block, NULL);
+      submitted++;
+    }
+    helper_Tick();
+    if (sdcard1.chain_count > longest_chain) {
+      longest_chain = sdcard1.chain_count;
+    }
+  }
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  uint32_t chained_transactions = card.transactions - transactions;
+  uint32_t chained_callbacks = sdcard_sim_callback_stats.count - callbacks;
+  helper_ReportThroughput("chained", start_ns, submitted);
+  printf("chained: longest chain %u, %u busy polls\n", longest_chain, card.busy_polls);
+
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+  helper_VerifyBlocks(BENCH_START_BLOCK, SDCARD_SIM_BENCH_BLOCKS);
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  transactions = card.transactions;
+  callbacks = sdcard_sim_callback_stats.count;
+  for (uint32_t b = 0; b < SDCARD_SIM_BENCH_BLOCKS; b++) {
+    helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK + b);
+    sdcard_spi_multiwrite_next(&sdcard1, NULL);
+    helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  }
+  uint32_t unchained_transactions = card.transactions - transactions;
+  uint32_t unchained_callbacks = sdcard_sim_callback_stats.count - callbacks;
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  printf("per block: chained %.2f transactions, %.2f callbacks; unchained %.2f transactions, %.2f callbacks\n",
+         chained_transactions / (double)SDCARD_SIM_BENCH_BLOCKS, chained_callbacks / (double)SDCARD_SIM_BENCH_BLOCKS,
+         unchained_transactions / (double)SDCARD_SIM_BENCH_BLOCKS,
+         unchained_callbacks / (double)SDCARD_SIM_BENCH_BLOCKS);
+  TEST_ASSERT_TRUE(chained_transactions < unchained_transactions);
+  TEST_ASSERT_TRUE(chained_callbacks < unchained_callbacks);
+  TEST_ASSERT_EQUAL(SDCARD_CHAIN_MAX, longest_chain);
+  TEST_ASSERT_EQUAL(0, card.tokens_while_busy);
+  TEST_ASSERT_EQUAL(0, card.blocks_rejected);
+  helper_VerifyBlocks(BENCH_START_BLOCK, SDCARD_SIM_BENCH_BLOCKS);
+}
+#endif
+
+/**
+ * A slow card with a recorded busy time trace, only to check the driver
+ * keeps polling long enough.
+ */
+void test_SimulatedMultiWriteWithBusyTrace(void)
+{
+  static const uint32_t trace_ns[] = { 300000, 300000, 12000000, 300000, 45000000 };
+  card.busy_model = SDCardSimBusy_Trace;
+  card.busy_trace_ns = trace_ns;
+  card.busy_trace_len = sizeof(trace_ns) / sizeof(trace_ns[0]);
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  for (uint32_t b = 0; b < 10; b++) {
+    helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK + b);
+    sdcard_spi_multiwrite_next(&sdcard1, NULL);
+    helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  }
+
+  TEST_ASSERT_EQUAL(10, card.blocks_written);
+  helper_VerifyBlocks(BENCH_START_BLOCK, 10);
+}
+
+/**
+ * Every third block is rejected. The driver restarts the multiwrite at the
+ * rejected block and resends it, all blocks end up on the card in order.
+ */
+void test_SimulatedRejectedBlockRecovers(void)
+{
+  card.reject_every = 3;
+  card.busy_model = SDCardSimBusy_Fixed;
+  card.busy_min_ns = 500000;
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  for (uint32_t b = 0; b < 12; b++) {
+    helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK + b);
+    sdcard_spi_multiwrite_next(&sdcard1, NULL);
+    helper_TickUntil(SDCard_MultiWriteIdle, 100);
+  }
+  printf("recovery: %u blocks rejected, %u recoveries, max %u us, 12 blocks in %.3f ms\n",
+         card.blocks_rejected, sdcard1.recoveries, sdcard1.recovery_time_max,
+         (sdcard_sim_time_ns() - start_ns) / 1e6);
+
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+
+  TEST_ASSERT_EQUAL(12, card.blocks_written);
+  TEST_ASSERT_TRUE(card.blocks_rejected > 0);
+  TEST_ASSERT_EQUAL(card.blocks_rejected, sdcard1.recoveries);
+  TEST_ASSERT_EQUAL(0, sdcard1.recovery_failures);
+  TEST_ASSERT_TRUE(sdcard1.recovery_time_max > 0);
+  helper_VerifyBlocks(BENCH_START_BLOCK, 12);
+}
+
+/**
+ * A card that rejects everything still ends in the error state.
+ */
+void test_SimulatedRejectingCardEndsInError(void)
+{
+  card.reject_every = 1;
+  helper_InitCard();
+
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK);
+  sdcard_spi_multiwrite_next(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Error, 100);
+
+  TEST_ASSERT_EQUAL(0, card.blocks_written);
+  TEST_ASSERT_EQUAL(SDCARD_MULTIWRITE_RETRIES + 1, card.blocks_rejected);
+  TEST_ASSERT_EQUAL(1, sdcard1.recovery_failures);
+}
+
+/**
+ * @brief Write nb blocks with multiwrite_next, return the time it took
+ */
+uint64_t helper_MultiWriteBlocks(uint32_t nb)
+{
+  sdcard_spi_multiwrite_start(&sdcard1, BENCH_START_BLOCK, NULL);
+  helper_TickUntil(SDCard_MultiWriteIdle, 100);
+
+  uint64_t start_ns = sdcard_sim_time_ns();
+  for (uint32_t b = 0; b < nb; b++) {
+    helper_FillBlock(&sdcard1.output_buf[1], BENCH_START_BLOCK + b);
+    sdcard_spi_multiwrite_next(&sdcard1, NULL);
+    helper_TickUntil(SDCard_MultiWriteIdle, 1000);
+  }
+  uint64_t duration_ns = sdcard_sim_time_ns() - start_ns;
+
+  sdcard_spi_multiwrite_stop(&sdcard1, NULL);
+  helper_TickUntil(SDCard_Idle, 1000);
+  return duration_ns;
+}
+
+/**
+ * With a card that is busy for several periodic intervals per block, adaptive
+ * polling leaves most of those intervals to the other devices on the bus,
+ * without making the writes noticeably slower.
+ */
+void test_AdaptivePollingSavesBusPolls(void)
+{
+  card.busy_model = SDCardSimBusy_Fixed;
+  card.busy_min_ns = 8000000;
+
+  helper_InitCard();
+  sdcard1.adaptive_poll = FALSE;
+  uint64_t fixed_ns = helper_MultiWriteBlocks(40);
+  uint32_t fixed_polls = card.busy_polls;
+
+  sdcard_sim_init(&card, &spi2, SPI_SLAVE3, CardStorage, CardBlocks);
+  card.busy_model = SDCardSimBusy_Fixed;
+  card.busy_min_ns = 8000000;
+  helper_InitCard();
+  sdcard1.adaptive_poll = TRUE;
+  uint64_t adaptive_ns = helper_MultiWriteBlocks(40);
+  uint32_t adaptive_polls = card.busy_polls;
+
+  printf("busy polls fixed %u, adaptive %u (%u skipped), duration %.1f ms vs %.1f ms\n", fixed_polls,
+         adaptive_polls, sdcard1.polls_skipped, fixed_ns / 1e6, adaptive_ns / 1e6);
+  TEST_ASSERT_TRUE(adaptive_polls * 2 < fixed_polls);
+  TEST_ASSERT_TRUE(adaptive_ns < fixed_ns + fixed_ns / 20);
+  helper_VerifyBlocks(BENCH_START_BLOCK, 40);
+}
+
+/* Per status of the driver when the SPI callback starts */
+uint32_t CallbackCalls[SDCARD_NB_STATES];
+/* Most transactions submitted by one callback */
+uint32_t CallbackMaxSubmits[SDCARD_NB_STATES];
+
+/**
+ * @brief Runs after_cb in place of the simulated card, counting per state
+ */
+void helper_CountingCallback(struct spi_transaction *t)
+{
+  enum SDCardStatus status = sdcard1.status;
+  uint32_t transactions = card.transactions;
+  TEST_ASSERT_TRUE(status < SDCARD_NB_STATES);
+
+  t->after_cb(t);
+
+  uint32_t submits = card.transactions - transactions;
+  CallbackCalls[status]++;
+  if (submits > CallbackMaxSubmits[status]) {
+    CallbackMaxSubmits[status] = submits;
+  }
+}
+
+/**
+ * An init, a multiwrite and a read go through the handler table. Every
+ * callback arrives in a state that has a handler, and no handler submits more
+ * than the next transaction, whatever the state. The host time spent in the
+ * callback is only printed, it depends on the machine running the test.
+ */
+void test_SimulatedCallbackTime(void)
+{
+  memset(CallbackCalls, 0, sizeof(CallbackCalls));
+  memset(CallbackMaxSubmits, 0, sizeof(CallbackMaxSubmits));
+  sdcard_sim_callback = &helper_CountingCallback;
+
+  card.busy_model = SDCardSimBusy_Uniform;
+  card.busy_min_ns = 250000;
+  card.busy_max_ns = 1500000;
+  helper_InitCard();
+  helper_MultiWriteBlocks(SDCARD_SIM_BENCH_BLOCKS);
+  sdcard_spi_read_block(&sdcard1, BENCH_START_BLOCK, &helper_ReadCallback);
+  helper_TickUntil(SDCard_Idle, 1000);
+  sdcard_sim_callback = NULL;
+
+  uint32_t calls = 0, worst = 0;
+  for (uint8_t s = 0; s < SDCARD_NB_STATES; s++) {
+    if (CallbackCalls[s] > 0) {
+      TEST_ASSERT_NOT_NULL(sdcard_spi_callback_handlers[s]);
+    }
+    TEST_ASSERT_TRUE(CallbackMaxSubmits[s] <= 1);
+    calls += CallbackCalls[s];
+    if (CallbackMaxSubmits[s] > worst) {
+      worst = CallbackMaxSubmits[s];
+    }
+  }
+  printf("callback: %u calls, %llu ns in total, max %llu ns, at most %u transaction submitted\n",
+         sdcard_sim_callback_stats.count, (unsigned long long)sdcard_sim_callback_stats.total_ns,
+         (unsigned long long)sdcard_sim_callback_stats.max_ns, worst);
+  TEST_ASSERT_EQUAL(sdcard_sim_callback_stats.count, calls);
+  TEST_ASSERT_TRUE(ReadCallbackWasCalled);
+  helper_VerifyBlocks(BENCH_START_BLOCK, SDCARD_SIM_BENCH_BLOCKS);
+}
+
+/**
+ * RAM used per card with both buffer layouts, and a read and write round
+ * trip through the card to show the layout of this build works. The shared
+ * layout has one block buffer instead of two, so it saves at least a block.
+ */
+void test_MemoryReport(void)
+{
+#ifdef SDCARD_SHARED_BUFFER
+  uint32_t shared = sizeof(struct SDCard);
+  uint32_t separate = sdcard_layout_other_size;
+  TEST_ASSERT_EQUAL_PTR(sdcard1.input_buf, sdcard1.output_buf);
+#else
+  uint32_t shared = sdcard_layout_other_size;
+  uint32_t separate = sizeof(struct SDCard);
+#endif
+  printf("struct SDCard: separate buffers %u bytes, shared buffer %u bytes, %u bytes saved\n",
+         separate, shared, separate - shared);
+  TEST_ASSERT_TRUE(separate > shared);
+  TEST_ASSERT_TRUE(separate - shared >= SD_BLOCK_SIZE);
+
+  helper_InitCard();
+  helper_FillBlock(&sdcard1.output_buf[6], 9);
+  sdcard_spi_write_block(&sdcard1, BENCH_START_BLOCK + 1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+  sdcard_spi_read_block(&sdcard1, BENCH_START_BLOCK + 1, NULL);
+  helper_TickUntil(SDCard_Idle, 100);
+  for (uint16_t i = 0; i < SD_BLOCK_SIZE; i++) {
+    TEST_ASSERT_EQUAL_HEX8(helper_Pattern(9, i), sdcard1.input_buf[i]);
+  }
+}
+
+#ifdef SDCARD_TRACE
+/**
+ * The trace of the init sequence walks through the states in simulated time.
+ */
+void test_TraceInitSequence(void)
+{
+  helper_InitCard();
+
+  uint16_t len = sd_trace_length();
+  TEST_ASSERT_GREATER_THAN(10, len);
+  for (uint16_t i = 1; i < len; i++) {
+    TEST_ASSERT_TRUE(sd_trace_get(i)->timestamp >= sd_trace_get(i - 1)->timestamp);
+    TEST_ASSERT_EQUAL(sd_trace_get(i - 1)->new_state, sd_trace_get(i)->old_state);
+  }
+  TEST_ASSERT_EQUAL(SDCard_Idle, sd_trace_get(len - 1)->new_state);
+}
+#endif
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+#
+# This file is part of paparazzi.
+#
+# paparazzi is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# paparazzi is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with paparazzi; see the file COPYING.  If not, write to
+# the Free Software Foundation, 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+#
+
+"""Decode a dumped sd_trace ring into a timeline and time per state.
+
+The trace is recorded when the airborne code is built with SDCARD_TRACE and
+dumped from the debugger:
+
+    (gdb) dump binary value sd_trace.bin sd_trace
+
+State names are taken from the enums in the headers, so the decoder does not
+need to be updated when states are added.
+
+    sdcard_trace_decode.py sd_trace.bin
+    sdcard_trace_decode.py --no-timeline sd_trace.bin
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+SD_TRACE_MAGIC = 0x52544453
+HEADER = struct.Struct('<IHHI')
+ENTRY = struct.Struct('<IHBBB3x')
+
+SOURCES = ['SDCard', 'Logger']
+
+
+def parse_enum(header, enum_name):
+    """Return the list of names of a C enum, indexed by value."""
+    with open(header) as f:
+        text = re.sub(r'/\*.*?\*/|//[^\n]*', '', f.read(), flags=re.S)
+    match = re.search(r'enum\s+' + enum_name + r'\s*\{(.*?)\}', text, flags=re.S)
+    if match is None:
+        sys.exit('enum %s not found in %s' % (enum_name, header))
+    names = {}
+    value = -1
+    for item in match.group(1).split(','):
+        item = item.strip()
+        if not item:
+            continue
+        if '=' in item:
+            item, expr = [s.strip() for s in item.split('=', 1)]
+            value = int(expr, 0)
+        else:
+            value += 1
+        names[value] = item
+    return [names.get(i, str(i)) for i in range(max(names) + 1)]
+
+
+def read_trace(filename):
+    """Return the entries of the dump, oldest first, and the total count."""
+    with open(filename, 'rb') as f:
+        data = f.read()
+    magic, size, head, count = HEADER.unpack_from(data, 0)
+    if magic != SD_TRACE_MAGIC:
+        sys.exit('%s is not an sd_trace dump (magic 0x%08X)' % (filename, magic))
+    if len(data) < HEADER.size + size * ENTRY.size:
+        sys.exit('%s is truncated' % filename)
+    raw = [ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size) for i in range(size)]
+    if count > size:
+        raw = raw[head:] + raw[:head]
+    else:
+        raw = raw[:count]
+    return raw, count
+
+
+def state_name(names, state):
+    return names[state] if state < len(names) else str(state)
+
+
+def main():
+    pprz = os.getenv('PAPARAZZI_SRC', os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..'))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('trace', help='binary dump of struct SDTrace')
+    parser.add_argument('--sdcard-header', default=os.path.join(pprz, 'sw/airborne/peripherals/sdcard_spi.h'))
+    parser.add_argument('--logger-header', default=os.path.join(pprz, 'sw/airborne/modules/loggers/sdlogger_spi_direct.h'))
+    parser.add_argument('--no-timeline', action='store_true', help='only print the time per state')
+    args = parser.parse_args()
+
+    names = [parse_enum(args.sdcard_header, 'SDCardStatus'),
+             parse_enum(args.logger_header, 'SDLoggerStatus')]
+    entries, count = read_trace(args.trace)
+    if not entries:
+        print('Trace is empty')
+        return
+    if count > len(entries):
+        print('%d oldest transitions were overwritten' % (count - len(entries)))
+
+    # Time in each state is the time until the next transition of the same source
+    t0 = entries[0][0]
+    elapsed = 0
+    previous = t0
+    last = [None, None]
+    time_in = [{}, {}]
+    visits = [{}, {}]
+    byte_count = [{}, {}]
+    for timestamp, nbytes, source, old, new in entries:
+        if source >= len(SOURCES):
+            continue
+        elapsed += (timestamp - previous) & 0xFFFFFFFF  # get_sys_time_usec wraps
+        previous = timestamp
+        if not args.no_timeline:
+            print('%12d us  %-6s %-28s -> %-28s %5d bytes' % (elapsed, SOURCES[source],
+                  state_name(names[source], old), state_name(names[source], new), nbytes))
+        if last[source] is not None:
+            state, since = last[source]
+            time_in[source][state] = time_in[source].get(state, 0) + elapsed - since
+        last[source] = (new, elapsed)
+        visits[source][new] = visits[source].get(new, 0) + 1
+        byte_count[source][new] = byte_count[source].get(new, 0) + nbytes
+
+    # The state each source is left in runs until the end of the trace
+    for source in range(len(SOURCES)):
+        if last[source] is not None:
+            state, since = last[source]
+            time_in[source][state] = time_in[source].get(state, 0) + elapsed - since
+
+    for source, label in enumerate(SOURCES):
+        total = sum(time_in[source].values())
+        if total == 0:
+            continue
+        print('\n%s, %d us traced' % (label, total))
+        print('%-28s %12s %7s %7s %10s' % ('state', 'time [us]', '[%]', 'visits', 'bytes'))
+        for state, t in sorted(time_in[source].items(), key=lambda kv: -kv[1]):
+            print('%-28s %12d %7.2f %7d %10d%s' % (state_name(names[source], state), t, 100.0 * t / total,
+                                                   visits[source].get(state, 0), byte_count[source].get(state, 0),
+                                                   '  (open)' if state == last[source][0] else ''))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2015 Bart Slinger <bartslinger@gmail.com>
+#
+# This file is part of paparazzi.
+#
+# paparazzi is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# paparazzi is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with paparazzi; see the file COPYING.  If not, write to
+# the Free Software Foundation, 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+#
+
+"""Decompress a log recorded with SDLOGGER_COMPRESS back to a pprzlog file.
+
+A compressed log is a sequence of 512 byte blocks, each one decodes on its
+own (see sw/airborne/modules/loggers/sdlog_compress.h). A corrupt block is
+reported and skipped, the blocks after it are not affected.
+
+    sdlog_decompress.py flight.log.z flight.log
+    sdlog_decompress.py --stats flight.log.z flight.log
+"""
+
+import argparse
+import sys
+
+BLOCK_SIZE = 512
+HEADER_SIZE = 2
+FRAME_MIN = 10
+REFS = 8
+
+LITERALS = 0x01
+RAW = 0x02
+DELTA = 0x80
+
+
+class CorruptBlock(Exception):
+    pass
+
+
+def frame_size(frame):
+    return max(frame[1], 2)
+
+
+def update_ref(refs, next_ref, frame):
+    """Store a frame like the encoder does, return the next round robin slot."""
+    if len(frame) < FRAME_MIN:
+        return next_ref
+    key = (frame[7], frame[8])
+    for i, ref in enumerate(refs):
+        if ref is not None and ref[0] == key:
+            refs[i] = (key, bytes(frame))
+            return next_ref
+    refs[next_ref] = (key, bytes(frame))
+    return (next_ref + 1) % len(refs)
+
+
+def decompress_block(block, nb_refs=REFS):
+    """Return the raw bytes of one block, raise CorruptBlock if it does not decode."""
+    used = (block[0] << 8) | block[1]
+    if used < HEADER_SIZE or used > BLOCK_SIZE:
+        raise CorruptBlock('used length %d' % used)
+    refs = [None] * nb_refs
+    next_ref = 0
+    out = bytearray()
+    pos = HEADER_SIZE
+    while pos < used:
+        tag = block[pos]
+        pos += 1
+        if tag == LITERALS:
+            if pos >= used or pos + 1 + block[pos] > used:
+                raise CorruptBlock('literals past the end at %d' % pos)
+            out += block[pos + 1:pos + 1 + block[pos]]
+            pos += 1 + block[pos]
+        elif tag == RAW:
+            if pos + 2 > used or pos + frame_size(block[pos:]) > used:
+                raise CorruptBlock('frame past the end at %d' % pos)
+            frame = block[pos:pos + frame_size(block[pos:])]
+            pos += len(frame)
+            out += frame
+            next_ref = update_ref(refs, next_ref, frame)
+        elif tag & DELTA:
+            slot = tag & ~DELTA
+            if slot >= nb_refs or refs[slot] is None:
+                raise CorruptBlock('delta on empty slot %d at %d' % (slot, pos))
+            ref = refs[slot][1]
+            frame = bytearray(ref)
+            for group in range(0, len(ref), 8):
+                if pos >= used:
+                    raise CorruptBlock('delta past the end at %d' % pos)
+                mask = block[pos]
+                pos += 1
+                for j in range(group, min(group + 8, len(ref))):
+                    if mask & (1 << (j - group)):
+                        if pos >= used:
+                            raise CorruptBlock('delta past the end at %d' % pos)
+                        frame[j] ^= block[pos]
+                        pos += 1
+            out += frame
+            next_ref = update_ref(refs, next_ref, frame)
+        else:
+            raise CorruptBlock('unknown record 0x%02X at %d' % (tag, pos - 1))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', help='compressed log, as downloaded from the card')
+    parser.add_argument('output', help='pprzlog file to write')
+    parser.add_argument('--refs', type=int, default=REFS, help='SDLOG_COMPRESS_REFS of the airborne build')
+    parser.add_argument('--stats', action='store_true', help='print the compression ratio')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+    if len(data) % BLOCK_SIZE:
+        print('%s: ignoring %d bytes after the last full block' % (args.input, len(data) % BLOCK_SIZE),
+              file=sys.stderr)
+
+    nb_blocks = len(data) // BLOCK_SIZE
+    raw_len = 0
+    corrupt = 0
+    with open(args.output, 'wb') as out:
+        for b in range(nb_blocks):
+            try:
+                raw = decompress_block(data[b * BLOCK_SIZE:(b + 1) * BLOCK_SIZE], args.refs)
+            except CorruptBlock as e:
+                print('block %d: %s, skipped' % (b, e), file=sys.stderr)
+                corrupt += 1
+                continue
+            out.write(raw)
+            raw_len += len(raw)
+
+    if args.stats and nb_blocks:
+        print('%d blocks (%d corrupt), %d raw bytes, ratio %.2f' % (
+              nb_blocks, corrupt, raw_len, raw_len / float(nb_blocks * BLOCK_SIZE)))
+    if corrupt:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -4,3 +4,6 @@
 
 #define DOWNLINK_SEND_LOG_DATAPACKET(_trans, _dev, timestamp, data_1, data_2, data_3, data_4, data_5, data_6, data_7, data_8, data_9, data_10, data_11, data_12) testable_pprz_msg_send_LOG_DATAPACKET(&((_trans).trans_tx), &((_dev).device), AC_ID, timestamp, data_1, data_2, data_3, data_4, data_5, data_6, data_7, data_8, data_9, data_10, data_11, data_12)
 void testable_pprz_msg_send_LOG_DATAPACKET(struct transport_tx *trans, struct link_device *dev, uint8_t ac_id, uint32_t *_timestamp, int32_t *_data_1, int32_t *_data_2, int32_t *_data_3, int32_t *_data_4, int32_t *_data_5, int32_t *_data_6, int32_t *_data_7, int32_t *_data_8, int32_t *_data_9, int32_t *_data_10, int32_t *_data_11, int32_t *_data_12);
+
+#define pprz_msg_send_SDCARD_LATENCY testable_pprz_msg_send_SDCARD_LATENCY
+void testable_pprz_msg_send_SDCARD_LATENCY(struct transport_tx *trans, struct link_device *dev, uint8_t ac_id, uint32_t *_count, uint32_t *_max, uint32_t *_p99, uint16_t *_busy_polls, uint16_t *_queue_blocks, uint16_t *_queue_max, uint32_t *_dropped, uint8_t nb_hist, uint32_t *_hist);